@@ -0,0 +1,797 @@
+/*
+ * capture-convert.cpp
+ *
+ * Converts a recording of the raw received byte stream (as read by the
+ * Python client's TelemetryFileSerial) into per-channel columnar files,
+ * decoding on all cores.
+ *
+ * The capture is memory-mapped and split into chunks, which are framed in
+ * parallel, each framer starting outside any frame at its chunk's start.
+ * Since a start-of-frame sequence can appear inside a frame (COBS-encoded
+ * bytes or a stuffed length aren't escaped), the chunks are then merged in
+ * order: frames before where the previous chunk's framer stopped are dropped,
+ * and a chunk whose framer was inside a (false) frame at that point is
+ * reframed from there until the two framers agree, so the result is exactly
+ * that of framing the whole capture sequentially. Chunked packets are
+ * reassembled and header packets applied in order during the merge, and data
+ * packets are then decoded in parallel against the schema in effect at each,
+ * with the columns written in capture order.
+ *
+ * Usage: capture-convert <capture> <output directory> [--key=value ...], see
+ * print_usage for options.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "decoder.h"
+
+using namespace telemetry;
+
+namespace {
+
+struct ConvertParams {
+  ConvertParams() : threads(0), chunk_mb(8), csv(false) {}
+
+  size_t threads;   // decode threads, 0 for one per core
+  size_t chunk_mb;  // capture megabytes framed and decoded at a time per thread
+  bool csv;         // also write a CSV per channel
+};
+
+void print_usage() {
+  printf("Usage: capture-convert <capture> <output directory> "
+         "[--key=value ...]\n"
+         "  --threads=0 (one per core) --chunk_mb=8 --csv=0\n");
+}
+
+bool parse_convert_param(ConvertParams& params, const std::string& key,
+    const std::string& value) {
+  const char* str = value.c_str();
+  if (key == "threads") {
+    params.threads = strtoul(str, NULL, 0);
+  } else if (key == "chunk_mb") {
+    params.chunk_mb = strtoul(str, NULL, 0);
+  } else if (key == "csv") {
+    params.csv = strtoul(str, NULL, 0) != 0;
+  } else {
+    return false;
+  }
+  return params.chunk_mb > 0;
+}
+
+// A frame found in the capture.
+struct FrameRef {
+  uint64_t start;  // capture position of its start-of-frame
+  uint64_t end;  // capture position past its last byte
+  size_t offset;  // of its payload in the chunk's payload buffer
+  size_t length;  // of its payload
+  uint64_t number;  // index of the frame in the capture, assigned on merging
+  size_t schema;  // index of the schemas it's decoded with, assigned on merging
+};
+
+// A chunk of the capture and the frames starting in it.
+struct Chunk {
+  uint64_t begin, end;
+  uint64_t stop;  // where its framer stopped, outside any frame, at or past end
+  std::vector<FrameRef> frames;
+  std::vector<uint8_t> payloads;
+  // Start and end of partial (or false) frames the framer discarded.
+  std::vector<std::pair<uint64_t, uint64_t> > discarded;
+  size_t first;  // index of its first frame which wasn't already framed
+};
+
+// Returns whether a chunk's framer was outside any frame at a capture position
+// (at or after the chunk's beginning), so that its frames from there on are
+// those of any other framer outside a frame there.
+bool is_synchronized_at(const Chunk& chunk, uint64_t pos) {
+  // Frames and discarded frames don't overlap, so only the last of each
+  // starting before pos can span it.
+  std::vector<FrameRef>::const_iterator frame = std::lower_bound(
+      chunk.frames.begin(), chunk.frames.end(), pos,
+      [](const FrameRef& frame, uint64_t pos) { return frame.start < pos; });
+  if (frame != chunk.frames.begin() && (frame - 1)->end > pos) {
+    return false;
+  }
+  std::vector<std::pair<uint64_t, uint64_t> >::const_iterator discarded =
+      std::lower_bound(chunk.discarded.begin(), chunk.discarded.end(),
+          std::make_pair(pos, (uint64_t)0));
+  if (discarded != chunk.discarded.begin() && (discarded - 1)->second > pos) {
+    return false;
+  }
+  return true;
+}
+
+// Finds the frames starting in [begin, end), with a framer starting outside
+// any frame at begin and running past end to finish any frame in progress.
+// If sync is given, stops early where that chunk's framer was also outside a
+// frame, from where the framers agree.
+void frame_chunk(const uint8_t* data, uint64_t size, uint64_t begin,
+    uint64_t end, Chunk& chunk, const Chunk* sync=NULL) {
+  chunk.begin = begin;
+  chunk.end = end;
+  chunk.frames.clear();
+  chunk.payloads.clear();
+  chunk.discarded.clear();
+  chunk.first = 0;
+
+  // Offline, there are no receive gaps to time out on.
+  host::FrameDecoder decoder;
+  uint64_t start = begin;
+  bool completed = false;  // whether the frame at start has been completed
+  uint64_t pos;
+  for (pos = begin; pos < size; pos++) {
+    bool busy = decoder.in_frame();
+    if (!busy) {
+      if (pos >= end || (sync != NULL && pos > begin
+          && is_synchronized_at(*sync, pos))) {
+        break;
+      }
+      start = pos;
+    }
+    bool done = decoder.add_byte(data[pos], 0);
+    if (done) {
+      const std::vector<uint8_t>& payload = decoder.get_frame();
+      FrameRef frame;
+      frame.start = start;
+      frame.end = pos + 1;
+      frame.offset = chunk.payloads.size();
+      frame.length = payload.size();
+      frame.number = 0;
+      frame.schema = 0;
+      chunk.frames.push_back(frame);
+      chunk.payloads.insert(chunk.payloads.end(), payload.begin(),
+          payload.end());
+      completed = true;
+    }
+    if (!decoder.in_frame() && (busy || done)) {
+      if (completed) {
+        // Includes the stuffing byte after a frame ending in the SOF byte.
+        chunk.frames.back().end = pos + 1;
+      } else {
+        chunk.discarded.push_back(std::make_pair(start, pos + 1));
+      }
+      completed = false;
+    }
+    if ((pos & 0xffff) == 0) {
+      decoder.take_passthrough();  // non-telemetry bytes aren't converted
+    }
+  }
+  if (decoder.in_frame() && !completed) {
+    chunk.discarded.push_back(std::make_pair(start, UINT64_MAX));
+  }
+  chunk.stop = pos;
+}
+
+// Reframes a chunk from a capture position at which its framer was inside a
+// (false) frame, up to where it resynchronized.
+void resynchronize(const uint8_t* data, uint64_t size, uint64_t pos,
+    Chunk& chunk) {
+  Chunk head;
+  frame_chunk(data, size, pos, chunk.end, head, &chunk);
+  if (head.stop >= chunk.end) {
+    chunk = head;  // didn't resynchronize within the chunk
+    return;
+  }
+  // Replace the chunk's frames before the resynchronization point.
+  size_t tail = 0;
+  while (tail < chunk.frames.size() && chunk.frames[tail].start < head.stop) {
+    tail++;
+  }
+  for (size_t i=0; i<head.frames.size(); i++) {
+    head.frames[i].offset += chunk.payloads.size();
+  }
+  chunk.payloads.insert(chunk.payloads.end(), head.payloads.begin(),
+      head.payloads.end());
+  head.frames.insert(head.frames.end(), chunk.frames.begin() + tail,
+      chunk.frames.end());
+  chunk.frames.swap(head.frames);
+  chunk.discarded.clear();
+  chunk.begin = pos;
+  chunk.first = 0;
+}
+
+// Runs fn(i) for i in [0, count) on the given number of threads.
+template <typename Function>
+void run_parallel(size_t count, size_t threads, Function fn) {
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (size_t t=0; t<threads && t<count; t++) {
+    workers.push_back(std::thread([&]() {
+      for (size_t i=next++; i<count; i=next++) {
+        fn(i);
+      }
+    }));
+  }
+  for (size_t t=0; t<workers.size(); t++) {
+    workers[t].join();
+  }
+}
+
+// Decoder state between header packets, with the output column of each
+// defined data object.
+struct Schemas {
+  host::PacketDecoder decoder;
+  // (namespace, data ID) => column index
+  std::map<std::pair<uint8_t, size_t>, size_t> columns;
+};
+
+// Index entry of a column row (a decoded data record), in the .index file.
+struct IndexEntry {
+  uint64_t frame;  // index of the frame in the capture
+  uint32_t cycle;  // cycle offset in packets grouped by cycle, otherwise 0
+  uint32_t count;  // number of values in the row
+};
+
+// Decoded rows of a column from one chunk, ready to append to its files.
+struct ColumnRows {
+  std::vector<IndexEntry> index;
+  std::vector<double> values;
+  std::string csv;
+  std::string log;  // log messages
+  std::string events;  // trace events, as CSV
+};
+
+// An output column, for a data object (by namespace and internal name).
+struct Column {
+  std::string path;  // output path without extension
+  uint8_t namespace_id;
+  host::ChannelDef def;  // latest definition
+  uint64_t rows;
+};
+
+struct ChunkOutput {
+  std::vector<ColumnRows> columns;
+  uint64_t data_frames;
+  uint64_t decode_errors;
+};
+
+void append_value(std::string& out, const host::ChannelDef& def,
+    double value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), def.length >= 8 ? ",%.17g" : ",%.10g", value);
+  out += buf;
+}
+
+void append_csv_rows(std::string& out, uint64_t frame,
+    const host::ChannelDef& def, const host::Sample& sample) {
+  char buf[64];
+  if (def.data_type == protocol::DATATYPE_CAPTURE) {
+    // A row per sample, numbered from the trigger.
+    size_t channels = def.channels ? def.channels : 1;
+    for (size_t i=0; i+channels<=sample.values.size(); i+=channels) {
+      snprintf(buf, sizeof(buf), "%llu,%u,%u,%ld", (unsigned long long)frame,
+          sample.cycle, sample.chunk.capture,
+          (long)(sample.chunk.start + i / channels) - sample.chunk.trigger);
+      out += buf;
+      for (size_t c=0; c<channels; c++) {
+        append_value(out, def, sample.values[i + c]);
+      }
+      out += '\n';
+    }
+  } else {
+    snprintf(buf, sizeof(buf), "%llu,%u", (unsigned long long)frame,
+        sample.cycle);
+    out += buf;
+    for (size_t i=0; i<sample.values.size(); i++) {
+      append_value(out, def, sample.values[i]);
+    }
+    out += '\n';
+  }
+}
+
+// Decodes the data packets of a merged chunk into column rows.
+void decode_chunk(const Chunk& chunk, const std::vector<Schemas>& schemas,
+    size_t column_count, bool csv, ChunkOutput& out) {
+  out.columns.assign(column_count, ColumnRows());
+  out.data_frames = 0;
+  out.decode_errors = 0;
+
+  host::PacketDecoder decoder;
+  size_t schema = SIZE_MAX;
+  std::vector<uint8_t> payload;
+  for (size_t i=chunk.first; i<chunk.frames.size(); i++) {
+    const FrameRef& frame = chunk.frames[i];
+    if (frame.length == 0) {
+      continue;
+    }
+    const uint8_t* data = chunk.payloads.data() + frame.offset;
+    uint8_t opcode = data[0] & ~(protocol::OPCODE_FLAG_COMPRESSED
+        | protocol::OPCODE_FLAG_NAMESPACE);
+    if (opcode != protocol::OPCODE_DATA
+        && opcode != protocol::OPCODE_DATA_CYCLES) {
+      continue;  // headers were applied on merging, probe replies are skipped
+    }
+    out.data_frames++;
+    if (frame.schema != schema) {
+      schema = frame.schema;
+      decoder = schemas[schema].decoder;
+    }
+    const std::map<std::pair<uint8_t, size_t>, size_t>& columns =
+        schemas[schema].columns;
+
+    payload.assign(data, data + frame.length);
+    host::Packet packet;
+    try {
+      packet = decoder.decode(payload);
+    } catch (host::DecodeError&) {
+      out.decode_errors++;
+      continue;
+    }
+    const host::Schema& packet_schema = decoder.get_schema(packet.namespace_id);
+    for (size_t s=0; s<packet.samples.size(); s++) {
+      const host::Sample& sample = packet.samples[s];
+      std::map<std::pair<uint8_t, size_t>, size_t>::const_iterator it =
+          columns.find(std::make_pair(packet.namespace_id, sample.data_id));
+      const host::ChannelDef* def = packet_schema.get(sample.data_id);
+      if (it == columns.end() || def == NULL) {
+        continue;
+      }
+      ColumnRows& rows = out.columns[it->second];
+      IndexEntry entry;
+      entry.frame = frame.number;
+      entry.cycle = sample.cycle;
+      entry.count = sample.values.size();
+      rows.index.push_back(entry);
+      rows.values.insert(rows.values.end(), sample.values.begin(),
+          sample.values.end());
+      if (csv) {
+        append_csv_rows(rows.csv, frame.number, *def, sample);
+      }
+      char buf[64];
+      for (size_t m=0; m<sample.messages.size(); m++) {
+        snprintf(buf, sizeof(buf), "%llu\t", (unsigned long long)frame.number);
+        rows.log += buf;
+        rows.log += sample.messages[m];
+        rows.log += '\n';
+      }
+      for (size_t e=0; e<sample.events.size(); e++) {
+        const host::TraceEvent& event = sample.events[e];
+        snprintf(buf, sizeof(buf), "%llu,%u,%u,",
+            (unsigned long long)frame.number, event.time_us, event.kind);
+        rows.events += buf;
+        if (event.index < def->formats.size()) {
+          rows.events += def->formats[event.index];
+        }
+        rows.events += '\n';
+      }
+    }
+  }
+}
+
+const char* data_type_name(uint8_t data_type) {
+  switch (data_type) {
+    case protocol::DATATYPE_NUMERIC: return "numeric";
+    case protocol::DATATYPE_NUMERIC_ARRAY: return "array";
+    case protocol::DATATYPE_CAPTURE: return "capture";
+    case protocol::DATATYPE_AGGREGATE: return "aggregate";
+    case protocol::DATATYPE_LOG: return "log";
+    case protocol::DATATYPE_TRACE: return "trace";
+    case protocol::DATATYPE_STREAM: return "stream";
+    default: return "unknown";
+  }
+}
+
+// Returns the CSV header line for a column.
+std::string csv_header(const host::ChannelDef& def) {
+  std::string out = "frame,cycle";
+  if (def.data_type == protocol::DATATYPE_NUMERIC) {
+    out += "," + def.internal_name;
+  } else if (def.data_type == protocol::DATATYPE_NUMERIC_ARRAY) {
+    for (size_t i=0; i<def.count; i++) {
+      char buf[16];
+      snprintf(buf, sizeof(buf), "[%zu]", i);
+      out += "," + def.internal_name + buf;
+    }
+  } else if (def.data_type == protocol::DATATYPE_CAPTURE) {
+    out += ",capture,sample";
+    for (size_t i=0; i<def.channels; i++) {
+      char buf[16];
+      snprintf(buf, sizeof(buf), "[%zu]", i);
+      out += "," + def.internal_name + buf;
+    }
+  } else if (def.data_type == protocol::DATATYPE_AGGREGATE) {
+    out += ",count,min,max,mean";
+  } else if (def.data_type == protocol::DATATYPE_STREAM) {
+    out += ",position,free,underruns,dropped";
+  } else {
+    out += ",dropped";
+  }
+  return out + "\n";
+}
+
+// Replaces characters which aren't safe in file names.
+std::string file_name(const std::string& name) {
+  std::string out = name.empty() ? "_" : name;
+  for (size_t i=0; i<out.size(); i++) {
+    char c = out[i];
+    if (!isalnum((unsigned char)c) && c != '_' && c != '-' && c != '.') {
+      out[i] = '_';
+    }
+  }
+  return out;
+}
+
+// An output file, opened for appending on the first write.
+class AppendFile {
+public:
+  AppendFile(const std::string& path) : path(path), file(NULL) {}
+  ~AppendFile() {
+    if (file != NULL) {
+      fclose(file);
+    }
+  }
+
+  void write(const void* data, size_t length) {
+    if (length == 0) {
+      return;
+    }
+    if (file == NULL) {
+      file = fopen(path.c_str(), "ab");
+    }
+    if (file == NULL || fwrite(data, 1, length, file) != length) {
+      fprintf(stderr, "Failed to write %s: %s\n", path.c_str(),
+          strerror(errno));
+      exit(1);
+    }
+  }
+
+protected:
+  std::string path;
+  FILE* file;
+};
+
+void create_file(const std::string& path, const std::string& contents) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if (file == NULL) {
+    fprintf(stderr, "Failed to create %s: %s\n", path.c_str(), strerror(errno));
+    exit(1);
+  }
+  fwrite(contents.data(), 1, contents.size(), file);
+  fclose(file);
+}
+
+// Sequential state carried between merged chunks.
+class Converter {
+public:
+  Converter(const std::string& output_dir, bool csv) :
+      output_dir(output_dir), csv(csv), stop(0), frame_count(0),
+      header_frames(0), lost_frames(0), decode_errors(0),
+      resynchronized_chunks(0) {
+    schemas.push_back(Schemas());
+  }
+
+  // Merges a framed chunk following the previous one: drops frames already
+  // framed, resynchronizes it if needed, and applies headers.
+  void merge(const uint8_t* data, uint64_t size, Chunk& chunk) {
+    if (stop >= chunk.end) {
+      // The whole chunk was inside frames already framed.
+      chunk.first = chunk.frames.size();
+      return;
+    }
+    if (!is_synchronized_at(chunk, stop)) {
+      resynchronize(data, size, stop, chunk);
+      resynchronized_chunks++;
+    }
+    while (chunk.first < chunk.frames.size()
+        && chunk.frames[chunk.first].start < stop) {
+      chunk.first++;
+    }
+    stop = chunk.stop;
+
+    for (size_t i=chunk.first; i<chunk.frames.size(); i++) {
+      FrameRef& frame = chunk.frames[i];
+      frame.number = frame_count++;
+      const uint8_t* payload = chunk.payloads.data() + frame.offset;
+      check_sequence(payload, frame.length);
+      uint8_t opcode = frame.length ? payload[0] : 0;
+      opcode &= ~(protocol::OPCODE_FLAG_COMPRESSED
+          | protocol::OPCODE_FLAG_NAMESPACE);
+      if (opcode == protocol::OPCODE_CHUNK
+          && add_chunk(std::vector<uint8_t>(payload, payload + frame.length))) {
+        // The last chunk's frame is replaced by the reassembled packet.
+        const std::vector<uint8_t>& chunked = chunks.get_packet();
+        frame.offset = chunk.payloads.size();
+        frame.length = chunked.size();
+        chunk.payloads.insert(chunk.payloads.end(), chunked.begin(),
+            chunked.end());
+        payload = chunk.payloads.data() + frame.offset;
+        opcode = payload[0] & ~(protocol::OPCODE_FLAG_COMPRESSED
+            | protocol::OPCODE_FLAG_NAMESPACE);
+      }
+      if (opcode == protocol::OPCODE_HEADER
+          || opcode == protocol::OPCODE_HEADER_APPEND) {
+        header_frames++;
+        apply_header(std::vector<uint8_t>(payload, payload + frame.length));
+      }
+      frame.schema = schemas.size() - 1;
+    }
+  }
+
+  // Writes the decoded rows of merged chunks in order, then drops the schemas
+  // they used except the latest.
+  void write(const std::vector<ChunkOutput>& outputs, size_t count) {
+    for (size_t i=0; i<count; i++) {
+      decode_errors += outputs[i].decode_errors;
+    }
+    for (size_t c=0; c<columns.size(); c++) {
+      const std::string& path = columns[c].path;
+      AppendFile index(path + ".index"), values(path + ".f64"),
+          csv(path + ".csv"), log(path + ".log"), events(path + ".events.csv");
+      for (size_t i=0; i<count; i++) {
+        const ColumnRows& rows = outputs[i].columns[c];
+        columns[c].rows += rows.index.size();
+        index.write(rows.index.data(), rows.index.size() * sizeof(IndexEntry));
+        values.write(rows.values.data(), rows.values.size() * sizeof(double));
+        csv.write(rows.csv.data(), rows.csv.size());
+        log.write(rows.log.data(), rows.log.size());
+        events.write(rows.events.data(), rows.events.size());
+      }
+    }
+    schemas.erase(schemas.begin(), schemas.end() - 1);
+  }
+
+  // Writes the channel list.
+  void finish() {
+    std::string out = "name,namespace,data_id,type,units,count,channels,rows\n";
+    for (size_t c=0; c<columns.size(); c++) {
+      const Column& column = columns[c];
+      char buf[128];
+      snprintf(buf, sizeof(buf), ",%u,%zu,%s,", column.namespace_id,
+          column.def.data_id, data_type_name(column.def.data_type));
+      out += column.path.substr(output_dir.size() + 1) + buf
+          + column.def.units;
+      snprintf(buf, sizeof(buf), ",%u,%u,%llu\n", column.def.count,
+          column.def.channels, (unsigned long long)column.rows);
+      out += buf;
+    }
+    create_file(output_dir + "/channels.csv", out);
+  }
+
+  const std::vector<Schemas>& get_schemas() const { return schemas; }
+  size_t get_column_count() const { return columns.size(); }
+
+  uint64_t get_frame_count() const { return frame_count; }
+  uint64_t get_header_frames() const { return header_frames; }
+  uint64_t get_lost_frames() const { return lost_frames; }
+  uint64_t get_decode_errors() const { return decode_errors; }
+  size_t get_resynchronized_chunks() const { return resynchronized_chunks; }
+
+protected:
+  // Counts frames lost by gaps in the packet sequence numbers.
+  void check_sequence(const uint8_t* payload, size_t length) {
+    if (length < 2) {
+      return;
+    }
+    uint8_t namespace_id = 0;
+    size_t pos = 1;
+    if (payload[0] & protocol::OPCODE_FLAG_NAMESPACE) {
+      if (length < 3) {
+        return;
+      }
+      namespace_id = payload[pos++];
+    }
+    uint8_t sequence = payload[pos];
+    std::map<uint8_t, uint8_t>::iterator it = sequences.find(namespace_id);
+    if (it != sequences.end()) {
+      lost_frames += (uint8_t)(sequence - it->second - 1);
+    }
+    sequences[namespace_id] = sequence;
+  }
+
+  // Adds a chunk to the chunked packet being reassembled, returning true if it
+  // completed it.
+  bool add_chunk(const std::vector<uint8_t>& payload) {
+    try {
+      return chunks.add(payload);
+    } catch (host::DecodeError&) {
+      decode_errors++;
+      return false;
+    }
+  }
+
+  // Decodes a header packet into new schemas, adding columns for any new data
+  // objects.
+  void apply_header(const std::vector<uint8_t>& payload) {
+    Schemas next = schemas.back();
+    host::Packet packet;
+    try {
+      packet = next.decoder.decode(payload);
+    } catch (host::DecodeError&) {
+      decode_errors++;
+      return;
+    }
+    uint8_t namespace_id = packet.namespace_id;
+    const std::map<size_t, host::ChannelDef>& defs =
+        next.decoder.get_schema(namespace_id).get_channels();
+    std::map<std::pair<uint8_t, size_t>, size_t>::iterator it =
+        next.columns.begin();
+    while (it != next.columns.end()) {
+      if (it->first.first == namespace_id) {
+        next.columns.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    for (std::map<size_t, host::ChannelDef>::const_iterator def=defs.begin();
+        def!=defs.end(); ++def) {
+      next.columns[std::make_pair(namespace_id, def->first)] =
+          get_column(namespace_id, def->second);
+    }
+    schemas.push_back(next);
+  }
+
+  // Returns the index of the column for a data object, creating its files if
+  // it's new.
+  size_t get_column(uint8_t namespace_id, const host::ChannelDef& def) {
+    std::string name = file_name(def.internal_name);
+    if (namespace_id != 0) {
+      char prefix[16];
+      snprintf(prefix, sizeof(prefix), "ns%u.", namespace_id);
+      name = prefix + name;
+    }
+    std::map<std::string, size_t>::iterator it = column_names.find(name);
+    if (it != column_names.end()) {
+      columns[it->second].def = def;
+      return it->second;
+    }
+    Column column;
+    column.path = output_dir + "/" + name;
+    column.namespace_id = namespace_id;
+    column.def = def;
+    column.rows = 0;
+    create_file(column.path + ".index", "");
+    create_file(column.path + ".f64", "");
+    if (csv) {
+      create_file(column.path + ".csv", csv_header(def));
+    }
+    if (def.data_type == protocol::DATATYPE_LOG) {
+      create_file(column.path + ".log", "");
+    } else if (def.data_type == protocol::DATATYPE_TRACE) {
+      create_file(column.path + ".events.csv", "frame,time_us,kind,name\n");
+    }
+    columns.push_back(column);
+    column_names[name] = columns.size() - 1;
+    return columns.size() - 1;
+  }
+
+  std::string output_dir;
+  bool csv;
+
+  uint64_t stop;  // where the last merged chunk's framer stopped
+  // Schemas in effect from the first frame of the chunks being merged, then
+  // after each header packet in them.
+  std::vector<Schemas> schemas;
+  std::vector<Column> columns;
+  std::map<std::string, size_t> column_names;  // file name => column index
+  std::map<uint8_t, uint8_t> sequences;  // namespace => last sequence number
+  // Chunked packets are reassembled in order, since their chunks can span
+  // capture chunks.
+  host::ChunkAssembler chunks;
+
+  uint64_t frame_count;
+  uint64_t header_frames;
+  uint64_t lost_frames;
+  uint64_t decode_errors;
+  size_t resynchronized_chunks;
+};
+
+}
+
+int main(int argc, char* argv[]) {
+  ConvertParams params;
+  std::vector<std::string> paths;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 2, "--") != 0) {
+      paths.push_back(arg);
+      continue;
+    }
+    size_t equals = arg.find('=');
+    if (equals == std::string::npos
+        || !parse_convert_param(params, arg.substr(2, equals - 2),
+            arg.substr(equals + 1))) {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      print_usage();
+      return 1;
+    }
+  }
+  if (paths.size() != 2) {
+    print_usage();
+    return 1;
+  }
+  if (params.threads == 0) {
+    params.threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  int fd = open(paths[0].c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", paths[0].c_str(),
+        strerror(errno));
+    return 1;
+  }
+  uint64_t size = st.st_size;
+  const uint8_t* data = NULL;
+  if (size > 0) {
+    data = (const uint8_t*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Failed to map %s: %s\n", paths[0].c_str(),
+          strerror(errno));
+      return 1;
+    }
+  }
+  if (mkdir(paths[1].c_str(), 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create %s: %s\n", paths[1].c_str(),
+        strerror(errno));
+    return 1;
+  }
+
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+
+  // Chunks are processed a round (one per thread) at a time, which bounds
+  // memory use to a few times the round's capture bytes.
+  uint64_t chunk_size = (uint64_t)params.chunk_mb << 20;
+  Converter converter(paths[1], params.csv);
+  std::vector<Chunk> chunks(params.threads);
+  std::vector<ChunkOutput> outputs(params.threads);
+  uint64_t data_frames = 0;
+  for (uint64_t round_begin=0; round_begin<size;
+      round_begin+=chunk_size * params.threads) {
+    size_t count = std::min<uint64_t>(params.threads,
+        (size - round_begin + chunk_size - 1) / chunk_size);
+    run_parallel(count, params.threads, [&](size_t i) {
+      uint64_t begin = round_begin + i * chunk_size;
+      frame_chunk(data, size, begin, std::min(begin + chunk_size, size),
+          chunks[i]);
+    });
+    for (size_t i=0; i<count; i++) {
+      converter.merge(data, size, chunks[i]);
+    }
+    run_parallel(count, params.threads, [&](size_t i) {
+      decode_chunk(chunks[i], converter.get_schemas(),
+          converter.get_column_count(), params.csv, outputs[i]);
+    });
+    for (size_t i=0; i<count; i++) {
+      data_frames += outputs[i].data_frames;
+    }
+    converter.write(outputs, count);
+  }
+  converter.finish();
+
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start_time).count();
+  printf("frames: %llu (%llu header, %llu data), lost: %llu, "
+         "decode errors: %llu\n",
+      (unsigned long long)converter.get_frame_count(),
+      (unsigned long long)converter.get_header_frames(),
+      (unsigned long long)data_frames,
+      (unsigned long long)converter.get_lost_frames(),
+      (unsigned long long)converter.get_decode_errors());
+  printf("converted %.1f MB in %.2f s (%.0f MB/s) on %zu threads, "
+         "%zu chunks resynchronized\n", size / 1e6, seconds,
+      seconds > 0 ? size / 1e6 / seconds : 0.0, params.threads,
+      converter.get_resynchronized_chunks());
+
+  if (data != NULL) {
+    munmap((void*)data, size);
+  }
+  close(fd);
+  return 0;
+}
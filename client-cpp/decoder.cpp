@@ -0,0 +1,775 @@
+/*
+ * decoder.cpp
+ *
+ * Implementation for the host-side telemetry stream decoder.
+ */
+
+#include "decoder.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace telemetry {
+namespace host {
+
+FrameDecoder::FrameDecoder(uint64_t timeout_us) :
+    state(SOF),
+    timeout_us(timeout_us),
+    last_byte_us(0),
+    pos(0),
+    length(0),
+    cobs_remaining(0),
+    cobs_zero_pending(false),
+    framing(protocol::FRAMING_STUFFED),
+    timeouts(0) {
+}
+
+bool FrameDecoder::add_byte(uint8_t byte, uint64_t time_us) {
+  if (state != SOF && time_us - last_byte_us > timeout_us) {
+    state = SOF;
+    pos = 0;
+    timeouts++;
+  }
+  last_byte_us = time_us;
+
+  if (state == SOF) {
+    if (byte == protocol::SOF_SEQ[pos]) {
+      pos++;
+      if (pos >= protocol::SOF_LENGTH) {
+        pos = 0;
+        length = 0;
+        state = LENGTH;
+      }
+    } else if (pos == protocol::SOF_LENGTH - 1
+        && byte == protocol::SOF_SEQ_COBS[pos]) {
+      pos = 0;
+      cobs_remaining = 0;
+      cobs_zero_pending = false;
+      frame.clear();
+      state = COBS_DATA;
+    } else {
+      // Pass through any partial SOF sequence.
+      for (size_t i=0; i<pos; i++) {
+        passthrough.push_back(protocol::SOF_SEQ[i]);
+      }
+      pos = 0;
+      if (byte == protocol::SOF_SEQ[0]) {
+        pos = 1;
+      } else {
+        passthrough.push_back(byte);
+      }
+    }
+  } else if (state == LENGTH) {
+    length = (length << 8) | byte;
+    pos++;
+    if (pos >= protocol::LENGTH_SIZE) {
+      pos = 0;
+      frame.clear();
+      state = DATA;
+      if (length == 0) {
+        state = SOF;
+        framing = protocol::FRAMING_STUFFED;
+        return true;
+      }
+    }
+  } else if (state == DATA) {
+    frame.push_back(byte);
+    pos++;
+    if (pos >= length) {
+      pos = 0;
+      if (byte == protocol::SOF_SEQ[0]) {
+        state = DATA_DESTUFF_END;
+      } else {
+        state = SOF;
+      }
+      framing = protocol::FRAMING_STUFFED;
+      return true;
+    } else if (byte == protocol::SOF_SEQ[0]) {
+      state = DATA_DESTUFF;
+    }
+  } else if (state == DATA_DESTUFF) {
+    state = DATA;
+  } else if (state == DATA_DESTUFF_END) {
+    state = SOF;
+  } else if (state == COBS_DATA) {
+    if (byte == protocol::COBS_DELIMITER) {
+      state = SOF;
+      return finish_cobs_frame();
+    } else if (cobs_remaining == 0) {
+      if (cobs_zero_pending) {
+        frame.push_back(0);
+      }
+      cobs_remaining = byte - 1;
+      cobs_zero_pending = byte <= protocol::COBS_MAX_BLOCK;
+    } else {
+      frame.push_back(byte);
+      cobs_remaining--;
+    }
+  }
+  return false;
+}
+
+bool FrameDecoder::finish_cobs_frame() {
+  // The decoded frame is the length followed by the payload.
+  if (cobs_remaining != 0 || frame.size() < protocol::LENGTH_SIZE) {
+    return false;
+  }
+  size_t frame_length = ((size_t)frame[0] << 8) | frame[1];
+  if (frame_length != frame.size() - protocol::LENGTH_SIZE) {
+    return false;
+  }
+  frame.erase(frame.begin(), frame.begin() + protocol::LENGTH_SIZE);
+  framing = protocol::FRAMING_COBS;
+  return true;
+}
+
+std::vector<uint8_t> FrameDecoder::take_passthrough() {
+  std::vector<uint8_t> out;
+  out.swap(passthrough);
+  return out;
+}
+
+uint8_t PacketReader::read_uint8() {
+  return *read_bytes(1);
+}
+
+uint16_t PacketReader::read_uint16() {
+  const uint8_t* bytes = read_bytes(2);
+  return ((uint16_t)bytes[0] << 8) | bytes[1];
+}
+
+uint32_t PacketReader::read_uint32() {
+  const uint8_t* bytes = read_bytes(4);
+  return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16)
+      | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+float PacketReader::read_float() {
+  uint32_t raw = read_uint32();
+  float out;
+  memcpy(&out, &raw, sizeof(out));
+  return out;
+}
+
+double PacketReader::read_double() {
+  uint64_t raw = (uint64_t)read_uint32() << 32;
+  raw |= read_uint32();
+  double out;
+  memcpy(&out, &raw, sizeof(out));
+  return out;
+}
+
+std::string PacketReader::read_string() {
+  std::string out;
+  uint8_t byte = read_uint8();
+  while (byte != '\0') {
+    out += (char)byte;
+    byte = read_uint8();
+  }
+  return out;
+}
+
+uint32_t PacketReader::read_varint() {
+  uint32_t value = 0;
+  for (size_t i=0; i<protocol::MAX_VARINT_LENGTH; i++) {
+    uint8_t byte = read_uint8();
+    value |= (uint32_t)(byte & 0x7f) << (7 * i);
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  throw DecodeError("Varint too long");
+}
+
+const uint8_t* PacketReader::read_bytes(size_t count) {
+  if (count > length - pos) {
+    throw DecodeError("Read over packet length");
+  }
+  pos += count;
+  return data + pos - count;
+}
+
+double ChannelDef::read_element(PacketReader& reader) const {
+  if (subtype == protocol::NUMERIC_SUBTYPE_FLOAT) {
+    if (length == 4) {
+      return reader.read_float();
+    } else if (length == 8) {
+      return reader.read_double();
+    }
+    throw DecodeError("Unknown float length");
+  } else if (subtype == protocol::NUMERIC_SUBTYPE_UINT
+      || subtype == protocol::NUMERIC_SUBTYPE_SINT) {
+    if (length == 0 || length > 8) {
+      throw DecodeError("Unknown integer length");
+    }
+    const uint8_t* bytes = reader.read_bytes(length);
+    uint64_t raw = 0;
+    for (size_t i=0; i<length; i++) {
+      raw = (raw << 8) | bytes[i];
+    }
+    if (subtype == protocol::NUMERIC_SUBTYPE_SINT && length < 8
+        && (raw >> (length * 8 - 1)) & 1) {
+      raw |= ~(uint64_t)0 << (length * 8);  // sign extend
+    }
+    if (subtype == protocol::NUMERIC_SUBTYPE_SINT) {
+      return (double)(int64_t)raw;
+    } else {
+      return (double)raw;
+    }
+  }
+  throw DecodeError("Unknown numeric subtype");
+}
+
+void Schema::decode_header(PacketReader& reader, bool append) {
+  if (!append) {
+    channels.clear();
+  }
+  uint32_t data_id = reader.read_varint();
+  while (data_id != protocol::DATAID_TERMINATOR) {
+    if (channels.count(data_id)) {
+      throw DecodeError("Duplicate data ID in header");
+    }
+    ChannelDef& def = channels[data_id];
+    def.data_id = data_id;
+    def.data_type = reader.read_uint8();
+
+    uint8_t record_id = reader.read_uint8();
+    while (record_id != protocol::RECORDID_TERMINATOR) {
+      if (record_id == protocol::RECORDID_INTERNAL_NAME) {
+        def.internal_name = reader.read_string();
+      } else if (record_id == protocol::RECORDID_DISPLAY_NAME) {
+        def.display_name = reader.read_string();
+      } else if (record_id == protocol::RECORDID_UNITS) {
+        def.units = reader.read_string();
+      } else if (record_id == protocol::RECORDID_NUMERIC_SUBTYPE) {
+        def.subtype = reader.read_uint8();
+      } else if (record_id == protocol::RECORDID_NUMERIC_LENGTH) {
+        def.length = reader.read_uint8();
+      } else if (record_id == protocol::RECORDID_NUMERIC_LIMITS) {
+        def.limit_min = def.read_element(reader);
+        def.limit_max = def.read_element(reader);
+      } else if (record_id == protocol::RECORDID_ARRAY_COUNT) {
+        def.count = reader.read_uint32();
+      } else if (record_id == protocol::RECORDID_CAPTURE_CHANNELS) {
+        def.channels = reader.read_uint8();
+      } else if (record_id == protocol::RECORDID_CAPTURE_PRETRIGGER) {
+        def.pretrigger = reader.read_uint32();
+      } else if (record_id == protocol::RECORDID_LOG_FORMATS
+          || record_id == protocol::RECORDID_TRACE_NAMES) {
+        uint16_t format_count = reader.read_uint16();
+        def.formats.clear();
+        for (size_t i=0; i<format_count; i++) {
+          def.formats.push_back(reader.read_string());
+        }
+      } else {
+        throw DecodeError("Unknown record ID in header");
+      }
+      record_id = reader.read_uint8();
+    }
+    data_id = reader.read_varint();
+  }
+}
+
+const ChannelDef* Schema::get(size_t data_id) const {
+  std::map<size_t, ChannelDef>::const_iterator it = channels.find(data_id);
+  if (it == channels.end()) {
+    return NULL;
+  }
+  return &it->second;
+}
+
+Packet PacketDecoder::decode(const std::vector<uint8_t>& frame) {
+  PacketReader header_reader(frame.data(), frame.size());
+  Packet packet;
+  packet.opcode = header_reader.read_uint8();
+  packet.compressed = (packet.opcode & protocol::OPCODE_FLAG_COMPRESSED) != 0;
+  packet.namespace_id = 0;
+  if (packet.opcode & protocol::OPCODE_FLAG_NAMESPACE) {
+    packet.namespace_id = header_reader.read_uint8();
+  }
+  packet.opcode &= ~(protocol::OPCODE_FLAG_COMPRESSED
+      | protocol::OPCODE_FLAG_NAMESPACE);
+  packet.sequence = header_reader.read_uint8();
+
+  if (packet.opcode == protocol::OPCODE_CHUNK) {
+    if (!chunks.add(frame)) {
+      return packet;
+    }
+    std::vector<uint8_t> chunked_frame = chunks.get_packet();
+    Packet chunked = decode(chunked_frame);
+    chunked.chunked_frame.swap(chunked_frame);
+    return chunked;
+  }
+
+  std::vector<uint8_t> payload;
+  if (packet.compressed) {
+    payload = lz_decompress(frame.data() + header_reader.position(),
+        header_reader.remaining());
+  } else {
+    payload.assign(frame.begin() + header_reader.position(), frame.end());
+  }
+  PacketReader reader(payload.data(), payload.size());
+  if (packet.opcode == protocol::OPCODE_HEADER) {
+    schemas[packet.namespace_id].decode_header(reader);
+  } else if (packet.opcode == protocol::OPCODE_HEADER_APPEND) {
+    schemas[packet.namespace_id].decode_header(reader, true);
+  } else if (packet.opcode == protocol::OPCODE_DATA) {
+    decode_data(reader, get_schema(packet.namespace_id), packet);
+  } else if (packet.opcode == protocol::OPCODE_DATA_CYCLES) {
+    uint32_t cycle = reader.read_varint();
+    while (cycle != 0) {
+      decode_data(reader, get_schema(packet.namespace_id), packet, cycle - 1);
+      cycle = reader.read_varint();
+    }
+  } else if (packet.opcode == protocol::OPCODE_PROBE) {
+    packet.probe.token = (uint64_t)reader.read_uint32() << 32;
+    packet.probe.token |= reader.read_uint32();
+    packet.probe.receive_time_us = reader.read_uint32();
+    packet.probe.transmit_time_us = reader.read_uint32();
+  } else {
+    throw DecodeError("Unknown opcode");
+  }
+  if (reader.remaining() > 0) {
+    throw DecodeError("Unused bytes in packet");
+  }
+  return packet;
+}
+
+bool ChunkAssembler::add(const std::vector<uint8_t>& frame) {
+  PacketReader header_reader(frame.data(), frame.size());
+  uint8_t opcode = header_reader.read_uint8();
+  uint8_t namespace_id = 0;
+  if (opcode & protocol::OPCODE_FLAG_NAMESPACE) {
+    namespace_id = header_reader.read_uint8();
+  }
+  uint8_t sequence = header_reader.read_uint8();
+
+  std::vector<uint8_t> payload;
+  if (opcode & protocol::OPCODE_FLAG_COMPRESSED) {
+    payload = lz_decompress(frame.data() + header_reader.position(),
+        header_reader.remaining());
+  } else {
+    payload.assign(frame.begin() + header_reader.position(), frame.end());
+  }
+  PacketReader reader(payload.data(), payload.size());
+  uint8_t number = reader.read_uint8();
+  uint32_t total = reader.read_varint();
+  uint32_t offset = reader.read_varint();
+  size_t length = reader.remaining();
+  const uint8_t* bytes = reader.read_bytes(length);
+
+  Transfer& transfer = transfers[namespace_id];
+  if (offset == 0) {
+    if (transfer.receiving) {
+      discarded++;  // its last chunks were lost
+    }
+    transfer.receiving = true;
+    transfer.discarding = false;
+    transfer.number = number;
+    transfer.total = total;
+    transfer.data.clear();
+  } else if (!transfer.receiving || transfer.number != number
+      || transfer.total != total || transfer.data.size() != offset) {
+    // A chunk is missing, so the rest of this chunked packet is discarded.
+    if (transfer.receiving || !transfer.discarding
+        || transfer.number != number) {
+      discarded++;
+    }
+    transfer.receiving = false;
+    transfer.discarding = true;
+    transfer.number = number;
+    return false;
+  }
+  if (length > total - offset) {
+    transfer.receiving = false;
+    throw DecodeError("Chunk past the end of its chunked packet");
+  }
+  transfer.data.insert(transfer.data.end(), bytes, bytes + length);
+  if (transfer.data.size() < total) {
+    return false;
+  }
+
+  transfer.receiving = false;
+  if (total == 0) {
+    throw DecodeError("Empty chunked packet");
+  }
+  uint8_t chunked_opcode = transfer.data[0] & ~protocol::OPCODE_FLAG_NAMESPACE;
+  if ((chunked_opcode & ~protocol::OPCODE_FLAG_COMPRESSED)
+      == protocol::OPCODE_CHUNK) {
+    throw DecodeError("Chunked chunk packet");
+  }
+  packet.clear();
+  if (opcode & protocol::OPCODE_FLAG_NAMESPACE) {
+    packet.push_back(chunked_opcode | protocol::OPCODE_FLAG_NAMESPACE);
+    packet.push_back(namespace_id);
+  } else {
+    packet.push_back(chunked_opcode);
+  }
+  packet.push_back(sequence);
+  packet.insert(packet.end(), transfer.data.begin() + 1, transfer.data.end());
+  return true;
+}
+
+const Schema& PacketDecoder::get_schema(uint8_t namespace_id) const {
+  static const Schema empty;
+  std::map<uint8_t, Schema>::const_iterator it = schemas.find(namespace_id);
+  if (it == schemas.end()) {
+    return empty;
+  }
+  return it->second;
+}
+
+void PacketDecoder::decode_data(PacketReader& reader, const Schema& schema,
+    Packet& packet, uint32_t cycle) {
+  uint32_t data_id = reader.read_varint();
+  while (data_id != protocol::DATAID_TERMINATOR) {
+    const ChannelDef* def = schema.get(data_id);
+    if (def == NULL) {
+      throw DecodeError("Data ID not defined in header");
+    }
+    packet.samples.push_back(Sample());
+    Sample& sample = packet.samples.back();
+    sample.data_id = data_id;
+    sample.cycle = cycle;
+    size_t start = reader.position();
+    size_t count = def->count;
+    if (def->data_type == protocol::DATATYPE_CAPTURE) {
+      sample.chunk.capture = reader.read_uint8();
+      sample.chunk.total = reader.read_uint16();
+      sample.chunk.trigger = reader.read_uint16();
+      sample.chunk.start = reader.read_uint16();
+      count = reader.read_uint8() * def->channels;
+    } else if (def->data_type == protocol::DATATYPE_AGGREGATE) {
+      // Count, min, max then mean.
+      sample.values.push_back(reader.read_uint32());
+      sample.values.push_back(def->read_element(reader));
+      sample.values.push_back(def->read_element(reader));
+      sample.values.push_back(reader.read_float());
+      count = 0;
+    } else if (def->data_type == protocol::DATATYPE_LOG) {
+      sample.values.push_back(reader.read_uint16());
+      uint16_t length = reader.read_uint16();
+      PacketReader messages(reader.read_bytes(length), length);
+      while (messages.remaining() > 0) {
+        uint32_t format_index = messages.read_varint();
+        if (format_index >= def->formats.size()) {
+          throw DecodeError("Log format index out of range");
+        }
+        sample.messages.push_back(
+            format_log_message(def->formats[format_index], messages));
+      }
+      count = 0;
+    } else if (def->data_type == protocol::DATATYPE_TRACE) {
+      sample.values.push_back(reader.read_uint16());
+      uint8_t event_count = reader.read_uint8();
+      uint32_t time_us = reader.read_uint32();
+      for (size_t i=0; i<event_count; i++) {
+        TraceEvent event;
+        uint32_t index_kind = reader.read_varint();
+        time_us += reader.read_varint();
+        event.index = index_kind >> 2;
+        event.kind = index_kind & 0x03;
+        event.time_us = time_us;
+        if (event.index >= def->formats.size()) {
+          throw DecodeError("Trace event index out of range");
+        }
+        sample.events.push_back(event);
+      }
+      count = 0;
+    } else if (def->data_type == protocol::DATATYPE_STREAM) {
+      // Position, free slots, underruns then dropped.
+      sample.values.push_back(reader.read_uint32());
+      sample.values.push_back(reader.read_uint16());
+      sample.values.push_back(reader.read_uint16());
+      sample.values.push_back(reader.read_uint16());
+      count = 0;
+    }
+    sample.values.reserve(count);
+    for (size_t i=0; i<count; i++) {
+      sample.values.push_back(def->read_element(reader));
+    }
+    sample.payload_length = reader.position() - start;
+    data_id = reader.read_varint();
+  }
+}
+
+std::string format_log_message(const std::string& format,
+    PacketReader& reader) {
+  std::string out;
+  size_t pos = 0;
+  while (pos < format.size()) {
+    size_t start = format.find('%', pos);
+    if (start == std::string::npos || start + 1 >= format.size()) {
+      break;
+    }
+    out.append(format, pos, start - pos);
+
+    // Flags, width and precision are kept, length modifiers are replaced.
+    size_t end = start + 1;
+    while (end < format.size() && strchr("-+ #0123456789.", format[end])) {
+      end++;
+    }
+    std::string spec = format.substr(start, end - start);
+    bool wide = false;
+    while (end < format.size() && strchr("hljztL", format[end])) {
+      if (format[end] == 'j'
+          || (format[end] == 'l' && end + 1 < format.size()
+              && format[end + 1] == 'l')) {
+        wide = true;
+      }
+      end++;
+    }
+    if (end >= format.size()) {
+      pos = start;
+      break;
+    }
+    char conversion = format[end];
+    char buffer[64];
+    buffer[0] = '\0';
+    if (strchr("diuoxX", conversion)) {
+      uint64_t raw = reader.read_uint32();
+      if (wide) {
+        raw = (raw << 32) | reader.read_uint32();
+      }
+      if (conversion == 'd' || conversion == 'i') {
+        long long value = wide ? (int64_t)raw : (int32_t)raw;
+        snprintf(buffer, sizeof(buffer), (spec + "lld").c_str(), value);
+      } else {
+        snprintf(buffer, sizeof(buffer), (spec + "ll" + conversion).c_str(),
+            (unsigned long long)raw);
+      }
+    } else if (conversion == 'p') {
+      snprintf(buffer, sizeof(buffer), "0x%x", (unsigned)reader.read_uint32());
+    } else if (conversion == 'c') {
+      snprintf(buffer, sizeof(buffer), (spec + "c").c_str(),
+          reader.read_uint8());
+    } else if (strchr("fFeEgGaA", conversion)) {
+      snprintf(buffer, sizeof(buffer), (spec + conversion).c_str(),
+          (double)reader.read_float());
+    } else if (conversion == 's') {
+      std::string value = reader.read_string();
+      std::vector<char> string_buffer(value.size() + sizeof(buffer));
+      snprintf(string_buffer.data(), string_buffer.size(),
+          (spec + "s").c_str(), value.c_str());
+      out += string_buffer.data();
+    } else if (conversion == '%') {
+      out += '%';
+    } else {
+      // Arguments end at unsupported conversions.
+      pos = start;
+      break;
+    }
+    out += buffer;
+    pos = end + 1;
+  }
+  out.append(format, pos, std::string::npos);
+  return out;
+}
+
+std::vector<uint8_t> lz_decompress(const uint8_t* data, size_t length) {
+  std::vector<uint8_t> out;
+  size_t pos = 0;
+  while (pos < length) {
+    uint8_t control = data[pos++];
+    for (size_t item=0; item<8 && pos<length; item++) {
+      if (control & (1 << item)) {
+        if (length - pos < 2) {
+          throw DecodeError("Truncated compressed match");
+        }
+        size_t offset = (size_t)data[pos] + 1;
+        size_t match_length = (size_t)data[pos + 1] + protocol::LZ_MIN_MATCH;
+        pos += 2;
+        if (offset > out.size()) {
+          throw DecodeError("Compressed match before start");
+        }
+        for (size_t i=0; i<match_length; i++) {
+          out.push_back(out[out.size() - offset]);
+        }
+      } else {
+        out.push_back(data[pos++]);
+      }
+    }
+  }
+  return out;
+}
+
+std::vector<uint8_t> compress_packet(const std::vector<uint8_t>& packet,
+    size_t header_length) {
+  std::vector<uint8_t> out(packet.begin(), packet.begin() + header_length);
+  out[0] |= protocol::OPCODE_FLAG_COMPRESSED;
+
+  // Greedy matching, as in the transmitter library, but with the longest
+  // matches allowed.
+  std::vector<uint8_t> group;
+  size_t items = 0;
+  size_t pos = header_length;
+  while (pos < packet.size()) {
+    if (items == 0) {
+      group.assign(1, 0);
+    }
+    size_t best_length = 0, best_offset = 0;
+    for (size_t offset = 1; offset <= protocol::LZ_WINDOW
+        && offset <= pos - header_length; offset++) {
+      size_t match_length = 0;
+      while (pos + match_length < packet.size()
+          && match_length < protocol::LZ_MAX_MATCH
+          && packet[pos + match_length - offset] == packet[pos + match_length]) {
+        match_length++;
+      }
+      if (match_length > best_length) {
+        best_length = match_length;
+        best_offset = offset;
+      }
+    }
+    if (best_length >= protocol::LZ_MIN_MATCH) {
+      group[0] |= 1 << items;
+      group.push_back(best_offset - 1);
+      group.push_back(best_length - protocol::LZ_MIN_MATCH);
+      pos += best_length;
+    } else {
+      group.push_back(packet[pos]);
+      pos++;
+    }
+    items++;
+    if (items == 8 || pos >= packet.size()) {
+      out.insert(out.end(), group.begin(), group.end());
+      items = 0;
+    }
+  }
+  return out;
+}
+
+std::vector<uint8_t> encode_frame(const std::vector<uint8_t>& payload,
+    protocol::Framing framing) {
+  if (framing == protocol::FRAMING_COBS) {
+    std::vector<uint8_t> data;
+    data.push_back((payload.size() >> 8) & 0xff);
+    data.push_back((payload.size() >> 0) & 0xff);
+    data.insert(data.end(), payload.begin(), payload.end());
+
+    std::vector<uint8_t> out(protocol::SOF_SEQ_COBS,
+        protocol::SOF_SEQ_COBS + protocol::SOF_LENGTH);
+    size_t code_pos = out.size();
+    out.push_back(0);  // placeholder for the block code
+    for (size_t i=0; i<data.size(); i++) {
+      if (data[i] != 0) {
+        out.push_back(data[i]);
+      }
+      if (data[i] == 0 || out.size() - code_pos > protocol::COBS_MAX_BLOCK) {
+        out[code_pos] = out.size() - code_pos;
+        code_pos = out.size();
+        out.push_back(0);
+      }
+    }
+    out[code_pos] = out.size() - code_pos;
+    out.push_back(protocol::COBS_DELIMITER);
+    return out;
+  }
+
+  std::vector<uint8_t> out(protocol::SOF_SEQ,
+      protocol::SOF_SEQ + protocol::SOF_LENGTH);
+  out.push_back((payload.size() >> 8) & 0xff);
+  out.push_back((payload.size() >> 0) & 0xff);
+  for (size_t i=0; i<payload.size(); i++) {
+    out.push_back(payload[i]);
+    if (payload[i] == protocol::SOF_SEQ[0]) {
+      out.push_back(protocol::SOF_SEQ0_STUFF);
+    }
+  }
+  return out;
+}
+
+namespace {
+void write_element(std::vector<uint8_t>& out, const ChannelDef& def,
+    double value) {
+  uint64_t raw;
+  if (def.subtype == protocol::NUMERIC_SUBTYPE_FLOAT && def.length == 4) {
+    float float_value = (float)value;
+    uint32_t raw32;
+    memcpy(&raw32, &float_value, sizeof(raw32));
+    raw = raw32;
+  } else if (def.subtype == protocol::NUMERIC_SUBTYPE_FLOAT) {
+    memcpy(&raw, &value, sizeof(raw));
+  } else if (def.subtype == protocol::NUMERIC_SUBTYPE_SINT) {
+    raw = (uint64_t)(int64_t)value;
+  } else {
+    raw = (uint64_t)value;
+  }
+  for (size_t i=def.length; i>0; i--) {
+    out.push_back((raw >> ((i - 1) * 8)) & 0xff);
+  }
+}
+
+// Writes the start of a data packet to the transmitter and the data ID of a
+// record.
+void write_data_start(std::vector<uint8_t>& out, const ChannelDef& def,
+    uint8_t namespace_id) {
+  // Packets to the transmitter have no sequence number.
+  if (namespace_id != 0) {
+    out.push_back(protocol::OPCODE_DATA | protocol::OPCODE_FLAG_NAMESPACE);
+    out.push_back(namespace_id);
+  } else {
+    out.push_back(protocol::OPCODE_DATA);
+  }
+  size_t data_id = def.data_id;
+  while (data_id >= 0x80) {
+    out.push_back((data_id & 0x7f) | 0x80);
+    data_id >>= 7;
+  }
+  out.push_back(data_id);
+}
+}
+
+std::vector<uint8_t> encode_set_packet(const ChannelDef& def,
+    const std::vector<double>& values, uint8_t namespace_id) {
+  if (values.size() != def.count) {
+    throw DecodeError("Value count mismatch");
+  }
+  std::vector<uint8_t> out;
+  write_data_start(out, def, namespace_id);
+  for (size_t i=0; i<values.size(); i++) {
+    write_element(out, def, values[i]);
+  }
+  out.push_back(protocol::DATAID_TERMINATOR);
+  return out;
+}
+
+std::vector<uint8_t> encode_stream_packet(const ChannelDef& def,
+    uint32_t position, const std::vector<double>& values,
+    uint8_t namespace_id) {
+  if (def.data_type != protocol::DATATYPE_STREAM) {
+    throw DecodeError("Not a stream");
+  }
+  if (values.size() > 255) {
+    throw DecodeError("Too many stream values");
+  }
+  std::vector<uint8_t> out;
+  write_data_start(out, def, namespace_id);
+  for (size_t i=4; i>0; i--) {
+    out.push_back((position >> ((i - 1) * 8)) & 0xff);
+  }
+  out.push_back(values.size());
+  for (size_t i=0; i<values.size(); i++) {
+    write_element(out, def, values[i]);
+  }
+  out.push_back(protocol::DATAID_TERMINATOR);
+  return out;
+}
+
+std::vector<uint8_t> encode_probe_packet(uint64_t token,
+    uint8_t namespace_id) {
+  std::vector<uint8_t> out;
+  if (namespace_id != 0) {
+    out.push_back(protocol::OPCODE_PROBE | protocol::OPCODE_FLAG_NAMESPACE);
+    out.push_back(namespace_id);
+  } else {
+    out.push_back(protocol::OPCODE_PROBE);
+  }
+  for (size_t i=0; i<protocol::PROBE_TOKEN_LENGTH; i++) {
+    out.push_back(token >> (8 * (protocol::PROBE_TOKEN_LENGTH - 1 - i)));
+  }
+  return out;
+}
+
+}
+}
@@ -0,0 +1,317 @@
+/**
+ * Host-side telemetry stream decoder: separates telemetry frames from other
+ * in-band data and decodes header and data packets using the wire constants
+ * in server-cpp/protocol.h.
+ */
+
+#ifndef _TELEMETRY_DECODER_H_
+#define _TELEMETRY_DECODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+
+namespace telemetry {
+namespace host {
+
+// Raised on malformed packet contents.
+class DecodeError : public std::runtime_error {
+public:
+  DecodeError(const std::string& message) : std::runtime_error(message) {}
+};
+
+// Byte-level frame decoder, equivalent to the receive state machine in the
+// transmitter library. Bytes are fed in with their receive time, and complete
+// frame payloads (destuffed or COBS-decoded, without start-of-frame or length)
+// are returned. Both framings are accepted.
+class FrameDecoder {
+public:
+  // timeout_us: gap after which a partially received frame is discarded.
+  FrameDecoder(uint64_t timeout_us=100000);
+
+  // Adds a received byte, returning true if it completed a frame, which is
+  // then available from get_frame until the next call.
+  bool add_byte(uint8_t byte, uint64_t time_us);
+
+  // Returns the payload of the last completed frame.
+  const std::vector<uint8_t>& get_frame() const { return frame; }
+  // Returns the framing of the last completed frame.
+  protocol::Framing get_framing() const { return framing; }
+
+  // Returns (and clears) received non-telemetry bytes.
+  std::vector<uint8_t> take_passthrough();
+
+  // Returns the number of partially received frames discarded on timeout.
+  size_t get_timeouts() const { return timeouts; }
+
+  // Returns whether a frame is currently being received.
+  bool in_frame() const { return state != SOF || pos != 0; }
+
+protected:
+  enum DecoderState {
+    SOF,
+    LENGTH,
+    DATA,
+    DATA_DESTUFF,
+    DATA_DESTUFF_END,
+    COBS_DATA
+  } state;
+
+  // Handles the delimiter of a COBS frame, returning true if it was valid.
+  bool finish_cobs_frame();
+
+  uint64_t timeout_us;
+  uint64_t last_byte_us;
+
+  size_t pos;
+  size_t length;
+  size_t cobs_remaining;  // bytes left in the current COBS block
+  bool cobs_zero_pending;  // whether the current COBS block ends in a zero
+  std::vector<uint8_t> frame;
+  protocol::Framing framing;
+  std::vector<uint8_t> passthrough;
+
+  size_t timeouts;
+};
+
+// Reads big-endian values from a packet payload, raising DecodeError on
+// overrun.
+class PacketReader {
+public:
+  PacketReader(const uint8_t* data, size_t length) :
+      data(data), length(length), pos(0) {}
+
+  uint8_t read_uint8();
+  uint16_t read_uint16();
+  uint32_t read_uint32();
+  float read_float();
+  double read_double();
+  std::string read_string();
+  uint32_t read_varint();
+  // Returns a pointer to the next count bytes, advancing past them.
+  const uint8_t* read_bytes(size_t count);
+
+  size_t remaining() const { return length - pos; }
+  size_t position() const { return pos; }
+
+protected:
+  const uint8_t* data;
+  size_t length;
+  size_t pos;
+};
+
+// Definition of a telemetry data object, from a header packet.
+struct ChannelDef {
+  ChannelDef() : data_id(0), data_type(0), subtype(0), length(0), count(1),
+      limit_min(0), limit_max(0), channels(1), pretrigger(0) {}
+
+  // Returns the size, in bytes, of a data payload for this channel. Capture
+  // payloads vary in length, so this is the size of a whole capture.
+  size_t get_payload_length() const { return length * count * channels; }
+
+  // Decodes a single numeric element from the reader.
+  double read_element(PacketReader& reader) const;
+
+  size_t data_id;
+  uint8_t data_type;
+  std::string internal_name;
+  std::string display_name;
+  std::string units;
+
+  uint8_t subtype;
+  uint8_t length;
+  // Number of elements, 1 for non-arrays, depth for captures and streams.
+  uint32_t count;
+  double limit_min, limit_max;
+
+  uint8_t channels;  // number of capture channels, 1 otherwise
+  uint32_t pretrigger;  // capture pre-trigger samples
+
+  std::vector<std::string> formats;  // log format strings, or trace names
+};
+
+// Position of a capture chunk within its capture.
+struct CaptureChunk {
+  CaptureChunk() : capture(0), total(0), trigger(0), start(0) {}
+
+  uint8_t capture;  // capture number
+  uint16_t total;  // samples in the capture
+  uint16_t trigger;  // index of the trigger sample
+  uint16_t start;  // index of the chunk's first sample
+};
+
+// A trace event.
+struct TraceEvent {
+  uint16_t index;  // into the trace's event names
+  uint8_t kind;  // TRACE_KIND_BEGIN, TRACE_KIND_END or TRACE_KIND_INSTANT
+  uint32_t time_us;  // transmitter time, wrapping at 32 bits
+};
+
+// A decoded data record.
+struct Sample {
+  size_t data_id;
+  size_t payload_length;  // in bytes
+  // Element values, for captures sample by sample with an element per
+  // channel, for aggregates the count, min, max and mean, for logs and
+  // traces the count of dropped messages or events, and for streams the
+  // position, free slots, underruns and dropped samples.
+  std::vector<double> values;
+  CaptureChunk chunk;  // for captures
+  std::vector<std::string> messages;  // formatted log messages
+  std::vector<TraceEvent> events;  // trace events
+  // Offset, in transmitter update cycles, from the start of the batch for
+  // data packets grouped by cycle, otherwise zero.
+  uint32_t cycle;
+};
+
+// Data definitions from the latest header packet.
+class Schema {
+public:
+  // Replaces the schema with the definitions in a header packet payload,
+  // starting after the opcode and sequence, or adds them to the schema if
+  // append is set (for header continuation packets).
+  void decode_header(PacketReader& reader, bool append=false);
+
+  // Returns the definition for a data ID, or NULL if undefined.
+  const ChannelDef* get(size_t data_id) const;
+
+  const std::map<size_t, ChannelDef>& get_channels() const { return channels; }
+
+  bool empty() const { return channels.empty(); }
+
+protected:
+  std::map<size_t, ChannelDef> channels;
+};
+
+// A transmitter's answer to a latency probe.
+struct ProbeReply {
+  ProbeReply() : token(0), receive_time_us(0), transmit_time_us(0) {}
+
+  uint64_t token;  // as sent in the probe
+  // Transmitter times at which the probe was received and answered.
+  uint32_t receive_time_us;
+  uint32_t transmit_time_us;
+};
+
+// A decoded telemetry packet.
+struct Packet {
+  // Without OPCODE_FLAG_COMPRESSED or OPCODE_FLAG_NAMESPACE. The last chunk
+  // of a chunked packet decodes as the chunked packet, other chunks as
+  // OPCODE_CHUNK packets without samples.
+  uint8_t opcode;
+  bool compressed;
+  uint8_t namespace_id;
+  uint8_t sequence;
+  std::vector<Sample> samples;  // for data packets, in order
+  ProbeReply probe;  // for probe packets
+  // For packets reassembled from chunks, the reassembled frame payload.
+  std::vector<uint8_t> chunked_frame;
+};
+
+// Reassembles chunked packets (see OPCODE_CHUNK) from their chunks, in each
+// namespace.
+class ChunkAssembler {
+public:
+  ChunkAssembler() : discarded(0) {}
+
+  // Adds a chunk packet (a frame payload), returning true if it completed a
+  // chunked packet, which is then available from get_packet until the next
+  // call. Chunked packets with a missing chunk are discarded. Raises
+  // DecodeError on malformed chunks.
+  bool add(const std::vector<uint8_t>& frame);
+
+  // Returns the last completed chunked packet as a frame payload, in the
+  // namespace and with the sequence number of its last chunk.
+  const std::vector<uint8_t>& get_packet() const { return packet; }
+
+  // Returns the number of chunked packets discarded for a missing chunk.
+  size_t get_discarded() const { return discarded; }
+
+protected:
+  // Chunked packet being reassembled in a namespace.
+  struct Transfer {
+    Transfer() : receiving(false), discarding(false), number(0), total(0) {}
+
+    bool receiving;  // whether its chunks so far are in data
+    bool discarding;  // whether it's discarded for a missing chunk
+    uint8_t number;
+    uint32_t total;  // length
+    std::vector<uint8_t> data;
+  };
+
+  std::map<uint8_t, Transfer> transfers;
+  std::vector<uint8_t> packet;
+  size_t discarded;
+};
+
+// Packet-level decoder, tracking the schema of each namespace from header
+// packets.
+class PacketDecoder {
+public:
+  // Decodes a frame payload, updating the schema on header packets. Raises
+  // DecodeError on malformed packets.
+  Packet decode(const std::vector<uint8_t>& frame);
+
+  // Returns the schema of a namespace, which is empty if no header has been
+  // received in it.
+  const Schema& get_schema(uint8_t namespace_id=0) const;
+
+  // Returns the number of chunked packets discarded for a missing chunk.
+  size_t get_discarded_chunked() const { return chunks.get_discarded(); }
+
+protected:
+  // Decodes data records up to their terminator, from the given cycle.
+  void decode_data(PacketReader& reader, const Schema& schema,
+      Packet& packet, uint32_t cycle=0);
+
+  std::map<uint8_t, Schema> schemas;
+  ChunkAssembler chunks;
+};
+
+// Builds the wire bytes (start-of-frame, length, stuffed or COBS-encoded
+// payload) of a frame.
+std::vector<uint8_t> encode_frame(const std::vector<uint8_t>& payload,
+    protocol::Framing framing=protocol::FRAMING_STUFFED);
+
+// Formats a deferred-format log message with the arguments of its
+// conversions read from the reader, raising DecodeError on overrun.
+std::string format_log_message(const std::string& format,
+    PacketReader& reader);
+
+// Decompresses an LZSS compressed packet payload, raising DecodeError if it's
+// malformed.
+std::vector<uint8_t> lz_decompress(const uint8_t* data, size_t length);
+
+// Compresses the part of a packet after its first header_length bytes (the
+// opcode, namespace and sequence number, if any), flagging the opcode as compressed.
+std::vector<uint8_t> compress_packet(const std::vector<uint8_t>& packet,
+    size_t header_length);
+
+// Builds a data packet payload setting a single channel (in the given
+// namespace) to the given values.
+std::vector<uint8_t> encode_set_packet(const ChannelDef& def,
+    const std::vector<double>& values, uint8_t namespace_id=0);
+
+// Builds a data packet payload sending a stream's values to a transmitter (in
+// the given namespace), starting at the given stream position. At most 255
+// values fit in a record.
+std::vector<uint8_t> encode_stream_packet(const ChannelDef& def,
+    uint32_t position, const std::vector<double>& values,
+    uint8_t namespace_id=0);
+
+// Builds a latency probe packet payload to a transmitter in the given
+// namespace, which answers with the token and its own receive and transmit
+// times.
+std::vector<uint8_t> encode_probe_packet(uint64_t token,
+    uint8_t namespace_id=0);
+
+}
+}
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ * gateway.cpp
+ *
+ * Implementation of the shared-memory telemetry gateway.
+ */
+
+#include "gateway.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace telemetry {
+namespace gateway {
+
+// The layout is also read by client-py/telemetry/gateway.py.
+static_assert(offsetof(SharedHeader, ring_claim) == 56,
+    "shared memory layout changed");
+static_assert(offsetof(SharedHeader, command_tail) == 96,
+    "shared memory layout changed");
+static_assert(sizeof(RecordHeader) == RECORD_ALIGN,
+    "record header must keep records aligned");
+
+namespace {
+
+size_t align_up(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+std::string system_error(const std::string& message,
+    const std::string& name) {
+  return message + " " + name + ": " + strerror(errno);
+}
+
+}
+
+uint64_t get_monotonic_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+GatewayWriter::GatewayWriter(const std::string& name, size_t ring_capacity,
+    size_t schema_capacity, size_t command_slots, size_t command_slot_size) :
+    name(name), fd(-1), base(NULL), size(0), header(NULL), ring(NULL),
+    frame_count(0) {
+  // The largest record, a maximum-length frame, has to fit several times.
+  size_t capacity = 1 << 20;
+  while (capacity < ring_capacity) {
+    capacity <<= 1;
+  }
+  command_slot_size = align_up(command_slot_size, 8);
+
+  size_t schema_offset = align_up(sizeof(SharedHeader), 64);
+  size_t command_offset = align_up(schema_offset + schema_capacity, 64);
+  size_t ring_offset = align_up(
+      command_offset + command_slots * command_slot_size, 4096);
+  size = ring_offset + capacity;
+
+  shm_unlink(name.c_str());
+  fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+  if (fd < 0) {
+    throw GatewayError(system_error("Failed to create", name));
+  }
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    shm_unlink(name.c_str());
+    throw GatewayError(system_error("Failed to size", name));
+  }
+  void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    close(fd);
+    shm_unlink(name.c_str());
+    throw GatewayError(system_error("Failed to map", name));
+  }
+  base = (uint8_t*)mapped;
+  header = (SharedHeader*)base;
+  ring = base + ring_offset;
+
+  // The object is zero-filled, which is a valid state for the positions.
+  header->version = LAYOUT_VERSION;
+  header->ring_offset = ring_offset;
+  header->ring_capacity = capacity;
+  header->schema_offset = schema_offset;
+  header->schema_capacity = schema_capacity;
+  header->command_offset = command_offset;
+  header->command_slots = command_slots;
+  header->command_slot_size = command_slot_size;
+  header->heartbeat_us.store(get_monotonic_us(), std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = LAYOUT_MAGIC;
+}
+
+GatewayWriter::~GatewayWriter() {
+  munmap(base, size);
+  close(fd);
+  shm_unlink(name.c_str());
+}
+
+void GatewayWriter::write_record(uint8_t type, uint8_t namespace_id,
+    uint64_t time_us, const void* data, size_t length, const void* data2,
+    size_t length2) {
+  uint64_t capacity = header->ring_capacity;
+  size_t total = align_up(sizeof(RecordHeader) + length + length2,
+      RECORD_ALIGN);
+  if (total > capacity / 4) {
+    return;  // would leave readers too little time to read it
+  }
+  uint64_t pos = header->ring_commit.load(std::memory_order_relaxed);
+  uint64_t offset = pos & (capacity - 1);
+  uint64_t start = pos;
+  if (offset + total > capacity) {
+    start += capacity - offset;  // pad to the end of the ring
+  }
+
+  // Readers check the claim after reading a record in place, so it's
+  // published before any bytes it covers are overwritten.
+  header->ring_claim.store(start + total, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  if (start != pos) {
+    RecordHeader* pad = (RecordHeader*)(ring + offset);
+    pad->length = capacity - offset - sizeof(RecordHeader);
+    pad->type = RECORD_PAD;
+    pad->namespace_id = 0;
+    pad->reserved = 0;
+    pad->time_us = time_us;
+  }
+  RecordHeader* record = (RecordHeader*)(ring + (start & (capacity - 1)));
+  record->length = length + length2;
+  record->type = type;
+  record->namespace_id = namespace_id;
+  record->reserved = 0;
+  record->time_us = time_us;
+  uint8_t* payload = (uint8_t*)(record + 1);
+  memcpy(payload, data, length);
+  if (length2 > 0) {
+    memcpy(payload + length, data2, length2);
+  }
+
+  header->ring_commit.store(start + total, std::memory_order_release);
+}
+
+void GatewayWriter::publish_frame(const std::vector<uint8_t>& frame,
+    const host::Packet* packet, uint64_t time_us) {
+  uint8_t namespace_id = packet != NULL ? packet->namespace_id : 0;
+  write_record(RECORD_FRAME, namespace_id, time_us, frame.data(),
+      frame.size());
+  if (packet != NULL) {
+    if (packet->opcode == protocol::OPCODE_HEADER
+        || packet->opcode == protocol::OPCODE_HEADER_APPEND) {
+      // Chunked headers are kept reassembled, as a frame readers can decode
+      // alone.
+      update_schema(namespace_id,
+          packet->opcode == protocol::OPCODE_HEADER_APPEND,
+          packet->chunked_frame.empty() ? frame : packet->chunked_frame);
+    }
+    for (size_t i=0; i<packet->samples.size(); i++) {
+      const host::Sample& sample = packet->samples[i];
+      SampleRecord record;
+      record.frame = frame_count;
+      record.data_id = sample.data_id;
+      record.cycle = sample.cycle;
+      record.count = sample.values.size();
+      record.reserved = 0;
+      write_record(RECORD_SAMPLE, namespace_id, time_us, &record,
+          sizeof(record), sample.values.data(),
+          sample.values.size() * sizeof(double));
+    }
+  }
+  frame_count++;
+}
+
+void GatewayWriter::publish_passthrough(const std::vector<uint8_t>& data,
+    uint64_t time_us) {
+  write_record(RECORD_PASSTHROUGH, 0, time_us, data.data(), data.size());
+}
+
+void GatewayWriter::update_schema(uint8_t namespace_id, bool append,
+    const std::vector<uint8_t>& frame) {
+  if (!append) {
+    std::vector<std::pair<uint8_t, std::vector<uint8_t> > >::iterator it =
+        schema.begin();
+    while (it != schema.end()) {
+      if (it->first == namespace_id) {
+        it = schema.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  schema.push_back(std::make_pair(namespace_id, frame));
+
+  // Entries which don't fit are left out, so readers attaching later can't
+  // decode their data objects until the next header.
+  uint8_t* area = base + header->schema_offset;
+  uint64_t version = header->schema_version.load(std::memory_order_relaxed);
+  header->schema_version.store(version + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  size_t length = 0;
+  for (size_t i=0; i<schema.size(); i++) {
+    const std::vector<uint8_t>& payload = schema[i].second;
+    if (length + sizeof(SchemaEntry) + payload.size()
+        > header->schema_capacity) {
+      continue;
+    }
+    SchemaEntry entry;
+    entry.namespace_id = schema[i].first;
+    entry.reserved = 0;
+    entry.length = payload.size();
+    memcpy(area + length, &entry, sizeof(entry));
+    memcpy(area + length + sizeof(entry), payload.data(), payload.size());
+    length += sizeof(entry) + payload.size();
+  }
+  header->schema_length = length;
+  header->schema_version.store(version + 2, std::memory_order_release);
+}
+
+bool GatewayWriter::take_command(std::vector<uint8_t>& out) {
+  uint64_t head = header->command_head.load(std::memory_order_relaxed);
+  uint64_t tail = header->command_tail.load(std::memory_order_acquire);
+  if (head == tail) {
+    return false;
+  }
+  const uint8_t* slot = base + header->command_offset
+      + (head % header->command_slots) * header->command_slot_size;
+  const CommandSlot* command = (const CommandSlot*)slot;
+  size_t length = std::min<size_t>(command->length,
+      header->command_slot_size - sizeof(CommandSlot));
+  out.assign(slot + sizeof(CommandSlot), slot + sizeof(CommandSlot) + length);
+  header->command_head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+void GatewayWriter::update_heartbeat() {
+  header->heartbeat_us.store(get_monotonic_us(), std::memory_order_relaxed);
+}
+
+GatewayReader::GatewayReader(const std::string& name) :
+    fd(-1), base(NULL), size(0), header(NULL), ring(NULL), position(0),
+    record_position(0), lost_bytes(0) {
+  fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    throw GatewayError(system_error("Failed to open", name));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SharedHeader)) {
+    close(fd);
+    throw GatewayError("Not a telemetry gateway: " + name);
+  }
+  size = st.st_size;
+  void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    close(fd);
+    throw GatewayError(system_error("Failed to map", name));
+  }
+  base = (uint8_t*)mapped;
+  header = (SharedHeader*)base;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (header->magic != LAYOUT_MAGIC || header->version != LAYOUT_VERSION
+      || header->ring_offset + header->ring_capacity > size) {
+    munmap(base, size);
+    close(fd);
+    throw GatewayError("Not a compatible telemetry gateway: " + name);
+  }
+  ring = base + header->ring_offset;
+  position = header->ring_commit.load(std::memory_order_acquire);
+  record_position = position;
+}
+
+GatewayReader::~GatewayReader() {
+  munmap(base, size);
+  close(fd);
+}
+
+const RecordHeader* GatewayReader::next() {
+  uint64_t capacity = header->ring_capacity;
+  while (true) {
+    uint64_t commit = header->ring_commit.load(std::memory_order_acquire);
+    if (position >= commit) {
+      return NULL;
+    }
+    const RecordHeader* record =
+        (const RecordHeader*)(ring + (position & (capacity - 1)));
+    uint8_t type = record->type;
+    uint32_t length = record->length;
+    record_position = position;
+    if (!is_valid()) {
+      // Fell behind by more than the ring: skip to the latest record.
+      lost_bytes += commit - position;
+      position = commit;
+      continue;
+    }
+    if (type == RECORD_PAD) {
+      position += capacity - (position & (capacity - 1));
+      continue;
+    }
+    position += align_up(sizeof(RecordHeader) + length, RECORD_ALIGN);
+    return record;
+  }
+}
+
+bool GatewayReader::is_valid() const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return header->ring_claim.load(std::memory_order_relaxed) - record_position
+      <= header->ring_capacity;
+}
+
+std::vector<std::vector<uint8_t> > GatewayReader::read_schema() const {
+  const uint8_t* area = base + header->schema_offset;
+  std::vector<uint8_t> copy;
+  while (true) {
+    uint64_t version = header->schema_version.load(std::memory_order_acquire);
+    if (version & 1) {
+      continue;  // being written
+    }
+    size_t length = std::min<size_t>(header->schema_length,
+        header->schema_capacity);
+    copy.assign(area, area + length);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->schema_version.load(std::memory_order_relaxed) == version) {
+      break;
+    }
+  }
+
+  std::vector<std::vector<uint8_t> > out;
+  size_t pos = 0;
+  while (pos + sizeof(SchemaEntry) <= copy.size()) {
+    SchemaEntry entry;
+    memcpy(&entry, copy.data() + pos, sizeof(entry));
+    pos += sizeof(entry);
+    if (pos + entry.length > copy.size()) {
+      break;
+    }
+    out.push_back(std::vector<uint8_t>(copy.begin() + pos,
+        copy.begin() + pos + entry.length));
+    pos += entry.length;
+  }
+  return out;
+}
+
+bool GatewayReader::send(const std::vector<uint8_t>& data) {
+  if (data.size() > header->command_slot_size - sizeof(CommandSlot)) {
+    return false;
+  }
+  if (flock(fd, LOCK_EX) != 0) {
+    return false;
+  }
+  uint64_t tail = header->command_tail.load(std::memory_order_relaxed);
+  uint64_t head = header->command_head.load(std::memory_order_acquire);
+  bool queued = tail - head < header->command_slots;
+  if (queued) {
+    uint8_t* slot = base + header->command_offset
+        + (tail % header->command_slots) * header->command_slot_size;
+    CommandSlot command;
+    command.length = data.size();
+    command.reserved = 0;
+    memcpy(slot, &command, sizeof(command));
+    memcpy(slot + sizeof(command), data.data(), data.size());
+    header->command_tail.store(tail + 1, std::memory_order_release);
+  }
+  flock(fd, LOCK_UN);
+  return queued;
+}
+
+bool GatewayReader::send_packet(const std::vector<uint8_t>& payload,
+    protocol::Framing framing) {
+  return send(host::encode_frame(payload, framing));
+}
+
+uint64_t GatewayReader::get_heartbeat_age_us() const {
+  return get_monotonic_us()
+      - header->heartbeat_us.load(std::memory_order_relaxed);
+}
+
+}
+}
@@ -0,0 +1,232 @@
+/**
+ * Shared-memory fan-out of a telemetry link to local processes.
+ *
+ * The gateway daemon (telemetry-gateway) owns the serial port and decodes
+ * each frame once, publishing it into a POSIX shared memory object which any
+ * number of local readers map:
+ * - A broadcast ring of records (received frames, their decoded samples and
+ *   non-telemetry bytes), with a single writer and independent readers that
+ *   read records in place and are never waited on: a reader which falls more
+ *   than the ring's size behind loses records, and is told so.
+ * - The header packets of the current schema of each namespace, so readers
+ *   attaching after the header was received can decode data.
+ * - A command queue from readers to the daemon, of wire bytes (like remote
+ *   set packets) it transmits to the device. Producers are serialized with
+ *   flock() on the shared memory object, so each command is sent whole.
+ *
+ * The layout is fixed (native byte order, 8-byte aligned fields), so it can
+ * be read without this header: client-py/telemetry/gateway.py does so.
+ */
+
+#ifndef _TELEMETRY_GATEWAY_H_
+#define _TELEMETRY_GATEWAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "decoder.h"
+
+namespace telemetry {
+namespace gateway {
+
+const uint32_t LAYOUT_MAGIC = 0x57474c54;  // "TLGW"
+const uint32_t LAYOUT_VERSION = 1;
+
+const char DEFAULT_NAME[] = "/telemetry";
+
+// Record types in the ring.
+// Filler to the end of the ring, the next record is at its start.
+const uint8_t RECORD_PAD = 0x00;
+// A received frame payload (opcode to end, as decoded by FrameDecoder).
+const uint8_t RECORD_FRAME = 0x01;
+// A decoded data record, as a SampleRecord followed by its values.
+const uint8_t RECORD_SAMPLE = 0x02;
+// Received non-telemetry bytes.
+const uint8_t RECORD_PASSTHROUGH = 0x03;
+
+// Records start on multiples of this, so a pad record always fits.
+const size_t RECORD_ALIGN = 16;
+
+// Header at the start of the shared memory object.
+struct SharedHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t ring_offset;
+  uint64_t ring_capacity;  // in bytes, a power of two
+  uint64_t schema_offset;
+  uint64_t schema_capacity;
+  uint64_t command_offset;
+  uint32_t command_slots;
+  uint32_t command_slot_size;  // including its CommandSlot header
+
+  // Ring positions, in bytes written since startup: the end of the record
+  // being written, and of the last complete record. Bytes before
+  // ring_claim - ring_capacity may have been overwritten.
+  std::atomic<uint64_t> ring_claim;
+  std::atomic<uint64_t> ring_commit;
+
+  // Schema area sequence lock, odd while being written.
+  std::atomic<uint64_t> schema_version;
+  uint64_t schema_length;
+
+  // Command queue positions, in commands: the next to transmit, and the next
+  // to write.
+  std::atomic<uint64_t> command_head;
+  std::atomic<uint64_t> command_tail;
+
+  // Daemon's CLOCK_MONOTONIC time at its last loop, in microseconds, so
+  // readers can tell if it stopped.
+  std::atomic<uint64_t> heartbeat_us;
+};
+
+// Header of each record in the ring, followed by its payload.
+struct RecordHeader {
+  uint32_t length;  // of the payload
+  uint8_t type;  // RECORD_*
+  uint8_t namespace_id;  // for frames and samples
+  uint16_t reserved;
+  uint64_t time_us;  // daemon's CLOCK_MONOTONIC time the frame completed
+};
+
+// Payload of RECORD_SAMPLE, followed by count doubles. Values are as in
+// host::Sample; log messages and trace events are only in the frame.
+struct SampleRecord {
+  uint64_t frame;  // number of the frame it's from, counting from 0
+  uint32_t data_id;
+  uint32_t cycle;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+// Schema area entry, followed by the header packet payload. Entries of a
+// namespace are its last OPCODE_HEADER packet and any following
+// OPCODE_HEADER_APPEND packets, in order.
+struct SchemaEntry {
+  uint8_t namespace_id;
+  uint8_t reserved;
+  uint16_t length;
+};
+
+// Command queue slot header, followed by wire bytes.
+struct CommandSlot {
+  uint32_t length;
+  uint32_t reserved;
+};
+
+class GatewayError : public std::runtime_error {
+public:
+  GatewayError(const std::string& message) : std::runtime_error(message) {}
+};
+
+// Returns CLOCK_MONOTONIC time in microseconds.
+uint64_t get_monotonic_us();
+
+// Daemon side: creates the shared memory object and publishes to it.
+class GatewayWriter {
+public:
+  // Creates (replacing any existing) shared memory object of the given name,
+  // raising GatewayError on failure.
+  GatewayWriter(const std::string& name, size_t ring_capacity,
+      size_t schema_capacity=65536, size_t command_slots=64,
+      size_t command_slot_size=1024);
+  // Unlinks the shared memory object. Mapped readers keep their mapping.
+  ~GatewayWriter();
+
+  // Publishes a received frame payload, its decoded samples and, for header
+  // packets, the namespace's updated schema.
+  void publish_frame(const std::vector<uint8_t>& frame,
+      const host::Packet* packet, uint64_t time_us);
+  // Publishes received non-telemetry bytes.
+  void publish_passthrough(const std::vector<uint8_t>& data, uint64_t time_us);
+
+  // Removes the next command from the queue into out, returning false if
+  // the queue is empty.
+  bool take_command(std::vector<uint8_t>& out);
+
+  void update_heartbeat();
+
+  uint64_t get_frame_count() const { return frame_count; }
+
+protected:
+  // Writes a record to the ring with a payload in up to two parts.
+  void write_record(uint8_t type, uint8_t namespace_id, uint64_t time_us,
+      const void* data, size_t length, const void* data2=NULL,
+      size_t length2=0);
+  void update_schema(uint8_t namespace_id, bool append,
+      const std::vector<uint8_t>& frame);
+
+  std::string name;
+  int fd;
+  uint8_t* base;
+  size_t size;
+  SharedHeader* header;
+  uint8_t* ring;
+
+  // Header packet payloads of each namespace, (namespace, payload) in order.
+  std::vector<std::pair<uint8_t, std::vector<uint8_t> > > schema;
+  uint64_t frame_count;
+};
+
+// Reader side: maps an existing gateway's shared memory object. Each thread
+// reading needs its own GatewayReader.
+class GatewayReader {
+public:
+  // Maps the shared memory object of the given name, raising GatewayError
+  // if it doesn't exist or isn't a compatible gateway. Reading starts at the
+  // next record written.
+  GatewayReader(const std::string& name=DEFAULT_NAME);
+  ~GatewayReader();
+
+  // Returns the next record, with its payload following it, or NULL if
+  // there's none yet. The record is read in place, so once done with it,
+  // check is_valid(): if false, the gateway overwrote it meanwhile, and it
+  // must be discarded. Pad records are skipped.
+  const RecordHeader* next();
+  bool is_valid() const;
+
+  // Returns the payload of a record.
+  static const uint8_t* get_payload(const RecordHeader* record) {
+    return (const uint8_t*)(record + 1);
+  }
+  // Returns the values of a RECORD_SAMPLE record.
+  static const double* get_values(const RecordHeader* record) {
+    return (const double*)(get_payload(record) + sizeof(SampleRecord));
+  }
+
+  // Returns a copy of the header packet payloads of the current schemas, in
+  // order, to be decoded (by host::PacketDecoder) before any frames.
+  std::vector<std::vector<uint8_t> > read_schema() const;
+
+  // Queues wire bytes for the daemon to transmit, returning false if the
+  // queue is full or they don't fit in a slot.
+  bool send(const std::vector<uint8_t>& data);
+  // Frames and queues a packet payload, like one from encode_set_packet.
+  bool send_packet(const std::vector<uint8_t>& payload,
+      protocol::Framing framing=protocol::FRAMING_STUFFED);
+
+  // Returns the number of ring bytes skipped because the reader fell behind.
+  uint64_t get_lost_bytes() const { return lost_bytes; }
+  // Returns how long ago the daemon last updated its heartbeat.
+  uint64_t get_heartbeat_age_us() const;
+
+protected:
+  int fd;
+  uint8_t* base;
+  size_t size;
+  SharedHeader* header;
+  const uint8_t* ring;
+
+  uint64_t position;  // of the next record
+  uint64_t record_position;  // of the record last returned by next
+  uint64_t lost_bytes;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,425 @@
+/*
+ * link-bench.cpp
+ *
+ * End-to-end benchmark of a transmitter-side Telemetry object and the host
+ * decoder over a simulated link. Reports uplink latency percentiles, goodput,
+ * resynchronization time after corruption and downlink (remote set) latency.
+ * Optionally, a flow-controlled stream is played back from the host at a fixed
+ * rate, reporting underruns and dropped samples.
+ *
+ * Usage: link-bench [--key=value ...], see print_usage for options. Link
+ * parameters (LinkParams field names) apply to both directions, or to one
+ * direction when prefixed with down. (device to host) or up. Exits with status
+ * 2 if goodput is below --min_goodput, for scripted checks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "decoder.h"
+#include "simlink.h"
+
+using namespace telemetry;
+
+namespace {
+
+struct BenchParams {
+  BenchParams() : seconds(10), loop_hz(1000), io_hz(100), channels(8),
+      set_period_ms(100), device_timeout_ms(DECODER_TIMEOUT_MS),
+      host_timeout_ms(100), nonblocking(false), cobs(false),
+      compression(false), batch_cycles(0), batch_latency_ms(0),
+      batch_bytes(0), stream_hz(0), stream_credit(0), min_goodput(0),
+      seed(1) {}
+
+  double seconds;
+  uint32_t loop_hz;          // rate data is updated at
+  uint32_t io_hz;            // rate do_io is called at
+  size_t channels;           // number of float channels besides the timestamp
+  uint32_t set_period_ms;    // period of host remote set commands, 0 to disable
+  uint32_t device_timeout_ms;
+  uint32_t host_timeout_ms;
+  bool nonblocking;
+  bool cobs;                 // use COBS framing in both directions
+  bool compression;          // compress transmitted packets
+  uint16_t batch_cycles;     // do_io calls batched per packet, 0 to disable
+  uint32_t batch_latency_ms; // age at which a batch is sent, 0 for none
+  size_t batch_bytes;        // size at which a batch is sent, 0 when full
+  uint32_t stream_hz;        // rate stream samples are played, 0 to disable
+  uint32_t stream_credit;    // reads per credit report, 0 for the default
+  double min_goodput;        // B/s below which the run fails
+  uint64_t seed;
+};
+
+void print_usage() {
+  printf("Usage: link-bench [--key=value ...]\n"
+         "  --seconds=10 --loop_hz=1000 --io_hz=100 --channels=8\n"
+         "  --set_period_ms=100 --device_timeout_ms=100 --host_timeout_ms=100\n"
+         "  --nonblocking=0 --cobs=0 --compression=0 --seed=1\n"
+         "  --batch_cycles=0 --batch_latency_ms=0 --batch_bytes=0\n"
+         "  --stream_hz=0 --stream_credit=0 --min_goodput=0\n"
+         "  link: --baud=115200 --bits_per_byte=10 --tx_buffer=64\n"
+         "        --latency_us=0 --jitter_us=0 --byte_loss=0 --bit_flip=0\n"
+         "        --burst_prob=0 --burst_length=0\n"
+         "        (prefix with down. or up. for a single direction)\n");
+}
+
+bool parse_bench_param(BenchParams& params, const std::string& key,
+    const std::string& value) {
+  const char* str = value.c_str();
+  if (key == "seconds") {
+    params.seconds = strtod(str, NULL);
+  } else if (key == "loop_hz") {
+    params.loop_hz = strtoul(str, NULL, 0);
+  } else if (key == "io_hz") {
+    params.io_hz = strtoul(str, NULL, 0);
+  } else if (key == "channels") {
+    params.channels = strtoul(str, NULL, 0);
+  } else if (key == "set_period_ms") {
+    params.set_period_ms = strtoul(str, NULL, 0);
+  } else if (key == "device_timeout_ms") {
+    params.device_timeout_ms = strtoul(str, NULL, 0);
+  } else if (key == "host_timeout_ms") {
+    params.host_timeout_ms = strtoul(str, NULL, 0);
+  } else if (key == "nonblocking") {
+    params.nonblocking = strtoul(str, NULL, 0) != 0;
+  } else if (key == "cobs") {
+    params.cobs = strtoul(str, NULL, 0) != 0;
+  } else if (key == "compression") {
+    params.compression = strtoul(str, NULL, 0) != 0;
+  } else if (key == "batch_cycles") {
+    params.batch_cycles = strtoul(str, NULL, 0);
+  } else if (key == "batch_latency_ms") {
+    params.batch_latency_ms = strtoul(str, NULL, 0);
+  } else if (key == "batch_bytes") {
+    params.batch_bytes = strtoul(str, NULL, 0);
+  } else if (key == "stream_hz") {
+    params.stream_hz = strtoul(str, NULL, 0);
+  } else if (key == "stream_credit") {
+    params.stream_credit = strtoul(str, NULL, 0);
+  } else if (key == "min_goodput") {
+    params.min_goodput = strtod(str, NULL);
+  } else if (key == "seed") {
+    params.seed = strtoull(str, NULL, 0);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const size_t STREAM_DEPTH = 256;
+// Interval after which the host requests a stream report if none arrived.
+const uint64_t STREAM_REQUEST_US = 100000;
+
+// Returns the given percentile (0-100) of sorted values, or 0 if empty.
+double percentile(const std::vector<double>& sorted, double pct) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t index = (size_t)(pct / 100 * (sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+void print_latencies(const char* name, std::vector<double>& latencies) {
+  std::sort(latencies.begin(), latencies.end());
+  printf("%s (ms, n=%zu): p50=%.3f p90=%.3f p99=%.3f max=%.3f\n", name,
+      latencies.size(), percentile(latencies, 50), percentile(latencies, 90),
+      percentile(latencies, 99), percentile(latencies, 100));
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  BenchParams params;
+  sim::LinkParams downlink, uplink;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg(argv[i]);
+    size_t equals = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || equals == std::string::npos) {
+      print_usage();
+      return 1;
+    }
+    std::string key = arg.substr(2, equals - 2);
+    std::string value = arg.substr(equals + 1);
+    bool ok;
+    if (key.compare(0, 5, "down.") == 0) {
+      ok = sim::parse_link_param(downlink, key.substr(5), value);
+    } else if (key.compare(0, 3, "up.") == 0) {
+      ok = sim::parse_link_param(uplink, key.substr(3), value);
+    } else {
+      ok = parse_bench_param(params, key, value)
+          || (sim::parse_link_param(downlink, key, value)
+              && sim::parse_link_param(uplink, key, value));
+    }
+    if (!ok) {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      print_usage();
+      return 1;
+    }
+  }
+
+  sim::Clock clock;
+  sim::Link link(clock, downlink, uplink, params.seed);
+  sim::SimulatedHal hal(clock, link);
+
+  Telemetry telemetry_obj(hal);
+  telemetry_obj.set_nonblocking(params.nonblocking);
+  protocol::Framing framing = params.cobs ?
+      protocol::FRAMING_COBS : protocol::FRAMING_STUFFED;
+  telemetry_obj.set_framing(framing);
+  telemetry_obj.set_compression(params.compression);
+  telemetry_obj.set_batching(params.batch_cycles, params.batch_latency_ms,
+      params.batch_bytes);
+  telemetry_obj.set_decoder_timeout_ms(params.device_timeout_ms);
+
+  Numeric<uint32_t> tele_time_us(telemetry_obj, "time_us", "Sample time", "us", 0);
+  Numeric<uint32_t> tele_set(telemetry_obj, "set", "Remote set time", "us", 0);
+  std::vector<Numeric<float>*> tele_channels;
+  for (size_t i=0; i<params.channels; i++) {
+    tele_channels.push_back(new Numeric<float>(telemetry_obj, "chan", "Channel", "", 0));
+  }
+  SampleStream<float, STREAM_DEPTH>* tele_stream = NULL;
+  if (params.stream_hz > 0) {
+    tele_stream = new SampleStream<float, STREAM_DEPTH>(telemetry_obj, "stream",
+        "Playback stream", "");
+    if (params.stream_credit > 0) {
+      tele_stream->set_credit_interval(params.stream_credit);
+    }
+  }
+  sim::Random values(params.seed);
+
+  host::FrameDecoder frame_decoder((uint64_t)params.host_timeout_ms * 1000);
+  host::PacketDecoder packet_decoder;
+
+  telemetry_obj.transmit_header();
+
+  std::vector<double> uplink_latencies, downlink_latencies, resync_times;
+  uint64_t payload_bytes = 0, frames = 0, decode_errors = 0, lost_frames = 0;
+  uint64_t bad_values = 0;
+  uint32_t last_time_us = 0;
+  int next_sequence = -1;
+  uint32_t last_set = 0;
+  size_t next_corruption = 0;
+  uint64_t frame_start_us = 0;
+
+  // Stream samples are their positions (exact as floats up to 2^24), to check
+  // order on the device.
+  size_t stream_id = 0;  // once the header is received
+  bool stream_reported = false;
+  uint32_t stream_limit = 0;  // reported position plus free slots
+  uint32_t stream_position = 0;  // next position to send
+  uint64_t stream_request_us = 0;  // last report or request
+  bool stream_requested = false;  // a request was sent since the last report
+  uint32_t stream_expected = 0;  // next position to play
+  uint64_t stream_played = 0, stream_underruns = 0, stream_misordered = 0;
+  uint64_t stream_records = 0;
+  bool stream_started = false;
+
+  const uint64_t end_us = (uint64_t)(params.seconds * 1000000);
+  const uint64_t loop_period_us = 1000000 / params.loop_hz;
+  const uint64_t io_period_us = 1000000 / params.io_hz;
+  const uint64_t stream_period_us = params.stream_hz > 0 ?
+      std::max<uint64_t>(1000000 / params.stream_hz, 1) : 0;
+  uint64_t next_io_us = 0, next_set_us = 0, next_stream_us = 0;
+
+  for (uint64_t now_us = 0; now_us < end_us; now_us += loop_period_us) {
+    clock.set_us(now_us);
+
+    // Device: update data, then do IO at its own rate.
+    tele_time_us = (uint32_t)now_us;
+    for (size_t i=0; i<tele_channels.size(); i++) {
+      *tele_channels[i] = (float)values.uniform();
+    }
+    while (tele_stream != NULL && now_us >= next_stream_us) {
+      next_stream_us += stream_period_us;
+      float sample;
+      if (tele_stream->read(&sample)) {
+        if ((uint32_t)sample != stream_expected) {
+          stream_misordered++;
+        }
+        stream_expected = (uint32_t)sample + 1;
+        stream_played++;
+        stream_started = true;
+      } else if (stream_started) {
+        stream_underruns++;  // the initial fill isn't counted
+      }
+    }
+    if (now_us >= next_io_us) {
+      next_io_us += io_period_us;
+      telemetry_obj.do_io();
+      uint32_t set = tele_set;
+      if (set != last_set) {
+        last_set = set;
+        downlink_latencies.push_back(((uint32_t)now_us - set) / 1000.0);
+      }
+    }
+
+    // Host: decode everything that has arrived.
+    while (link.to_host.next_arrival_us() <= now_us) {
+      uint64_t arrival_us = link.to_host.next_arrival_us();
+      bool was_in_frame = frame_decoder.in_frame();
+      bool complete = frame_decoder.add_byte(link.to_host.read(), arrival_us);
+      if (!was_in_frame && frame_decoder.in_frame()) {
+        frame_start_us = arrival_us;
+      }
+      if (!complete) {
+        continue;
+      }
+
+      host::Packet packet;
+      try {
+        packet = packet_decoder.decode(frame_decoder.get_frame());
+      } catch (host::DecodeError& e) {
+        decode_errors++;
+        continue;
+      }
+      frames++;
+      if (next_sequence >= 0 && packet.sequence != next_sequence) {
+        lost_frames += (uint8_t)(packet.sequence - next_sequence);
+      }
+      next_sequence = (uint8_t)(packet.sequence + 1);
+
+      bool clean = true;
+      for (size_t i=0; i<packet.samples.size(); i++) {
+        const host::Sample& sample = packet.samples[i];
+        const host::ChannelDef* def = packet_decoder.get_schema().get(sample.data_id);
+        payload_bytes += sample.payload_length;
+        if (def->data_type == protocol::DATATYPE_STREAM) {
+          // Resynchronizes on the first report, if the device skipped ahead
+          // or was reset, or (resending lost samples) on a report after a
+          // request, which was sent after all samples in flight.
+          uint32_t reported = (uint32_t)sample.values[0];
+          uint32_t in_flight = stream_position - reported;
+          if (!stream_reported || in_flight > STREAM_DEPTH
+              || stream_requested) {
+            stream_position = reported;
+          }
+          stream_reported = true;
+          stream_requested = false;
+          stream_limit = reported + (uint32_t)sample.values[1];
+          stream_request_us = arrival_us;
+        }
+        if (def->internal_name == "time_us") {
+          uint32_t time_us = (uint32_t)sample.values[0];
+          if (time_us > arrival_us || time_us < last_time_us) {
+            bad_values++;  // undetected corruption
+            clean = false;
+          } else {
+            last_time_us = time_us;
+            uplink_latencies.push_back((arrival_us - time_us) / 1000.0);
+          }
+        }
+      }
+
+      const std::vector<uint64_t>& corruptions = link.to_host.get_corruption_times();
+      while (clean && next_corruption < corruptions.size()
+          && corruptions[next_corruption] < frame_start_us) {
+        resync_times.push_back((arrival_us - corruptions[next_corruption]) / 1000.0);
+        next_corruption++;
+      }
+    }
+
+    // Host: periodically remote set a value to the current time.
+    if (params.set_period_ms > 0 && now_us >= next_set_us
+        && !packet_decoder.get_schema().empty()) {
+      next_set_us += (uint64_t)params.set_period_ms * 1000;
+      const host::ChannelDef* set_def = NULL;
+      const std::map<size_t, host::ChannelDef>& defs = packet_decoder.get_schema().get_channels();
+      for (std::map<size_t, host::ChannelDef>::const_iterator it = defs.begin();
+          it != defs.end(); ++it) {
+        if (it->second.internal_name == "set") {
+          set_def = &it->second;
+        }
+      }
+      std::vector<double> set_values(1, (double)(uint32_t)now_us);
+      std::vector<uint8_t> frame = host::encode_frame(
+          host::encode_set_packet(*set_def, set_values), framing);
+      for (size_t i=0; i<frame.size(); i++) {
+        link.to_device.write(frame[i]);
+      }
+    }
+
+    // Host: keep the stream FIFO full, as far as the credit allows, and
+    // request a report if none has arrived for a while.
+    const std::map<size_t, host::ChannelDef>& stream_defs =
+        packet_decoder.get_schema().get_channels();
+    for (std::map<size_t, host::ChannelDef>::const_iterator it =
+        stream_defs.begin(); stream_id == 0 && it != stream_defs.end(); ++it) {
+      if (it->second.data_type == protocol::DATATYPE_STREAM) {
+        stream_id = it->first;
+      }
+    }
+    const host::ChannelDef* stream_def =
+        packet_decoder.get_schema().get(stream_id);
+    if (tele_stream != NULL && stream_def != NULL) {
+      std::vector<std::vector<uint8_t> > packets;
+      while (stream_reported && (int32_t)(stream_limit - stream_position) > 0) {
+        uint32_t count = stream_limit - stream_position;
+        std::vector<double> samples;
+        for (uint32_t i=0; i<count && i<255; i++) {
+          samples.push_back(stream_position + i);
+        }
+        packets.push_back(host::encode_stream_packet(*stream_def,
+            stream_position, samples));
+        stream_position += samples.size();
+      }
+      if (now_us - stream_request_us >= STREAM_REQUEST_US) {
+        stream_request_us = now_us;
+        stream_requested = true;
+        packets.push_back(host::encode_stream_packet(*stream_def,
+            stream_position, std::vector<double>()));
+      }
+      for (size_t p=0; p<packets.size(); p++) {
+        std::vector<uint8_t> frame = host::encode_frame(packets[p], framing);
+        for (size_t i=0; i<frame.size(); i++) {
+          link.to_device.write(frame[i]);
+        }
+        stream_records++;
+      }
+    }
+  }
+
+  const Stats& stats = telemetry_obj.get_stats();
+  double link_bytes_per_s = (double)downlink.baud / downlink.bits_per_byte;
+  double goodput = payload_bytes / params.seconds;
+
+  printf("frames decoded: %llu, lost: %llu, decode errors: %llu, timeouts: %zu\n",
+      (unsigned long long)frames, (unsigned long long)lost_frames,
+      (unsigned long long)decode_errors, frame_decoder.get_timeouts());
+  printf("undetected corrupt values: %llu\n", (unsigned long long)bad_values);
+  printf("goodput: %.0f B/s (%.1f%% of %.0f B/s link), wire: %llu B\n",
+      goodput, 100 * goodput / link_bytes_per_s, link_bytes_per_s,
+      (unsigned long long)link.to_host.get_bytes_written());
+  print_latencies("uplink latency", uplink_latencies);
+  print_latencies("downlink latency", downlink_latencies);
+  print_latencies("resync time", resync_times);
+  printf("corruption events: %zu (%zu before last clean frame)\n",
+      link.to_host.get_corruption_times().size(), next_corruption);
+  printf("device: tx frames %u, deferred %u, rx frames %u, rx timeouts %u, "
+      "errors %zu, blocked %.1f ms\n",
+      stats.tx_frames, stats.tx_frames_deferred, stats.rx_frames,
+      stats.rx_timeouts, hal.get_error_count(),
+      link.to_host.get_blocked_us() / 1000.0);
+  if (tele_stream != NULL) {
+    printf("stream: played %llu of %llu samples, underruns %llu, dropped %u, "
+        "misordered %llu, records sent %llu\n",
+        (unsigned long long)stream_played, (unsigned long long)(
+            params.stream_hz * params.seconds), (unsigned long long)stream_underruns,
+        tele_stream->get_dropped(), (unsigned long long)stream_misordered,
+        (unsigned long long)stream_records);
+  }
+
+  for (size_t i=0; i<tele_channels.size(); i++) {
+    delete tele_channels[i];
+  }
+  delete tele_stream;
+  if (goodput < params.min_goodput) {
+    fprintf(stderr, "Goodput below %.0f B/s\n", params.min_goodput);
+    return 2;
+  }
+  return 0;
+}
@@ -0,0 +1,392 @@
+/*
+ * pydecoder.cpp
+ *
+ * Python extension module (telemetry._decoder) exposing the host decoder to
+ * client-py, which uses it when it's built (see client-py/setup.py) and falls
+ * back to decoding in Python otherwise.
+ *
+ * Decoder frames received bytes and decodes each frame. Data packets of
+ * numeric and numeric array channels are returned as Batch objects: the
+ * values of all their records as a contiguous buffer of doubles (exposed
+ * through the buffer protocol, so numpy.frombuffer reads it without copying),
+ * grouped by channel, with an index of the records. Other frames (headers,
+ * probes, other data types and malformed packets) are left to Python to
+ * decode, so it keeps its own objects and error handling.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <map>
+#include <vector>
+
+#include "decoder.h"
+
+using namespace telemetry;
+
+namespace {
+
+struct BatchObject {
+  PyObject_HEAD
+  std::vector<double>* values;  // grouped by channel
+  Py_ssize_t length;  // of values, as the buffer's shape
+  PyObject* records;  // list of (cycle, data ID, offset, count), in order
+  PyObject* channels;  // dict of data ID to (offset, count)
+  int opcode;
+  int namespace_id;
+  int sequence;
+};
+
+void Batch_dealloc(BatchObject* self) {
+  delete self->values;
+  Py_XDECREF(self->records);
+  Py_XDECREF(self->channels);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+int Batch_getbuffer(BatchObject* self, Py_buffer* view, int flags) {
+  // Values are immutable once built, so exports aren't tracked.
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "Batch values are read-only");
+    view->obj = NULL;
+    return -1;
+  }
+  view->obj = (PyObject*)self;
+  Py_INCREF(self);
+  view->buf = self->values->data();
+  view->len = self->values->size() * sizeof(double);
+  view->readonly = 1;
+  view->itemsize = sizeof(double);
+  view->format = (flags & PyBUF_FORMAT) ? (char*)"d" : NULL;
+  view->ndim = 1;
+  view->shape = (flags & PyBUF_ND) ? &self->length : NULL;
+  view->strides = NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+PyBufferProcs Batch_as_buffer = {
+  (getbufferproc)Batch_getbuffer,
+  NULL,
+};
+
+PyObject* Batch_get(BatchObject* self, PyObject* data_id) {
+  PyObject* channel = PyDict_GetItem(self->channels, data_id);
+  if (channel == NULL) {
+    Py_RETURN_NONE;
+  }
+  Py_ssize_t offset = PyLong_AsSsize_t(PyTuple_GET_ITEM(channel, 0));
+  Py_ssize_t count = PyLong_AsSsize_t(PyTuple_GET_ITEM(channel, 1));
+  PyObject* view = PyMemoryView_FromObject((PyObject*)self);
+  if (view == NULL) {
+    return NULL;
+  }
+  PyObject* slice = PySequence_GetSlice(view, offset, offset + count);
+  Py_DECREF(view);
+  return slice;
+}
+
+PyMethodDef Batch_methods[] = {
+  {"get", (PyCFunction)Batch_get, METH_O,
+   "Returns a memoryview of the values of a data ID (of all its records, in "
+   "order), or None if it has none."},
+  {NULL, NULL, 0, NULL}
+};
+
+PyObject* Batch_get_records(BatchObject* self, void*) {
+  Py_INCREF(self->records);
+  return self->records;
+}
+
+PyObject* Batch_get_channels(BatchObject* self, void*) {
+  Py_INCREF(self->channels);
+  return self->channels;
+}
+
+PyObject* Batch_get_opcode(BatchObject* self, void*) {
+  return PyLong_FromLong(self->opcode);
+}
+
+PyObject* Batch_get_namespace(BatchObject* self, void*) {
+  return PyLong_FromLong(self->namespace_id);
+}
+
+PyObject* Batch_get_sequence(BatchObject* self, void*) {
+  return PyLong_FromLong(self->sequence);
+}
+
+PyGetSetDef Batch_getset[] = {
+  {(char*)"records", (getter)Batch_get_records, NULL,
+   (char*)"List of (cycle, data ID, offset, count) of each record, in order.",
+   NULL},
+  {(char*)"channels", (getter)Batch_get_channels, NULL,
+   (char*)"Dict of data ID to (offset, count) of its values.", NULL},
+  {(char*)"opcode", (getter)Batch_get_opcode, NULL, NULL, NULL},
+  {(char*)"namespace", (getter)Batch_get_namespace, NULL, NULL, NULL},
+  {(char*)"sequence", (getter)Batch_get_sequence, NULL, NULL, NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+PyTypeObject BatchType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "telemetry._decoder.Batch",
+};
+
+// Returns whether the decoder handles all samples of a packet natively.
+bool is_numeric_packet(const host::Packet& packet,
+    const host::Schema& schema) {
+  if (packet.opcode != protocol::OPCODE_DATA
+      && packet.opcode != protocol::OPCODE_DATA_CYCLES) {
+    return false;
+  }
+  for (size_t i=0; i<packet.samples.size(); i++) {
+    uint8_t data_type = schema.get(packet.samples[i].data_id)->data_type;
+    if (data_type != protocol::DATATYPE_NUMERIC
+        && data_type != protocol::DATATYPE_NUMERIC_ARRAY) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Builds a Batch from a numeric data packet, returning NULL on error.
+PyObject* make_batch(host::Packet& packet) {
+  BatchObject* batch = PyObject_New(BatchObject, &BatchType);
+  if (batch == NULL) {
+    return NULL;
+  }
+  batch->values = new std::vector<double>();
+  batch->length = 0;
+  batch->records = PyList_New(packet.samples.size());
+  batch->channels = PyDict_New();
+  batch->opcode = packet.opcode;
+  batch->namespace_id = packet.namespace_id;
+  batch->sequence = packet.sequence;
+  if (batch->records == NULL || batch->channels == NULL) {
+    Py_DECREF(batch);
+    return NULL;
+  }
+
+  // Plain data packets start a new cycle when a data ID repeats, as in
+  // DataPacket in parser.py.
+  if (packet.opcode == protocol::OPCODE_DATA) {
+    uint32_t cycle = 0;
+    std::map<size_t, uint32_t> last_cycle;
+    for (size_t i=0; i<packet.samples.size(); i++) {
+      host::Sample& sample = packet.samples[i];
+      std::map<size_t, uint32_t>::iterator it =
+          last_cycle.find(sample.data_id);
+      if (it != last_cycle.end() && it->second == cycle) {
+        cycle++;
+      }
+      last_cycle[sample.data_id] = cycle;
+      sample.cycle = cycle;
+    }
+  }
+
+  // Channels are laid out in order of first appearance.
+  std::vector<size_t> order;
+  std::map<size_t, size_t> counts;
+  for (size_t i=0; i<packet.samples.size(); i++) {
+    const host::Sample& sample = packet.samples[i];
+    if (counts.find(sample.data_id) == counts.end()) {
+      order.push_back(sample.data_id);
+    }
+    counts[sample.data_id] += sample.values.size();
+  }
+  std::map<size_t, size_t> offsets;
+  size_t total = 0;
+  for (size_t i=0; i<order.size(); i++) {
+    offsets[order[i]] = total;
+    PyObject* channel = Py_BuildValue("(nn)", (Py_ssize_t)total,
+        (Py_ssize_t)counts[order[i]]);
+    PyObject* key = PyLong_FromSize_t(order[i]);
+    int result = (channel == NULL || key == NULL) ? -1
+        : PyDict_SetItem(batch->channels, key, channel);
+    Py_XDECREF(channel);
+    Py_XDECREF(key);
+    if (result < 0) {
+      Py_DECREF(batch);
+      return NULL;
+    }
+    total += counts[order[i]];
+  }
+
+  batch->values->resize(total);
+  batch->length = total;
+  for (size_t i=0; i<packet.samples.size(); i++) {
+    const host::Sample& sample = packet.samples[i];
+    size_t& offset = offsets[sample.data_id];
+    PyObject* record = Py_BuildValue("(InnI)", sample.cycle,
+        (Py_ssize_t)sample.data_id, (Py_ssize_t)offset,
+        (unsigned int)sample.values.size());
+    if (record == NULL) {
+      Py_DECREF(batch);
+      return NULL;
+    }
+    PyList_SET_ITEM(batch->records, i, record);
+    std::copy(sample.values.begin(), sample.values.end(),
+        batch->values->begin() + offset);
+    offset += sample.values.size();
+  }
+  return (PyObject*)batch;
+}
+
+struct DecoderObject {
+  PyObject_HEAD
+  host::FrameDecoder* frames;
+  host::PacketDecoder* packets;
+};
+
+int Decoder_init(DecoderObject* self, PyObject* args, PyObject* kwds) {
+  static const char* keywords[] = {"timeout_us", NULL};
+  unsigned long long timeout_us = 100000;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|K", (char**)keywords,
+      &timeout_us)) {
+    return -1;
+  }
+  delete self->frames;
+  delete self->packets;
+  self->frames = new host::FrameDecoder(timeout_us);
+  self->packets = new host::PacketDecoder();
+  return 0;
+}
+
+void Decoder_dealloc(DecoderObject* self) {
+  delete self->frames;
+  delete self->packets;
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// Appends (framing, payload, batch or None) for the last completed frame.
+int add_frame(DecoderObject* self, PyObject* out) {
+  const std::vector<uint8_t>& frame = self->frames->get_frame();
+  PyObject* batch = NULL;
+  try {
+    host::Packet packet = self->packets->decode(frame);
+    if (is_numeric_packet(packet,
+        self->packets->get_schema(packet.namespace_id))) {
+      batch = make_batch(packet);
+      if (batch == NULL) {
+        return -1;
+      }
+    }
+  } catch (host::DecodeError&) {
+    // Decoded again in Python, which reports the error.
+  }
+  if (batch == NULL) {
+    batch = Py_None;
+    Py_INCREF(batch);
+  }
+  PyObject* item = Py_BuildValue("(iy#N)", (int)self->frames->get_framing(),
+      (const char*)frame.data(), (Py_ssize_t)frame.size(), batch);
+  if (item == NULL) {
+    return -1;
+  }
+  int result = PyList_Append(out, item);
+  Py_DECREF(item);
+  return result;
+}
+
+PyObject* Decoder_feed(DecoderObject* self, PyObject* args) {
+  Py_buffer data;
+  unsigned long long time_us;
+  if (!PyArg_ParseTuple(args, "y*K", &data, &time_us)) {
+    return NULL;
+  }
+  PyObject* out = PyList_New(0);
+  if (out == NULL) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+  try {
+    const uint8_t* bytes = (const uint8_t*)data.buf;
+    for (Py_ssize_t i=0; i<data.len; i++) {
+      if (self->frames->add_byte(bytes[i], time_us)
+          && add_frame(self, out) < 0) {
+        Py_CLEAR(out);
+        break;
+      }
+    }
+  } catch (std::exception& e) {
+    Py_CLEAR(out);
+    PyErr_SetString(PyExc_RuntimeError, e.what());
+  }
+  PyBuffer_Release(&data);
+  return out;
+}
+
+PyObject* Decoder_take_passthrough(DecoderObject* self, PyObject*) {
+  std::vector<uint8_t> passthrough = self->frames->take_passthrough();
+  return PyBytes_FromStringAndSize((const char*)passthrough.data(),
+      passthrough.size());
+}
+
+PyObject* Decoder_get_timeouts(DecoderObject* self, void*) {
+  return PyLong_FromSize_t(self->frames->get_timeouts());
+}
+
+PyMethodDef Decoder_methods[] = {
+  {"feed", (PyCFunction)Decoder_feed, METH_VARARGS,
+   "feed(data, time_us): adds received bytes, with their receive time in "
+   "microseconds, returning a list of (framing, payload, batch) for the "
+   "frames they completed, where framing is 0 for stuffed and 1 for COBS, "
+   "and batch is a Batch for numeric data packets, otherwise None."},
+  {"take_passthrough", (PyCFunction)Decoder_take_passthrough, METH_NOARGS,
+   "Returns (and clears) received non-telemetry bytes."},
+  {NULL, NULL, 0, NULL}
+};
+
+PyGetSetDef Decoder_getset[] = {
+  {(char*)"timeouts", (getter)Decoder_get_timeouts, NULL,
+   (char*)"Number of partially received frames discarded on timeout.", NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+PyTypeObject DecoderType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "telemetry._decoder.Decoder",
+};
+
+PyModuleDef decoder_module = {
+  PyModuleDef_HEAD_INIT,
+  "telemetry._decoder",
+  "Native telemetry stream decoder, see client-cpp/pydecoder.cpp.",
+  -1,
+  NULL,
+};
+
+}
+
+PyMODINIT_FUNC PyInit__decoder() {
+  BatchType.tp_basicsize = sizeof(BatchObject);
+  BatchType.tp_dealloc = (destructor)Batch_dealloc;
+  BatchType.tp_as_buffer = &Batch_as_buffer;
+  BatchType.tp_flags = Py_TPFLAGS_DEFAULT;
+  BatchType.tp_doc = "Values of a decoded numeric data packet.";
+  BatchType.tp_methods = Batch_methods;
+  BatchType.tp_getset = Batch_getset;
+
+  DecoderType.tp_basicsize = sizeof(DecoderObject);
+  DecoderType.tp_dealloc = (destructor)Decoder_dealloc;
+  DecoderType.tp_flags = Py_TPFLAGS_DEFAULT;
+  DecoderType.tp_doc = "Decoder(timeout_us=100000): telemetry stream decoder.";
+  DecoderType.tp_methods = Decoder_methods;
+  DecoderType.tp_getset = Decoder_getset;
+  DecoderType.tp_init = (initproc)Decoder_init;
+  DecoderType.tp_new = PyType_GenericNew;
+
+  if (PyType_Ready(&BatchType) < 0 || PyType_Ready(&DecoderType) < 0) {
+    return NULL;
+  }
+  PyObject* module = PyModule_Create(&decoder_module);
+  if (module == NULL) {
+    return NULL;
+  }
+  Py_INCREF(&DecoderType);
+  PyModule_AddObject(module, "Decoder", (PyObject*)&DecoderType);
+  Py_INCREF(&BatchType);
+  PyModule_AddObject(module, "Batch", (PyObject*)&BatchType);
+  return module;
+}
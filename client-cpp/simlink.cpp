@@ -0,0 +1,149 @@
+/*
+ * simlink.cpp
+ *
+ * Implementation for the simulated serial link.
+ */
+
+#include "simlink.h"
+
+#include <stdlib.h>
+
+namespace telemetry {
+namespace sim {
+
+uint64_t Random::next() {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dULL;
+}
+
+double Random::uniform() {
+  return (next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+Channel::Channel(Clock& clock, const LinkParams& params, uint64_t seed) :
+    clock(clock),
+    params(params),
+    random(seed),
+    byte_time_ns((uint64_t)params.bits_per_byte * 1000000000ULL / params.baud),
+    line_free_ns(0),
+    last_arrival_us(0),
+    burst_remaining(0),
+    blocked_until_ns(0),
+    blocked_ns(0),
+    bytes_written(0) {
+}
+
+void Channel::write(uint8_t byte) {
+  uint64_t now_ns = clock.get_us() * 1000;
+  bytes_written++;
+
+  // A full buffer means a real writer would block until a byte drains.
+  uint64_t buffer_ns = params.tx_buffer * byte_time_ns;
+  uint64_t blocked_from_ns = blocked_until_ns > now_ns ? blocked_until_ns : now_ns;
+  if (line_free_ns > blocked_from_ns + buffer_ns) {
+    blocked_until_ns = line_free_ns - buffer_ns;
+    blocked_ns += blocked_until_ns - blocked_from_ns;
+  }
+
+  uint64_t start_ns = line_free_ns > now_ns ? line_free_ns : now_ns;
+  line_free_ns = start_ns + byte_time_ns;
+
+  uint64_t arrival_us = line_free_ns / 1000 + params.latency_us;
+  if (params.jitter_us > 0) {
+    arrival_us += random.next() % (params.jitter_us + 1);
+  }
+  if (arrival_us < last_arrival_us) {
+    arrival_us = last_arrival_us;  // a serial line doesn't reorder bytes
+  }
+
+  if (burst_remaining > 0) {
+    burst_remaining--;
+    return;
+  }
+  if (random.chance(params.burst_prob) && params.burst_length > 0) {
+    corruption_times.push_back(arrival_us);
+    burst_remaining = params.burst_length - 1;
+    return;
+  }
+  if (random.chance(params.byte_loss)) {
+    corruption_times.push_back(arrival_us);
+    return;
+  }
+  if (random.chance(params.bit_flip)) {
+    corruption_times.push_back(arrival_us);
+    byte ^= 1 << (random.next() % 8);
+  }
+  last_arrival_us = arrival_us;
+
+  InFlight in_flight_byte;
+  in_flight_byte.arrival_us = arrival_us;
+  in_flight_byte.byte = byte;
+  in_flight.push_back(in_flight_byte);
+}
+
+size_t Channel::tx_space() const {
+  uint64_t now_ns = clock.get_us() * 1000;
+  if (line_free_ns <= now_ns) {
+    return params.tx_buffer;
+  }
+  uint64_t queued = (line_free_ns - now_ns + byte_time_ns - 1) / byte_time_ns;
+  if (queued >= params.tx_buffer) {
+    return 0;
+  }
+  return params.tx_buffer - queued;
+}
+
+size_t Channel::available() const {
+  size_t count = 0;
+  uint64_t now_us = clock.get_us();
+  for (std::deque<InFlight>::const_iterator it = in_flight.begin();
+      it != in_flight.end() && it->arrival_us <= now_us; ++it) {
+    count++;
+  }
+  return count;
+}
+
+uint8_t Channel::read() {
+  uint8_t byte = in_flight.front().byte;
+  in_flight.pop_front();
+  return byte;
+}
+
+uint64_t Channel::next_arrival_us() const {
+  if (in_flight.empty()) {
+    return UINT64_MAX;
+  }
+  return in_flight.front().arrival_us;
+}
+
+bool parse_link_param(LinkParams& params, const std::string& key,
+    const std::string& value) {
+  const char* str = value.c_str();
+  if (key == "baud") {
+    params.baud = strtoul(str, NULL, 0);
+  } else if (key == "bits_per_byte") {
+    params.bits_per_byte = strtoul(str, NULL, 0);
+  } else if (key == "tx_buffer") {
+    params.tx_buffer = strtoul(str, NULL, 0);
+  } else if (key == "latency_us") {
+    params.latency_us = strtoul(str, NULL, 0);
+  } else if (key == "jitter_us") {
+    params.jitter_us = strtoul(str, NULL, 0);
+  } else if (key == "byte_loss") {
+    params.byte_loss = strtod(str, NULL);
+  } else if (key == "bit_flip") {
+    params.bit_flip = strtod(str, NULL);
+  } else if (key == "burst_prob") {
+    params.burst_prob = strtod(str, NULL);
+  } else if (key == "burst_length") {
+    params.burst_length = strtoul(str, NULL, 0);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+}
+}
@@ -0,0 +1,175 @@
+/**
+ * Deterministic simulated serial link, for running a transmitter-side
+ * Telemetry object against a host-side decoder without hardware.
+ *
+ * Build with TELEMETRY_HOST defined so telemetry.h accepts the simulated HAL.
+ */
+
+#ifndef _TELEMETRY_SIMLINK_H_
+#define _TELEMETRY_SIMLINK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "telemetry.h"
+
+namespace telemetry {
+namespace sim {
+
+// Simulation time source shared by everything on a link, in microseconds.
+class Clock {
+public:
+  Clock() : now_us(0) {}
+
+  uint64_t get_us() const { return now_us; }
+  void advance_us(uint64_t delta_us) { now_us += delta_us; }
+  void set_us(uint64_t time_us) { now_us = time_us; }
+
+protected:
+  uint64_t now_us;
+};
+
+// Small deterministic PRNG (xorshift64*), so runs are repeatable by seed.
+class Random {
+public:
+  Random(uint64_t seed) : state(seed ? seed : 0x9e3779b97f4a7c15ULL) {}
+
+  uint64_t next();
+  // Returns a uniformly distributed double in [0, 1).
+  double uniform();
+  // Returns true with the given probability.
+  bool chance(double probability) {
+    return probability > 0 && uniform() < probability;
+  }
+
+protected:
+  uint64_t state;
+};
+
+// Impairments and timing for one direction of a link.
+struct LinkParams {
+  LinkParams() : baud(115200), bits_per_byte(10), tx_buffer(64),
+      latency_us(0), jitter_us(0), byte_loss(0), bit_flip(0),
+      burst_prob(0), burst_length(0) {}
+
+  uint32_t baud;
+  uint32_t bits_per_byte;  // including start and stop bits
+  size_t tx_buffer;        // sender transmit buffer size, in bytes
+  uint32_t latency_us;     // fixed propagation latency
+  uint32_t jitter_us;      // additional uniformly random latency
+  double byte_loss;        // probability each byte is dropped
+  double bit_flip;         // probability each byte has a random bit flipped
+  double burst_prob;       // probability each byte starts a burst drop
+  uint32_t burst_length;   // bytes dropped per burst
+};
+
+// One direction of a simulated serial link. Bytes are serialized at the baud
+// rate after any queued bytes, then arrive after the latency, in order.
+class Channel {
+public:
+  Channel(Clock& clock, const LinkParams& params, uint64_t seed);
+
+  // Queues a byte for transmission at the current time. Never blocks: bytes
+  // written when the transmit buffer is full are counted as blocking time,
+  // which a real HAL would have spent waiting.
+  void write(uint8_t byte);
+  // Returns the number of bytes which can be written without overflowing the
+  // sender transmit buffer.
+  size_t tx_space() const;
+
+  // Returns the number of bytes which have arrived by the current time.
+  size_t available() const;
+  // Returns the next arrived byte. available must return > 0.
+  uint8_t read();
+  // Returns the arrival time of the next byte, or UINT64_MAX if none queued.
+  uint64_t next_arrival_us() const;
+
+  const LinkParams& get_params() const { return params; }
+
+  // Returns the times at which corrupted or dropped bytes arrived (or would
+  // have arrived).
+  const std::vector<uint64_t>& get_corruption_times() const {
+    return corruption_times;
+  }
+  // Returns the total time writers would have blocked on a full buffer.
+  uint64_t get_blocked_us() const { return blocked_ns / 1000; }
+  // Returns the number of bytes written.
+  uint64_t get_bytes_written() const { return bytes_written; }
+
+protected:
+  struct InFlight {
+    uint64_t arrival_us;
+    uint8_t byte;
+  };
+
+  Clock& clock;
+  LinkParams params;
+  Random random;
+
+  uint64_t byte_time_ns;   // serialization time per byte
+  uint64_t line_free_ns;   // time the line finishes its queued bytes
+  uint64_t last_arrival_us;
+  uint32_t burst_remaining;
+
+  std::deque<InFlight> in_flight;
+  std::vector<uint64_t> corruption_times;
+  uint64_t blocked_until_ns;  // time a blocked writer would be released
+  uint64_t blocked_ns;
+  uint64_t bytes_written;
+};
+
+// A full-duplex simulated link between a device and a host.
+class Link {
+public:
+  Link(Clock& clock, const LinkParams& downlink, const LinkParams& uplink,
+      uint64_t seed=1) :
+      to_host(clock, downlink, seed * 2 + 1),
+      to_device(clock, uplink, seed * 2 + 2) {}
+
+  Channel to_host;
+  Channel to_device;
+};
+
+// Transmitter-side HAL for the device end of a simulated link.
+class SimulatedHal : public HalInterface {
+public:
+  SimulatedHal(Clock& clock, Link& link) :
+      clock(clock), link(link), error_count(0) {}
+
+  void transmit_byte(uint8_t data) { link.to_host.write(data); }
+  size_t tx_space() { return link.to_host.tx_space(); }
+  size_t rx_available() { return link.to_device.available(); }
+  uint8_t receive_byte() { return link.to_device.read(); }
+
+  void do_error(const char* message) {
+    error_count++;
+    last_error = message;
+  }
+
+  uint32_t get_time_ms() { return clock.get_us() / 1000; }
+  uint32_t get_time_us() { return clock.get_us(); }
+
+  size_t get_error_count() const { return error_count; }
+  const std::string& get_last_error() const { return last_error; }
+
+protected:
+  Clock& clock;
+  Link& link;
+
+  size_t error_count;
+  std::string last_error;
+};
+
+// Parses a link parameter of the form key=value into params, returning false
+// if the key is unknown. Keys are the LinkParams field names.
+bool parse_link_param(LinkParams& params, const std::string& key,
+    const std::string& value);
+
+}
+}
+
+#endif
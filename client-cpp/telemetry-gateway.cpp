@@ -0,0 +1,242 @@
+/*
+ * telemetry-gateway.cpp
+ *
+ * Daemon which owns a telemetry serial port and fans it out to local
+ * processes through shared memory (see gateway.h): received frames are
+ * decoded once and published with their samples, and wire bytes queued by
+ * readers (like remote set packets) are transmitted to the device.
+ *
+ * Usage: telemetry-gateway <serial port> [--key=value ...], see print_usage
+ * for options.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "decoder.h"
+#include "gateway.h"
+
+using namespace telemetry;
+
+namespace {
+
+struct GatewayParams {
+  GatewayParams() : baud(115200), name(gateway::DEFAULT_NAME), ring_mb(16),
+      timeout_ms(100) {}
+
+  uint32_t baud;
+  std::string name;  // of the shared memory object
+  size_t ring_mb;
+  uint32_t timeout_ms;  // for partially received frames
+};
+
+void print_usage() {
+  printf("Usage: telemetry-gateway <serial port> [--key=value ...]\n"
+         "  --baud=115200 --name=%s --ring_mb=16 --timeout_ms=100\n",
+         gateway::DEFAULT_NAME);
+}
+
+bool parse_gateway_param(GatewayParams& params, const std::string& key,
+    const std::string& value) {
+  const char* str = value.c_str();
+  if (key == "baud") {
+    params.baud = strtoul(str, NULL, 0);
+  } else if (key == "name") {
+    params.name = value;
+  } else if (key == "ring_mb") {
+    params.ring_mb = strtoul(str, NULL, 0);
+  } else if (key == "timeout_ms") {
+    params.timeout_ms = strtoul(str, NULL, 0);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Returns the termios speed for a baud rate, or B0 if unsupported.
+speed_t get_speed(uint32_t baud) {
+  switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+#ifdef B460800
+    case 460800: return B460800;
+#endif
+#ifdef B921600
+    case 921600: return B921600;
+#endif
+#ifdef B1000000
+    case 1000000: return B1000000;
+#endif
+#ifdef B2000000
+    case 2000000: return B2000000;
+#endif
+#ifdef B3000000
+    case 3000000: return B3000000;
+#endif
+    default: return B0;
+  }
+}
+
+// Opens a serial port in raw mode, returning its file descriptor, or -1 on
+// failure.
+int open_serial(const std::string& port, uint32_t baud) {
+  speed_t speed = get_speed(baud);
+  if (speed == B0) {
+    fprintf(stderr, "Unsupported baud rate: %u\n", baud);
+    return -1;
+  }
+  int fd = open(port.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", port.c_str(), strerror(errno));
+    return -1;
+  }
+  struct termios tio;
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tio);
+  }  // otherwise not a terminal, like a pipe, which is used as is
+  return fd;
+}
+
+// Writes all of data to a non-blocking file descriptor, returning false on
+// error.
+bool write_all(int fd, const std::vector<uint8_t>& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t result = write(fd, data.data() + written, data.size() - written);
+    if (result > 0) {
+      written += result;
+    } else if (result < 0 && errno != EAGAIN && errno != EINTR) {
+      return false;
+    } else {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      poll(&pfd, 1, 10);
+    }
+  }
+  return true;
+}
+
+volatile sig_atomic_t running = 1;
+
+void handle_signal(int) {
+  running = 0;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  GatewayParams params;
+  std::string port;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 2, "--") != 0) {
+      port = arg;
+      continue;
+    }
+    size_t equals = arg.find('=');
+    if (equals == std::string::npos
+        || !parse_gateway_param(params, arg.substr(2, equals - 2),
+            arg.substr(equals + 1))) {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      print_usage();
+      return 1;
+    }
+  }
+  if (port.empty()) {
+    print_usage();
+    return 1;
+  }
+
+  int fd = open_serial(port, params.baud);
+  if (fd < 0) {
+    return 1;
+  }
+  gateway::GatewayWriter* writer;
+  try {
+    writer = new gateway::GatewayWriter(params.name, params.ring_mb << 20);
+  } catch (gateway::GatewayError& e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  printf("Serving %s on %s\n", port.c_str(), params.name.c_str());
+
+  host::FrameDecoder frame_decoder((uint64_t)params.timeout_ms * 1000);
+  host::PacketDecoder packet_decoder;
+  uint64_t decode_errors = 0, commands = 0;
+  std::vector<uint8_t> command;
+  uint8_t buffer[4096];
+  while (running) {
+    // The timeout bounds the latency of queued commands.
+    struct pollfd pfd = {fd, POLLIN, 0};
+    poll(&pfd, 1, 1);
+
+    ssize_t count = read(fd, buffer, sizeof(buffer));
+    if (count < 0 && errno != EAGAIN && errno != EINTR) {
+      fprintf(stderr, "Failed to read %s: %s\n", port.c_str(),
+          strerror(errno));
+      break;
+    } else if (count <= 0 && (pfd.revents & (POLLHUP | POLLERR))) {
+      fprintf(stderr, "%s closed\n", port.c_str());
+      break;
+    }
+    uint64_t now_us = gateway::get_monotonic_us();
+    for (ssize_t i=0; i<count; i++) {
+      if (frame_decoder.add_byte(buffer[i], now_us)) {
+        const std::vector<uint8_t>& frame = frame_decoder.get_frame();
+        try {
+          host::Packet packet = packet_decoder.decode(frame);
+          writer->publish_frame(frame, &packet, now_us);
+        } catch (host::DecodeError&) {
+          // Still published, for readers with their own decoders.
+          writer->publish_frame(frame, NULL, now_us);
+          decode_errors++;
+        }
+      }
+    }
+    std::vector<uint8_t> passthrough = frame_decoder.take_passthrough();
+    if (!passthrough.empty()) {
+      writer->publish_passthrough(passthrough, now_us);
+    }
+
+    while (writer->take_command(command)) {
+      if (!write_all(fd, command)) {
+        fprintf(stderr, "Failed to write %s: %s\n", port.c_str(),
+            strerror(errno));
+        running = 0;
+        break;
+      }
+      commands++;
+    }
+    writer->update_heartbeat();
+  }
+
+  printf("frames: %llu, decode errors: %llu, timeouts: %zu, commands: %llu\n",
+      (unsigned long long)writer->get_frame_count(),
+      (unsigned long long)decode_errors, frame_decoder.get_timeouts(),
+      (unsigned long long)commands);
+  delete writer;
+  close(fd);
+  return 0;
+}
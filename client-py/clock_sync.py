@@ -0,0 +1,41 @@
+"""Periodically probes a transmitter, printing its estimated clock offset and
+drift from the host's and the round-trip latency percentiles.
+"""
+from __future__ import print_function
+import time
+
+from telemetry.parser import TelemetrySerial, TelemetrySerialSerial, ProbePacket, host_time_us
+from telemetry.clocksync import ClockSync
+
+if __name__ == "__main__":
+  import argparse
+  parser = argparse.ArgumentParser(description='Telemetry clock synchronization and latency monitor.')
+  parser.add_argument('port', help='serial port to communicate on')
+  parser.add_argument('--baud', '-b', type=int, default=38400,
+                      help='serial baud rate')
+  parser.add_argument('--namespace', type=int, default=0,
+                      help='namespace of the transmitter to probe')
+  parser.add_argument('--period', '-p', type=float, default=0.5,
+                      help='seconds between probes')
+  args = parser.parse_args()
+
+  telemetry = TelemetrySerial(TelemetrySerialSerial(args.port, args.baud))
+  clock_sync = ClockSync()
+  next_probe = time.time()
+  while True:
+    if time.time() >= next_probe:
+      telemetry.transmit_probe(args.namespace)
+      next_probe += args.period
+
+    telemetry.process_rx()
+    while True:
+      packet = telemetry.next_rx_packet()
+      if not packet:
+        break
+      if isinstance(packet, ProbePacket) and packet.namespace == args.namespace:
+        clock_sync.add_probe(packet)
+        p50, p90, p99 = clock_sync.get_delay_percentiles()
+        print("offset %.0f us, drift %+.1f ppm, RTT p50 %i us, p90 %i us, p99 %i us"
+              % (clock_sync.get_offset_us(host_time_us()), clock_sync.get_drift_ppm(),
+                 p50, p90, p99))
+    time.sleep(0.001)
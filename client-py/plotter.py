@@ -19,12 +19,16 @@ import matplotlib.animation as animation
 import numpy as np
 import serial
 
-from telemetry.parser import TelemetrySerialSerial, TelemetrySocketSerial, TelemetrySerial, DataPacket, HeaderPacket, NumericData, NumericArray
+from telemetry.parser import TelemetrySerialSerial, TelemetrySocketSerial, TelemetrySerial, DataPacket, HeaderPacket, NumericData, NumericArray, CaptureData, AggregateData, LogData, TraceData, StreamData, load_schema
+from telemetry.gateway import TelemetryGatewaySerial
 
 class BasePlot(object):
   """Base class / interface definition for telemetry plotter plots with a
   dependent variable vs. an scrolling independent variable (like time).
   """
+  # whether the x axis follows the independent variable span
+  scrolling = True
+
   def __init__(self, subplot, indep_def, dep_def, indep_span):
     """Constructor.
 
@@ -112,6 +116,47 @@ class NumericPlot(BasePlot):
       maxlim += rangelim / 20
       self.subplot.set_ylim(minlim, maxlim)
 
+class AggregatePlot(NumericPlot):
+  """A plot of an aggregated numeric, showing the mean as a line within a band
+  from the min to the max of each window.
+  """
+  def __init__(self, subplot, indep_def, dep_def, indep_span):
+    super(AggregatePlot, self).__init__(subplot, indep_def, dep_def, indep_span)
+    self.band = None
+    self.min_data = deque()
+    self.max_data = deque()
+
+  def update_from_packet(self, packet):
+    assert isinstance(packet, DataPacket)
+    indep_val = packet.get_data_by_id(self.indep_id)
+    dep_val = packet.get_data_by_id(self.dep_id)
+
+    if indep_val is not None and dep_val is not None:
+      self.indep_data.append(indep_val)
+      self.dep_data.append(dep_val['mean'])
+      self.min_data.append(dep_val['min'])
+      self.max_data.append(dep_val['max'])
+
+      indep_cutoff = indep_val - self.indep_span
+
+      while self.indep_data[0] < indep_cutoff or self.indep_data[0] > indep_val:
+        self.indep_data.popleft()
+        self.dep_data.popleft()
+        self.min_data.popleft()
+        self.max_data.popleft()
+
+  def update_show(self):
+    if self.band is not None:
+      self.band.remove()
+    self.band = self.subplot.fill_between(self.indep_data, self.min_data, self.max_data,
+                                          color=self.line.get_color(), alpha=0.3)
+    super(AggregatePlot, self).update_show()
+    if self.limits is None and self.dep_data:
+      minlim = min(min(self.min_data), 0)
+      maxlim = max(max(self.max_data), 0)
+      rangelim = maxlim - minlim
+      self.subplot.set_ylim(minlim - rangelim / 20, maxlim + rangelim / 20)
+
 class WaterfallPlot(BasePlot):
   def __init__(self, subplot, indep_def, dep_def, indep_span):
     super(WaterfallPlot, self).__init__(subplot, indep_def, dep_def, indep_span)
@@ -161,9 +206,46 @@ class WaterfallPlot(BasePlot):
       self.quad = self.subplot.pcolorfast(self.x_mesh, self.y_mesh, self.data_array,
           cmap='gray', interpolation='None')
 
+class CapturePlot(BasePlot):
+  """A plot of the latest complete trigger capture, with a line per channel vs.
+  the sample index relative to the trigger.
+  """
+  scrolling = False
+
+  def __init__(self, subplot, indep_def, dep_def, indep_span):
+    super(CapturePlot, self).__init__(subplot, indep_def, dep_def, indep_span)
+    self.lines = [subplot.plot([0])[0] for _ in range(dep_def.channels)]
+    subplot.axvline(0, color='gray', linestyle='--')
+    self.shown_capture = None
+
+  def update_from_packet(self, packet):
+    pass  # the data def reassembles captures from chunks
+
+  def update_show(self):
+    capture = self.dep_def.get_latest_value()
+    if capture is None or capture is self.shown_capture:
+      return
+    self.shown_capture = capture
+
+    indices = [index - capture['trigger'] for index in range(len(capture['channels'][0]))]
+    for line, channel_data in zip(self.lines, capture['channels']):
+      line.set_xdata(indices)
+      line.set_ydata(channel_data)
+    self.subplot.set_xlim(indices[0], indices[-1])
+
+    if self.limits is not None:
+      minlim, maxlim = self.limits
+    else:
+      minlim = min(min(channel_data) for channel_data in capture['channels'])
+      maxlim = max(max(channel_data) for channel_data in capture['channels'])
+    rangelim = (maxlim - minlim) or 1
+    self.subplot.set_ylim(minlim - rangelim / 20, maxlim + rangelim / 20)
+
 plot_registry = {}
 plot_registry[NumericData] = NumericPlot
 plot_registry[NumericArray] = WaterfallPlot
+plot_registry[CaptureData] = CapturePlot
+plot_registry[AggregateData] = AggregatePlot
 
 def data_def_title(data_def):
   return "%s: %s (%s)" % (data_def.internal_name, data_def.display_name, data_def.units)
@@ -195,6 +277,12 @@ def subplots_from_header(packet, figure, indep_def, indep_span=10000, merge_data
       continue
     if data_def.internal_name in hide_data:
       continue
+    if isinstance(data_def, LogData):
+      continue  # printed to the console instead
+    if isinstance(data_def, TraceData):
+      continue  # exported with trace_export.py instead
+    if isinstance(data_def, StreamData):
+      continue  # fed with telemetry.stream.StreamTransmitter instead
 
     if data_name in merge_data_names_to_sets:
       merged_set = merge_data_names_to_sets[data_name]
@@ -277,9 +365,11 @@ class CsvLogger(object):
 if __name__ == "__main__":
   import argparse
   parser = argparse.ArgumentParser(description='Telemetry data plotter.')
-  parser.add_argument('port', help='serial port to receive on')
+  parser.add_argument('port', help='serial port to receive on, or shared memory name with --gateway')
   parser.add_argument('--baud', '-b', type=int, default=38400,
                       help='serial baud rate')
+  parser.add_argument('--gateway', action='store_true',
+                      help='receive through a telemetry-gateway daemon, which can be shared with other tools')
   parser.add_argument('--indep_name', '-i', default='time',
                       help='internal name of independent axis')
   parser.add_argument('--span', '-s', type=int, default=10000,
@@ -290,16 +380,25 @@ if __name__ == "__main__":
                       help='*EXPERIMETAL* names of data to hide')
   parser.add_argument('--log_filename_prefix', '-f', default='telemetry',
                       help='filename prefix for logging output, set to empty to disable logging')
+  parser.add_argument('--namespace', '-n', type=int, default=0,
+                      help='namespace of the data to plot, for links shared by several transmitters')
+  parser.add_argument('--schema',
+                      help='schema file from schema_report.py, for display names and units stripped from the transmitter')
   args = parser.parse_args()
 
   # serial_hal = TelemetrySocketSerial(args.port)
-  serial_hal = TelemetrySerialSerial(args.port, args.baud)
-  telemetry = TelemetrySerial(serial_hal)
+  if args.gateway:
+    serial_hal = TelemetryGatewaySerial(args.port)
+  else:
+    serial_hal = TelemetrySerialSerial(args.port, args.baud)
+  schema = load_schema(args.schema) if args.schema else {}
+  telemetry = TelemetrySerial(serial_hal, schema)
 
   # note: mutable elements are in lists to allow access from nested functions
   indep_def = [None]  # note: data ID 0 is invalid
   latest_indep = [0]
   plots_dict = [[]]
+  log_defs = [[]]
 
   csv_logger = [None]
 
@@ -319,6 +418,8 @@ if __name__ == "__main__":
       packet = telemetry.next_rx_packet()
       if not packet:
         break
+      if packet.namespace != args.namespace:
+        continue
 
       if isinstance(packet, HeaderPacket):
         fig.clf()
@@ -332,6 +433,8 @@ if __name__ == "__main__":
 
         # instantiate plots
         plots_dict[0] = subplots_from_header(packet, fig, indep_def[0], args.span, merge_data_names_to_sets, args.hide)
+        log_defs[0] = [data_def for data_def in packet.get_data_defs().values()
+                       if isinstance(data_def, LogData)]
         plt.show()
 
         # prepare CSV file and headers
@@ -355,6 +458,20 @@ if __name__ == "__main__":
         if csv_logger[0]:
           csv_logger[0].write_data(packet)
 
+        # log messages are handled like other text from the transmitter
+        for log_def in log_defs[0]:
+          log_value = packet.get_data_by_id(log_def.data_id)
+          if log_value is None:
+            continue
+          lines = list(log_value['messages'])
+          if log_value['dropped']:
+            lines.append("(%i log messages dropped)" % log_value['dropped'])
+          for line in lines:
+            print("%s: %s" % (log_def.internal_name, line))
+            if csv_logger[0]:
+              for char in "%s: %s\n" % (log_def.internal_name, line):
+                csv_logger[0].add_char(char)
+
       else:
         raise Exception("Unknown received packet %s" % repr(packet))
 
@@ -373,8 +490,9 @@ if __name__ == "__main__":
       for plot_list in plots_dict[0].values():
         for plot in plot_list:
           plot.update_show()
-      for subplot in plots_dict[0].keys():
-        subplot.set_xlim([latest_indep[0] - args.span, latest_indep[0]])
+      for subplot, plot_list in plots_dict[0].items():
+        if all(plot.scrolling for plot in plot_list):
+          subplot.set_xlim([latest_indep[0] - args.span, latest_indep[0]])
 
   def set_plot_dialog(plot):
     def set_plot_dialog_inner():
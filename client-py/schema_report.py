@@ -0,0 +1,162 @@
+"""Build-time schema and footprint report for transmitter sources.
+
+Scans C++ sources for Numeric, NumericArray, NumericArrayView, Aggregate,
+Capture and SampleStream declarations, writes a schema file (loadable with
+telemetry.parser.load_schema and the plotter --schema option) holding the
+metadata a TELEMETRY_STRIP_METADATA build doesn't send, and prints the
+estimated per-channel RAM and flash cost.
+
+Estimates ignore padding and assume each string literal is stored once.
+"""
+from __future__ import print_function
+import json
+import re
+import sys
+
+# pointer size, size_t size and double size per target
+TARGETS = {
+  'avr': {'pointer': 2, 'size_t': 2, 'double': 4},
+  'arm': {'pointer': 4, 'size_t': 4, 'double': 8},
+}
+
+TYPE_SIZES = {
+  'bool': 1, 'uint8_t': 1, 'int8_t': 1, 'char': 1,
+  'uint16_t': 2, 'int16_t': 2,
+  'uint32_t': 4, 'int32_t': 4, 'float': 4,
+  'uint64_t': 8, 'int64_t': 8,
+}
+
+STRING = r'(?:TELEMETRY_METADATA\s*\(\s*)?"((?:[^"\\]|\\.)*)"\s*\)?'
+DECLARATION_RE = re.compile(
+    r'\b(Numeric|NumericArray|NumericArrayView|Aggregate|Capture|SampleStream)\s*<\s*([\w:]+)\s*(?:,\s*([\w:]+)\s*)?(?:,\s*([\w:]+)\s*)?>\s*'
+    r'(\w+)\s*\(\s*[\w.>-]+\s*,\s*' + STRING + r'\s*,\s*' + STRING + r'\s*,\s*' + STRING)
+CONSTANT_RE = re.compile(r'(?:#define\s+(\w+)\s+|\b(\w+)\s*=\s*)(\d+)\b')
+
+def fnv1a_32(string):
+  """Hash of an internal name, usable as a compact key for schema lookups."""
+  value = 0x811c9dc5
+  for byte in bytearray(string.encode('utf-8')):
+    value = ((value ^ byte) * 0x01000193) & 0xffffffff
+  return value
+
+def find_channels(sources):
+  constants = {}
+  for source in sources:
+    for match in CONSTANT_RE.finditer(source):
+      constants[match.group(1) or match.group(2)] = int(match.group(3))
+
+  channels = []
+  for source in sources:
+    for match in DECLARATION_RE.finditer(source):
+      kind, data_type, dimension_1, dimension_2, variable, internal_name, display_name, units = match.groups()
+      data_type = data_type.split('::')[-1]
+      count = 1
+      for dimension in (dimension_1, dimension_2):  # captures are channels * depth, streams depth
+        if dimension is None:
+          continue
+        if dimension.isdigit():
+          count *= int(dimension)
+        elif dimension.split('::')[-1] in constants:
+          count *= constants[dimension.split('::')[-1]]
+        else:
+          print("Warning: can't resolve array count of %s" % variable, file=sys.stderr)
+      channels.append({
+        'internal_name': internal_name,
+        'display_name': display_name,
+        'units': units,
+        'hash': '%08x' % fnv1a_32(internal_name),
+        'variable': variable,
+        'data_type': data_type,
+        'array': kind in ('NumericArray', 'NumericArrayView'),
+        'kind': kind,
+        'count': count,
+      })
+  return channels
+
+def channel_footprint(channel, target, metadata_in_flash, strip_metadata,
+                      change_suppression=False):
+  """Returns (RAM bytes, flash bytes, header bytes) for a channel."""
+  sizes = TARGETS[target]
+  if channel['data_type'] == 'double':
+    element = sizes['double']
+  else:
+    element = TYPE_SIZES.get(channel['data_type'], 4)
+
+  strings = [channel['internal_name']]
+  if not strip_metadata:
+    strings += [channel['display_name'], channel['units']]
+  string_bytes = sum(len(string) + 1 for string in strings)
+
+  ram = (sizes['pointer']  # vtable pointer
+         + sizes['pointer'] * len(strings)  # metadata pointers
+         + sizes['pointer']  # container reference
+         + sizes['size_t']  # data ID
+         + element * (channel['count'] + 2)  # value and limits
+         + sizes['pointer'])  # Telemetry data table entry
+  flash = string_bytes
+  if target == 'avr' and not metadata_in_flash:
+    ram += string_bytes  # copied from flash into RAM at startup
+
+  header = (1 + 1  # data ID, data type
+            + sum(1 + len(string) + 1 for string in strings)
+            + 2 + 2  # subtype, length
+            + 1 + element * 2  # limits
+            + 1)  # terminator
+  if channel['array']:
+    header += 1 + 4
+  if channel['kind'] == 'Numeric' and change_suppression:
+    ram += element + 4 + 4 + 4 + 1  # change suppression reference, deadband, times, mode
+  if channel['kind'] == 'NumericArrayView':
+    # values are in caller-owned buffers, referenced by two pointers
+    ram += (sizes['pointer'] * 2 + 1 + 4 * 3  # buffers, index, counts
+            - element * channel['count'])
+  if channel['kind'] == 'Aggregate':
+    ram += element * 2 + 4 + sizes['double']  # window min, max, count and sum
+  if channel['kind'] == 'Capture':
+    header += 1 + 4 + 1 + 1 + 1 + 4  # depth, channels, pretrigger
+    ram += sizes['double'] * 2 + sizes['size_t'] * 12  # capture state, roughly
+  if channel['kind'] == 'SampleStream':
+    header += 1 + 4 - (1 + element * 2)  # depth, but no limits
+    # a FIFO of one more slot than the depth, its pointers, and counters
+    ram += sizes['pointer'] * 4 + sizes['size_t'] + 4 * 10 + 6 - element
+  return ram, flash, header
+
+if __name__ == "__main__":
+  import argparse
+  parser = argparse.ArgumentParser(description='Telemetry schema and footprint report.')
+  parser.add_argument('sources', nargs='+', help='transmitter C++ source files')
+  parser.add_argument('--target', choices=sorted(TARGETS.keys()), default='avr',
+                      help='target architecture for size estimates')
+  parser.add_argument('--metadata_in_flash', action='store_true',
+                      help='estimate with TELEMETRY_METADATA_IN_FLASH set')
+  parser.add_argument('--strip_metadata', action='store_true',
+                      help='estimate with TELEMETRY_STRIP_METADATA set')
+  parser.add_argument('--change_suppression', action='store_true',
+                      help='estimate with TELEMETRY_CHANGE_SUPPRESSION set')
+  parser.add_argument('--output', '-o',
+                      help='schema file to write')
+  args = parser.parse_args()
+
+  sources = []
+  for filename in args.sources:
+    with open(filename) as source_file:
+      sources.append(source_file.read())
+  channels = find_channels(sources)
+
+  print("%-24s %-10s %6s %6s %6s %6s" % ('channel', 'type', 'count', 'RAM', 'flash', 'header'))
+  totals = [0, 0, 0]
+  for channel in channels:
+    footprint = channel_footprint(channel, args.target,
+                                  args.metadata_in_flash, args.strip_metadata,
+                                  args.change_suppression)
+    totals = [total + value for total, value in zip(totals, footprint)]
+    print("%-24s %-10s %6i %6i %6i %6i" % ((channel['internal_name'], channel['data_type'],
+                                            channel['count']) + footprint))
+  print("%-24s %-10s %6s %6i %6i %6i" % (('total', '', '') + tuple(totals)))
+
+  if args.output:
+    schema = {'channels': [dict((key, channel[key]) for key in
+                                ('internal_name', 'display_name', 'units', 'hash'))
+                           for channel in channels]}
+    with open(args.output, 'w') as schema_file:
+      json.dump(schema, schema_file, indent=2)
@@ -0,0 +1,23 @@
+"""Builds the native decoder extension module (telemetry._decoder, from
+client-cpp/pydecoder.cpp), which the telemetry package uses when available:
+  python setup.py build_ext --inplace
+Without it, decoding is done in Python.
+"""
+import os
+
+from setuptools import setup, Extension
+
+root = os.path.dirname(os.path.abspath(os.path.dirname(__file__) or '.'))
+client_cpp = os.path.join(root, 'client-cpp')
+server_cpp = os.path.join(root, 'server-cpp')
+
+setup(
+  name='telemetry',
+  packages=['telemetry'],
+  ext_modules=[
+    Extension('telemetry._decoder',
+              sources=[os.path.join(client_cpp, 'pydecoder.cpp'),
+                       os.path.join(client_cpp, 'decoder.cpp')],
+              include_dirs=[client_cpp, server_cpp]),
+  ],
+)
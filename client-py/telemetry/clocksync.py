@@ -0,0 +1,109 @@
+"""Host/transmitter clock synchronization from latency probe round trips.
+
+Each probe gives four times: t1 when the host sent it (its token), t2 and t3
+when the transmitter received and answered it, and t4 when the host received
+the answer. As in NTP, the round-trip delay excluding the transmitter's
+processing is (t4 - t1) - (t3 - t2), and the transmitter clock's offset from
+the host's is ((t2 - t1) + (t3 - t4)) / 2, which is exact if the link is
+symmetric and in error by at most half the delay otherwise.
+
+Queueing only ever adds delay, so the estimator trusts low-delay samples: the
+offset and drift are a least-squares line through the lowest-delay half of a
+window of recent samples.
+"""
+from collections import deque
+import math
+
+class ClockSync(object):
+  """NTP-style estimator of the offset and drift of a transmitter's clock from
+  the host's, with rolling round-trip latency percentiles. All times are in
+  microseconds.
+  """
+  def __init__(self, window=32, latency_window=256):
+    # (host time at the probe midpoint, offset, delay), most recent last
+    self.samples = deque(maxlen=window)
+    self.delays = deque(maxlen=latency_window)
+    # transmitter clock unwrapping: last 32-bit time and the offset to add
+    self.last_device_us = None
+    self.device_wrap_us = 0
+    # fitted line: offset at host time fit_origin_us, and drift (slope)
+    self.fit_origin_us = None
+    self.fit_offset_us = None
+    self.fit_drift = 0.0
+
+  def unwrap(self, device_us):
+    """Extends a 32-bit transmitter time to an unwrapped one, assuming times
+    arrive in order and less than a wrap (about 71 minutes) apart.
+    """
+    if self.last_device_us is not None and device_us < self.last_device_us:
+      self.device_wrap_us += 1 << 32
+    self.last_device_us = device_us
+    return device_us + self.device_wrap_us
+
+  def add_probe(self, packet):
+    """Adds the round trip of a ProbePacket whose token is the host send time,
+    as sent by TelemetrySerial.transmit_probe.
+    """
+    self.add_sample(packet.token, self.unwrap(packet.receive_time_us),
+                    self.unwrap(packet.transmit_time_us), packet.host_receive_us)
+
+  def add_sample(self, t1, t2, t3, t4):
+    """Adds a round trip from its host send time t1, unwrapped transmitter
+    receive and answer times t2 and t3, and host receive time t4.
+    """
+    delay = (t4 - t1) - (t3 - t2)
+    offset = ((t2 - t1) + (t3 - t4)) / 2.0
+    self.samples.append(((t1 + t4) / 2.0, offset, delay))
+    self.delays.append(delay)
+    self.fit()
+
+  def fit(self):
+    by_delay = sorted(self.samples, key=lambda sample: sample[2])
+    best = by_delay[:max(1, len(by_delay) // 2)]
+    # times relative to the first, to keep the fit well conditioned
+    self.fit_origin_us = best[0][0]
+    n = float(len(best))
+    mean_t = sum(sample[0] - self.fit_origin_us for sample in best) / n
+    mean_offset = sum(sample[1] for sample in best) / n
+    var_t = sum((sample[0] - self.fit_origin_us - mean_t) ** 2 for sample in best)
+    if var_t > 0:
+      self.fit_drift = sum((sample[0] - self.fit_origin_us - mean_t) * (sample[1] - mean_offset)
+                           for sample in best) / var_t
+    else:
+      self.fit_drift = 0.0
+    self.fit_offset_us = mean_offset - self.fit_drift * mean_t
+
+  def is_synchronized(self):
+    return self.fit_offset_us is not None
+
+  def get_offset_us(self, host_us):
+    """Returns the estimated transmitter clock offset (transmitter time minus
+    host time) at a host time.
+    """
+    return self.fit_offset_us + self.fit_drift * (host_us - self.fit_origin_us)
+
+  def get_drift_ppm(self):
+    """Returns the estimated rate of the transmitter clock relative to the
+    host's, in parts per million fast.
+    """
+    return self.fit_drift * 1e6
+
+  def device_to_host_us(self, device_us):
+    """Converts an unwrapped transmitter time to host time."""
+    # solve host = device - (offset0 + drift * (host - origin)) for host
+    return ((device_us - self.fit_offset_us + self.fit_drift * self.fit_origin_us)
+            / (1 + self.fit_drift))
+
+  def host_to_device_us(self, host_us):
+    """Converts a host time to unwrapped transmitter time."""
+    return host_us + self.get_offset_us(host_us)
+
+  def get_delay_percentiles(self, percentiles=(50, 90, 99)):
+    """Returns the round-trip delays at the given percentiles (by nearest rank)
+    of the recent probes, or None if there are none.
+    """
+    if not self.delays:
+      return None
+    ordered = sorted(self.delays)
+    return [ordered[max(0, int(math.ceil(p / 100.0 * len(ordered))) - 1)]
+            for p in percentiles]
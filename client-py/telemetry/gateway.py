@@ -0,0 +1,144 @@
+"""Access to a telemetry link through the telemetry-gateway daemon, which owns
+the serial port and publishes what it receives into shared memory, so several
+tools (like the plotter and a logger) can watch one device at once. See
+client-cpp/gateway.h for the shared memory layout.
+
+TelemetryGatewaySerial is a drop-in replacement for TelemetrySerialSerial:
+received frames are replayed as a byte stream, starting with the header
+packets of the current schema, and transmitted bytes (like remote set packets)
+are queued for the daemon to send.
+"""
+from collections import deque
+import fcntl
+import mmap
+import struct
+
+from .parser import encode_cobs_frame
+
+LAYOUT_MAGIC = 0x57474c54
+LAYOUT_VERSION = 1
+
+RECORD_PAD = 0x00
+RECORD_FRAME = 0x01
+RECORD_SAMPLE = 0x02
+RECORD_PASSTHROUGH = 0x03
+RECORD_ALIGN = 16
+
+# SharedHeader: layout fields, then positions at fixed offsets
+LAYOUT_FORMAT = '=IIQQQQQII'
+RING_CLAIM = 56
+RING_COMMIT = 64
+SCHEMA_VERSION = 72
+SCHEMA_LENGTH = 80
+COMMAND_HEAD = 88
+COMMAND_TAIL = 96
+
+RECORD_HEADER_FORMAT = '=IBBHQ'  # length, type, namespace, reserved, time
+RECORD_HEADER_LENGTH = struct.calcsize(RECORD_HEADER_FORMAT)
+SCHEMA_ENTRY_FORMAT = '=BBH'  # namespace, reserved, length
+COMMAND_SLOT_HEADER_LENGTH = 8
+
+def shared_memory_path(name):
+  """Returns the file system path of a POSIX shared memory object (Linux)."""
+  return '/dev/shm/' + name.lstrip('/')
+
+class TelemetryGatewaySerial(object):
+  def __init__(self, name='/telemetry'):
+    self.file = open(shared_memory_path(name), 'r+b')
+    self.shm = mmap.mmap(self.file.fileno(), 0)
+    (magic, version, self.ring_offset, self.ring_capacity,
+     self.schema_offset, self.schema_capacity, self.command_offset,
+     self.command_slots, self.command_slot_size) = struct.unpack_from(LAYOUT_FORMAT, self.shm, 0)
+    if magic != LAYOUT_MAGIC or version != LAYOUT_VERSION:
+      raise ValueError("%s is not a compatible telemetry gateway" % name)
+
+    self.buffer = deque()
+    self.position = self.read_position(RING_COMMIT)
+    self.lost_bytes = 0  # ring bytes skipped by falling behind
+    for payload in self.read_schema():
+      self.buffer.extend(encode_cobs_frame(payload))
+
+  def read_position(self, offset):
+    return struct.unpack_from('=Q', self.shm, offset)[0]
+
+  def read_schema(self):
+    """Returns the header packet payloads of the current schemas, in order."""
+    while True:
+      version = self.read_position(SCHEMA_VERSION)
+      if version % 2:
+        continue  # being written
+      length = min(self.read_position(SCHEMA_LENGTH), self.schema_capacity)
+      area = self.shm[self.schema_offset:self.schema_offset + length]
+      if self.read_position(SCHEMA_VERSION) == version:
+        break
+
+    payloads = []
+    pos = 0
+    entry_length = struct.calcsize(SCHEMA_ENTRY_FORMAT)
+    while pos + entry_length <= len(area):
+      _, _, length = struct.unpack_from(SCHEMA_ENTRY_FORMAT, area, pos)
+      pos += entry_length
+      payloads.append(area[pos:pos + length])
+      pos += length
+    return payloads
+
+  def poll(self):
+    """Moves newly published frames and non-telemetry bytes to the buffer."""
+    while True:
+      commit = self.read_position(RING_COMMIT)
+      if self.position >= commit:
+        return
+      offset = self.position & (self.ring_capacity - 1)
+      start = self.ring_offset + offset
+      length, record_type, _, _, _ = struct.unpack_from(RECORD_HEADER_FORMAT, self.shm, start)
+      if record_type == RECORD_PAD:
+        payload = None
+      else:
+        payload = self.shm[start + RECORD_HEADER_LENGTH:start + RECORD_HEADER_LENGTH + length]
+      if self.read_position(RING_CLAIM) - self.position > self.ring_capacity:
+        # fell behind by more than the ring, and it was overwritten
+        self.lost_bytes += commit - self.position
+        self.position = commit
+        print("Gateway reader fell behind; dropping")
+        continue
+
+      if record_type == RECORD_PAD:
+        self.position += self.ring_capacity - offset
+        continue
+      self.position += ((RECORD_HEADER_LENGTH + length + RECORD_ALIGN - 1)
+                        // RECORD_ALIGN * RECORD_ALIGN)
+      if record_type == RECORD_FRAME:
+        self.buffer.extend(encode_cobs_frame(payload))
+      elif record_type == RECORD_PASSTHROUGH:
+        self.buffer.extend(bytearray(payload))
+
+  def rx_available(self):
+    self.poll()
+    return len(self.buffer)
+
+  def next_rx_byte(self):
+    return self.buffer.popleft()
+
+  def rx_read(self):
+    self.poll()
+    data = bytearray(self.buffer)
+    self.buffer.clear()
+    return data
+
+  def tx(self, data):
+    data = bytearray(data)
+    if len(data) > self.command_slot_size - COMMAND_SLOT_HEADER_LENGTH:
+      print("Transmit of %i bytes too long for the gateway; dropping" % len(data))
+      return
+    fcntl.flock(self.file, fcntl.LOCK_EX)
+    try:
+      tail = self.read_position(COMMAND_TAIL)
+      if tail - self.read_position(COMMAND_HEAD) >= self.command_slots:
+        print("Gateway command queue full; dropping")
+        return
+      slot = self.command_offset + (tail % self.command_slots) * self.command_slot_size
+      struct.pack_into('=II', self.shm, slot, len(data), 0)
+      self.shm[slot + COMMAND_SLOT_HEADER_LENGTH:slot + COMMAND_SLOT_HEADER_LENGTH + len(data)] = bytes(data)
+      struct.pack_into('=Q', self.shm, COMMAND_TAIL, tail + 1)
+    finally:
+      fcntl.flock(self.file, fcntl.LOCK_UN)
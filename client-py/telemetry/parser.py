@@ -1,8 +1,17 @@
+import array
 from collections import deque
+import json
 from numbers import Number
+import re
 import struct
 import time
 
+try:
+  # native decoder, built with setup.py, otherwise decoding is done in Python
+  from . import _decoder as native_decoder
+except ImportError:
+  native_decoder = None
+
 # TODO: MASSIVE REFACTORING EVERYWHERE
 
 # lifted from https://stackoverflow.com/questions/36932/how-can-i-represent-an-enum-in-python
@@ -13,14 +22,36 @@ def enum(*sequential, **named):
 # Global constants defined by the telemetry protocol.
 # TODO: parse constants from cpp header
 SOF_BYTE = [0x05, 0x39]
+SOF_BYTE_COBS = [0x05, 0x3A]  # followed by COBS-encoded length and payload
+COBS_DELIMITER = 0x00
+COBS_MAX_BLOCK = 254
+
+FRAMING_STUFFED = 'stuffed'
+FRAMING_COBS = 'cobs'
 
 OPCODE_HEADER = 0x81
+OPCODE_HEADER_APPEND = 0x82  # more data definitions, added to the last header
 OPCODE_DATA = 0x01
+OPCODE_DATA_CYCLES = 0x03  # data grouped by transmitter cycle
+OPCODE_PROBE = 0x02  # latency probe, answered by the transmitter
+PROBE_TOKEN_LENGTH = 8
+OPCODE_CHUNK = 0x04  # chunk of a packet too large to buffer, see ChunkAssembler
+
+OPCODE_FLAG_NAMESPACE = 0x20  # a uint8 namespace follows the opcode
 
 DATAID_TERMINATOR = 0x00
 
 DATATYPE_NUMERIC = 0x01
 DATATYPE_NUMERIC_ARRAY = 0x02
+DATATYPE_CAPTURE = 0x03
+DATATYPE_AGGREGATE = 0x04
+DATATYPE_LOG = 0x05
+DATATYPE_TRACE = 0x06
+DATATYPE_STREAM = 0x07
+
+TRACE_KIND_BEGIN = 0x00
+TRACE_KIND_END = 0x01
+TRACE_KIND_INSTANT = 0x02
 
 NUMERIC_SUBTYPE_UINT = 0x01
 NUMERIC_SUBTYPE_SINT = 0x02
@@ -48,6 +79,18 @@ def deserialize_uint32(byte_stream):
          | byte_stream.popleft() << 8
          | byte_stream.popleft())
 
+def deserialize_varint(byte_stream):
+  value = 0
+  shift = 0
+  while True:
+    byte = byte_stream.popleft()
+    value |= (byte & 0x7f) << shift
+    if not byte & 0x80:
+      return value
+    shift += 7
+    if shift >= 35:
+      raise TelemetryDeserializationError("Varint too long")
+
 def deserialize_float(byte_stream):
   # TODO: handle overflow
   packed = bytearray([byte_stream.popleft(),
@@ -57,14 +100,15 @@ def deserialize_float(byte_stream):
   return struct.unpack('!f', packed)[0]
 
 def deserialize_numeric(byte_stream, subtype, length):
-  if subtype == NUMERIC_SUBTYPE_UINT:
+  if subtype == NUMERIC_SUBTYPE_UINT or subtype == NUMERIC_SUBTYPE_SINT:
     value = 0
     remaining = length
     while remaining > 0:
       value = value << 8 | deserialize_uint8(byte_stream)
       remaining -= 1
+    if subtype == NUMERIC_SUBTYPE_SINT and value >= 1 << (length * 8 - 1):
+      value -= 1 << (length * 8)
     return value
-    # TODO: add support for sint
   elif subtype == NUMERIC_SUBTYPE_FLOAT:
     if length == 4:
       return deserialize_float(byte_stream)
@@ -110,6 +154,16 @@ def serialize_uint16(value):
     raise ValueError("Invalid uint16: %s" % value)
   return struct.pack('!H', value)
 
+def serialize_varint(value):
+  if (not isinstance(value, int)) or (value < 0 or value > 2 ** 32 - 1):
+    raise ValueError("Invalid varint: %s" % value)
+  out = bytearray()
+  while value >= 0x80:
+    out.append((value & 0x7f) | 0x80)
+    value >>= 7
+  out.append(value)
+  return bytes(out)
+
 def serialize_uint32(value):
   if (not isinstance(value, int)) or (value < 0 or value > 2 ** 32 - 1):
     raise ValueError("Invalid uint32: %s" % value)
@@ -130,6 +184,10 @@ def serialize_numeric(value, subtype, length):
       return serialize_uint32(value)
     else:
       raise ValueError("Unknown uint length %02x" % length)
+  elif subtype == NUMERIC_SUBTYPE_SINT:
+    if not isinstance(value, int) or not -(1 << (length * 8 - 1)) <= value < 1 << (length * 8 - 1):
+      raise ValueError("Invalid sint%i: %s" % (length * 8, value))
+    return serialize_numeric(value & ((1 << (length * 8)) - 1), NUMERIC_SUBTYPE_UINT, length)
   elif subtype == NUMERIC_SUBTYPE_FLOAT:
     if length == 4:
       return serialize_float(value)
@@ -142,6 +200,30 @@ def serialize_numeric(value, subtype, length):
 
 PACKET_LENGTH_BYTES = 2 # number of bytes in the packet length field
 
+OPCODE_FLAG_COMPRESSED = 0x40  # payload after the sequence number is LZSS compressed
+LZ_MIN_MATCH = 3
+
+def lz_decompress(byte_stream):
+  """Destructively reads in an LZSS compressed payload from the input stream,
+  returning the decompressed bytes as a deque. See protocol.h for the format.
+  """
+  out = []
+  while byte_stream:
+    control = byte_stream.popleft()
+    for item in range(8):
+      if not byte_stream:
+        break
+      if control & (1 << item):
+        offset = byte_stream.popleft() + 1
+        length = byte_stream.popleft() + LZ_MIN_MATCH
+        if offset > len(out):
+          raise TelemetryDeserializationError("Compressed match before start")
+        for _ in range(length):
+          out.append(out[-offset])
+      else:
+        out.append(byte_stream.popleft())
+  return deque(out)
+
 class TelemetryDeserializationError(Exception):
   pass
 
@@ -191,11 +273,23 @@ class TelemetryData(object):
     self.internal_name = "%02x" % data_id
     self.display_name = self.internal_name
     self.units = ""
+    self.namespace = 0  # set by the receiver
 
     self.latest_value = None
 
+    self.received_records = set()
     self.decode_kvrs(byte_stream)
 
+  def apply_schema(self, schema):
+    """Fills in metadata records not sent in the header (for example, from a
+    transmitter built with TELEMETRY_STRIP_METADATA) from a schema dict of
+    internal name to dict of record name to value.
+    """
+    entry = schema.get(self.internal_name, {})
+    for record_name, value in entry.items():
+      if record_name not in self.received_records and hasattr(self, record_name):
+        setattr(self, record_name, value)
+
   def decode_kvrs(self, byte_stream):
     """Destructively reads in a sequence of KVRs from the input stream, writing
     the known ones as instance variables and throwing exceptions on unknowns.
@@ -209,6 +303,7 @@ class TelemetryData(object):
         raise NoRecordIdError("No RecordId %02x in %s" % (record_id, self.__class__.__name__))
       record_name, record_deserializer = kvrs_dict[record_id]
       setattr(self, record_name, record_deserializer(byte_stream))
+      self.received_records.add(record_name)
 
     # check that all KVRs have been read in / defaulted
     for record_id, record_desc in kvrs_dict.items():
@@ -227,6 +322,12 @@ class TelemetryData(object):
     """
     raise NotImplementedError
 
+  def value_from_elements(self, elements):
+    """Returns the value of this data from its element values decoded by the
+    native decoder (as floats), as deserialize_data would return it.
+    """
+    raise NotImplementedError
+
   def get_latest_value(self):
     return self.latest_value
 
@@ -254,8 +355,27 @@ class NumericData(TelemetryData):
   def serialize_data(self, value):
     return serialize_numeric(value, self.subtype, self.length)
 
+  def value_from_elements(self, elements):
+    if self.subtype == NUMERIC_SUBTYPE_FLOAT:
+      return elements[0]
+    return int(elements[0])
+
 datatype_registry[DATATYPE_NUMERIC] = NumericData
 
+class AggregateData(NumericData):
+  """Numeric aggregated over each transmit window. Values are dicts of the
+  count of values in the window, and their min, max and mean.
+  """
+  def deserialize_data(self, byte_stream):
+    return {
+      'count': deserialize_uint32(byte_stream),
+      'min': deserialize_numeric(byte_stream, self.subtype, self.length),
+      'max': deserialize_numeric(byte_stream, self.subtype, self.length),
+      'mean': deserialize_float(byte_stream),
+    }
+
+datatype_registry[DATATYPE_AGGREGATE] = AggregateData
+
 class NumericArray(TelemetryData):
   def get_kvrs_dict(self):
     newdict = super(NumericArray, self).get_kvrs_dict().copy()
@@ -282,8 +402,220 @@ class NumericArray(TelemetryData):
       out += serialize_numeric(elt, self.subtype, self.length)
     return out
 
+  def value_from_elements(self, elements):
+    if self.subtype == NUMERIC_SUBTYPE_FLOAT:
+      return elements
+    return [int(elt) for elt in elements]
+
 datatype_registry[DATATYPE_NUMERIC_ARRAY] = NumericArray
 
+class CaptureData(TelemetryData):
+  """Trigger capture, received as a burst of chunks. Each packet's value is
+  the chunk (a dict of capture number, total samples, trigger sample index,
+  start sample index and a list of samples, each a list of channel values),
+  while the latest value is the last complete capture (a dict of capture
+  number, trigger sample index and a list of samples per channel).
+  """
+  def __init__(self, data_id, byte_stream):
+    super(CaptureData, self).__init__(data_id, byte_stream)
+    self.partial = None
+
+  def get_kvrs_dict(self):
+    newdict = super(CaptureData, self).get_kvrs_dict().copy()
+    newdict.update({
+      0x40: ('subtype', deserialize_uint8),
+      0x41: ('length', deserialize_uint8),
+      0x42: ('limits', deserialize_numeric_from_def(self, count=2)),
+      0x50: ('count', deserialize_uint32),
+      0x60: ('channels', deserialize_uint8),
+      0x61: ('pretrigger', deserialize_uint32),
+    })
+    return newdict
+
+  def deserialize_data(self, byte_stream):
+    chunk = {
+      'capture': deserialize_uint8(byte_stream),
+      'total': deserialize_uint16(byte_stream),
+      'trigger': deserialize_uint16(byte_stream),
+      'start': deserialize_uint16(byte_stream),
+    }
+    count = deserialize_uint8(byte_stream)
+    chunk['samples'] = [[deserialize_numeric(byte_stream, self.subtype, self.length)
+                         for _ in range(self.channels)]
+                        for _ in range(count)]
+    return chunk
+
+  def serialize_data(self, value):
+    raise ValueError("Captures can't be set")
+
+  def set_latest_value(self, chunk):
+    if not chunk['samples']:
+      return
+    if chunk['start'] == 0:
+      self.partial = {'capture': chunk['capture'], 'trigger': chunk['trigger'],
+                      'total': chunk['total'], 'samples': []}
+    elif (self.partial is None or self.partial['capture'] != chunk['capture']
+          or len(self.partial['samples']) != chunk['start']):
+      self.partial = None  # missed a chunk, drop this capture
+      return
+    self.partial['samples'].extend(chunk['samples'])
+    if len(self.partial['samples']) >= self.partial['total']:
+      samples = self.partial['samples']
+      self.latest_value = {
+        'capture': self.partial['capture'],
+        'trigger': self.partial['trigger'],
+        'channels': [[sample[channel] for sample in samples]
+                     for channel in range(self.channels)],
+      }
+      self.partial = None
+
+datatype_registry[DATATYPE_CAPTURE] = CaptureData
+
+def deserialize_string_table(byte_stream):
+  count = deserialize_uint16(byte_stream)
+  return [deserialize_string(byte_stream) for _ in range(count)]
+
+# printf conversion: flags, width and precision, length modifier, conversion
+LOG_CONVERSION_RE = re.compile(r'%([-+ #0-9.]*)(hh|h|ll|l|j|z|t|L)?(.)', re.DOTALL)
+
+def format_log_message(format_string, byte_stream):
+  """Formats a deferred-format log message, destructively reading the
+  arguments of its conversions from the input stream.
+  """
+  out = ''
+  pos = 0
+  for match in LOG_CONVERSION_RE.finditer(format_string):
+    flags, modifier, conversion = match.groups()
+    out += format_string[pos:match.start()]
+    pos = match.end()
+    length = 8 if modifier in ('ll', 'j') else 4
+    if conversion in 'di':
+      out += ('%' + flags + 'd') % deserialize_numeric(byte_stream, NUMERIC_SUBTYPE_SINT, length)
+    elif conversion in 'uoxX':
+      out += ('%' + flags + conversion.replace('u', 'd')) % deserialize_numeric(byte_stream, NUMERIC_SUBTYPE_UINT, length)
+    elif conversion == 'p':
+      out += '0x%x' % deserialize_uint32(byte_stream)
+    elif conversion == 'c':
+      out += ('%' + flags + 'c') % deserialize_uint8(byte_stream)
+    elif conversion in 'fFeEgG':
+      out += ('%' + flags + conversion) % deserialize_float(byte_stream)
+    elif conversion in 'aA':
+      out += deserialize_float(byte_stream).hex()
+    elif conversion == 's':
+      out += ('%' + flags + 's') % deserialize_string(byte_stream)
+    elif conversion == '%':
+      out += '%'
+    else:  # arguments end at unsupported conversions
+      pos = match.start()
+      break
+  return out + format_string[pos:]
+
+class LogData(TelemetryData):
+  """Deferred-format log, with format strings from the header. Values are
+  dicts of the count of messages dropped by the transmitter since the last
+  value, and a list of the messages in the value, formatted here.
+  """
+  def get_kvrs_dict(self):
+    newdict = super(LogData, self).get_kvrs_dict().copy()
+    newdict.update({
+      0x70: ('formats', deserialize_string_table),
+    })
+    return newdict
+
+  def deserialize_data(self, byte_stream):
+    dropped = deserialize_uint16(byte_stream)
+    length = deserialize_uint16(byte_stream)
+    message_stream = deque([deserialize_uint8(byte_stream) for _ in range(length)])
+    messages = []
+    while message_stream:
+      format_index = deserialize_varint(message_stream)
+      if format_index >= len(self.formats):
+        raise TelemetryDeserializationError("Log format index %i out of range" % format_index)
+      messages.append(format_log_message(self.formats[format_index], message_stream))
+    return {'dropped': dropped, 'messages': messages}
+
+  def serialize_data(self, value):
+    raise ValueError("Logs can't be set")
+
+datatype_registry[DATATYPE_LOG] = LogData
+
+class TraceData(TelemetryData):
+  """Trace events, with event names from the header. Values are dicts of the
+  count of events dropped by the transmitter since the last value, and a list
+  of events, each a tuple of event name, TRACE_KIND and time in microseconds
+  (which wraps at 32 bits).
+  """
+  def get_kvrs_dict(self):
+    newdict = super(TraceData, self).get_kvrs_dict().copy()
+    newdict.update({
+      0x71: ('names', deserialize_string_table),
+    })
+    return newdict
+
+  def deserialize_data(self, byte_stream):
+    dropped = deserialize_uint16(byte_stream)
+    count = deserialize_uint8(byte_stream)
+    time_us = deserialize_uint32(byte_stream)
+    events = []
+    for _ in range(count):
+      event = deserialize_varint(byte_stream)
+      time_us = (time_us + deserialize_varint(byte_stream)) & 0xffffffff
+      if event >> 2 >= len(self.names):
+        raise TelemetryDeserializationError("Trace event index %i out of range" % (event >> 2))
+      events.append((self.names[event >> 2], event & 0x03, time_us))
+    return {'dropped': dropped, 'events': events}
+
+  def serialize_data(self, value):
+    raise ValueError("Traces can't be set")
+
+datatype_registry[DATATYPE_TRACE] = TraceData
+
+class StreamData(TelemetryData):
+  """Flow-controlled stream of samples to the transmitter's FIFO (of count
+  samples). Values are reports, dicts of the stream position of the next
+  sample the transmitter expects, its free FIFO slots, and the underruns and
+  dropped samples since the last report. Samples are set as a tuple of the
+  stream position of the first sample and a list of samples (at most 255);
+  see telemetry.stream.StreamTransmitter to keep the FIFO full.
+  """
+  def __init__(self, data_id, byte_stream):
+    super(StreamData, self).__init__(data_id, byte_stream)
+    self.underruns = 0  # totals over all reports
+    self.dropped = 0
+
+  def get_kvrs_dict(self):
+    newdict = super(StreamData, self).get_kvrs_dict().copy()
+    newdict.update({
+      0x40: ('subtype', deserialize_uint8),
+      0x41: ('length', deserialize_uint8),
+      0x50: ('count', deserialize_uint32),
+    })
+    return newdict
+
+  def deserialize_data(self, byte_stream):
+    return {
+      'position': deserialize_uint32(byte_stream),
+      'free': deserialize_uint16(byte_stream),
+      'underruns': deserialize_uint16(byte_stream),
+      'dropped': deserialize_uint16(byte_stream),
+    }
+
+  def serialize_data(self, value):
+    position, samples = value
+    if len(samples) > 255:
+      raise ValueError("At most 255 stream samples per record")
+    out = serialize_uint32(position & 0xffffffff) + serialize_uint8(len(samples))
+    for sample in samples:
+      out += serialize_numeric(sample, self.subtype, self.length)
+    return out
+
+  def set_latest_value(self, report):
+    self.underruns += report['underruns']
+    self.dropped += report['dropped']
+    self.latest_value = report
+
+datatype_registry[DATATYPE_STREAM] = StreamData
+
 class PacketSizeError(TelemetryDeserializationError):
   pass
 class NoOpcodeError(TelemetryDeserializationError):
@@ -298,16 +630,27 @@ class TelemetryPacket(object):
   """Abstract base class for telemetry packets.
   """
   @staticmethod
-  def decode(byte_stream, context):
-    opcode = byte_stream[0]
+  def decode(byte_stream, contexts):
+    """Decodes a packet, given a dict of namespace to TelemetryContext.
+    """
+    opcode = deserialize_uint8(byte_stream)
+    namespace = 0
+    if opcode & OPCODE_FLAG_NAMESPACE:
+      namespace = deserialize_uint8(byte_stream)
+    sequence = deserialize_uint8(byte_stream)
+    if opcode & OPCODE_FLAG_COMPRESSED:
+      byte_stream = lz_decompress(byte_stream)
+    opcode &= ~(OPCODE_FLAG_COMPRESSED | OPCODE_FLAG_NAMESPACE)
     if opcode not in opcodes_registry:
       raise NoOpcodeError("No opcode %02x" % opcode)
     packet_cls = opcodes_registry[opcode]
-    return packet_cls(byte_stream, context)
+    context = contexts.get(namespace, TelemetryContext({}))
+    return packet_cls(opcode, namespace, sequence, byte_stream, context)
 
-  def __init__(self, byte_stream, context):
-    self.opcode = deserialize_uint8(byte_stream)
-    self.sequence = deserialize_uint8(byte_stream)
+  def __init__(self, opcode, namespace, sequence, byte_stream, context):
+    self.opcode = opcode
+    self.namespace = namespace
+    self.sequence = sequence
     self.decode_payload(byte_stream, context)
     if len(byte_stream) > 0:
       raise PacketSizeError("%i unused bytes in packet" % len(byte_stream))
@@ -320,14 +663,19 @@ class HeaderPacket(TelemetryPacket):
     return "[%i]Header: %s" % (self.sequence, repr(self.data))
 
   def decode_payload(self, byte_stream, context):
-    self.data = {}
+    self.data = self.get_initial_data_defs(context)
+    self.new_data = {}
     while True:
-      data_id = deserialize_uint8(byte_stream)
+      data_id = deserialize_varint(byte_stream)
       if data_id == DATAID_TERMINATOR:
         break
       elif data_id in self.data:
         raise DuplicateDataIdError("Duplicate DataId %02x" % data_id)
       self.data[data_id] = TelemetryData.decode_header(data_id, byte_stream)
+      self.new_data[data_id] = self.data[data_id]
+
+  def get_initial_data_defs(self, context):
+    return {}
 
   def get_data_defs(self):
     """Returns the data defs defined in this header as a dict of data ID to
@@ -335,6 +683,12 @@ class HeaderPacket(TelemetryPacket):
     """
     return self.data
 
+  def get_new_data_defs(self):
+    """Returns the data defs first defined in this packet, which for a header
+    are all of them.
+    """
+    return self.new_data
+
   def get_data_names(self):
     data_names = []
     for data_def in self.data.values():
@@ -343,14 +697,70 @@ class HeaderPacket(TelemetryPacket):
 
 opcodes_registry[OPCODE_HEADER] = HeaderPacket
 
+class HeaderAppendPacket(HeaderPacket):
+  """Header continuation, adding definitions to the current header. Its data
+  defs are those of the whole header, including the added ones.
+  """
+  def __repr__(self):
+    return "[%i]HeaderAppend: %s" % (self.sequence, repr(self.new_data))
+
+  def get_initial_data_defs(self, context):
+    return dict(context.data_defs)
+
+opcodes_registry[OPCODE_HEADER_APPEND] = HeaderAppendPacket
+
 class DataPacket(TelemetryPacket):
+  """Data records. Batches of updates from several transmitter cycles may
+  update a data ID more than once, so records are kept in order, each tagged
+  with the cycle it's from: the cycle offset for DataCyclesPacket, and for
+  plain data packets, a new cycle is assumed whenever a data ID repeats.
+  """
   def __repr__(self):
     return "[%i]Data: %s" % (self.sequence, repr(self.data))
 
   def decode_payload(self, byte_stream, context):
     self.data = {}
+    self.records = []  # (cycle, data ID, value), in order
+    self.cycle = 0
+    self.batch = None  # from the native decoder, see from_batch
+    cycle_ids = set()
+    for data_id, data_value in self.decode_records(byte_stream, context):
+      if data_id in cycle_ids:
+        self.cycle += 1
+        cycle_ids = set()
+      cycle_ids.add(data_id)
+      self.add_record(self.cycle, data_id, data_value)
+    self.cycle = 0
+
+  @staticmethod
+  def from_batch(batch, contexts):
+    """Builds a packet from a batch decoded by the native decoder (see
+    client-cpp/pydecoder.cpp), given a dict of namespace to TelemetryContext.
+    """
+    packet_cls = opcodes_registry[batch.opcode]
+    packet = packet_cls.__new__(packet_cls)
+    packet.opcode = batch.opcode
+    packet.namespace = batch.namespace
+    packet.sequence = batch.sequence
+    packet.data = {}
+    packet.records = []
+    packet.cycle = 0
+    packet.batch = batch
+    context = contexts.get(batch.namespace, TelemetryContext({}))
+    values = memoryview(batch).tolist()
+    for cycle, data_id, offset, count in batch.records:
+      data_def = context.get_data_def(data_id)
+      if not data_def:
+        raise UndefinedDataIdError("Received DataId %02x not defined in header" % data_id)
+      data_value = data_def.value_from_elements(values[offset:offset + count])
+      data_def.set_latest_value(data_value)
+      packet.add_record(cycle, data_id, data_value)
+    return packet
+
+  def decode_records(self, byte_stream, context):
+    """Yields (data ID, value) for data records up to their terminator."""
     while True:
-      data_id = deserialize_uint8(byte_stream)
+      data_id = deserialize_varint(byte_stream)
       if data_id == DATAID_TERMINATOR:
         break
       data_def = context.get_data_def(data_id)
@@ -358,9 +768,14 @@ class DataPacket(TelemetryPacket):
         raise UndefinedDataIdError("Received DataId %02x not defined in header" % data_id)
       data_value = data_def.deserialize_data(byte_stream)
       data_def.set_latest_value(data_value)
-      self.data[data_def.data_id] = data_value
+      yield data_id, data_value
+
+  def add_record(self, cycle, data_id, data_value):
+    self.records.append((cycle, data_id, data_value))
+    self.data[data_id] = data_value
 
   def get_data_dict(self):
+    """Returns the latest value of each data ID in this packet."""
     return self.data
 
   def get_data_by_id(self, data_id):
@@ -369,8 +784,153 @@ class DataPacket(TelemetryPacket):
     else:
       return None
 
+  def get_records(self):
+    """Returns the records as (cycle, data ID, value), in order."""
+    return self.records
+
+  def get_buffer(self, data_id):
+    """Returns the values of a numeric or numeric array data ID in this packet
+    (of all its records in order, arrays flattened) as a buffer of doubles,
+    which numpy.frombuffer reads without copying, or None if it has none.
+    With the native decoder, this is a view of the decoded values.
+    """
+    if self.batch is not None:
+      return self.batch.get(data_id)
+    values = array.array('d')
+    for _, record_id, value in self.records:
+      if record_id != data_id:
+        continue
+      if isinstance(value, list):
+        values.extend(value)
+      else:
+        values.append(value)
+    return values if values else None
+
+  def split_cycles(self):
+    """Returns a DataPacket per cycle in this packet (just this packet if it
+    has only one), each with the cycle as its cycle attribute.
+    """
+    if not self.records or self.records[-1][0] == self.records[0][0]:
+      return [self]
+    packets = []
+    for cycle, data_id, data_value in self.records:
+      if not packets or packets[-1].cycle != cycle:
+        packet = DataPacket.__new__(DataPacket)
+        packet.opcode = self.opcode
+        packet.namespace = self.namespace
+        packet.sequence = self.sequence
+        packet.data = {}
+        packet.records = []
+        packet.cycle = cycle
+        packet.batch = None
+        packets.append(packet)
+      packets[-1].add_record(cycle, data_id, data_value)
+    return packets
+
 opcodes_registry[OPCODE_DATA] = DataPacket
 
+class DataCyclesPacket(DataPacket):
+  """Data records grouped by the transmitter cycle they were updated in."""
+  def decode_payload(self, byte_stream, context):
+    self.data = {}
+    self.records = []
+    self.cycle = 0
+    self.batch = None
+    while True:
+      cycle = deserialize_varint(byte_stream)
+      if cycle == 0:
+        break
+      for data_id, data_value in self.decode_records(byte_stream, context):
+        self.add_record(cycle - 1, data_id, data_value)
+
+opcodes_registry[OPCODE_DATA_CYCLES] = DataCyclesPacket
+
+class ProbePacket(TelemetryPacket):
+  """Transmitter answer to a latency probe, with the probe's token and the
+  transmitter times (in microseconds, wrapping at 32 bits) at which the probe
+  was received and answered. The receiver sets host_receive_us to the host
+  time (in microseconds) at which the answer was decoded.
+  """
+  def __repr__(self):
+    return "[%i]Probe: token=%i, rx=%i, tx=%i" % (self.sequence, self.token,
+        self.receive_time_us, self.transmit_time_us)
+
+  def decode_payload(self, byte_stream, context):
+    self.token = deserialize_uint32(byte_stream) << 32 | deserialize_uint32(byte_stream)
+    self.receive_time_us = deserialize_uint32(byte_stream)
+    self.transmit_time_us = deserialize_uint32(byte_stream)
+    self.host_receive_us = None
+
+opcodes_registry[OPCODE_PROBE] = ProbePacket
+
+class ChunkPacket(TelemetryPacket):
+  """Chunk of a chunked packet: the bytes at offset in a packet of total
+  length (its opcode followed by its payload), with the transfer number of
+  that packet. See ChunkAssembler.
+  """
+  def __repr__(self):
+    return "[%i]Chunk: transfer=%i, %i bytes at %i of %i" % (self.sequence,
+        self.transfer, len(self.data), self.offset, self.total)
+
+  def decode_payload(self, byte_stream, context):
+    self.transfer = deserialize_uint8(byte_stream)
+    self.total = deserialize_varint(byte_stream)
+    self.offset = deserialize_varint(byte_stream)
+    self.data = bytearray(byte_stream)
+    byte_stream.clear()
+
+opcodes_registry[OPCODE_CHUNK] = ChunkPacket
+
+class ChunkAssembler(object):
+  """Reassembles chunked packets from their chunks (ChunkPackets, which are
+  sent in order), in each namespace. A chunked packet with a missing chunk is
+  discarded.
+  """
+  def __init__(self):
+    self.transfers = {}  # namespace to (transfer, total, bytes so far)
+    self.discarded = 0  # chunked packets discarded for a missing chunk
+
+  def add(self, chunk):
+    """Adds a chunk, returning the chunked packet it completed as a frame
+    payload (in the chunk's namespace, with its sequence number), or None.
+    """
+    transfer = self.transfers.pop(chunk.namespace, None)
+    if chunk.offset == 0:
+      if transfer is not None:
+        self.discarded += 1  # its last chunks were lost
+      transfer = (chunk.transfer, chunk.total, bytearray())
+    elif (transfer is None or transfer[0] != chunk.transfer
+          or transfer[1] != chunk.total or len(transfer[2]) != chunk.offset):
+      if transfer is not None:
+        self.discarded += 1
+      return None
+    if chunk.offset + len(chunk.data) > chunk.total:
+      raise PacketSizeError("Chunk past the end of its chunked packet")
+    transfer[2].extend(chunk.data)
+    if len(transfer[2]) < chunk.total:
+      self.transfers[chunk.namespace] = transfer
+      return None
+
+    data = transfer[2]
+    if not data:
+      raise PacketSizeError("Empty chunked packet")
+    opcode = data[0] & ~OPCODE_FLAG_NAMESPACE
+    if opcode & ~OPCODE_FLAG_COMPRESSED == OPCODE_CHUNK:
+      raise NoOpcodeError("Chunked chunk packet")
+    if chunk.namespace:
+      packet = bytearray([opcode | OPCODE_FLAG_NAMESPACE, chunk.namespace])
+    else:
+      packet = bytearray([opcode])
+    packet.append(chunk.sequence)
+    packet += data[1:]
+    return packet
+
+  def forget(self, namespace):
+    """Drops the chunked packet being reassembled in a namespace, which was
+    completed elsewhere (by the native decoder).
+    """
+    self.transfers.pop(namespace, None)
+
 
 
 class TelemetryContext(object):
@@ -388,6 +948,19 @@ class TelemetryContext(object):
 
 import serial
 
+def host_time_us():
+  """Returns the host time, as used for latency probes, in integer microseconds.
+  """
+  return int(time.time() * 1e6)
+
+def load_schema(filename):
+  """Loads a schema file, as generated by schema_report.py, returning a dict of
+  internal name to dict of metadata records.
+  """
+  with open(filename) as schema_file:
+    schema = json.load(schema_file)
+  return dict((channel['internal_name'], channel) for channel in schema['channels'])
+
 class TelemetrySerialHal(object):
   def rx_available(self):
     pass
@@ -395,6 +968,12 @@ class TelemetrySerialHal(object):
   def next_rx_byte(self):
     pass
 
+  def rx_read(self):
+    """Returns all available received bytes. Optional, used instead of
+    next_rx_byte with the native decoder.
+    """
+    pass
+
   def tx(self):
     pass
 
@@ -408,9 +987,32 @@ class TelemetrySerialSerial(object):
   def next_rx_byte(self):
     return ord(self.serial.read())
 
+  def rx_read(self):
+    return self.serial.read(self.serial.inWaiting())
+
   def tx(self, data):
     self.serial.write(data)
 
+class TelemetryFileSerial(object):
+  """Reads a recording of the raw byte stream from a file."""
+  def __init__(self, filename):
+    with open(filename, 'rb') as recording:
+      self.buffer = deque(bytearray(recording.read()))
+
+  def rx_available(self):
+    return len(self.buffer)
+
+  def next_rx_byte(self):
+    return self.buffer.popleft()
+
+  def rx_read(self):
+    data = bytearray(self.buffer)
+    self.buffer.clear()
+    return data
+
+  def tx(self, data):
+    pass
+
 import socket
 
 class TelemetrySocketSerial(object):
@@ -431,37 +1033,80 @@ class TelemetrySocketSerial(object):
   def next_rx_byte(self):
     return self.buffer.popleft()
 
+  def rx_read(self):
+    self.rx_available()
+    data = bytearray(self.buffer)
+    self.buffer.clear()
+    return data
+
   def tx(self, data):
     self.sock.send(data)
 
 
+def encode_cobs_frame(packet):
+  """Returns the wire bytes of a COBS frame containing packet.
+  """
+  data = serialize_uint16(len(packet)) + bytearray(packet)
+  out = bytearray(SOF_BYTE_COBS)
+  code_pos = len(out)
+  out.append(0)  # placeholder for the block code
+  for data_byte in data:
+    if data_byte != 0:
+      out.append(data_byte)
+    if data_byte == 0 or len(out) - code_pos > COBS_MAX_BLOCK:
+      out[code_pos] = len(out) - code_pos
+      code_pos = len(out)
+      out.append(0)
+  out[code_pos] = len(out) - code_pos
+  out.append(COBS_DELIMITER)
+  return out
+
 class TelemetrySerial(object):
   """Telemetry serial receiver state machine. Separates out telemetry packets
   from the rest of the stream.
   """
-  DecoderState = enum('SOF', 'LENGTH', 'DATA', 'DATA_DESTUFF', 'DATA_DESTUFF_END')
+  DecoderState = enum('SOF', 'LENGTH', 'DATA', 'DATA_DESTUFF', 'DATA_DESTUFF_END', 'COBS_DATA')
   PACKET_TIMEOUT_THRESHOLD = 0.1  # seconds
 
-  def __init__(self, serial):
+  def __init__(self, serial, schema={}, native=True):
+    """native: whether to use the native decoder, if it's built.
+    """
     self.serial = serial
+    self.schema = schema  # internal name to metadata, see load_schema
+
+    # frames and decodes numeric data natively, other packets are decoded from
+    # its frames here
+    self.native = None
+    if native and native_decoder:
+      self.native = native_decoder.Decoder(int(self.PACKET_TIMEOUT_THRESHOLD * 1e6))
 
     self.rx_packets = deque()  # queued decoded packets
 
-    self.context = TelemetryContext([])
+    self.contexts = {}  # namespace to TelemetryContext
+    self.chunks = ChunkAssembler()
 
     # decoder state machine variables
     self.decoder_state = self.DecoderState.SOF;  # expected next byte
     self.decoder_pos = 0; # position within decoder_State
     self.packet_length = 0;  # expected packet length
     self.packet_buffer = deque()
+    self.cobs_remaining = 0  # bytes left in the current COBS block
+    self.cobs_zero_pending = False  # whether the current COBS block ends in a zero
 
     self.data_buffer = deque()
 
+    # framing of transmitted packets, following the last received packet
+    self.framing = FRAMING_STUFFED
+
     # decoder packet timeout variables
     self.last_loop_received = False
     self.last_receive_time = time.time()
 
   def process_rx(self):
+    if self.native:
+      self.process_rx_native()
+      return
+
     if ((not self.last_loop_received)
         and (time.time() - self.last_receive_time > self.PACKET_TIMEOUT_THRESHOLD)
         and (self.decoder_state != self.DecoderState.SOF and self.decoder_pos > 0)):
@@ -486,6 +1131,19 @@ class TelemetrySerial(object):
             self.packet_length = 0
             self.decoder_pos = 0
             self.decoder_state = self.DecoderState.LENGTH
+        elif (self.decoder_pos == len(SOF_BYTE_COBS) - 1
+              and rx_byte == SOF_BYTE_COBS[self.decoder_pos]):
+          self.packet_buffer = deque()
+          self.cobs_remaining = 0
+          self.cobs_zero_pending = False
+          self.decoder_pos = 0
+          self.decoder_state = self.DecoderState.COBS_DATA
+        elif rx_byte == SOF_BYTE[0]:
+          # pass through the partial SOF, this byte may start another
+          self.packet_buffer.pop()
+          self.data_buffer.extend(self.packet_buffer)
+          self.packet_buffer = deque([rx_byte])
+          self.decoder_pos = 1
         else:
           self.data_buffer.extend(self.packet_buffer)
           self.packet_buffer = deque()
@@ -501,17 +1159,8 @@ class TelemetrySerial(object):
         self.packet_buffer.append(rx_byte)
         self.decoder_pos += 1
         if self.decoder_pos == self.packet_length:
-          try:
-            decoded = TelemetryPacket.decode(self.packet_buffer, self.context)
-
-            if isinstance(decoded, HeaderPacket):
-              self.context = TelemetryContext(decoded.get_data_defs())
-
-            self.rx_packets.append(decoded)
-          except TelemetryDeserializationError as e:
-            print("Deserialization error: %s" % repr(e)) # TODO prettier cleaner
-          except IndexError as e:
-            print("Index error: %s" % repr(e))
+          self.framing = FRAMING_STUFFED
+          self.decode_packet()
           self.packet_buffer = deque()
 
           self.decoder_pos = 0
@@ -525,18 +1174,127 @@ class TelemetrySerial(object):
         self.decoder_state = self.DecoderState.DATA
       elif self.decoder_state == self.DecoderState.DATA_DESTUFF_END:
         self.decoder_state = self.DecoderState.SOF
+      elif self.decoder_state == self.DecoderState.COBS_DATA:
+        if rx_byte == COBS_DELIMITER:
+          self.decoder_state = self.DecoderState.SOF
+          self.finish_cobs_packet()
+        elif self.cobs_remaining == 0:
+          # block code, the previous block's implied zero is only known to not
+          # be the frame end once another block starts
+          if self.cobs_zero_pending:
+            self.packet_buffer.append(0)
+          self.cobs_remaining = rx_byte - 1
+          self.cobs_zero_pending = rx_byte <= COBS_MAX_BLOCK
+        else:
+          self.packet_buffer.append(rx_byte)
+          self.cobs_remaining -= 1
       else:
         raise RuntimeError("Unknown DecoderState")
 
+  def read_rx(self):
+    """Returns all available received bytes."""
+    if hasattr(self.serial, 'rx_read'):
+      return self.serial.rx_read()
+    data = bytearray()
+    while self.serial.rx_available():
+      data.append(self.serial.next_rx_byte())
+    return data
+
+  def process_rx_native(self):
+    timeouts = self.native.timeouts
+    frames = self.native.feed(self.read_rx(), host_time_us())
+    if self.native.timeouts != timeouts:
+      print("Packet timed out; dropping")
+    for framing, payload, batch in frames:
+      self.framing = FRAMING_COBS if framing == 1 else FRAMING_STUFFED
+      if batch is None:
+        self.packet_buffer = deque(bytearray(payload))
+      elif (bytearray(payload)[0] & ~(OPCODE_FLAG_COMPRESSED | OPCODE_FLAG_NAMESPACE)
+            == OPCODE_CHUNK):
+        # the last chunk of a chunked data packet, reassembled natively
+        self.chunks.forget(batch.namespace)
+      self.decode_packet(batch)
+    self.packet_buffer = deque()
+    self.data_buffer.extend(bytearray(self.native.take_passthrough()))
+
+  def finish_cobs_packet(self):
+    # the decoded frame is the length followed by the packet
+    if self.cobs_remaining != 0 or len(self.packet_buffer) < PACKET_LENGTH_BYTES:
+      print("COBS frame truncated; dropping")
+    else:
+      packet_length = self.packet_buffer.popleft() << 8 | self.packet_buffer.popleft()
+      if packet_length != len(self.packet_buffer):
+        print("COBS frame length mismatch; dropping")
+      else:
+        self.framing = FRAMING_COBS
+        self.decode_packet()
+    self.packet_buffer = deque()
+
+  def decode_packet(self, batch=None):
+    """Decodes the packet in packet_buffer, or a natively decoded batch."""
+    try:
+      if batch is not None:
+        decoded = DataPacket.from_batch(batch, self.contexts)
+      else:
+        decoded = TelemetryPacket.decode(self.packet_buffer, self.contexts)
+
+      if isinstance(decoded, ChunkPacket):
+        chunked = self.chunks.add(decoded)
+        if chunked is None:
+          return
+        decoded = TelemetryPacket.decode(deque(chunked), self.contexts)
+
+      if isinstance(decoded, HeaderPacket):
+        for data_def in decoded.get_new_data_defs().values():
+          data_def.namespace = decoded.namespace
+          data_def.apply_schema(self.schema)
+        self.contexts[decoded.namespace] = TelemetryContext(decoded.get_data_defs())
+      elif isinstance(decoded, ProbePacket):
+        decoded.host_receive_us = host_time_us()
+
+      if isinstance(decoded, DataPacket):
+        # batches are delivered a cycle at a time
+        self.rx_packets.extend(decoded.split_cycles())
+      else:
+        self.rx_packets.append(decoded)
+    except TelemetryDeserializationError as e:
+      print("Deserialization error: %s" % repr(e)) # TODO prettier cleaner
+    except IndexError as e:
+      print("Index error: %s" % repr(e))
+
   def transmit_set_packet(self, data_def, value):
     packet = bytearray()
-    packet += serialize_uint8(OPCODE_DATA)
-    packet += serialize_uint8(data_def.data_id)
+    if data_def.namespace:
+      packet += serialize_uint8(OPCODE_DATA | OPCODE_FLAG_NAMESPACE)
+      packet += serialize_uint8(data_def.namespace)
+    else:
+      packet += serialize_uint8(OPCODE_DATA)
+    packet += serialize_varint(data_def.data_id)
     packet += data_def.serialize_data(value)
     packet += serialize_uint8(DATAID_TERMINATOR)
     self.transmit_packet(packet)
 
+  def transmit_probe(self, namespace=0):
+    """Sends a latency probe to the transmitter in a namespace, with the
+    current host time in microseconds as its token, which is returned.
+    """
+    token = host_time_us()
+    packet = bytearray()
+    if namespace:
+      packet += serialize_uint8(OPCODE_PROBE | OPCODE_FLAG_NAMESPACE)
+      packet += serialize_uint8(namespace)
+    else:
+      packet += serialize_uint8(OPCODE_PROBE)
+    packet += serialize_uint32(token >> 32)
+    packet += serialize_uint32(token & 0xffffffff)
+    self.transmit_packet(packet)
+    return token
+
   def transmit_packet(self, packet):
+    if self.framing == FRAMING_COBS:
+      self.serial.tx(encode_cobs_frame(packet))
+      return
+
     header = bytearray()
     for elt in SOF_BYTE:
       header += serialize_uint8(elt)
@@ -0,0 +1,88 @@
+"""Host side of flow-controlled streams to the transmitter (StreamData).
+
+The transmitter queues received samples in a FIFO, which its code drains at
+its own rate, and reports the stream position of the next sample it expects
+and the free slots in the FIFO. Samples in flight are all at or after that
+position, so sending up to the position plus the free slots never overflows
+the FIFO, even from a stale report, and sending as far as that keeps the FIFO
+as full as the reports allow.
+
+Reports are sent by the transmitter as it reads (every quarter of the FIFO by
+default), on each received record and when it underruns, and requested by an
+empty record if none has arrived for a while, so a lost report only stalls the
+stream briefly. The report answering a request reflects every record sent
+before it, so samples still in flight then were lost, and sending resumes from
+the reported position.
+"""
+from collections import deque
+
+from .parser import host_time_us
+
+MAX_RECORD_SAMPLES = 255
+
+def position_diff(a, b):
+  """Returns a - b for 32-bit wrapping stream positions."""
+  return ((a - b + (1 << 31)) & 0xffffffff) - (1 << 31)
+
+class StreamTransmitter(object):
+  """Keeps a transmitter's stream FIFO full from a queue of samples.
+  Samples are queued with write(), and update() must be called regularly,
+  after received packets have been decoded (which updates the stream's
+  latest report).
+  """
+  def __init__(self, telemetry, data_def, request_interval_us=100000):
+    self.telemetry = telemetry  # TelemetrySerial
+    self.data_def = data_def  # StreamData
+    self.request_interval_us = request_interval_us
+    self.samples = deque()
+    self.position = None  # of the next sample to send, once reported
+    self.report = None  # latest report handled
+    self.last_report_us = None
+    self.last_request_us = None
+    self.requested = False  # a request was sent since the last report
+    self.sent = 0
+    self.resyncs = 0
+
+  def write(self, samples):
+    """Queues samples for sending."""
+    self.samples.extend(samples)
+
+  def queued(self):
+    """Returns the number of samples not yet sent."""
+    return len(self.samples)
+
+  def update(self):
+    """Sends as many queued samples as the latest report gives credit for,
+    and requests a report if none has arrived recently.
+    """
+    now_us = host_time_us()
+    report = self.data_def.get_latest_value()
+    if report is not None and report is not self.report:
+      self.report = report
+      self.last_report_us = now_us
+      in_flight = (position_diff(self.position, report['position'])
+                   if self.position is not None else -1)
+      if in_flight < 0 or in_flight > self.data_def.count or (self.requested and in_flight > 0):
+        # first report, the transmitter was reset or is ahead of us, or
+        # samples sent before the request were lost
+        if self.position is not None:
+          self.resyncs += 1
+        self.position = report['position']
+      self.requested = False
+
+    if self.position is not None and self.samples:
+      credit = position_diff((self.report['position'] + self.report['free']) & 0xffffffff,
+                             self.position)
+      while credit > 0 and self.samples:
+        count = min(credit, len(self.samples), MAX_RECORD_SAMPLES)
+        record = [self.samples.popleft() for _ in range(count)]
+        self.telemetry.transmit_set_packet(self.data_def, (self.position, record))
+        self.position = (self.position + count) & 0xffffffff
+        self.sent += count
+        credit -= count
+
+    last_us = max(self.last_report_us or 0, self.last_request_us or 0)
+    if now_us - last_us >= self.request_interval_us:
+      self.last_request_us = now_us
+      self.requested = True
+      self.telemetry.transmit_set_packet(self.data_def, (self.position or 0, []))
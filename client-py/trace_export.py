@@ -0,0 +1,120 @@
+"""Converts trace events received from a transmitter into a Chrome trace
+event JSON file, which can be viewed in Perfetto (ui.perfetto.dev) or
+chrome://tracing.
+
+Each Trace data object is shown as a thread, in a process per namespace.
+Events are read from a serial port for a given duration, or from a file
+holding a recording of the raw byte stream.
+"""
+from __future__ import print_function
+import json
+import time
+
+from telemetry.parser import TelemetrySerial, TelemetrySerialSerial, TelemetryFileSerial, HeaderPacket, DataPacket, TraceData, TRACE_KIND_BEGIN, TRACE_KIND_END
+from telemetry.gateway import TelemetryGatewaySerial
+
+TRACE_PHASES = {
+  TRACE_KIND_BEGIN: 'B',
+  TRACE_KIND_END: 'E',
+}
+
+class TraceConverter(object):
+  """Accumulates Chrome trace events from received packets."""
+  def __init__(self):
+    self.trace_events = []
+    self.named_threads = set()
+    # (namespace, data ID) => TraceData, from the latest headers
+    self.trace_defs = {}
+    # (namespace, data ID) => (last 32-bit time, offset to unwrap it)
+    self.clocks = {}
+
+  def add_packet(self, packet):
+    if isinstance(packet, HeaderPacket):
+      # header data defs are complete, including any appended ones
+      for key in list(self.trace_defs.keys()):
+        if key[0] == packet.namespace:
+          del self.trace_defs[key]
+      for data_def in packet.get_data_defs().values():
+        if isinstance(data_def, TraceData):
+          self.trace_defs[(packet.namespace, data_def.data_id)] = data_def
+          self.name_thread(packet.namespace, data_def)
+    elif isinstance(packet, DataPacket):
+      for data_id, value in packet.get_data_dict().items():
+        data_def = self.trace_defs.get((packet.namespace, data_id))
+        if data_def is not None:
+          self.add_events(packet.namespace, data_def, value)
+
+  def name_thread(self, namespace, data_def):
+    if (namespace, data_def.data_id) in self.named_threads:
+      return
+    self.named_threads.add((namespace, data_def.data_id))
+    self.trace_events.append({
+      'name': 'thread_name', 'ph': 'M', 'pid': namespace, 'tid': data_def.data_id,
+      'args': {'name': data_def.display_name},
+    })
+
+  def add_events(self, namespace, data_def, value):
+    key = (namespace, data_def.data_id)
+    last_us, offset_us = self.clocks.get(key, (None, 0))
+    for name, kind, time_us in value['events']:
+      if last_us is not None and time_us < last_us:
+        offset_us += 1 << 32  # the transmitter clock wrapped
+      last_us = time_us
+      event = {
+        'name': name, 'ph': TRACE_PHASES.get(kind, 'i'), 'ts': time_us + offset_us,
+        'pid': namespace, 'tid': data_def.data_id,
+      }
+      if event['ph'] == 'i':
+        event['s'] = 't'
+      self.trace_events.append(event)
+    if value['dropped'] and last_us is not None:
+      self.trace_events.append({
+        'name': '%i events dropped' % value['dropped'], 'ph': 'i', 's': 't',
+        'ts': last_us + offset_us, 'pid': namespace, 'tid': data_def.data_id,
+      })
+    self.clocks[key] = (last_us, offset_us)
+
+  def to_json(self):
+    return {'traceEvents': self.trace_events, 'displayTimeUnit': 'ns'}
+
+if __name__ == "__main__":
+  import argparse
+  parser = argparse.ArgumentParser(description='Telemetry trace event exporter.')
+  parser.add_argument('port', help='serial port to receive on, recording file with --file, or shared memory name with --gateway')
+  parser.add_argument('--baud', '-b', type=int, default=38400,
+                      help='serial baud rate')
+  parser.add_argument('--file', action='store_true',
+                      help='read a recording of the raw byte stream instead of a serial port')
+  parser.add_argument('--gateway', action='store_true',
+                      help='receive through a telemetry-gateway daemon, which can be shared with other tools')
+  parser.add_argument('--duration', '-d', type=float, default=10,
+                      help='seconds to receive for, from a serial port')
+  parser.add_argument('--output', '-o', default='trace.json',
+                      help='Chrome trace event JSON file to write')
+  args = parser.parse_args()
+
+  if args.file:
+    telemetry = TelemetrySerial(TelemetryFileSerial(args.port))
+    end_time = None
+  elif args.gateway:
+    telemetry = TelemetrySerial(TelemetryGatewaySerial(args.port))
+    end_time = time.time() + args.duration
+  else:
+    telemetry = TelemetrySerial(TelemetrySerialSerial(args.port, args.baud))
+    end_time = time.time() + args.duration
+
+  converter = TraceConverter()
+  while True:
+    telemetry.process_rx()
+    while True:
+      packet = telemetry.next_rx_packet()
+      if not packet:
+        break
+      converter.add_packet(packet)
+    if end_time is None or time.time() >= end_time:
+      break
+    time.sleep(0.1)
+
+  with open(args.output, 'w') as output_file:
+    json.dump(converter.to_json(), output_file)
+  print("Wrote %i trace events to %s" % (len(converter.trace_events), args.output))
@@ -0,0 +1,64 @@
+/*
+ * compress.cpp
+ *
+ * Implementation for the streaming LZSS decoder.
+ */
+
+#include "telemetry.h"
+
+namespace telemetry {
+
+void LzDecoder::reset() {
+  state = CONTROL;
+  control = 0;
+  item = 0;
+  head = 0;
+  total = 0;
+  literal_pending = false;
+  match_offset = 0;
+  match_remaining = 0;
+}
+
+bool LzDecoder::add_byte(uint8_t data) {
+  if (state == CONTROL) {
+    control = data;
+    item = 0;
+    state = ITEM;
+  } else if (state == ITEM) {
+    if (control & (1 << item)) {
+      match_offset = (size_t)data + 1;
+      state = MATCH_LENGTH;
+      return match_offset <= total;
+    }
+    literal = data;
+    literal_pending = true;
+    item++;
+  } else if (state == MATCH_LENGTH) {
+    match_remaining = (size_t)data + protocol::LZ_MIN_MATCH;
+    item++;
+    state = ITEM;
+  }
+  if (state == ITEM && item >= 8) {
+    state = CONTROL;
+  }
+  return true;
+}
+
+bool LzDecoder::read(uint8_t* data) {
+  if (literal_pending) {
+    literal_pending = false;
+    *data = literal;
+  } else if (match_remaining > 0) {
+    *data = history[(head + protocol::LZ_WINDOW - match_offset)
+        % protocol::LZ_WINDOW];
+    match_remaining--;
+  } else {
+    return false;
+  }
+  history[head] = *data;
+  head = (head + 1) % protocol::LZ_WINDOW;
+  total++;
+  return true;
+}
+
+}
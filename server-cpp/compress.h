@@ -0,0 +1,205 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+namespace telemetry {
+/**
+ * Streaming LZSS encoder for compressed packet payloads (see protocol.h for
+ * the format), usable as a packet that compresses into another packet.
+ * Items are emitted to the output packet in groups, so RAM use is fixed: a
+ * history window of LZ_WINDOW bytes, a lookahead of LOOKAHEAD (at most
+ * LZ_MAX_MATCH) bytes, and one item group. Matches are found by a greedy
+ * search over the whole window, so encoding costs O(LZ_WINDOW) per byte.
+ */
+template <size_t LOOKAHEAD> class LzEncoder : public TransmitPacket {
+public:
+  LzEncoder() {
+    reset(NULL);
+  }
+
+  // Starts a new stream, emitting to out, or only counting the output length
+  // if out is NULL.
+  void reset(TransmitPacket* new_out) {
+    out = new_out;
+    head = 0;
+    total = 0;
+    pending = 0;
+    group_length = 1;
+    group_items = 0;
+    group[0] = 0;
+    length = 0;
+  }
+
+  // Adds a byte to the stream.
+  void write_byte(uint8_t data) {
+    ring[head] = data;
+    head = wrap(head + 1);
+    total++;
+    pending++;
+    if (pending >= LOOKAHEAD) {
+      encode_item();
+    }
+  }
+
+  void write_uint8(uint8_t data) {
+    write_byte(data);
+  }
+  void write_uint16(uint16_t data) {
+    write_byte((data >> 8) & 0xff);
+    write_byte((data >> 0) & 0xff);
+  }
+  void write_uint32(uint32_t data) {
+    write_byte((data >> 24) & 0xff);
+    write_byte((data >> 16) & 0xff);
+    write_byte((data >> 8) & 0xff);
+    write_byte((data >> 0) & 0xff);
+  }
+  void write_float(float data) {
+    // TODO: THIS IS ENDIANNESS DEPENDENT, ABSTRACT INTO HAL?
+    uint8_t *float_array = (uint8_t*) &data;
+    write_byte(float_array[3]);
+    write_byte(float_array[2]);
+    write_byte(float_array[1]);
+    write_byte(float_array[0]);
+  }
+
+  // Encodes all remaining input and emits the last (partial) item group. The
+  // output packet isn't finished.
+  void finish() {
+    while (pending > 0) {
+      encode_item();
+    }
+    if (group_items > 0) {
+      flush_group();
+    }
+  }
+
+  // Returns the number of bytes emitted so far.
+  size_t get_length() const { return length; }
+
+protected:
+  static const size_t RING_SIZE = protocol::LZ_WINDOW + LOOKAHEAD;
+
+  static size_t wrap(size_t index) {
+    return index >= RING_SIZE ? index - RING_SIZE : index;
+  }
+
+  void encode_item() {
+    size_t start = wrap(head + RING_SIZE - pending);
+    size_t history = total - pending;
+    if (history > protocol::LZ_WINDOW) {
+      history = protocol::LZ_WINDOW;
+    }
+
+    size_t best_length = 0, best_offset = 0;
+    for (size_t offset = 1; offset <= history; offset++) {
+      size_t match_start = wrap(start + RING_SIZE - offset);
+      size_t match_length = 0;
+      // Matches may overlap the lookahead, the decoder copies byte by byte.
+      while (match_length < pending
+          && ring[wrap(match_start + match_length)]
+              == ring[wrap(start + match_length)]) {
+        match_length++;
+      }
+      if (match_length > best_length) {
+        best_length = match_length;
+        best_offset = offset;
+        if (best_length >= pending) {
+          break;
+        }
+      }
+    }
+
+    if (best_length >= protocol::LZ_MIN_MATCH) {
+      group[0] |= 1 << group_items;
+      group[group_length++] = best_offset - 1;
+      group[group_length++] = best_length - protocol::LZ_MIN_MATCH;
+      pending -= best_length;
+    } else {
+      group[group_length++] = ring[start];
+      pending--;
+    }
+    group_items++;
+    if (group_items >= 8) {
+      flush_group();
+    }
+  }
+
+  void flush_group() {
+    if (out != NULL) {
+      for (size_t i=0; i<group_length; i++) {
+        out->write_uint8(group[i]);
+      }
+    }
+    length += group_length;
+    group_length = 1;
+    group_items = 0;
+    group[0] = 0;
+  }
+
+  TransmitPacket* out;
+
+  // History and lookahead ring buffer, and the position of the next byte.
+  uint8_t ring[RING_SIZE];
+  size_t head;
+  // Number of bytes written, and the number not yet encoded.
+  size_t total;
+  size_t pending;
+
+  // Control byte and items of the group being built.
+  uint8_t group[1 + 8 * 2];
+  size_t group_length;
+  size_t group_items;
+
+  size_t length;
+};
+
+/**
+ * Streaming LZSS decoder. Compressed bytes are added one at a time, and the
+ * decompressed bytes they produce are then read out. Uses a history window
+ * of LZ_WINDOW bytes.
+ */
+class LzDecoder {
+public:
+  LzDecoder() {
+    reset();
+  }
+
+  // Starts a new stream.
+  void reset();
+
+  // Adds a compressed byte. All output must have been read before this is
+  // called. Returns false if the byte is invalid (a match before the start of
+  // the stream).
+  bool add_byte(uint8_t data);
+
+  // Reads the next decompressed byte into data, returning false if there is
+  // none available.
+  bool read(uint8_t* data);
+
+protected:
+  enum State {
+    CONTROL,       // expecting a control byte
+    ITEM,          // expecting a literal or match offset
+    MATCH_LENGTH   // expecting a match length
+  } state;
+
+  uint8_t control;
+  uint8_t item;
+
+  uint8_t history[protocol::LZ_WINDOW];
+  size_t head;
+  size_t total;
+
+  // Output waiting to be read: a literal, or the remainder of a match.
+  bool literal_pending;
+  uint8_t literal;
+  size_t match_offset;
+  size_t match_remaining;
+};
+
+}
+
+#endif
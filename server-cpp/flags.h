@@ -0,0 +1,144 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _FLAGS_H_
+#define _FLAGS_H_
+
+#if TELEMETRY_THREADSAFE
+#include <atomic>
+#endif
+
+namespace telemetry {
+namespace internal {
+
+#if TELEMETRY_THREADSAFE
+// Word of flags which can be set from multiple threads without locking.
+class FlagWord {
+public:
+  FlagWord() : bits(0) {}
+
+  void set(uint32_t mask) {
+    // Release orders the producer's preceding value write before the flag.
+    bits.fetch_or(mask, std::memory_order_release);
+  }
+  uint32_t take() {
+    if (bits.load(std::memory_order_relaxed) == 0) {
+      return 0;  // avoid the read-modify-write when nothing is set
+    }
+    return bits.exchange(0, std::memory_order_acquire);
+  }
+  // Takes only the flags in mask, leaving the others set.
+  uint32_t take(uint32_t mask) {
+    if ((bits.load(std::memory_order_relaxed) & mask) == 0) {
+      return 0;
+    }
+    return bits.fetch_and(~mask, std::memory_order_acquire) & mask;
+  }
+
+protected:
+  std::atomic<uint32_t> bits;
+};
+
+// Storage for a data value shared between producer threads and do_io.
+// Individual values are read and written atomically, without ordering
+// (which is provided by the update flags).
+template <typename T> class Value {
+public:
+  Value() {}
+  Value(T init) : value(init) {}
+
+  T operator = (T b) {
+    value.store(b, std::memory_order_relaxed);
+    return b;
+  }
+  operator T() const {
+    return value.load(std::memory_order_relaxed);
+  }
+
+protected:
+  std::atomic<T> value;
+};
+#else
+// Word of flags, for single-threaded use.
+class FlagWord {
+public:
+  FlagWord() : bits(0) {}
+
+  void set(uint32_t mask) {
+    bits |= mask;
+  }
+  uint32_t take() {
+    uint32_t out = bits;
+    bits = 0;
+    return out;
+  }
+  // Takes only the flags in mask, leaving the others set.
+  uint32_t take(uint32_t mask) {
+    uint32_t out = bits & mask;
+    bits &= ~mask;
+    return out;
+  }
+
+protected:
+  uint32_t bits;
+};
+
+// Storage for a data value, for single-threaded use.
+template <typename T> class Value {
+public:
+  Value() {}
+  Value(T init) : value(init) {}
+
+  T operator = (T b) {
+    value = b;
+    return b;
+  }
+  operator T() const {
+    return value;
+  }
+
+protected:
+  T value;
+};
+#endif
+
+/**
+ * Statically allocated set of N flags (like data updated flags), packed into
+ * bits. Flags can be set by multiple producers and taken by one consumer.
+ * Each producer slot has its own set of flags (so producers on different
+ * cores don't contend on the same memory), which are merged when taken.
+ */
+template <size_t N, size_t Slots> class UpdateFlags {
+public:
+  // Sets a flag from a producer slot.
+  void set(size_t index, size_t slot=0) {
+    slots[slot][index / 32].set((uint32_t)1 << (index % 32));
+  }
+
+  // Takes (reading and clearing) the first count flags from all slots, merged,
+  // writing them to out. If mask (a bitmask of 32-bit words) is given, only
+  // flags set in it are taken, and the others are left set.
+  void take(bool* out, size_t count, const uint32_t* mask=NULL) {
+    for (size_t word=0; word*32 < count; word++) {
+      uint32_t bits = 0;
+      for (size_t slot=0; slot<Slots; slot++) {
+        if (mask == NULL) {
+          bits |= slots[slot][word].take();
+        } else {
+          bits |= slots[slot][word].take(mask[word]);
+        }
+      }
+      for (size_t bit=0; bit<32 && word*32 + bit < count; bit++) {
+        out[word*32 + bit] = (bits >> bit) & 1;
+      }
+    }
+  }
+
+protected:
+  FlagWord slots[Slots][(N + 31) / 32];
+};
+
+}
+}
+
+#endif
@@ -16,12 +16,21 @@ namespace internal {
   template<> void pkt_write<uint32_t>(TransmitPacket& interface, uint32_t data) {
     interface.write_uint32(data);
   }
+  template<> void pkt_write<int8_t>(TransmitPacket& interface, int8_t data) {
+    interface.write_uint8(data);
+  }
+  template<> void pkt_write<int16_t>(TransmitPacket& interface, int16_t data) {
+    interface.write_uint16(data);
+  }
+  template<> void pkt_write<int32_t>(TransmitPacket& interface, int32_t data) {
+    interface.write_uint32(data);
+  }
   template<> void pkt_write<float>(TransmitPacket& interface, float data) {
     interface.write_float(data);
   }
 
   template<> uint8_t buf_read<uint8_t>(ReceivePacketBuffer& buffer) {
-    return buffer.read_float();
+    return buffer.read_uint8();
   }
   template<> uint16_t buf_read<uint16_t>(ReceivePacketBuffer& buffer) {
     return buffer.read_uint16();
@@ -29,16 +38,199 @@ namespace internal {
   template<> uint32_t buf_read<uint32_t>(ReceivePacketBuffer& buffer) {
     return buffer.read_uint32();
   }
+  template<> int8_t buf_read<int8_t>(ReceivePacketBuffer& buffer) {
+    return buffer.read_uint8();
+  }
+  template<> int16_t buf_read<int16_t>(ReceivePacketBuffer& buffer) {
+    return buffer.read_uint16();
+  }
+  template<> int32_t buf_read<int32_t>(ReceivePacketBuffer& buffer) {
+    return buffer.read_uint32();
+  }
   template<> float buf_read<float>(ReceivePacketBuffer& buffer) {
     return buffer.read_float();
   }
 }
 
+namespace {
+// Sends length followed by data, COBS-encoded without the delimiter, to the
+// HAL (or nowhere, if hal is NULL). Returns the encoding overhead in bytes,
+// that is, block codes which don't replace a zero.
+size_t cobs_transmit(HalInterface* hal, size_t length, const uint8_t* data,
+    size_t count) {
+  const uint8_t length_bytes[protocol::LENGTH_SIZE] = {
+      (uint8_t)((length >> 8) & 0xff), (uint8_t)((length >> 0) & 0xff)};
+  const size_t total = protocol::LENGTH_SIZE + count;
+  size_t overhead = 0;
+  size_t pos = 0;
+  while (true) {
+    size_t run = 0;
+    while (pos + run < total && run < protocol::COBS_MAX_BLOCK) {
+      size_t i = pos + run;
+      uint8_t byte = i < protocol::LENGTH_SIZE ?
+          length_bytes[i] : data[i - protocol::LENGTH_SIZE];
+      if (byte == 0) {
+        break;
+      }
+      run++;
+    }
+
+    if (hal != NULL) {
+      hal->transmit_byte(run + 1);
+      for (size_t i = pos; i < pos + run; i++) {
+        hal->transmit_byte(i < protocol::LENGTH_SIZE ?
+            length_bytes[i] : data[i - protocol::LENGTH_SIZE]);
+      }
+    }
+
+    pos += run;
+    if (run >= protocol::COBS_MAX_BLOCK) {
+      // A full block has no implied zero. Like the streaming encoder, this is
+      // followed by another (possibly empty) block even at the end.
+      overhead++;
+    } else if (pos >= total) {
+      overhead++;  // the final code
+      break;
+    } else {
+      pos++;  // skip the zero, which is replaced by the code
+    }
+  }
+  return overhead;
+}
+}
+
+BufferedTransmitPacket::BufferedTransmitPacket(HalInterface& hal,
+    uint8_t* buffer, size_t capacity, protocol::Framing framing) :
+        hal(hal),
+        buffer(buffer),
+        capacity(capacity),
+        framing(framing),
+        count(0),
+        overflowed(false),
+        valid(true) {
+}
+
+void BufferedTransmitPacket::write_byte(uint8_t data) {
+  if (count >= capacity) {
+    overflowed = true;
+    return;
+  }
+  buffer[count] = data;
+  count++;
+}
+
+void BufferedTransmitPacket::write_uint8(uint8_t data) {
+  write_byte(data);
+}
+
+void BufferedTransmitPacket::write_uint16(uint16_t data) {
+  write_byte((data >> 8) & 0xff);
+  write_byte((data >> 0) & 0xff);
+}
+
+void BufferedTransmitPacket::write_uint32(uint32_t data) {
+  write_byte((data >> 24) & 0xff);
+  write_byte((data >> 16) & 0xff);
+  write_byte((data >> 8) & 0xff);
+  write_byte((data >> 0) & 0xff);
+}
+
+void BufferedTransmitPacket::write_float(float data) {
+  // TODO: THIS IS ENDIANNESS DEPENDENT, ABSTRACT INTO HAL?
+  uint8_t *float_array = (uint8_t*) &data;
+  write_byte(float_array[3]);
+  write_byte(float_array[2]);
+  write_byte(float_array[1]);
+  write_byte(float_array[0]);
+}
+
+void BufferedTransmitPacket::rewind(size_t length) {
+  if (length < count) {
+    count = length;
+  }
+  overflowed = false;
+}
+
+void BufferedTransmitPacket::resume(size_t length) {
+  count = length <= capacity ? length : capacity;
+  overflowed = false;
+}
+
+size_t BufferedTransmitPacket::get_stuff_count() const {
+  if (framing == protocol::FRAMING_COBS) {
+    return cobs_transmit(NULL, count, buffer, count);
+  }
+
+  size_t stuff_count = 0;
+  for (size_t i=0; i<count; i++) {
+    if (buffer[i] == protocol::SOF_SEQ[0]) {
+      stuff_count++;
+    }
+  }
+  return stuff_count;
+}
+
+void BufferedTransmitPacket::finish() {
+  if (!valid) {
+    hal.do_error("Finish invalid packet");
+    return;
+  } else if (overflowed) {
+    hal.do_error("TX packet over length");
+    valid = false;
+    return;
+  }
+
+  if (framing == protocol::FRAMING_COBS) {
+    for (int i=0; i<protocol::SOF_LENGTH; i++) {
+      hal.transmit_byte(protocol::SOF_SEQ_COBS[i]);
+    }
+    cobs_transmit(&hal, count, buffer, count);
+    hal.transmit_byte(protocol::COBS_DELIMITER);
+    return;
+  }
+
+  for (int i=0; i<protocol::SOF_LENGTH; i++) {
+    hal.transmit_byte(protocol::SOF_SEQ[i]);
+  }
+
+  hal.transmit_byte((count >> 8) & 0xff);
+  hal.transmit_byte((count >> 0) & 0xff);
+
+  for (size_t i=0; i<count; i++) {
+    hal.transmit_byte(buffer[i]);
+    if (buffer[i] == protocol::SOF_SEQ[0]) {
+      hal.transmit_byte(protocol::SOF_SEQ0_STUFF);
+    }
+  }
+
+  // TODO: add CRC check here
+}
+
 FixedLengthTransmitPacket::FixedLengthTransmitPacket(HalInterface& hal,
-    size_t length) :
+    size_t length, protocol::Framing framing, uint8_t* block_buffer,
+    size_t block_capacity) :
         hal(hal),
+        framing(framing),
+        block_buffer(block_buffer),
+        block_count(0),
         length(length),
-        count(0) {
+        count(0),
+        stuff_count(0) {
+  if (framing == protocol::FRAMING_COBS) {
+    if (block_buffer == NULL || block_capacity < protocol::COBS_MAX_BLOCK) {
+      hal.do_error("COBS block buffer too small");
+      valid = false;
+      return;
+    }
+    for (int i=0; i<protocol::SOF_LENGTH; i++) {
+      hal.transmit_byte(protocol::SOF_SEQ_COBS[i]);
+    }
+    write_cobs((length >> 8) & 0xff);
+    write_cobs((length >> 0) & 0xff);
+    valid = true;
+    return;
+  }
+
   for (int i=0; i<protocol::SOF_LENGTH; i++) {
     hal.transmit_byte(protocol::SOF_SEQ[i]);
   }
@@ -49,6 +241,27 @@ FixedLengthTransmitPacket::FixedLengthTransmitPacket(HalInterface& hal,
   valid = true;
 }
 
+void FixedLengthTransmitPacket::write_cobs(uint8_t data) {
+  if (data == 0) {
+    flush_cobs_block(block_count + 1);
+  } else {
+    block_buffer[block_count] = data;
+    block_count++;
+    if (block_count >= protocol::COBS_MAX_BLOCK) {
+      flush_cobs_block(block_count + 1);
+      stuff_count++;  // a code not replacing a zero
+    }
+  }
+}
+
+void FixedLengthTransmitPacket::flush_cobs_block(uint8_t code) {
+  hal.transmit_byte(code);
+  for (size_t i=0; i<block_count; i++) {
+    hal.transmit_byte(block_buffer[i]);
+  }
+  block_count = 0;
+}
+
 void FixedLengthTransmitPacket::write_byte(uint8_t data) {
   if (!valid) {
     hal.do_error("Writing to invalid packet");
@@ -57,12 +270,18 @@ void FixedLengthTransmitPacket::write_byte(uint8_t data) {
     hal.do_error("Writing over packet length");
     return;
   }
+  if (framing == protocol::FRAMING_COBS) {
+    write_cobs(data);
+    count++;
+    return;
+  }
   hal.transmit_byte(data);
 #if SOF_LENGTH > 2
 #error "Byte stuffing algorithm does not work for SOF_LENGTH > 2"
 #endif
   if (data == protocol::SOF_SEQ[0]) {
     hal.transmit_byte(protocol::SOF_SEQ0_STUFF);
+    stuff_count++;
   }
   count++;
 }
@@ -98,12 +317,89 @@ void FixedLengthTransmitPacket::finish() {
     return;
   } else if (count != length) {
     hal.do_error("TX packet under length");
+    valid = false;
+    if (framing == protocol::FRAMING_COBS) {
+      // End the frame anyways, so the receiver resynchronizes immediately.
+      flush_cobs_block(block_count + 1);
+      hal.transmit_byte(protocol::COBS_DELIMITER);
+    }
     return;
   }
 
+  if (framing == protocol::FRAMING_COBS) {
+    flush_cobs_block(block_count + 1);
+    stuff_count++;
+    hal.transmit_byte(protocol::COBS_DELIMITER);
+  }
+
   // TODO: add CRC check here
 }
 
+CountingTransmitPacket::CountingTransmitPacket(size_t length,
+    protocol::Framing framing) :
+        framing(framing),
+        block_count(0),
+        count(0),
+        stuff_count(0) {
+  if (framing == protocol::FRAMING_COBS) {
+    count_cobs((length >> 8) & 0xff);
+    count_cobs((length >> 0) & 0xff);
+  }
+}
+
+void CountingTransmitPacket::count_cobs(uint8_t data) {
+  if (data == 0) {
+    block_count = 0;
+  } else {
+    block_count++;
+    if (block_count >= protocol::COBS_MAX_BLOCK) {
+      block_count = 0;
+      stuff_count++;  // a code not replacing a zero
+    }
+  }
+}
+
+void CountingTransmitPacket::write_byte(uint8_t data) {
+  if (framing == protocol::FRAMING_COBS) {
+    count_cobs(data);
+  } else if (data == protocol::SOF_SEQ[0]) {
+    stuff_count++;
+  }
+  count++;
+}
+
+void CountingTransmitPacket::write_uint8(uint8_t data) {
+  write_byte(data);
+}
+
+void CountingTransmitPacket::write_uint16(uint16_t data) {
+  write_byte((data >> 8) & 0xff);
+  write_byte((data >> 0) & 0xff);
+}
+
+void CountingTransmitPacket::write_uint32(uint32_t data) {
+  write_byte((data >> 24) & 0xff);
+  write_byte((data >> 16) & 0xff);
+  write_byte((data >> 8) & 0xff);
+  write_byte((data >> 0) & 0xff);
+}
+
+void CountingTransmitPacket::write_float(float data) {
+  uint8_t *float_array = (uint8_t*) &data;
+  write_byte(float_array[3]);
+  write_byte(float_array[2]);
+  write_byte(float_array[1]);
+  write_byte(float_array[0]);
+}
+
+size_t CountingTransmitPacket::get_wire_length() const {
+  size_t length = protocol::frame_overhead(framing) + count + stuff_count;
+  if (framing == protocol::FRAMING_COBS) {
+    length++;  // the final code
+  }
+  return length;
+}
+
 ReceivePacketBuffer::ReceivePacketBuffer(HalInterface& hal) :
     hal(hal) {
   new_packet();
@@ -114,14 +410,15 @@ void ReceivePacketBuffer::new_packet() {
   read_loc = 0;
 }
 
-void ReceivePacketBuffer::add_byte(uint8_t byte) {
-  if (packet_length >= MAX_RECEIVE_PACKET_LENGTH) {
+bool ReceivePacketBuffer::add_byte(uint8_t byte) {
+  if (packet_length >= MAX_RECEIVE_ELEMENT_LENGTH) {
     hal.do_error("RX packet over length");
-    return;
+    return false;
   }
 
   data[packet_length] = byte;
   packet_length++;
+  return true;
 }
 
 uint8_t ReceivePacketBuffer::read_uint8() {
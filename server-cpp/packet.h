@@ -31,11 +31,22 @@ public:
     internal::pkt_write<T>(*this, data);
   }
 
+  // Writes an unsigned integer as a varint (see protocol.h).
+  void write_varint(uint32_t data) {
+    while (data >= 0x80) {
+      write_uint8((data & 0x7f) | 0x80);
+      data >>= 7;
+    }
+    write_uint8(data);
+  }
+
   // Finish the packet and writes data to the transmit stream (if not already
   // done). No more data may be written afterwards.
   virtual void finish() = 0;
 };
 
+// Buffer for reading a received payload element (or other small part of a
+// received packet).
 class ReceivePacketBuffer {
 public:
   ReceivePacketBuffer(HalInterface& hal);
@@ -43,8 +54,12 @@ public:
   // Starts a new packet, resetting the packet length and read pointer.
   void new_packet();
 
-  // Appends a new byte onto this packet, advancing the packet length
-  void add_byte(uint8_t byte);
+  // Returns the number of bytes in this packet.
+  size_t get_length() const { return packet_length; }
+
+  // Appends a new byte onto this packet, advancing the packet length.
+  // Returns false if the packet is full and the byte was dropped.
+  bool add_byte(uint8_t byte);
 
   // Reads a 8-bit unsigned integer from the packet stream, advancing buffer.
   uint8_t read_uint8();
@@ -65,15 +80,77 @@ protected:
 
   size_t packet_length;
   size_t read_loc;
-  uint8_t data[MAX_RECEIVE_PACKET_LENGTH];
+  uint8_t data[MAX_RECEIVE_ELEMENT_LENGTH];
+};
+
+// A telemetry packet built in a caller-provided buffer in a single pass, with
+// the length prefix computed when finished. Nothing is sent to the HAL until
+// finish(). Writes past the buffer capacity are dropped and flag the packet as
+// overflowed, which can be undone by rewinding to an earlier length.
+class BufferedTransmitPacket : public TransmitPacket {
+public:
+  BufferedTransmitPacket(HalInterface& hal, uint8_t* buffer, size_t capacity,
+      protocol::Framing framing=protocol::FRAMING_STUFFED);
+
+  void write_byte(uint8_t data);
+
+  void write_uint8(uint8_t data);
+  void write_uint16(uint16_t data);
+  void write_uint32(uint32_t data);
+  void write_float(float data);
+
+  // Sends the framed (start-of-frame sequence, length and stuffed or COBS
+  // encoded) payload to the HAL.
+  virtual void finish();
+
+  // Returns the current length, in bytes, of this packet's payload.
+  size_t get_length() const { return count; }
+  // Discards everything written after the payload was the given length,
+  // clearing the overflow flag.
+  void rewind(size_t length);
+  // Continues a packet whose first length bytes are already in the buffer,
+  // as written by an earlier packet on the same buffer.
+  void resume(size_t length);
+  // Returns the buffer holding the payload.
+  uint8_t* get_buffer() const { return buffer; }
+  // Returns whether a write was dropped because the buffer was full.
+  bool is_overflowed() const { return overflowed; }
+
+  // Returns the number of bytes finish() sends to the HAL, including the
+  // framing and stuffed bytes.
+  size_t get_wire_length() const {
+    return protocol::frame_overhead(framing) + count + get_stuff_count();
+  }
+  // Returns the number of stuffed bytes (or COBS block codes) needed for the
+  // current payload.
+  size_t get_stuff_count() const;
+  // Returns whether the packet was correctly finished.
+  bool is_valid() const { return valid; }
+
+protected:
+  HalInterface& hal;
+
+  uint8_t* buffer;
+  size_t capacity;
+  protocol::Framing framing;
+
+  // Current length, in bytes, of this packet's payload.
+  size_t count;
+
+  bool overflowed;
+  bool valid;
 };
 
 // A telemetry packet with a length known before data is written to it.
 // Data is written directly to the hardware transmit buffers without packet
 // buffering. Assumes transmit buffers won't fill up.
+// COBS framing needs a block buffer of at least COBS_MAX_BLOCK bytes, since
+// each block's code byte is only known once the block ends.
 class FixedLengthTransmitPacket : public TransmitPacket {
 public:
-  FixedLengthTransmitPacket(HalInterface& hal, size_t length);
+  FixedLengthTransmitPacket(HalInterface& hal, size_t length,
+      protocol::Framing framing=protocol::FRAMING_STUFFED,
+      uint8_t* block_buffer=NULL, size_t block_capacity=0);
 
   void write_byte(uint8_t data);
 
@@ -84,8 +161,29 @@ public:
 
   virtual void finish();
 
+  // Returns the number of bytes of the finished packet sent to the HAL,
+  // including the framing and stuffed bytes.
+  size_t get_wire_length() const {
+    return protocol::frame_overhead(framing) + count + stuff_count;
+  }
+  // Returns the number of stuffed bytes (or COBS block codes) sent to the HAL
+  // so far.
+  size_t get_stuff_count() const { return stuff_count; }
+  // Returns whether the packet was correctly finished.
+  bool is_valid() const { return valid; }
+
 protected:
+  // Adds a byte to the COBS block, sending the block if it's complete.
+  void write_cobs(uint8_t data);
+  // Sends the COBS block with its code byte.
+  void flush_cobs_block(uint8_t code);
+
   HalInterface& hal;
+  protocol::Framing framing;
+
+  // COBS block being built, before it's sent.
+  uint8_t* block_buffer;
+  size_t block_count;
 
   // Predetermined length, in bytes, of this packet's payload, for sanity check.
   size_t length;
@@ -93,10 +191,50 @@ protected:
   // Current length, in bytes, of this packet's payload.
   size_t count;
 
+  // Number of stuffed bytes transmitted.
+  size_t stuff_count;
+
   // Is the packet valid?
   bool valid;
 };
 
+// A telemetry packet which sends nothing, only counting the bytes it would
+// take on the wire, so a packet too large to buffer can be checked against
+// the HAL's tx_space before being sent with a FixedLengthTransmitPacket.
+class CountingTransmitPacket : public TransmitPacket {
+public:
+  CountingTransmitPacket(size_t length,
+      protocol::Framing framing=protocol::FRAMING_STUFFED);
+
+  void write_byte(uint8_t data);
+
+  void write_uint8(uint8_t data);
+  void write_uint16(uint16_t data);
+  void write_uint32(uint32_t data);
+  void write_float(float data);
+
+  virtual void finish() {}
+
+  // Returns the number of bytes the packet written so far takes on the wire
+  // once finished, including the framing and stuffed bytes.
+  size_t get_wire_length() const;
+
+protected:
+  // Counts a byte of a COBS block.
+  void count_cobs(uint8_t data);
+
+  protocol::Framing framing;
+
+  // Length of the current COBS block.
+  size_t block_count;
+
+  // Current length, in bytes, of this packet's payload.
+  size_t count;
+
+  // Number of stuffed bytes (or COBS block codes not replacing a zero).
+  size_t stuff_count;
+};
+
 }
 
 #endif
@@ -17,15 +17,163 @@ const uint8_t SOF_SEQ0_STUFF = 0x00;
 
 const size_t LENGTH_SIZE = 2;
 
+// Frame encodings: byte stuffing after every SOF_SEQ[0], or COBS.
+enum Framing {
+  FRAMING_STUFFED,
+  FRAMING_COBS
+};
+
+// Start of frame sequence for COBS frames. The length and payload follow
+// COBS-encoded, and the frame ends with COBS_DELIMITER.
+const uint8_t SOF_SEQ_COBS[] = {0x05, 0x3A};
+const uint8_t COBS_DELIMITER = 0x00;
+// Maximum number of data bytes in a COBS block.
+const size_t COBS_MAX_BLOCK = 254;
+
+// Returns the number of bytes a frame adds to its payload, excluding stuffed
+// bytes or COBS block codes.
+inline size_t frame_overhead(Framing framing) {
+  if (framing == FRAMING_COBS) {
+    return SOF_LENGTH + LENGTH_SIZE + 1;
+  } else {
+    return SOF_LENGTH + LENGTH_SIZE;
+  }
+}
+
+// Returns the most bytes a frame with the given payload length can take on
+// the wire.
+inline size_t max_frame_wire_length(Framing framing, size_t payload_length) {
+  if (framing == FRAMING_COBS) {
+    return frame_overhead(framing) + payload_length
+        + (LENGTH_SIZE + payload_length) / COBS_MAX_BLOCK + 1;
+  } else {
+    return frame_overhead(framing) + 2 * payload_length;
+  }
+}
+
+// Returns the longest payload whose frame fits in the given number of bytes
+// on the wire, whatever its contents.
+inline size_t max_frame_payload_length(Framing framing, size_t wire_length) {
+  if (framing == FRAMING_COBS) {
+    if (wire_length < frame_overhead(framing) + 1) {
+      return 0;
+    }
+    size_t available = wire_length - frame_overhead(framing) - 1;
+    size_t length = available - (LENGTH_SIZE + available) / (COBS_MAX_BLOCK + 1);
+    while (length > 0
+        && length + (LENGTH_SIZE + length) / COBS_MAX_BLOCK > available) {
+      length--;
+    }
+    return length;
+  } else {
+    if (wire_length < frame_overhead(framing)) {
+      return 0;
+    }
+    return (wire_length - frame_overhead(framing)) / 2;
+  }
+}
+
 // TODO: make these length independent
 
 const uint8_t OPCODE_HEADER = 0x81;
+// Header continuation: more data definitions, added to those of the last
+// OPCODE_HEADER, so large headers can span several frames.
+const uint8_t OPCODE_HEADER_APPEND = 0x82;
+// Data records, in order. A data ID can appear several times in a batch of
+// updates from several transmitter update cycles.
 const uint8_t OPCODE_DATA = 0x01;
+// Data grouped by transmitter update cycle (do_io call), for batches of
+// updates from several cycles. The payload is a sequence of groups, each a
+// varint of the group's cycle offset from the start of the batch plus 1, then
+// data records as in OPCODE_DATA up to and including their terminator. A
+// zero in place of the cycle offset ends the payload.
+const uint8_t OPCODE_DATA_CYCLES = 0x03;
+// Round-trip latency probe. To the transmitter, the payload is an opaque
+// PROBE_TOKEN_LENGTH byte token (typically the sender's transmit time). The
+// transmitter answers each with a probe packet (with a sequence number) whose
+// payload is the token, then the uint32 transmitter times in microseconds at
+// which the probe was received and the answer sent.
+const uint8_t OPCODE_PROBE = 0x02;
+const size_t PROBE_TOKEN_LENGTH = 8;
+// Chunk of a chunked packet, for packets too large to buffer, which are sent
+// as a sequence of chunk packets so other packets can be sent between them.
+// The payload is a uint8 transfer number (the same for all chunks of a
+// packet, and incremented per chunked packet), a varint of the chunked
+// packet's total length, a varint of the chunk's offset in it, then the
+// chunk's bytes. Chunks are sent in order. The chunked packet is an opcode
+// (without OPCODE_FLAG_NAMESPACE) followed by its payload, as after the
+// sequence number of a packet; its namespace is that of its chunks. A chunked
+// packet with a missing chunk is discarded.
+const uint8_t OPCODE_CHUNK = 0x04;
+
+// Opcode flag indicating a uint8 namespace follows the opcode (before the
+// sequence number, if any). Data IDs and headers are per namespace, so
+// several Telemetry objects can share a link. Packets without the flag are
+// in namespace 0.
+const uint8_t OPCODE_FLAG_NAMESPACE = 0x20;
+
+// Data IDs are varints: 7 bits per byte, least significant group first, with
+// the MSB set on all but the last byte.
+const size_t MAX_VARINT_LENGTH = 5;
+
+// Returns the number of bytes in the varint encoding of value.
+inline size_t varint_length(uint32_t value) {
+  size_t length = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    length++;
+  }
+  return length;
+}
+
+// Set in the opcode of packets whose payload (after the sequence number, or
+// after the opcode for packets to the transmitter) is LZSS compressed. The
+// compressed payload is a sequence of groups of a control byte followed by up
+// to 8 items, where control bit i (LSB first) set means item i is a match
+// (a byte of offset-1 then a byte of length-LZ_MIN_MATCH, copying from that
+// far back in the decompressed payload), otherwise item i is a literal byte.
+const uint8_t OPCODE_FLAG_COMPRESSED = 0x40;
+const size_t LZ_WINDOW = 256;
+const size_t LZ_MIN_MATCH = 3;
+const size_t LZ_MAX_MATCH = LZ_MIN_MATCH + 255;
 
 const uint8_t DATAID_TERMINATOR = 0x00;
 
 const uint8_t DATATYPE_NUMERIC = 0x01;
 const uint8_t DATATYPE_NUMERIC_ARRAY = 0x02;
+// Trigger capture: the payload is one chunk of a captured burst, a uint8
+// capture number, uint16 total samples, uint16 trigger sample index, uint16
+// index of the first sample in the chunk, uint8 sample count, then the
+// samples (each with one element per channel) in order.
+const uint8_t DATATYPE_CAPTURE = 0x03;
+// Windowed aggregate of a numeric: the payload is the uint32 count of values
+// assigned since the last transmitted payload, their min and max (of the
+// numeric type), then their mean as a float. If the count is zero, min, max
+// and mean are the latest value.
+const uint8_t DATATYPE_AGGREGATE = 0x04;
+// Deferred-format log: the payload is a uint16 count of messages dropped since
+// the last transmitted payload, the uint16 length in bytes of the messages
+// which follow, then the messages. Each is a varint index into the format
+// strings (RECORDID_LOG_FORMATS) followed by the arguments of its conversions
+// in order: d and i as int32, u, o, x, X and p as uint32 (64-bit with the ll
+// and j length modifiers), c as uint8, floating-point as float, and s as a
+// null-terminated string. Arguments end at any other conversion.
+const uint8_t DATATYPE_LOG = 0x05;
+// Trace events: the payload is a uint16 count of events dropped since the last
+// transmitted payload, a uint8 event count, the uint32 time in microseconds
+// of the first event, then the events. Each is a varint of the event's index
+// into the event names (RECORDID_TRACE_NAMES) shifted left by 2 and ORed with
+// its TRACE_KIND, then a varint time in microseconds since the previous event
+// (zero for the first).
+const uint8_t DATATYPE_TRACE = 0x06;
+// Flow-controlled stream of samples to the transmitter: the payload is the
+// uint32 stream position of the next sample expected, the uint16 count of free
+// slots in the transmitter's FIFO, then uint16 counts of underruns and of
+// samples dropped since the last transmitted payload. Samples are sent to the
+// transmitter as a uint32 stream position of the first sample, a uint8 sample
+// count, then the samples, and must not go beyond the reported position plus
+// the free slots. A record without samples requests a payload.
+const uint8_t DATATYPE_STREAM = 0x07;
 
 const uint8_t RECORDID_TERMINATOR = 0x00;
 const uint8_t RECORDID_INTERNAL_NAME = 0x01;
@@ -39,6 +187,16 @@ const uint8_t RECORDID_NUMERIC_SUBTYPE = 0x40;
 const uint8_t RECORDID_NUMERIC_LENGTH = 0x41;
 const uint8_t RECORDID_NUMERIC_LIMITS = 0x42;
 const uint8_t RECORDID_ARRAY_COUNT = 0x50;
+const uint8_t RECORDID_CAPTURE_CHANNELS = 0x60;
+const uint8_t RECORDID_CAPTURE_PRETRIGGER = 0x61;
+// uint16 count of format strings, then each as a null-terminated string.
+const uint8_t RECORDID_LOG_FORMATS = 0x70;
+// uint16 count of event names, then each as a null-terminated string.
+const uint8_t RECORDID_TRACE_NAMES = 0x71;
+
+const uint8_t TRACE_KIND_BEGIN = 0x00;
+const uint8_t TRACE_KIND_END = 0x01;
+const uint8_t TRACE_KIND_INSTANT = 0x02;
 
 const uint8_t NUMERIC_SUBTYPE_UINT = 0x01;
 const uint8_t NUMERIC_SUBTYPE_SINT = 0x02;
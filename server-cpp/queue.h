@@ -77,6 +77,59 @@ public:
     return true;
   }
 
+  // Returns the number of values in the queue.
+  size_t size() const {
+    volatile T* read = read_ptr;
+    volatile T* write = write_ptr;
+    if (write >= read) {
+      return write - read;
+    } else {
+      return (N + 1) - (read - write);
+    }
+  }
+
+  /**
+   * Assigns output to the value index places from the head of the queue,
+   * without removing it. Returns false if there aren't that many values.
+   * Must only be called by the consumer.
+   */
+  bool peek(size_t index, T* output) const {
+    if (index >= size()) {
+      return false;
+    }
+    *output = begin[(read_ptr - begin + index) % (N + 1)];
+    return true;
+  }
+
+  /**
+   * Removes count values (at most size()) from the head of the queue. Must
+   * only be called by the consumer.
+   */
+  void drop(size_t count) {
+    read_ptr = begin + (read_ptr - begin + count) % (N + 1);
+  }
+
+  /**
+   * Writes a value index places past the tail of the queue, without adding
+   * it. Returns false if the queue can't hold that many more values. Must
+   * only be called by the producer.
+   */
+  bool stage(size_t index, const T& value) {
+    if (size() + index >= N) {
+      return false;
+    }
+    begin[(write_ptr - begin + index) % (N + 1)] = value;
+    return true;
+  }
+
+  /**
+   * Adds count values, written with stage(), to the tail of the queue. Must
+   * only be called by the producer.
+   */
+  void commit(size_t count) {
+    write_ptr = begin + (write_ptr - begin + count) % (N + 1);
+  }
+
 protected:
   // Lots of volatiles to prevent compiler reordering which could corrupt data
   // when accessed by multiple threads. Yes, it's completely overkill, but
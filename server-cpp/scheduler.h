@@ -0,0 +1,127 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+namespace telemetry {
+namespace internal {
+
+/**
+ * Statically allocated transmit scheduler for N data objects with minimum
+ * transmit periods, as a hashed timing wheel of SLOTS buckets of TICK_MS each.
+ * A rate-limited data object is ineligible for transmission from when it is
+ * transmitted until its next due time, when it becomes eligible again.
+ * Objects without a period are always eligible.
+ *
+ * Advancing visits only the buckets of ticks elapsed since the last advance
+ * (at most SLOTS) and the objects in them, so the cost per advance is
+ * O(ticks elapsed + objects due), plus one visit per wheel revolution for
+ * objects with periods longer than SLOTS * TICK_MS. Due objects become
+ * eligible up to a tick late.
+ */
+template <size_t N, size_t SLOTS, uint32_t TICK_MS> class Scheduler {
+public:
+  Scheduler() : next_tick(0) {
+    for (size_t i=0; i<N; i++) {
+      period_ms[i] = 0;
+      due_ms[i] = 0;
+      next[i] = NONE;
+    }
+    for (size_t i=0; i<SLOTS; i++) {
+      heads[i] = NONE;
+    }
+    for (size_t i=0; i<WORDS; i++) {
+      eligible[i] = 0xffffffff;
+    }
+  }
+
+  // Sets the minimum transmit period of an object, zero to transmit on every
+  // update. The object is eligible immediately.
+  void set_period(size_t index, uint32_t new_period_ms, uint32_t now_ms) {
+    unlink(index);
+    period_ms[index] = new_period_ms;
+    due_ms[index] = now_ms;
+    eligible[index / 32] |= (uint32_t)1 << (index % 32);
+  }
+
+  // Makes objects due by now_ms eligible.
+  void advance(uint32_t now_ms) {
+    uint32_t now_tick = now_ms / TICK_MS;
+    // Only fully elapsed ticks are visited, so everything in them is due.
+    uint32_t ticks = now_tick - next_tick;
+    if (ticks > SLOTS) {  // including time going backwards or wrapping
+      ticks = SLOTS;
+    }
+    for (uint32_t tick = now_tick - ticks; tick != now_tick; tick++) {
+      size_t* link = &heads[tick % SLOTS];
+      while (*link != NONE) {
+        size_t index = *link;
+        if ((int32_t)(now_ms - due_ms[index]) >= 0) {
+          *link = next[index];
+          next[index] = NONE;
+          eligible[index / 32] |= (uint32_t)1 << (index % 32);
+        } else {
+          link = &next[index];
+        }
+      }
+    }
+    next_tick = now_tick;
+  }
+
+  // Records that an object was transmitted, making it ineligible until its
+  // next due time if it has a period.
+  void transmitted(size_t index, uint32_t now_ms) {
+    if (period_ms[index] == 0) {
+      return;
+    }
+    // Keep the phase of a regularly updated object, but don't catch up on
+    // missed periods.
+    due_ms[index] += period_ms[index];
+    if ((int32_t)(now_ms - due_ms[index]) >= 0) {
+      due_ms[index] = now_ms + period_ms[index];
+    }
+    eligible[index / 32] &= ~((uint32_t)1 << (index % 32));
+    size_t slot = (due_ms[index] / TICK_MS) % SLOTS;
+    next[index] = heads[slot];
+    heads[slot] = index;
+  }
+
+  // Returns the eligibility bitmask, as 32-bit words, LSB first.
+  const uint32_t* get_eligible() const { return eligible; }
+
+protected:
+  static const size_t NONE = N;
+  static const size_t WORDS = (N + 31) / 32;
+
+  // Removes an object from its bucket, if it's in one.
+  void unlink(size_t index) {
+    if (period_ms[index] == 0) {
+      return;
+    }
+    size_t* link = &heads[(due_ms[index] / TICK_MS) % SLOTS];
+    while (*link != NONE) {
+      if (*link == index) {
+        *link = next[index];
+        next[index] = NONE;
+        return;
+      }
+      link = &next[*link];
+    }
+  }
+
+  uint32_t period_ms[N];
+  uint32_t due_ms[N];
+  // Next object in the same bucket, or NONE.
+  size_t next[N];
+  // First object in each bucket, or NONE.
+  size_t heads[SLOTS];
+  uint32_t eligible[WORDS];
+  // First tick not yet visited.
+  uint32_t next_tick;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,137 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+namespace telemetry {
+/**
+ * Statically allocated histogram with logarithmically (power-of-two) sized
+ * buckets. Bucket 0 counts zero values, bucket i (for 0 < i < N-1) counts
+ * values in [2^(i-1), 2^i), and the last bucket counts everything larger.
+ * Adding a sample is O(log value) with no divisions.
+ */
+template <size_t N> class Log2Histogram {
+public:
+  Log2Histogram() {
+    reset();
+  }
+
+  // Records a sample.
+  void add(uint32_t value) {
+    size_t bucket = 0;
+    uint32_t remaining = value;
+    while (remaining != 0 && bucket < N - 1) {
+      remaining >>= 1;
+      bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    if (value > max_value) {
+      max_value = value;
+    }
+  }
+
+  // Clears all recorded samples.
+  void reset() {
+    for (size_t i=0; i<N; i++) {
+      buckets[i] = 0;
+    }
+    count = 0;
+    max_value = 0;
+  }
+
+  // Returns the number of buckets.
+  size_t get_bucket_count() const { return N; }
+  // Returns the number of samples recorded in a bucket.
+  uint32_t get_bucket(size_t bucket) const { return buckets[bucket]; }
+  // Returns the inclusive lower bound of values counted in a bucket.
+  uint32_t get_bucket_min(size_t bucket) const {
+    return bucket == 0 ? 0 : (uint32_t)1 << (bucket - 1);
+  }
+  // Returns the total number of samples recorded.
+  uint32_t get_count() const { return count; }
+  // Returns the largest sample recorded.
+  uint32_t get_max() const { return max_value; }
+
+protected:
+  uint32_t buckets[N];
+  uint32_t count;
+  uint32_t max_value;
+};
+
+// Number of buckets in each Stats histogram.
+// Default given here, but can be redefined with a compiler define.
+#ifndef TELEMETRY_HISTOGRAM_BUCKETS
+#define TELEMETRY_HISTOGRAM_BUCKETS 16
+#endif
+
+const size_t HISTOGRAM_BUCKETS = TELEMETRY_HISTOGRAM_BUCKETS;
+
+/**
+ * Self-instrumentation counters for a Telemetry object. All counters are
+ * free-running and may overflow.
+ */
+struct Stats {
+  Stats() {
+    reset();
+  }
+
+  void reset() {
+    tx_frames = 0;
+    tx_bytes = 0;
+    tx_stuff_bytes = 0;
+    tx_frames_dropped = 0;
+    tx_frames_deferred = 0;
+    tx_unbuffered_deferred = 0;
+    rx_frames = 0;
+    rx_bytes = 0;
+    rx_timeouts = 0;
+    rx_unknown_ids = 0;
+    rx_unknown_opcodes = 0;
+    rx_overflows = 0;
+    transmit_time_us.reset();
+    receive_time_us.reset();
+    tx_frame_size.reset();
+  }
+
+  // Telemetry frames transmitted.
+  uint32_t tx_frames;
+  // Bytes transmitted, including framing and stuffed bytes.
+  uint32_t tx_bytes;
+  // Stuff bytes transmitted.
+  uint32_t tx_stuff_bytes;
+  // Telemetry frames that were not (fully) transmitted.
+  uint32_t tx_frames_dropped;
+  // Telemetry frames postponed to a later do_io for lack of transmit space.
+  uint32_t tx_frames_deferred;
+  // Of those, frames of a single payload (or definition) too large for the
+  // transmit buffer. These are only sent once the HAL's transmit buffer has
+  // room for the whole frame, so if this keeps rising, the HAL's buffer may be
+  // too small for it.
+  uint32_t tx_unbuffered_deferred;
+
+  // Telemetry frames received.
+  uint32_t rx_frames;
+  // Bytes received, including non-telemetry data.
+  uint32_t rx_bytes;
+  // Partially received frames discarded due to timeout.
+  uint32_t rx_timeouts;
+  // Received data records with an unknown data ID.
+  uint32_t rx_unknown_ids;
+  // Received frames with an unknown opcode.
+  uint32_t rx_unknown_opcodes;
+  // Received bytes dropped due to a full buffer.
+  uint32_t rx_overflows;
+
+  // Duration of each transmit_data call, in microseconds.
+  Log2Histogram<HISTOGRAM_BUCKETS> transmit_time_us;
+  // Duration of each process_received_data call, in microseconds.
+  Log2Histogram<HISTOGRAM_BUCKETS> receive_time_us;
+  // Size of each transmitted frame payload, in bytes.
+  Log2Histogram<HISTOGRAM_BUCKETS> tx_frame_size;
+};
+
+}
+
+#endif
@@ -11,12 +11,25 @@
 
 #ifdef TELEMETRY_HAL_ARDUINO
 
+#include <Arduino.h>
+
 namespace telemetry {
 
 void ArduinoHalInterface::transmit_byte(uint8_t data) {
   serial.write(data);
 }
 
+size_t ArduinoHalInterface::tx_space() {
+  int space = serial.availableForWrite();
+  if (space > 0) {
+    tx_space_reported = true;
+  } else if (!tx_space_reported) {
+    // Streams which don't track their transmit buffer always report 0.
+    return (size_t)-1;
+  }
+  return space;
+}
+
 size_t ArduinoHalInterface::rx_available() {
   return serial.available();
 }
@@ -31,6 +44,14 @@ void ArduinoHalInterface::do_error(const char* msg) {
   serial.println(msg);
 }
 
+uint32_t ArduinoHalInterface::get_time_ms() {
+  return millis();
+}
+
+uint32_t ArduinoHalInterface::get_time_us() {
+  return micros();
+}
+
 }
 
 #endif
@@ -12,21 +12,38 @@
 #define TELEMETRY_HAL
 #define TELEMETRY_HAL_ARDUINO
 
+#if defined(__AVR__) && TELEMETRY_METADATA_IN_FLASH
+// AVR program memory is a separate address space, so metadata strings need
+// to be declared and read with the pgmspace helpers. TELEMETRY_METADATA can
+// only be used inside functions; at file scope, declare PROGMEM arrays.
+#include <avr/pgmspace.h>
+#define TELEMETRY_METADATA(str) PSTR(str)
+#define TELEMETRY_READ_METADATA_BYTE(ptr) pgm_read_byte(ptr)
+#endif
+
 namespace telemetry {
 
 class ArduinoHalInterface : public HalInterface {
 public:
   ArduinoHalInterface(Stream& serial) :
-    serial(serial) {}
+    serial(serial), tx_space_reported(false) {}
 
   void transmit_byte(uint8_t data);
+  // Returns availableForWrite, or unbounded space until that has reported
+  // any, since Streams which don't implement it always report 0.
+  size_t tx_space();
   size_t rx_available();
   uint8_t receive_byte();
 
   void do_error(const char* message);
 
+  uint32_t get_time_ms();
+  uint32_t get_time_us();
+
 protected:
   Stream& serial;
+  // Whether availableForWrite has reported space.
+  bool tx_space_reported;
 };
 
 }
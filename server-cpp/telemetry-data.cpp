@@ -6,32 +6,334 @@
  *
  * Implementation for Telemetry Data classes.
  */
-#include "telemetry.h"
 #include <string.h>
 
+#include "telemetry.h"
+
 namespace telemetry {
+// Writes a metadata string, including the null terminator.
 void packet_write_string(TransmitPacket& packet, const char* str) {
   // TODO: move into HAL for higher performance?
-  while (*str != '\0') {
-    packet.write_uint8(*str);
+  uint8_t c = TELEMETRY_READ_METADATA_BYTE(str);
+  while (c != '\0') {
+    packet.write_uint8(c);
     str++;
+    c = TELEMETRY_READ_METADATA_BYTE(str);
   }
   packet.write_uint8('\0');
 }
 
+// Returns the length of a metadata string, excluding the null terminator.
+size_t metadata_strlen(const char* str) {
+  size_t length = 0;
+  while (TELEMETRY_READ_METADATA_BYTE(str + length) != '\0') {
+    length++;
+  }
+  return length;
+}
+
 size_t Data::get_header_kvrs_length() {
-  return 1 + strlen(internal_name) + 1
-      + 1 + strlen(display_name) + 1
-      + 1 + strlen(units) + 1;
+#if TELEMETRY_STRIP_METADATA
+  return 1 + metadata_strlen(internal_name) + 1;
+#else
+  return 1 + metadata_strlen(internal_name) + 1
+      + 1 + metadata_strlen(display_name) + 1
+      + 1 + metadata_strlen(units) + 1;
+#endif
 }
 
 void Data::write_header_kvrs(TransmitPacket& packet) {
   packet.write_uint8(protocol::RECORDID_INTERNAL_NAME);
   packet_write_string(packet, internal_name);
+#if !TELEMETRY_STRIP_METADATA
   packet.write_uint8(protocol::RECORDID_DISPLAY_NAME);
   packet_write_string(packet, display_name);
   packet.write_uint8(protocol::RECORDID_UNITS);
   packet_write_string(packet, units);
+#endif
+}
+
+}
+
+namespace telemetry {
+StatsChannels::StatsChannels(Telemetry& telemetry_container,
+    uint32_t period_ms) :
+    telemetry_container(telemetry_container),
+    period_ms(period_ms),
+    last_update_ms(telemetry_container.get_time_ms()),
+#if TELEMETRY_STATS_HISTOGRAMS
+    transmit_time_us(telemetry_container, TELEMETRY_METADATA("tele_tx_time_hist"),
+        TELEMETRY_METADATA("Telemetry TX time histogram (log2 us)"), TELEMETRY_METADATA("count"), 0),
+    receive_time_us(telemetry_container, TELEMETRY_METADATA("tele_rx_time_hist"),
+        TELEMETRY_METADATA("Telemetry RX time histogram (log2 us)"), TELEMETRY_METADATA("count"), 0),
+    tx_frame_size(telemetry_container, TELEMETRY_METADATA("tele_tx_size_hist"),
+        TELEMETRY_METADATA("Telemetry TX frame size histogram (log2 bytes)"), TELEMETRY_METADATA("count"), 0),
+#endif
+    counters(telemetry_container, TELEMETRY_METADATA("tele_counters"),
+        TELEMETRY_METADATA("Telemetry counters"), TELEMETRY_METADATA("count"), 0) {
+  telemetry_container.set_stats_channels(this);
+}
+
+void StatsChannels::update() {
+  uint32_t current_ms = telemetry_container.get_time_ms();
+  if (current_ms - last_update_ms < period_ms) {
+    return;
+  }
+  last_update_ms = current_ms;
+
+  const Stats& stats = telemetry_container.get_stats();
+  const uint32_t values[COUNTER_COUNT] = {
+      stats.tx_frames, stats.tx_bytes, stats.tx_stuff_bytes,
+      stats.tx_frames_dropped, stats.tx_frames_deferred,
+      stats.tx_unbuffered_deferred, stats.rx_frames, stats.rx_bytes,
+      stats.rx_timeouts, stats.rx_unknown_ids, stats.rx_unknown_opcodes,
+      stats.rx_overflows};
+  for (size_t i=0; i<COUNTER_COUNT; i++) {
+    counters[i] = values[i];
+  }
+#if TELEMETRY_STATS_HISTOGRAMS
+  for (size_t i=0; i<HISTOGRAM_BUCKETS; i++) {
+    transmit_time_us[i] = stats.transmit_time_us.get_bucket(i);
+    receive_time_us[i] = stats.receive_time_us.get_bucket(i);
+    tx_frame_size[i] = stats.tx_frame_size.get_bucket(i);
+  }
+#endif
+}
+
+}
+
+namespace telemetry {
+LogBase::LogBase(Telemetry& telemetry_container,
+    const char* internal_name, const char* display_name,
+    const char* const* formats, size_t format_count,
+    uint8_t* buffer, size_t buffer_length) :
+    // No units.
+    Data(internal_name, display_name, TELEMETRY_METADATA("")),
+    telemetry_container(telemetry_container),
+    formats(formats),
+    format_count(format_count),
+    buffer(buffer),
+    buffer_length(buffer_length),
+    read_pos(0),
+    write_pos(0),
+    message_length(0),
+    dropped(0),
+    sent_length(0),
+    sent_dropped(0) {
+  data_id = telemetry_container.add_data(*this);
+}
+
+bool LogBase::log(size_t format_index, ...) {
+  va_list args;
+  va_start(args, format_index);
+  bool logged = vlog(format_index, args);
+  va_end(args);
+  return logged;
+}
+
+bool LogBase::vlog(size_t format_index, va_list args) {
+  if (format_index >= format_count) {
+    telemetry_container.do_error("Log format index out of range.");
+    return false;
+  }
+
+  // The message is written after its length prefix, which is filled in once
+  // it's complete.
+  message_length = 0;
+  bool fits = true;
+  uint32_t index = format_index;
+  while (index >= 0x80) {
+    fits = fits && put((index & 0x7f) | 0x80);
+    index >>= 7;
+  }
+  fits = fits && put(index);
+
+  const char* format = formats[format_index];
+  bool done = false;
+  while (fits && !done) {
+    uint8_t c = TELEMETRY_READ_METADATA_BYTE(format++);
+    if (c == '\0') {
+      break;
+    } else if (c != '%') {
+      continue;
+    }
+
+    // Skip flags, width and precision, then read any length modifier.
+    c = TELEMETRY_READ_METADATA_BYTE(format++);
+    while (c == '-' || c == '+' || c == ' ' || c == '#' || c == '.'
+        || (c >= '0' && c <= '9')) {
+      c = TELEMETRY_READ_METADATA_BYTE(format++);
+    }
+    size_t longs = 0;
+    bool size = false;
+    while (c == 'h' || c == 'l' || c == 'j' || c == 'z' || c == 't'
+        || c == 'L') {
+      if (c == 'l' || c == 'L') {
+        longs++;
+      } else if (c == 'j') {
+        longs = 2;
+      } else if (c == 'z' || c == 't') {
+        size = true;
+      }
+      c = TELEMETRY_READ_METADATA_BYTE(format++);
+    }
+
+    switch (c) {
+    case 'd': case 'i':
+      if (longs >= 2) {
+        fits = put_uint64(va_arg(args, long long));
+      } else if (longs == 1) {
+        fits = put_uint32(va_arg(args, long));
+      } else if (size) {
+        fits = put_uint32(va_arg(args, size_t));
+      } else {
+        fits = put_uint32(va_arg(args, int));
+      }
+      break;
+    case 'u': case 'o': case 'x': case 'X':
+      if (longs >= 2) {
+        fits = put_uint64(va_arg(args, unsigned long long));
+      } else if (longs == 1) {
+        fits = put_uint32(va_arg(args, unsigned long));
+      } else if (size) {
+        fits = put_uint32(va_arg(args, size_t));
+      } else {
+        fits = put_uint32(va_arg(args, unsigned int));
+      }
+      break;
+    case 'c':
+      fits = put(va_arg(args, int));
+      break;
+    case 'p':
+      fits = put_uint32((uintptr_t)va_arg(args, void*));
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a':
+    case 'A': {
+      float value;
+      if (longs > 0) {
+        value = va_arg(args, long double);
+      } else {
+        value = va_arg(args, double);
+      }
+      uint32_t raw;
+      memcpy(&raw, &value, sizeof(raw));
+      fits = put_uint32(raw);
+      break;
+    }
+    case 's': {
+      const char* str = va_arg(args, const char*);
+      while (fits && *str != '\0') {
+        fits = put(*str++);
+      }
+      fits = fits && put('\0');
+      break;
+    }
+    case '%':
+      break;
+    default:
+      done = true;
+      break;
+    }
+  }
+
+  if (!fits) {
+    if (dropped < 0xffff) {
+      dropped++;
+    }
+    telemetry_container.mark_data_updated(data_id);
+    return false;
+  }
+  buffer[write_pos] = message_length;
+  write_pos = (write_pos + 1 + message_length) % buffer_length;
+  telemetry_container.mark_data_updated(data_id);
+  return true;
+}
+
+bool LogBase::put(uint8_t data) {
+  size_t free = (read_pos + buffer_length - write_pos - 1) % buffer_length;
+  // Leave space for the length prefix.
+  if (message_length >= MAX_MESSAGE_LENGTH || message_length + 1 >= free) {
+    return false;
+  }
+  buffer[(write_pos + 1 + message_length) % buffer_length] = data;
+  message_length++;
+  return true;
+}
+
+bool LogBase::put_uint32(uint32_t data) {
+  return put((data >> 24) & 0xff) && put((data >> 16) & 0xff)
+      && put((data >> 8) & 0xff) && put((data >> 0) & 0xff);
+}
+
+bool LogBase::put_uint64(uint64_t data) {
+  return put_uint32(data >> 32) && put_uint32(data & 0xffffffff);
+}
+
+size_t LogBase::get_header_kvrs_length() {
+  size_t length = Data::get_header_kvrs_length() + 1 + 2;
+  for (size_t i=0; i<format_count; i++) {
+    length += metadata_strlen(formats[i]) + 1;
+  }
+  return length;
+}
+
+void LogBase::write_header_kvrs(TransmitPacket& packet) {
+  Data::write_header_kvrs(packet);
+  packet.write_uint8(protocol::RECORDID_LOG_FORMATS);
+  packet.write_uint16(format_count);
+  for (size_t i=0; i<format_count; i++) {
+    packet_write_string(packet, formats[i]);
+  }
+}
+
+size_t LogBase::find_payload(size_t* message_bytes) {
+  size_t pos = read_pos;
+  size_t length = 0;
+  *message_bytes = 0;
+  while (pos != write_pos) {
+    size_t message = buffer[pos];
+    if (*message_bytes + message > PAYLOAD_FIT) {
+      break;
+    }
+    *message_bytes += message;
+    length += 1 + message;
+    pos = (pos + 1 + message) % buffer_length;
+  }
+  return length;
+}
+
+size_t LogBase::get_payload_length() {
+  size_t message_bytes;
+  find_payload(&message_bytes);
+  return PAYLOAD_HEADER_LENGTH + message_bytes;
+}
+
+void LogBase::write_payload(TransmitPacket& packet) {
+  size_t message_bytes;
+  sent_length = find_payload(&message_bytes);
+  sent_dropped = dropped;
+  packet.write_uint16(sent_dropped);
+  packet.write_uint16(message_bytes);
+  size_t pos = read_pos;
+  size_t end = (read_pos + sent_length) % buffer_length;
+  while (pos != end) {
+    size_t message = buffer[pos];
+    pos = (pos + 1) % buffer_length;
+    for (size_t i=0; i<message; i++) {
+      packet.write_uint8(buffer[pos]);
+      pos = (pos + 1) % buffer_length;
+    }
+  }
+}
+
+void LogBase::payload_transmitted() {
+  read_pos = (read_pos + sent_length) % buffer_length;
+  dropped -= sent_dropped;
+  sent_length = 0;
+  sent_dropped = 0;
+  if (read_pos != write_pos) {
+    telemetry_container.mark_data_updated(data_id);
+  }
 }
 
 }
@@ -3,8 +3,6 @@
  * Use the automatic platform detection in telemetry.h instead.
  */
 
-#include "mbed.h"
-
 #include "telemetry-hal.h"
 
 #ifndef _TELEMETRY_DUMMY_HAL_
@@ -10,6 +10,11 @@ public:
 
   // Write a byte to the transmit buffer.
   virtual void transmit_byte(uint8_t data) = 0;
+  // Returns the number of bytes that can be written to the transmit buffer
+  // without blocking. Defaults to unbounded for HALs that can't tell.
+  virtual size_t tx_space() {
+    return (size_t)-1;
+  }
   // Returns the number of bytes available in the receive buffer.
   virtual size_t rx_available() = 0;
   // Returns the next byte in the receive stream. rx_available must return > 0.
@@ -17,11 +22,23 @@ public:
 
   // TODO: more efficient block transmit operations?
 
+  // Returns the producer slot for the calling thread or core, used to
+  // spread data updates across TELEMETRY_PRODUCER_SLOTS sets of flags. Only
+  // called when there is more than one slot. Must be less than the slot count.
+  virtual size_t get_producer_slot() {
+    return 0;
+  }
+
   // Called on a telemetry error.
   virtual void do_error(const char* message) = 0;
 
   // Return the current time in milliseconds. May overflow at any time.
   virtual uint32_t get_time_ms() = 0;
+  // Return the current time in microseconds, used for self-instrumentation.
+  // May overflow at any time. Defaults to millisecond resolution.
+  virtual uint32_t get_time_us() {
+    return get_time_ms() * 1000;
+  }
 };
 
 }
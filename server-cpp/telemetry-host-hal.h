@@ -0,0 +1,17 @@
+/**
+ * HAL header for host (PC) builds, like simulations and benchmarks. DO NOT
+ * INCLUDE THIS FILE DIRECTLY. Define TELEMETRY_HOST and use the automatic
+ * platform detection in telemetry.h instead.
+ *
+ * No hardware HAL is provided: instantiate a HalInterface subclass, like the
+ * simulated link HAL in client-cpp.
+ */
+
+#include "telemetry-hal.h"
+
+#ifndef _TELEMETRY_HOST_HAL_
+#define _TELEMETRY_HOST_HAL_
+#define TELEMETRY_HAL
+#define TELEMETRY_HAL_HOST
+
+#endif
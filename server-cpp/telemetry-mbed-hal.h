@@ -25,11 +25,23 @@ public:
     return timer.read_ms();
   }
 
+  uint32_t get_time_us() {
+    return timer.read_us();
+  }
+
   void transmit_byte(uint8_t data) {
     // TODO: optimize with DMA
     serial.putc(data);
   }
 
+  // Serial and RawSerial only have the UART's transmit register, so this is
+  // one byte while it's free: no frame fits, so nonblocking mode (see
+  // Telemetry::set_nonblocking) sends no data. Use MbedBufferedHal with a
+  // buffered serial for that.
+  size_t tx_space() {
+    return serial.writeable() ? 1 : 0;
+  }
+
   size_t rx_available() {
     return serial.readable();
   }
@@ -54,6 +66,18 @@ class MbedHal : public MbedHalBase<Serial> {
 class MbedRawSerialHal : public MbedHalBase<RawSerial> {
 };
 
+// HAL for serials with a software transmit buffer, like MODSERIAL, whose free
+// space is reported as tx_space.
+template<typename S>
+class MbedBufferedHal : public MbedHalBase<S> {
+public:
+  MbedBufferedHal(S& serial_in) : MbedHalBase<S>(serial_in) {}
+
+  size_t tx_space() {
+    return this->serial.txBufferGetSize(0) - this->serial.txBufferGetCount();
+  }
+};
+
 }
 
 #endif
@@ -16,55 +16,221 @@ size_t Telemetry::add_data(Data& new_data) {
     do_error("MAX_DATA_PER_TELEMETRY limit reached.");
     return 0;
   }
-  if (header_transmitted) {
-    do_error("Cannot add new data after header transmitted.");
-    return 0;
-  }
   data[data_count] = &new_data;
-  data_updated[data_count] = true;
+  data_updated.set(data_count);
   data_count++;
   return data_count - 1;
 }
 
-void Telemetry::mark_data_updated(size_t data_id) {
-  data_updated[data_id] = true;
-}
-
 void Telemetry::transmit_header() {
   if (header_transmitted) {
     do_error("Cannot retransmit header.");
     return;
   }
 
-  size_t packet_legnth = 2; // opcode + sequence
-  for (size_t data_idx = 0; data_idx < data_count; data_idx++) {
-    packet_legnth += 2; // data ID, data type
-    packet_legnth += data[data_idx]->get_header_kvrs_length();
-    packet_legnth += 1; // terminator record id
+  transmit_header_records(0, true);
+  header_transmitted = true;
+  header_data_count = data_count;
+}
+
+size_t Telemetry::transmit_header_records(size_t data_idx,
+    bool new_header) {
+  // A new header is always sent, appends only as tx_space allows in
+  // nonblocking mode.
+  bool blocking = new_header || !nonblocking;
+  // Definitions are split across as many packets as needed, with at least one
+  // (possibly empty) packet sent.
+  do {
+    uint8_t opcode = new_header ?
+        protocol::OPCODE_HEADER : protocol::OPCODE_HEADER_APPEND;
+    size_t packet_records = 0;
+    BufferedTransmitPacket packet(hal, tx_packet_buffer,
+        MAX_TRANSMIT_PACKET_LENGTH, framing);
+
+    size_t packet_start_idx = data_idx;
+    bool fits_buffer = true;
+    write_packet_start(packet, opcode);
+    for (; data_idx < data_count; data_idx++) {
+      size_t record_start = packet.get_length();
+      write_header_record(packet, data_idx);
+      // Leave space for the terminator.
+      fits_buffer = !packet.is_overflowed()
+          && packet.get_length() < MAX_TRANSMIT_PACKET_LENGTH;
+      if (!fits_buffer || (!blocking && !fits_tx_space(packet, 1))) {
+        packet.rewind(record_start);
+        break;
+      }
+      packet_records++;
+    }
+
+    if (data_idx < data_count && packet_records == 0) {
+      if (fits_buffer) {
+        // The next definition doesn't fit in the HAL's transmit buffer yet.
+        return data_idx;
+      }
+      // The next definition alone doesn't fit in the buffer.
+      if (!transmit_header_unbuffered(opcode, data_idx)) {
+        return data_idx;
+      }
+      data_idx++;
+    } else {
+      packet.write_uint8(protocol::DATAID_TERMINATOR);
+      if (!send_buffered_packet(packet, blocking)) {
+        return packet_start_idx;
+      }
+      packet_tx_sequence++;
+    }
+    new_header = false;
+  } while (data_idx < data_count);
+  return data_idx;
+}
+
+void Telemetry::write_packet_start(TransmitPacket& packet, uint8_t opcode) {
+  if (namespace_id != 0) {
+    packet.write_uint8(opcode | protocol::OPCODE_FLAG_NAMESPACE);
+    packet.write_uint8(namespace_id);
+  } else {
+    packet.write_uint8(opcode);
+  }
+  packet.write_uint8(packet_tx_sequence);
+}
+
+void Telemetry::write_header_record(TransmitPacket& packet, size_t data_idx) {
+  packet.write_varint(data_idx+1);
+  packet.write_uint8(data[data_idx]->get_data_type());
+  data[data_idx]->write_header_kvrs(packet);
+  packet.write_uint8(protocol::RECORDID_TERMINATOR);
+}
+
+bool Telemetry::transmit_header_unbuffered(uint8_t opcode, size_t data_idx) {
+#if TELEMETRY_CHUNKING
+  if (chunk_length != 0) {
+    return transmit_chunked(opcode, data_idx, true);
   }
+#endif
+  bool blocking = opcode == protocol::OPCODE_HEADER || !nonblocking;
+
+  size_t packet_legnth = get_packet_start_length();
+  packet_legnth += protocol::varint_length(data_idx+1);
+  packet_legnth += 1; // data type
+  packet_legnth += data[data_idx]->get_header_kvrs_length();
+  packet_legnth += 1; // terminator record id
   packet_legnth++;  // terminator "record"
 
-  FixedLengthTransmitPacket packet(hal, packet_legnth);
+#if TELEMETRY_COMPRESSION
+  if (compression) {
+    // The definition doesn't change, so it can be compressed once to find the
+    // compressed length, then again while streaming it out.
+    tx_compressor.reset(NULL);
+    write_header_record(tx_compressor, data_idx);
+    tx_compressor.write_uint8(protocol::DATAID_TERMINATOR);
+    tx_compressor.finish();
+    size_t compressed_length = get_packet_start_length()
+        + tx_compressor.get_length();
 
-  packet.write_uint8(protocol::OPCODE_HEADER);
-  packet.write_uint8(packet_tx_sequence);
-  for (size_t data_idx = 0; data_idx < data_count; data_idx++) {
-    packet.write_uint8(data_idx+1);
-    packet.write_uint8(data[data_idx]->get_data_type());
-    data[data_idx]->write_header_kvrs(packet);
-    packet.write_uint8(protocol::RECORDID_TERMINATOR);
+    if (compressed_length < packet_legnth) {
+      if (!blocking && !header_fits_tx_space(
+          opcode | protocol::OPCODE_FLAG_COMPRESSED, data_idx,
+          compressed_length)) {
+        return false;
+      }
+      FixedLengthTransmitPacket packet(hal, compressed_length, framing,
+          tx_packet_buffer, MAX_TRANSMIT_PACKET_LENGTH);
+      write_packet_start(packet, opcode | protocol::OPCODE_FLAG_COMPRESSED);
+      tx_compressor.reset(&packet);
+      write_header_record(tx_compressor, data_idx);
+      tx_compressor.write_uint8(protocol::DATAID_TERMINATOR);
+      tx_compressor.finish();
+
+      packet.finish();
+      record_transmitted_packet(packet.is_valid(), compressed_length,
+          packet.get_stuff_count());
+      packet_tx_sequence++;
+      return true;
+    }
+  }
+#endif
+
+  if (!blocking && !header_fits_tx_space(opcode, data_idx, packet_legnth)) {
+    return false;
   }
+
+  // The transmit buffer is unused here, so it holds COBS blocks.
+  FixedLengthTransmitPacket packet(hal, packet_legnth, framing,
+      tx_packet_buffer, MAX_TRANSMIT_PACKET_LENGTH);
+
+  write_packet_start(packet, opcode);
+  write_header_record(packet, data_idx);
   packet.write_uint8(protocol::DATAID_TERMINATOR);
 
   packet.finish();
-
+  record_transmitted_packet(packet.is_valid(), packet_legnth,
+      packet.get_stuff_count());
   packet_tx_sequence++;
-  header_transmitted = true;
+  return true;
+}
+
+bool Telemetry::header_fits_tx_space(uint8_t opcode, size_t data_idx,
+    size_t packet_length) {
+  size_t space = hal.tx_space();
+  if (protocol::max_frame_wire_length(framing, packet_length) <= space) {
+    return true;
+  }
+  // Stuffing (or COBS block codes) is only known once written, so count it
+  // from a dry run of the packet.
+  CountingTransmitPacket counter(packet_length, framing);
+  write_packet_start(counter, opcode);
+#if TELEMETRY_COMPRESSION
+  if (opcode & protocol::OPCODE_FLAG_COMPRESSED) {
+    tx_compressor.reset(&counter);
+    write_header_record(tx_compressor, data_idx);
+    tx_compressor.write_uint8(protocol::DATAID_TERMINATOR);
+    tx_compressor.finish();
+  } else {
+    write_header_record(counter, data_idx);
+    counter.write_uint8(protocol::DATAID_TERMINATOR);
+  }
+#else
+  write_header_record(counter, data_idx);
+  counter.write_uint8(protocol::DATAID_TERMINATOR);
+#endif
+  if (space < counter.get_wire_length()) {
+    stats.tx_unbuffered_deferred++;
+    return false;
+  }
+  return true;
 }
 
 void Telemetry::do_io() {
+  io_time_ms = hal.get_time_ms();
+  if (stats_channels != NULL) {
+    stats_channels->update();
+  }
+
+  uint32_t start_us = hal.get_time_us();
+  if (probe_reply_pending) {
+    transmit_probe_reply();
+  }
   transmit_data();
+  uint32_t transmit_end_us = hal.get_time_us();
   process_received_data();
+  uint32_t receive_end_us = hal.get_time_us();
+
+  stats.transmit_time_us.add(transmit_end_us - start_us);
+  stats.receive_time_us.add(receive_end_us - transmit_end_us);
+}
+
+void Telemetry::record_transmitted_packet(bool sent, size_t payload_length,
+    size_t stuff_count) {
+  if (sent) {
+    stats.tx_frames++;
+    stats.tx_bytes += protocol::frame_overhead(framing)
+        + payload_length + stuff_count;
+    stats.tx_stuff_bytes += stuff_count;
+    stats.tx_frame_size.add(payload_length);
+  } else {
+    stats.tx_frames_dropped++;
+  }
 }
 
 void Telemetry::transmit_data() {
@@ -73,58 +239,673 @@ void Telemetry::transmit_data() {
     return;
   }
 
-  // Keep a local copy to make it more thread-safe
+  if (header_data_count < data_count) {
+    // Announce data added since the header was transmitted, before any of its
+    // values. In nonblocking mode, data is held back until all of it is.
+    header_data_count = transmit_header_records(header_data_count, false);
+    if (header_data_count < data_count) {
+      stats.tx_frames_deferred++;
+      return;
+    }
+  }
+
+  // Take a local copy, merging updates from all producers. Updates made
+  // after this are sent on the next call.
   bool data_updated_local[MAX_DATA_PER_TELEMETRY];
+#if TELEMETRY_SCHEDULER
+  // Data held back by its period stays pending.
+  scheduler.advance(io_time_ms);
+  data_updated.take(data_updated_local, data_count,
+      scheduler.get_eligible());
+#else
+  data_updated.take(data_updated_local, data_count);
+#endif
+
+#if TELEMETRY_CHUNKING
+  // Urgent data goes first, in its own packets (not batched).
+  transmit_urgent(data_updated_local);
 
-  size_t packet_legnth = 2; // opcode + sequence
-  for (size_t data_idx = 0; data_idx < data_count; data_idx++) {
-    data_updated_local[data_idx] = data_updated[data_idx];
-    data_updated[data_idx] = 0;
-    if (data_updated_local[data_idx]) {
-      packet_legnth += 1; // data ID
-      packet_legnth += data[data_idx]->get_payload_length();
+  if (chunk_resume_offset != 0 && !chunk_resume_header) {
+    // Then the rest of a chunked transfer left in progress. If its data was
+    // updated meanwhile, it's sent again in full once this one is done.
+    size_t resume_idx = chunk_resume_idx;
+    bool updated = data_updated_local[resume_idx];
+    data_updated_local[resume_idx] = false;
+    if (!transmit_chunked(protocol::OPCODE_DATA, resume_idx, false)
+        || updated) {
+      data_updated.set(resume_idx);
     }
   }
-  packet_legnth++;  // terminator "record"
+#endif
 
-  FixedLengthTransmitPacket packet(hal, packet_legnth);
+#if TELEMETRY_BATCHING
+  if (batch_max_cycles != 0) {
+    transmit_data_batched(data_updated_local);
+    return;
+  }
+#endif
 
-  packet.write_uint8(protocol::OPCODE_DATA);
-  packet.write_uint8(packet_tx_sequence);
-  for (size_t data_idx = 0; data_idx < data_count; data_idx++) {
-    if (data_updated_local[data_idx]) {
-      packet.write_uint8(data_idx+1);
-      data[data_idx]->write_payload(packet);
+  // Updated data is split across as many packets as needed, with at least
+  // one (possibly empty) packet sent per call.
+  size_t data_idx = 0;
+  do {
+    size_t packet_start_idx = data_idx;
+    size_t packet_records = 0;
+    bool fits_buffer = true;
+    BufferedTransmitPacket packet(hal, tx_packet_buffer,
+        MAX_TRANSMIT_PACKET_LENGTH, framing);
+
+    write_packet_start(packet, protocol::OPCODE_DATA);
+    for (; data_idx < data_count; data_idx++) {
+      if (data_updated_local[data_idx]) {
+        size_t record_start = packet.get_length();
+        packet.write_varint(data_idx+1);
+        data[data_idx]->write_payload(packet);
+        // Leave space for the terminator.
+        fits_buffer = !packet.is_overflowed()
+            && packet.get_length() < MAX_TRANSMIT_PACKET_LENGTH;
+        if (!fits_buffer || (nonblocking && !fits_tx_space(packet, 1))) {
+          packet.rewind(record_start);
+          break;
+        }
+        packet_records++;
+      }
+    }
+
+    if (data_idx < data_count && packet_records == 0) {
+      if (fits_buffer) {
+        // The next record doesn't fit in the HAL's transmit buffer yet.
+        break;
+      }
+      // The next record alone doesn't fit in the buffer.
+      if (!transmit_data_unbuffered(data_idx)) {
+        break;
+      }
+      data_idx++;
+      continue;
+    }
+
+    packet.write_uint8(protocol::DATAID_TERMINATOR);
+
+    if (!send_buffered_packet(packet, !nonblocking)) {
+      data_idx = packet_start_idx;
+      break;
+    }
+    packet_tx_sequence++;
+    for (size_t i=packet_start_idx; i<data_idx; i++) {
+      if (data_updated_local[i]) {
+        data_transmitted(i);
+      }
+    }
+  } while (data_idx < data_count);
+
+  if (data_idx < data_count) {
+    // Deferred, keep remaining updated data pending for the next call.
+    for (; data_idx < data_count; data_idx++) {
+      if (data_updated_local[data_idx]) {
+        data_updated.set(data_idx);
+      }
+    }
+    stats.tx_frames_deferred++;
+  }
+}
+
+#if TELEMETRY_BATCHING
+void Telemetry::transmit_data_batched(bool* data_updated_local) {
+  BufferedTransmitPacket packet(hal, tx_batch_buffer,
+      MAX_TRANSMIT_PACKET_LENGTH, framing);
+  packet.resume(batch_length);
+  if (batch_length == 0) {
+    write_packet_start(packet, batch_cycle_offsets ?
+        protocol::OPCODE_DATA_CYCLES : protocol::OPCODE_DATA);
+    batch_cycle = 0;
+    batch_start_ms = io_time_ms;
+  }
+
+  // Updates are committed to the batch as they're added, so they're sent
+  // (in this or a later batch) even if the batch is deferred. In cycle
+  // offset mode, this call's updates are a group, opened by the first.
+  bool group_open = false;
+  size_t data_idx = 0;
+  while (data_idx < data_count) {
+    if (!data_updated_local[data_idx]) {
+      data_idx++;
+      continue;
+    }
+    size_t record_start = packet.get_length();
+    if (batch_cycle_offsets && !group_open) {
+      packet.write_varint(batch_cycle + 1);
+    }
+    packet.write_varint(data_idx+1);
+    data[data_idx]->write_payload(packet);
+    bool fits_buffer = !packet.is_overflowed() && packet.get_length()
+        + get_batch_reserve_length() <= MAX_TRANSMIT_PACKET_LENGTH;
+    if (fits_buffer && (!nonblocking
+        || fits_tx_space(packet, get_batch_reserve_length()))) {
+      group_open = batch_cycle_offsets;
+      data_transmitted(data_idx);
+      data_idx++;
+      continue;
+    }
+
+    packet.rewind(record_start);
+    if (record_start > get_packet_start_length()) {
+      // Send the batch so far, then retry the record in a new one.
+      if (group_open) {
+        packet.write_uint8(protocol::DATAID_TERMINATOR);
+        group_open = false;
+      }
+      if (!send_batch(packet)) {
+        break;
+      }
+    } else if (fits_buffer) {
+      // The record doesn't fit in the HAL's transmit buffer yet.
+      break;
+    } else {
+      // The record alone doesn't fit in the buffer.
+      if (!transmit_data_unbuffered(data_idx)) {
+        break;
+      }
+      data_idx++;
+    }
+  }
+
+  if (group_open) {
+    packet.write_uint8(protocol::DATAID_TERMINATOR);
+  }
+  batch_length = packet.get_length();
+
+  if (data_idx < data_count) {
+    // Deferred, keep remaining updated data pending for the next call.
+    for (; data_idx < data_count; data_idx++) {
+      if (data_updated_local[data_idx]) {
+        data_updated.set(data_idx);
+      }
     }
+    stats.tx_frames_deferred++;
+  }
+
+  if (batch_cycle < 0xffff) {
+    batch_cycle++;
   }
+  if (batch_cycle >= batch_max_cycles
+      || (batch_max_latency_ms != 0
+          && io_time_ms - batch_start_ms >= batch_max_latency_ms)
+      || (batch_max_bytes != 0 && batch_length >= batch_max_bytes)) {
+    // If deferred, this is retried on the next call.
+    send_batch(packet);
+  }
+}
+
+bool Telemetry::send_batch(BufferedTransmitPacket& packet) {
+  size_t length = packet.get_length();
+  // Ends the last data records, or in cycle offset mode, the groups.
   packet.write_uint8(protocol::DATAID_TERMINATOR);
+  // Packets sent while the batch was built took sequence numbers since it
+  // was started.
+  packet.get_buffer()[get_packet_start_length() - 1] = packet_tx_sequence;
+  if (!send_buffered_packet(packet, !nonblocking)) {
+    packet.rewind(length);
+    return false;
+  }
+  packet_tx_sequence++;
 
-  packet.finish();
+  packet.rewind(0);
+  write_packet_start(packet, batch_cycle_offsets ?
+      protocol::OPCODE_DATA_CYCLES : protocol::OPCODE_DATA);
+  batch_length = packet.get_length();
+  batch_cycle = 0;
+  batch_start_ms = io_time_ms;
+  return true;
+}
+#endif
 
+bool Telemetry::send_buffered_packet(BufferedTransmitPacket& packet,
+    bool blocking) {
+  BufferedTransmitPacket* send_packet = &packet;
+#if TELEMETRY_COMPRESSION
+  BufferedTransmitPacket compressed_packet(hal, tx_compress_buffer,
+      MAX_TRANSMIT_PACKET_LENGTH, framing);
+  if (compression) {
+    // The opcode, namespace and sequence number aren't compressed.
+    const uint8_t* buffer = packet.get_buffer();
+    size_t start_length = get_packet_start_length();
+    compressed_packet.write_uint8(buffer[0]
+        | protocol::OPCODE_FLAG_COMPRESSED);
+    for (size_t i=1; i<start_length; i++) {
+      compressed_packet.write_uint8(buffer[i]);
+    }
+    tx_compressor.reset(&compressed_packet);
+    for (size_t i=start_length; i<packet.get_length(); i++) {
+      tx_compressor.write_byte(buffer[i]);
+    }
+    tx_compressor.finish();
+    if (!compressed_packet.is_overflowed()
+        && compressed_packet.get_length() < packet.get_length()) {
+      send_packet = &compressed_packet;
+    }
+  }
+#endif
+
+  if (!blocking && hal.tx_space() < send_packet->get_wire_length()) {
+    return false;
+  }
+
+  send_packet->finish();
+  record_transmitted_packet(send_packet->is_valid(),
+      send_packet->get_length(), send_packet->get_stuff_count());
+  return true;
+}
+
+bool Telemetry::fits_tx_space(BufferedTransmitPacket& packet,
+    size_t reserve_length) {
+  size_t space = hal.tx_space();
+  size_t length = packet.get_length();
+  if (protocol::max_frame_wire_length(framing, length + reserve_length)
+      <= space) {
+    return true;
+  }
+  for (size_t i=0; i<reserve_length; i++) {
+    packet.write_uint8(protocol::DATAID_TERMINATOR);
+  }
+  bool fits = !packet.is_overflowed() && packet.get_wire_length() <= space;
+  packet.rewind(length);
+  return fits;
+}
+
+bool Telemetry::transmit_data_unbuffered(size_t data_idx) {
+#if TELEMETRY_CHUNKING
+  if (chunk_length != 0) {
+    return transmit_chunked(protocol::OPCODE_DATA, data_idx, false);
+  }
+#endif
+
+  size_t packet_legnth = get_packet_start_length();
+  packet_legnth += protocol::varint_length(data_idx+1);
+  packet_legnth += data[data_idx]->get_payload_length();
+  packet_legnth++;  // terminator "record"
+
+  if (nonblocking) {
+    size_t space = hal.tx_space();
+    if (space < protocol::max_frame_wire_length(framing, packet_legnth)) {
+      // Stuffing (or COBS block codes) is only known once written, so
+      // count it from a dry run of the payload.
+      CountingTransmitPacket counter(packet_legnth, framing);
+      write_packet_start(counter, protocol::OPCODE_DATA);
+      counter.write_varint(data_idx+1);
+      data[data_idx]->write_payload(counter);
+      counter.write_uint8(protocol::DATAID_TERMINATOR);
+      if (space < counter.get_wire_length()) {
+        stats.tx_unbuffered_deferred++;
+        return false;
+      }
+    }
+  }
+
+  // The transmit buffer is unused here, so it holds COBS blocks.
+  FixedLengthTransmitPacket packet(hal, packet_legnth, framing,
+      tx_packet_buffer, MAX_TRANSMIT_PACKET_LENGTH);
+
+  write_packet_start(packet, protocol::OPCODE_DATA);
+  packet.write_varint(data_idx+1);
+  data[data_idx]->write_payload(packet);
+  packet.write_uint8(protocol::DATAID_TERMINATOR);
+
+  packet.finish();
+  record_transmitted_packet(packet.is_valid(), packet_legnth,
+      packet.get_stuff_count());
   packet_tx_sequence++;
+  data_transmitted(data_idx);
+  return true;
 }
 
-void Telemetry::process_received_data() {
-  uint32_t current_time = hal.get_time_ms();
+#if TELEMETRY_CHUNKING
+class Telemetry::ChunkedTransmitPacket : public TransmitPacket {
+public:
+  // The chunked packet is total_length bytes, sent in chunks of chunk_length
+  // bytes (which must fit in the transmit buffer) from start_offset, the
+  // bytes before which were sent in an earlier call. Urgent data other than
+  // exclude_idx is sent between them. Unless blocking, chunks are cut to what
+  // fits in the HAL's transmit buffer, and sending stops once none does.
+  ChunkedTransmitPacket(Telemetry& telemetry, size_t total_length,
+      size_t chunk_length, size_t exclude_idx, size_t start_offset,
+      bool blocking) :
+      telemetry(telemetry),
+      packet(telemetry.hal, telemetry.tx_packet_buffer,
+          MAX_TRANSMIT_PACKET_LENGTH, telemetry.framing),
+      total_length(total_length),
+      chunk_length(chunk_length),
+      exclude_idx(exclude_idx),
+      blocking(blocking),
+      stopped(false),
+      position(0),
+      offset(start_offset),
+      count(0),
+      limit(0) {
+  }
 
-  if (decoder_last_receive_ms <= current_time) {
-    if (!decoder_last_received && decoder_state != SOF && decoder_pos != 0
-        && (decoder_last_receive_ms - current_time > DECODER_TIMEOUT_MS)) {
-      decoder_pos = 0;
-      packet_length = 0;
-      decoder_state = SOF;
-      hal.do_error("RX timeout");
+  void write_byte(uint8_t data) {
+    if (stopped) {
+      return;
+    }
+    position++;
+    if (position <= offset) {
+      return;  // sent in an earlier call
+    }
+    if (count == 0 && !start_chunk()) {
+      stopped = true;
+      return;
+    }
+    packet.write_byte(data);
+    count++;
+    if (count >= limit) {
+      send_chunk();
+    }
+  }
+
+  void write_uint8(uint8_t data) {
+    write_byte(data);
+  }
+  void write_uint16(uint16_t data) {
+    write_byte((data >> 8) & 0xff);
+    write_byte((data >> 0) & 0xff);
+  }
+  void write_uint32(uint32_t data) {
+    write_byte((data >> 24) & 0xff);
+    write_byte((data >> 16) & 0xff);
+    write_byte((data >> 8) & 0xff);
+    write_byte((data >> 0) & 0xff);
+  }
+  void write_float(float data) {
+    // TODO: THIS IS ENDIANNESS DEPENDENT, ABSTRACT INTO HAL?
+    uint8_t *float_array = (uint8_t*) &data;
+    write_byte(float_array[3]);
+    write_byte(float_array[2]);
+    write_byte(float_array[1]);
+    write_byte(float_array[0]);
+  }
+
+  // Sends the last (partial) chunk.
+  void finish() {
+    if (count > 0 && !stopped) {
+      send_chunk();
+    }
+    if (!stopped) {
+      telemetry.chunk_transfer++;
     }
+  }
+
+  // Returns whether sending stopped before the end of the chunked packet.
+  bool is_stopped() {
+    return stopped;
+  }
+  // Returns the number of bytes sent, in this and earlier calls.
+  size_t get_offset() {
+    return offset;
+  }
+
+protected:
+  // Starts a chunk, returning false if none fits in the transmit buffer.
+  bool start_chunk() {
+    size_t start_length = telemetry.get_chunk_start_length(total_length);
+    limit = chunk_length;
+    if (!blocking) {
+      size_t fit = protocol::max_frame_payload_length(telemetry.framing,
+          telemetry.hal.tx_space());
+      fit = fit > start_length ? fit - start_length : 0;
+      if (fit < limit) {
+        limit = fit;
+      }
+      if (limit == 0) {
+        return false;
+      }
+    }
+    // Chunks are started on their first byte, so the transmit buffer is
+    // free for urgent packets between them.
+    packet.rewind(0);
+    telemetry.write_packet_start(packet, protocol::OPCODE_CHUNK);
+    packet.write_uint8(telemetry.chunk_transfer);
+    packet.write_varint(total_length);
+    packet.write_varint(offset);
+    return true;
+  }
+
+  void send_chunk() {
+    if (!telemetry.send_buffered_packet(packet, blocking)) {
+      stopped = true;
+      return;
+    }
+    telemetry.packet_tx_sequence++;
+    offset += count;
+    count = 0;
+    if (offset < total_length) {
+      telemetry.transmit_urgent_pending(exclude_idx);
+    }
+  }
+
+  Telemetry& telemetry;
+  BufferedTransmitPacket packet;
+  size_t total_length;
+  size_t chunk_length;
+  size_t exclude_idx;
+  bool blocking;
+  bool stopped;
+  // Bytes written, bytes sent (in earlier chunks and calls), and bytes
+  // written to the current chunk, out of at most limit.
+  size_t position;
+  size_t offset;
+  size_t count;
+  size_t limit;
+};
+
+bool Telemetry::transmit_chunked(uint8_t opcode, size_t data_idx,
+    bool header) {
+  size_t total_length = 1;  // opcode
+  total_length += protocol::varint_length(data_idx+1);
+  if (header) {
+    total_length += 1; // data type
+    total_length += data[data_idx]->get_header_kvrs_length();
+    total_length += 1; // terminator record id
+  } else {
+    total_length += data[data_idx]->get_payload_length();
+  }
+  total_length++;  // terminator "record"
+
+  size_t start_length = get_chunk_start_length(total_length);
+  size_t chunk_bytes = MAX_TRANSMIT_PACKET_LENGTH - start_length;
+  if (chunk_length < chunk_bytes) {
+    chunk_bytes = chunk_length;
+  }
+
+  // A new header is always sent, appends and data only as tx_space allows in
+  // nonblocking mode.
+  bool blocking = !nonblocking || opcode == protocol::OPCODE_HEADER;
+  size_t start_offset = 0;
+  if (chunk_resume_offset != 0) {
+    if (header != chunk_resume_header || data_idx != chunk_resume_idx) {
+      if (!blocking) {
+        // Waits for the transfer in progress.
+        return false;
+      }
+      cancel_chunked();
+    } else if (total_length == chunk_resume_length) {
+      start_offset = chunk_resume_offset;
+    } else {
+      // The payload changed length, so it's sent again from the start.
+      chunk_transfer++;
+    }
+    chunk_resume_offset = 0;
+  }
+
+  ChunkedTransmitPacket packet(*this, total_length, chunk_bytes, data_idx,
+      start_offset, blocking);
+  packet.write_uint8(opcode);
+  if (header) {
+    write_header_record(packet, data_idx);
   } else {
-    // timer overflowed, do nothing
+    packet.write_varint(data_idx+1);
+    data[data_idx]->write_payload(packet);
+  }
+  packet.write_uint8(protocol::DATAID_TERMINATOR);
+  packet.finish();
+
+  if (packet.is_stopped()) {
+    if (packet.get_offset() == 0) {
+      return false;
+    }
+    // Resumed by the next do_io. Data is then taken as sent, while the
+    // definition holds back those after it.
+    chunk_resume_header = header;
+    chunk_resume_idx = data_idx;
+    chunk_resume_offset = packet.get_offset();
+    chunk_resume_length = total_length;
+    return !header;
+  }
+  if (!header) {
+    data_transmitted(data_idx);
+  }
+  return true;
+}
+
+void Telemetry::cancel_chunked() {
+  if (chunk_resume_offset != 0) {
+    // The receiver discards the partial transfer, so it's sent again.
+    if (!chunk_resume_header) {
+      data_updated.set(chunk_resume_idx);
+    }
+    chunk_transfer++;
+    chunk_resume_offset = 0;
+  }
+}
+
+void Telemetry::transmit_urgent(bool* updated) {
+  size_t data_idx = 0;
+  while (data_idx < data_count) {
+    size_t packet_start_idx = data_idx;
+    size_t packet_records = 0;
+    BufferedTransmitPacket packet(hal, tx_packet_buffer,
+        MAX_TRANSMIT_PACKET_LENGTH, framing);
+
+    write_packet_start(packet, protocol::OPCODE_DATA);
+    for (; data_idx < data_count; data_idx++) {
+      if (updated[data_idx] && is_urgent(data_idx)) {
+        size_t record_start = packet.get_length();
+        packet.write_varint(data_idx+1);
+        data[data_idx]->write_payload(packet);
+        // Leave space for the terminator.
+        if (packet.is_overflowed()
+            || packet.get_length() >= MAX_TRANSMIT_PACKET_LENGTH) {
+          packet.rewind(record_start);
+          break;
+        }
+        packet_records++;
+      }
+    }
+
+    if (packet_records == 0) {
+      // The next record alone doesn't fit in the buffer, it's left to be
+      // sent unbuffered with the rest.
+      data_idx++;
+      continue;
+    }
+
+    packet.write_uint8(protocol::DATAID_TERMINATOR);
+
+    if (!send_buffered_packet(packet, !nonblocking)) {
+      return;
+    }
+    packet_tx_sequence++;
+    for (size_t i=packet_start_idx; i<data_idx; i++) {
+      if (updated[i] && is_urgent(i)) {
+        data_transmitted(i);
+        updated[i] = false;
+      }
+    }
+  }
+}
+
+void Telemetry::transmit_urgent_pending(size_t exclude_idx) {
+  // Only urgent data announced in the header (and eligible to be sent, with
+  // the scheduler) is taken, other than the data being sent.
+  uint32_t mask[(MAX_DATA_PER_TELEMETRY + 31) / 32];
+  for (size_t word=0; word*32 < data_count; word++) {
+    mask[word] = urgent_mask[word];
+#if TELEMETRY_SCHEDULER
+    mask[word] &= scheduler.get_eligible()[word];
+#endif
+    if (header_data_count <= word*32) {
+      mask[word] = 0;
+    } else if (header_data_count < word*32 + 32) {
+      mask[word] &= ((uint32_t)1 << (header_data_count - word*32)) - 1;
+    }
+    if (exclude_idx / 32 == word) {
+      mask[word] &= ~((uint32_t)1 << (exclude_idx % 32));
+    }
+  }
+
+  bool updated[MAX_DATA_PER_TELEMETRY];
+  data_updated.take(updated, data_count, mask);
+  transmit_urgent(updated);
+  for (size_t i=0; i<data_count; i++) {
+    if (updated[i]) {
+      data_updated.set(i);
+    }
+  }
+}
+
+void Telemetry::set_urgent(Data& target, bool urgent) {
+  for (size_t i=0; i<data_count; i++) {
+    if (data[i] == &target) {
+      if (urgent) {
+        urgent_mask[i / 32] |= (uint32_t)1 << (i % 32);
+      } else {
+        urgent_mask[i / 32] &= ~((uint32_t)1 << (i % 32));
+      }
+      return;
+    }
+  }
+  do_error("set_urgent: data not in this Telemetry");
+}
+#endif
+
+void Telemetry::data_transmitted(size_t data_idx) {
+#if TELEMETRY_SCHEDULER
+  scheduler.transmitted(data_idx, io_time_ms);
+#endif
+  data[data_idx]->payload_transmitted();
+}
+
+#if TELEMETRY_SCHEDULER
+void Telemetry::set_period_ms(Data& target, uint32_t period_ms) {
+  for (size_t i=0; i<data_count; i++) {
+    if (data[i] == &target) {
+      scheduler.set_period(i, period_ms, hal.get_time_ms());
+      return;
+    }
+  }
+  do_error("set_period_ms: data not in this Telemetry");
+}
+#endif
+
+void Telemetry::process_received_data() {
+  uint32_t current_time = hal.get_time_ms();
+
+  // Time out a partially received packet if nothing more has been received.
+  if (decoder_state != SOF && !hal.rx_available()
+      && current_time - decoder_last_receive_ms > decoder_timeout_ms) {
+    decoder_pos = 0;
+    packet_length = 0;
+    decoder_state = SOF;
+    receive_frame_done(false);
+    stats.rx_timeouts++;
+    hal.do_error("RX timeout");
   }
-  decoder_last_receive_ms = current_time;
 
-  decoder_last_received = false;
   while (hal.rx_available()) {
-    decoder_last_received = true;
+    decoder_last_receive_ms = current_time;
 
     uint8_t rx_byte = hal.receive_byte();
+    stats.rx_bytes++;
 
     if (decoder_state == SOF) {
       if (rx_byte == protocol::SOF_SEQ[decoder_pos]) {
@@ -132,30 +913,41 @@ void Telemetry::process_received_data() {
         if (decoder_pos >= protocol::SOF_LENGTH) {
           decoder_pos = 0;
           packet_length = 0;
+          receive_frame_intact = true;
           decoder_state = LENGTH;
         }
+      } else if (decoder_pos == protocol::SOF_LENGTH - 1
+          && rx_byte == protocol::SOF_SEQ_COBS[decoder_pos]) {
+        decoder_pos = 0;
+        packet_length = 0;
+        cobs_remaining = 0;
+        cobs_zero_pending = false;
+        receive_frame_intact = true;
+        decoder_state = COBS_DATA;
       } else {
         if (decoder_pos > 0) {
           // Pass through any partial SOF sequence.
           for (uint8_t i=0; i<decoder_pos; i++) {
-            rx_buffer.enqueue(protocol::SOF_SEQ[i]);
+            enqueue_receive(protocol::SOF_SEQ[i]);
           }
         }
         decoder_pos = 0;
-        rx_buffer.enqueue(rx_byte);
+        enqueue_receive(rx_byte);
       }
     } else if (decoder_state == LENGTH) {
       packet_length = (packet_length << 8) | rx_byte;
       decoder_pos++;
       if (decoder_pos >= protocol::LENGTH_SIZE) {
         decoder_pos = 0;
+        receive_state = RX_OPCODE;
         decoder_state = DATA;
       }
     } else if (decoder_state == DATA) {
-      received_packet.add_byte(rx_byte);
+      process_received_byte(rx_byte);
       decoder_pos++;
       if (decoder_pos >= packet_length) {
-        process_received_packet();
+        stats.rx_frames++;
+        process_received_packet_end();
 
         decoder_pos = 0;
         if (rx_byte == protocol::SOF_SEQ[0]) {
@@ -169,27 +961,263 @@ void Telemetry::process_received_data() {
         }
       }
     } else if (decoder_state == DATA_DESTUFF) {
-      decoder_state = DATA;
+      if (rx_byte == protocol::SOF_SEQ0_STUFF) {
+        decoder_state = DATA;
+      } else {
+        // Not stuffed, so bytes of this frame were lost, and this is likely
+        // the start of the next frame.
+        hal.do_error("RX frame truncated");
+        receive_frame_intact = false;
+        process_received_packet_end();
+        decoder_pos = 0;
+        packet_length = 0;
+        receive_frame_intact = true;
+        if (rx_byte == protocol::SOF_SEQ[1]) {
+          decoder_state = LENGTH;
+        } else if (rx_byte == protocol::SOF_SEQ_COBS[1]) {
+          cobs_remaining = 0;
+          cobs_zero_pending = false;
+          decoder_state = COBS_DATA;
+        } else {
+          decoder_state = SOF;
+        }
+      }
     } else if (decoder_state == DATA_DESTUFF_END) {
       decoder_state = SOF;
+    } else if (decoder_state == COBS_DATA) {
+      if (rx_byte == protocol::COBS_DELIMITER) {
+        process_received_cobs_end();
+        decoder_pos = 0;
+        decoder_state = SOF;
+      } else if (cobs_remaining == 0) {
+        // Block code: the previous block's implied zero, if any, is only
+        // known not to be the frame end once another block starts.
+        if (cobs_zero_pending) {
+          process_received_cobs_byte(0);
+        }
+        cobs_remaining = rx_byte - 1;
+        cobs_zero_pending = rx_byte <= protocol::COBS_MAX_BLOCK;
+      } else {
+        process_received_cobs_byte(rx_byte);
+        cobs_remaining--;
+      }
     }
   }
 }
 
-void Telemetry::process_received_packet() {
-  uint8_t opcode = received_packet.read_uint8();
-  if (opcode == protocol::OPCODE_DATA) {
-    uint8_t data_id = received_packet.read_uint8();
-    while (data_id != protocol::DATAID_TERMINATOR) {
-      if (data_id < data_count + 1) {
-        data[data_id - 1]->set_from_packet(received_packet);
-      } else {
-        hal.do_error("Unknown data ID");
+void Telemetry::process_received_cobs_byte(uint8_t rx_byte) {
+  if (decoder_pos < protocol::LENGTH_SIZE) {
+    packet_length = (packet_length << 8) | rx_byte;
+    if (decoder_pos == protocol::LENGTH_SIZE - 1) {
+      receive_state = RX_OPCODE;
+    }
+  } else if (decoder_pos < protocol::LENGTH_SIZE + packet_length) {
+    process_received_byte(rx_byte);
+  }
+  decoder_pos++;
+}
+
+void Telemetry::process_received_cobs_end() {
+  if (decoder_pos < protocol::LENGTH_SIZE) {
+    hal.do_error("RX COBS frame too short");
+    receive_frame_done(false);
+    return;
+  } else if (decoder_pos > protocol::LENGTH_SIZE + packet_length) {
+    hal.do_error("RX COBS frame over length");
+    receive_frame_intact = false;
+  }
+  if (cobs_remaining != 0) {
+    hal.do_error("RX COBS block truncated");
+    receive_frame_intact = false;
+  }
+  if (decoder_pos >= protocol::LENGTH_SIZE + packet_length) {
+    stats.rx_frames++;
+  } else {
+    receive_frame_intact = false;
+  }
+  process_received_packet_end();
+}
+
+void Telemetry::process_received_byte(uint8_t rx_byte) {
+  if (receive_state == RX_OPCODE) {
+#if TELEMETRY_COMPRESSION
+    receive_compressed = (rx_byte & protocol::OPCODE_FLAG_COMPRESSED) != 0;
+    if (receive_compressed) {
+      rx_byte &= ~protocol::OPCODE_FLAG_COMPRESSED;
+      rx_decompressor.reset();
+    }
+#endif
+    bool has_namespace = (rx_byte & protocol::OPCODE_FLAG_NAMESPACE) != 0;
+    rx_byte &= ~protocol::OPCODE_FLAG_NAMESPACE;
+    receive_opcode = rx_byte;
+    if (rx_byte != protocol::OPCODE_DATA && rx_byte != protocol::OPCODE_PROBE) {
+      stats.rx_unknown_opcodes++;
+      hal.do_error("Unknown opcode");
+      receive_state = RX_IGNORE;
+    } else if (has_namespace) {
+      receive_state = RX_NAMESPACE;
+    } else if (namespace_id != 0) {
+      receive_state = RX_IGNORE;  // for another Telemetry in namespace 0
+    } else {
+      start_receive_payload();
+    }
+    return;
+  } else if (receive_state == RX_NAMESPACE) {
+    if (rx_byte == namespace_id) {
+      start_receive_payload();
+    } else {
+      receive_state = RX_IGNORE;
+    }
+    return;
+  } else if (receive_state == RX_IGNORE) {
+    return;
+  }
+
+#if TELEMETRY_COMPRESSION
+  if (receive_compressed) {
+    if (!rx_decompressor.add_byte(rx_byte)) {
+      hal.do_error("RX invalid compressed data");
+      receive_state = RX_IGNORE;
+      return;
+    }
+    uint8_t decompressed;
+    while (rx_decompressor.read(&decompressed)) {
+      process_received_payload_byte(decompressed);
+    }
+    return;
+  }
+#endif
+  process_received_payload_byte(rx_byte);
+}
+
+void Telemetry::start_receive_payload() {
+  if (receive_opcode == protocol::OPCODE_PROBE) {
+    // A reply still pending is replaced, as its token is overwritten.
+    probe_reply_pending = false;
+    probe_receive_time_us = hal.get_time_us();
+    probe_token_length = 0;
+    receive_state = RX_PROBE;
+  } else {
+    start_receive_data_id();
+  }
+}
+
+void Telemetry::start_receive_data_id() {
+  receive_data_id = 0;
+  receive_data_id_shift = 0;
+  receive_state = RX_DATA_ID;
+}
+
+void Telemetry::process_received_payload_byte(uint8_t rx_byte) {
+  if (receive_state == RX_DATA_ID) {
+    receive_data_id |= (uint32_t)(rx_byte & 0x7f) << receive_data_id_shift;
+    if (rx_byte & 0x80) {
+      receive_data_id_shift += 7;
+      if (receive_data_id_shift >= 7 * protocol::MAX_VARINT_LENGTH) {
+        stats.rx_unknown_ids++;
+        hal.do_error("RX data ID too long");
+        receive_state = RX_IGNORE;
       }
-      data_id = received_packet.read_uint8();
+      return;
+    }
+
+    if (receive_data_id == protocol::DATAID_TERMINATOR) {
+      receive_state = RX_IGNORE;
+    } else if (receive_data_id < header_data_count + 1) {
+      receive_data = data[receive_data_id - 1];
+      receive_element = 0;
+      received_packet.new_packet();
+      receive_state = RX_ELEMENT;
+    } else {
+      // Payload length is unknown, so the rest of the packet is unusable.
+      stats.rx_unknown_ids++;
+      hal.do_error("Unknown data ID");
+      receive_state = RX_IGNORE;
+    }
+  } else if (receive_state == RX_ELEMENT) {
+    if (!received_packet.add_byte(rx_byte)) {
+      stats.rx_overflows++;
+      receive_state = RX_IGNORE;
+      return;
+    }
+    if (received_packet.get_length() >= receive_data->get_element_length()) {
+      receive_data->set_element_from_packet(receive_element, received_packet);
+      received_packet.new_packet();
+      receive_element++;
+      if (receive_element >= receive_data->get_element_count()) {
+        receive_payload_done();
+        start_receive_data_id();
+      }
+    }
+  } else if (receive_state == RX_PROBE) {
+    probe_token[probe_token_length++] = rx_byte;
+    if (probe_token_length >= protocol::PROBE_TOKEN_LENGTH) {
+      receive_state = RX_PROBE_DONE;
     }
+  } else if (receive_state == RX_PROBE_DONE) {
+    hal.do_error("RX probe over length");
+    receive_state = RX_IGNORE;
+  }
+}
+
+void Telemetry::process_received_packet_end() {
+  if (receive_state == RX_ELEMENT) {
+    // Elements received so far remain set.
+    receive_payload_done();
+  } else if (receive_state == RX_PROBE_DONE) {
+    transmit_probe_reply();
+    receive_state = RX_IGNORE;
+  }
+  if (receive_state != RX_IGNORE) {
+    hal.do_error("RX packet truncated");
+    receive_frame_intact = false;
+  }
+  receive_frame_done(receive_frame_intact);
+}
+
+void Telemetry::receive_payload_done() {
+  receive_data->set_from_packet_done();
+  size_t index = receive_data_id - 1;
+  if (receive_done_begin == receive_done_end) {
+    receive_done_begin = index;
+    receive_done_end = index + 1;
+  } else if (index < receive_done_begin) {
+    receive_done_begin = index;
+  } else if (index >= receive_done_end) {
+    receive_done_end = index + 1;
+  }
+}
+
+void Telemetry::receive_frame_done(bool intact) {
+  for (size_t i=receive_done_begin; i<receive_done_end; i++) {
+    data[i]->set_from_frame_done(intact);
+  }
+  receive_done_begin = 0;
+  receive_done_end = 0;
+}
+
+void Telemetry::transmit_probe_reply() {
+  BufferedTransmitPacket packet(hal, tx_packet_buffer,
+      MAX_TRANSMIT_PACKET_LENGTH, framing);
+  write_packet_start(packet, protocol::OPCODE_PROBE);
+  for (size_t i=0; i<protocol::PROBE_TOKEN_LENGTH; i++) {
+    packet.write_uint8(probe_token[i]);
+  }
+  packet.write_uint32(probe_receive_time_us);
+  // Taken last so the host sees as little of the transmitter's processing
+  // time as possible as link latency.
+  packet.write_uint32(hal.get_time_us());
+  probe_reply_pending = !send_buffered_packet(packet, !nonblocking);
+  if (probe_reply_pending) {
+    stats.tx_frames_deferred++;
   } else {
-    hal.do_error("Unknown opcode");
+    packet_tx_sequence++;
+  }
+}
+
+void Telemetry::enqueue_receive(uint8_t rx_byte) {
+  if (!rx_buffer.enqueue(rx_byte)) {
+    stats.rx_overflows++;
   }
 }
 
@@ -1,6 +1,8 @@
 #ifndef _TELEMETRY_H_
 #define _TELEMETRY_H_
 
+#include <new>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -10,19 +12,116 @@
 #define TELEMETRY_DATA_LIMIT 16
 #endif
 
+// Set to 1 to allow data to be updated from multiple threads (or cores)
+// concurrently with do_io, which must still be called from a single thread.
+#ifndef TELEMETRY_THREADSAFE
+#define TELEMETRY_THREADSAFE 0
+#endif
+
+// Number of independent sets of data updated flags, selected through the
+// HAL's get_producer_slot, to reduce contention between cores.
+#ifndef TELEMETRY_PRODUCER_SLOTS
+#define TELEMETRY_PRODUCER_SLOTS 1
+#endif
+
+// Set to 1 if data metadata strings (names and units) are placed in program
+// memory, which is read through TELEMETRY_READ_METADATA_BYTE. Declare those
+// strings with TELEMETRY_METADATA("string") or as PROGMEM arrays on AVR.
+#ifndef TELEMETRY_METADATA_IN_FLASH
+#define TELEMETRY_METADATA_IN_FLASH 0
+#endif
+
+// Set to 1 to not store or transmit data display names and units, which can
+// instead be provided to the client in a schema file (see README).
+#ifndef TELEMETRY_STRIP_METADATA
+#define TELEMETRY_STRIP_METADATA 0
+#endif
+
+// Set to 1 to support change suppression (see Numeric::set_suppression), at
+// the cost of its state in RAM for every Numeric.
+#ifndef TELEMETRY_CHANGE_SUPPRESSION
+#define TELEMETRY_CHANGE_SUPPRESSION 0
+#endif
+
+// Set to 1 to support per-data minimum transmit periods (see
+// Telemetry::set_period_ms), scheduled on a timing wheel of
+// TELEMETRY_SCHEDULER_SLOTS buckets of TELEMETRY_SCHEDULER_TICK_MS each.
+#ifndef TELEMETRY_SCHEDULER
+#define TELEMETRY_SCHEDULER 0
+#endif
+
+#ifndef TELEMETRY_SCHEDULER_SLOTS
+#define TELEMETRY_SCHEDULER_SLOTS 32
+#endif
+
+#ifndef TELEMETRY_SCHEDULER_TICK_MS
+#define TELEMETRY_SCHEDULER_TICK_MS 8
+#endif
+
+#ifndef TELEMETRY_TRANSMIT_PACKET_LENGTH
+#define TELEMETRY_TRANSMIT_PACKET_LENGTH 256
+#endif
+
+// Set to 1 to support compressed packets (see set_compression), at the cost
+// of about 800 bytes of RAM per Telemetry object.
+#ifndef TELEMETRY_COMPRESSION
+#define TELEMETRY_COMPRESSION 0
+#endif
+
+// Longest match the compressor looks for, at most LZ_MAX_MATCH. Longer is
+// better for slowly changing arrays, but costs RAM and search time.
+#ifndef TELEMETRY_COMPRESSION_LOOKAHEAD
+#define TELEMETRY_COMPRESSION_LOOKAHEAD 32
+#endif
+
+// Set to 1 to support batching data updates from several do_io calls into
+// one packet (see set_batching), at the cost of a second transmit buffer.
+#ifndef TELEMETRY_BATCHING
+#define TELEMETRY_BATCHING 0
+#endif
+
+// Set to 1 to support sending packets too large for the transmit buffer in
+// chunks, with urgent data sent between them (see set_chunking and
+// set_urgent).
+#ifndef TELEMETRY_CHUNKING
+#define TELEMETRY_CHUNKING 0
+#endif
+
 #ifndef TELEMETRY_SERIAL_RX_BUFFER_SIZE
 #define TELEMETRY_SERIAL_RX_BUFFER_SIZE 256
 #endif
 
+// Set to 1 to also publish the Stats histograms in StatsChannels, at the cost
+// of three more data objects.
+#ifndef TELEMETRY_STATS_HISTOGRAMS
+#define TELEMETRY_STATS_HISTOGRAMS 0
+#endif
+
 namespace telemetry {
 // Maximum number of Data objects a Telemetry object can hold.
 // Used for array sizing.
 const size_t MAX_DATA_PER_TELEMETRY = TELEMETRY_DATA_LIMIT;
 
-// Maximum payload size for a received telemetry packet.
-const size_t MAX_RECEIVE_PACKET_LENGTH = 255;
+// Number of independent sets of data updated flags.
+const size_t PRODUCER_SLOTS = TELEMETRY_PRODUCER_SLOTS;
+
+// Size of the buffer transmitted packets are built in. Packets containing a
+// single data payload too large for this are sent unbuffered.
+const size_t MAX_TRANSMIT_PACKET_LENGTH = TELEMETRY_TRANSMIT_PACKET_LENGTH;
+
+// Longest match the packet compressor looks for.
+const size_t COMPRESSION_LOOKAHEAD = TELEMETRY_COMPRESSION_LOOKAHEAD;
 
-// Time after which a partially received packet is discarded.
+// Timing wheel size and resolution of the transmit scheduler.
+const size_t SCHEDULER_SLOTS = TELEMETRY_SCHEDULER_SLOTS;
+const uint32_t SCHEDULER_TICK_MS = TELEMETRY_SCHEDULER_TICK_MS;
+
+// Maximum size of a single element (like a number, or an array element) of a
+// received data payload. Received packets are parsed as they arrive and only
+// buffered one element at a time.
+const size_t MAX_RECEIVE_ELEMENT_LENGTH = 8;
+
+// Default time after which a partially received packet is discarded.
 const uint32_t DECODER_TIMEOUT_MS = 100;
 
 // Buffer size for received non-telemetry data.
@@ -43,25 +142,58 @@ const size_t SERIAL_RX_BUFFER_SIZE = TELEMETRY_SERIAL_RX_BUFFER_SIZE;
   #include "telemetry-mbed-hal.h"
 #endif
 
+#if defined(TELEMETRY_HOST)
+  #ifdef TELEMETRY_HAL
+    #error "Multiple telemetry HALs defined"
+  #endif
+  #include "telemetry-host-hal.h"
+#endif
+
 #ifndef TELEMETRY_HAL
   #error "No telemetry HAL defined"
 #endif
 
 #include "telemetry-dummy-hal.h"
 
+// Wraps a metadata string literal to place it in program memory, if needed
+// (HALs may define this when TELEMETRY_METADATA_IN_FLASH is set).
+#ifndef TELEMETRY_METADATA
+#define TELEMETRY_METADATA(str) (str)
+#endif
+
+// Reads a byte of a metadata string.
+#ifndef TELEMETRY_READ_METADATA_BYTE
+#define TELEMETRY_READ_METADATA_BYTE(ptr) (*(const uint8_t*)(ptr))
+#endif
+
 #include "protocol.h"
 #include "packet.h"
 #include "queue.h"
+#include "stats.h"
+#include "flags.h"
+#include "scheduler.h"
+#include "compress.h"
 
 namespace telemetry {
+class StatsChannels;
+
+// Writes a metadata string, including the null terminator.
+void packet_write_string(TransmitPacket& packet, const char* str);
+// Returns the length of a metadata string, excluding the null terminator.
+size_t metadata_strlen(const char* str);
+
 // Abstract base class for telemetry data objects.
 class Data {
 public:
   Data(const char* internal_name, const char* display_name,
       const char* units):
+#if TELEMETRY_STRIP_METADATA
+      internal_name(internal_name) {};
+#else
       internal_name(internal_name),
       display_name(display_name),
       units(units) {};
+#endif
 
   virtual ~Data() {}
 
@@ -69,25 +201,49 @@ public:
   virtual uint8_t get_data_type() = 0;
 
   // Returns the length of the header KVRs, in bytes. Does not include the
-  // terminator header.
+  // terminator header. Only used if the header doesn't fit in the transmit
+  // buffer.
   virtual size_t get_header_kvrs_length();
   // Writes the header KVRs to the transmit packet. Does not write the
   // terminiator header.
   virtual void write_header_kvrs(TransmitPacket& packet);
 
-  // Returns the length of the payload, in bytes. Should be "fast".
-  virtual size_t get_payload_length() = 0;
+  // Returns the length of the payload, in bytes. Only used for payloads
+  // which don't fit in the transmit buffer.
+  virtual size_t get_payload_length() {
+    return get_element_length() * get_element_count();
+  }
   // Writes the payload to the transmit packet. Should be "fast".
   virtual void write_payload(TransmitPacket& packet) = 0;
-
-  // Sets my value from the received packet, interpreting the current packet
-  // read position as my data type.
-  virtual void set_from_packet(ReceivePacketBuffer& packet) = 0;
+  // Called once a packet containing the payload last written has been sent,
+  // but not if that payload was rewound or deferred.
+  virtual void payload_transmitted() {}
+
+  // Returns the length, in bytes, of each element of a received payload.
+  // Must not exceed MAX_RECEIVE_ELEMENT_LENGTH.
+  virtual size_t get_element_length() = 0;
+  // Returns the number of elements in a received payload.
+  virtual size_t get_element_count() {
+    return 1;
+  }
+  // Sets an element of my value from a received payload as soon as it
+  // arrives, reading from a packet buffer containing only that element.
+  // Elements are set in order, starting from zero.
+  virtual void set_element_from_packet(size_t index,
+      ReceivePacketBuffer& packet) = 0;
+  // Called once all elements of a received payload have been set.
+  virtual void set_from_packet_done() {}
+  // Called at the end of a received frame in which set_from_packet_done was
+  // called, with whether the frame was received intact (its length and
+  // framing checked out). Received values may be held back until then.
+  virtual void set_from_frame_done(bool intact) {}
 
 protected:
   const char* internal_name;
+#if !TELEMETRY_STRIP_METADATA
   const char* display_name;
   const char* units;
+#endif
 };
 
 // Telemetry Server object.
@@ -98,29 +254,187 @@ public:
     data_count(0),
     received_packet(ReceivePacketBuffer(hal)),
     decoder_state(SOF),
+    receive_state(RX_OPCODE),
+    receive_data(NULL),
+    receive_element(0),
+    receive_data_id(0),
+    receive_data_id_shift(0),
+    receive_opcode(0),
+    receive_done_begin(0),
+    receive_done_end(0),
+    receive_frame_intact(true),
+    probe_token_length(0),
+    probe_receive_time_us(0),
+    probe_reply_pending(false),
     decoder_pos(0),
     packet_length(0),
-	  decoder_last_received(false),
-	  decoder_last_receive_ms(0),
+    cobs_remaining(0),
+    cobs_zero_pending(false),
+    decoder_last_receive_ms(0),
+    decoder_timeout_ms(DECODER_TIMEOUT_MS),
     header_transmitted(false),
+    header_data_count(0),
     packet_tx_sequence(0),
-    packet_rx_sequence(0) {};
+    packet_rx_sequence(0),
+    nonblocking(false),
+    framing(protocol::FRAMING_STUFFED),
+    namespace_id(0),
+    io_time_ms(0),
+#if TELEMETRY_COMPRESSION
+    compression(false),
+    receive_compressed(false),
+#endif
+#if TELEMETRY_BATCHING
+    batch_max_cycles(0),
+    batch_max_latency_ms(0),
+    batch_max_bytes(0),
+    batch_cycle_offsets(false),
+    batch_length(0),
+    batch_cycle(0),
+    batch_start_ms(0),
+#endif
+#if TELEMETRY_CHUNKING
+    chunk_length(0),
+    chunk_transfer(0),
+    chunk_resume_header(false),
+    chunk_resume_idx(0),
+    chunk_resume_offset(0),
+    chunk_resume_length(0),
+#endif
+    stats_channels(NULL) {
+#if TELEMETRY_CHUNKING
+    for (size_t i=0; i<(MAX_DATA_PER_TELEMETRY + 31) / 32; i++) {
+      urgent_mask[i] = 0;
+    }
+#endif
+  };
 
-  // Associates a DataInterface with this object, returning the data ID.
+  // Associates a DataInterface with this object, returning the data ID. Data
+  // added after the header is transmitted is announced in a header append
+  // packet by the next transmit_data, so it must be added from the thread
+  // calling do_io.
   size_t add_data(Data& new_data);
 
   // Marks a data ID as updated, to be transmitted in the next packet.
-  void mark_data_updated(size_t data_id);
+  // Thread-safe (and lock-free) if TELEMETRY_THREADSAFE is set.
+  void mark_data_updated(size_t data_id) {
+    if (PRODUCER_SLOTS > 1) {
+      data_updated.set(data_id, hal.get_producer_slot());
+    } else {
+      data_updated.set(data_id);
+    }
+  }
 
-  // Transmits header data. Must be called after all add_data calls are done
-  // and before and IO is done.
+  // Transmits header data. Must be called once, after the initial add_data
+  // calls and before any IO is done.
   void transmit_header();
 
   // Does IO, including transmitting telemetry packets. Should be called on
   // a regular basis. Since this does IO, this may block depending on the HAL
-  // semantics.
+  // semantics, unless non-blocking transmit is enabled.
   void do_io();
 
+  // Sets non-blocking transmit mode. When enabled, a data packet is only
+  // sent if it fits in the HAL's tx_space. Otherwise, nothing more is sent
+  // and updated data remains pending for the next do_io, where newer values
+  // replace older ones. A payload too large for the transmit buffer is only
+  // sent once its whole frame fits, so never if that's larger than the HAL's
+  // transmit buffer (see Stats::tx_unbuffered_deferred), unless chunking is
+  // set. The header is always sent, while definitions of data added after it
+  // are deferred like data, and hold back all data until they're sent. The
+  // HAL's tx_space must report its transmit buffer space: with the Arduino
+  // HAL, Streams whose availableForWrite isn't implemented are treated as
+  // unbounded, so as blocking. On mbed, use MbedBufferedHal with a buffered
+  // serial (like MODSERIAL), since a plain Serial only has room for a byte.
+  void set_nonblocking(bool enabled) {
+    nonblocking = enabled;
+  }
+
+  // Sets the framing of transmitted packets, byte stuffing (the default) or
+  // COBS, which has bounded overhead and resynchronizes on a single delimiter
+  // byte. Received packets are accepted in either framing. Unbuffered COBS
+  // packets need a transmit buffer of at least COBS_MAX_BLOCK bytes.
+  void set_framing(protocol::Framing new_framing) {
+    framing = new_framing;
+  }
+
+  // Sets the namespace of this object's packets, so several Telemetry objects
+  // (each with its own data IDs and header) can share a link, the default
+  // being namespace 0. Must be set before the header is transmitted. Received
+  // packets in other namespaces are ignored.
+  void set_namespace(uint8_t new_namespace) {
+    namespace_id = new_namespace;
+  }
+
+#if TELEMETRY_COMPRESSION
+  // Sets whether transmitted packets are compressed. Each packet is only sent
+  // compressed if that makes it smaller, which is flagged in its opcode.
+  // Headers of any size and data packets which fit in the transmit buffer are
+  // compressed. Compressed received packets are always accepted.
+  void set_compression(bool enabled) {
+    compression = enabled;
+  }
+#endif
+
+#if TELEMETRY_BATCHING
+  // Batches data updates from up to max_cycles do_io calls into each data
+  // packet, instead of sending a packet per call, to amortize the framing and
+  // packet overhead at high do_io rates. A batch is also sent once it's
+  // max_latency_ms old (if nonzero), once it reaches max_bytes (if nonzero,
+  // otherwise when full), or when the next update doesn't fit. Data updated
+  // in several calls is sent once per call, in order. With cycle_offsets,
+  // updates are grouped by the do_io call they were made in, each group
+  // tagged with its offset in calls from the start of the batch. Zero
+  // max_cycles (the default) disables batching. Must be set before the header
+  // is transmitted.
+  void set_batching(uint16_t max_cycles, uint32_t max_latency_ms=0,
+      size_t max_bytes=0, bool cycle_offsets=false) {
+    batch_max_cycles = max_cycles;
+    batch_max_latency_ms = max_latency_ms;
+    batch_max_bytes = max_bytes;
+    batch_cycle_offsets = cycle_offsets;
+  }
+#endif
+
+#if TELEMETRY_CHUNKING
+  // Sends packets too large for the transmit buffer (large data payloads and
+  // definitions) as chunk packets of up to chunk_length bytes each (capped to
+  // what fits in the transmit buffer), instead of as one unbuffered packet.
+  // Urgent data (see set_urgent) updated while such a packet is being sent is
+  // sent between its chunks, so it waits for at most a chunk rather than the
+  // whole packet. Zero (the default) disables chunking. In nonblocking mode,
+  // chunks are sent as far as the HAL's tx_space allows, and the rest on later
+  // do_io calls, so a payload larger than the HAL's transmit buffer is still
+  // sent. Its payload is serialized again each time, so an update while it's
+  // in progress can arrive torn (it's then sent again in full). Other chunked
+  // payloads wait for the transfer in progress.
+  void set_chunking(size_t new_chunk_length) {
+    if (new_chunk_length == 0) {
+      cancel_chunked();
+    }
+    chunk_length = new_chunk_length;
+  }
+
+  // Sets whether a data object is urgent. Urgent updates are sent first on
+  // each do_io, in their own packets, and between the chunks of chunked
+  // packets (if their payload fits in the transmit buffer).
+  void set_urgent(Data& target, bool urgent=true);
+#endif
+
+#if TELEMETRY_SCHEDULER
+  // Sets the minimum period between transmissions of a data object, zero (the
+  // default) to transmit it on every do_io where it was updated. Updates
+  // within the period are held back, with newer values replacing older ones,
+  // and sent once the period has elapsed.
+  void set_period_ms(Data& target, uint32_t period_ms);
+#endif
+
+  // Sets the time after which a partially received packet is discarded,
+  // defaulting to DECODER_TIMEOUT_MS.
+  void set_decoder_timeout_ms(uint32_t timeout_ms) {
+    decoder_timeout_ms = timeout_ms;
+  }
+
   // TODO: better docs defining in-band receive.
   // Returns whether or not read_receive will return valid data.
   bool receive_available();
@@ -132,6 +446,35 @@ public:
     hal.do_error(message);
   }
 
+  // Returns the self-instrumentation counters and histograms.
+  const Stats& get_stats() const {
+    return stats;
+  }
+  // Clears the self-instrumentation counters and histograms.
+  void reset_stats() {
+    stats.reset();
+  }
+
+  // Associates a StatsChannels with this object, which will be updated on
+  // each do_io. Done automatically by the StatsChannels constructor.
+  void set_stats_channels(StatsChannels* new_stats_channels) {
+    stats_channels = new_stats_channels;
+  }
+
+  // Returns the current HAL time, in milliseconds.
+  uint32_t get_time_ms() {
+    return hal.get_time_ms();
+  }
+  // Returns the current HAL time, in microseconds.
+  uint32_t get_time_us() {
+    return hal.get_time_us();
+  }
+  // Returns the HAL time at the start of the latest do_io, in milliseconds,
+  // without calling into the HAL.
+  uint32_t get_io_time_ms() {
+    return io_time_ms;
+  }
+
 protected:
   // Transmits any updated data.
   void transmit_data();
@@ -140,8 +483,125 @@ protected:
   // data and processing received telemetry packets.
   void process_received_data();
 
-  // Handles a received packet in received_packet.
-  void process_received_packet();
+  // Handles a received (destuffed) byte of a telemetry packet.
+  void process_received_byte(uint8_t rx_byte);
+  // Handles a received (decompressed) byte of a telemetry packet payload.
+  void process_received_payload_byte(uint8_t rx_byte);
+  // Handles a decoded byte of a COBS frame, starting with the length.
+  void process_received_cobs_byte(uint8_t rx_byte);
+  // Handles the delimiter at the end of a COBS frame.
+  void process_received_cobs_end();
+
+  // Starts receiving the payload of the opcode in receive_opcode.
+  void start_receive_payload();
+  // Starts receiving a data ID.
+  void start_receive_data_id();
+
+  // Handles the end of a received telemetry packet.
+  void process_received_packet_end();
+  // Ends the payload of receive_data, noting it for the end of the frame.
+  void receive_payload_done();
+  // Ends a received frame, notifying the data with payloads in it.
+  void receive_frame_done(bool intact);
+
+  // Answers the received probe with the times it was received and answered.
+  // In nonblocking mode, a reply which doesn't fit in the HAL's transmit
+  // buffer is left pending, and retried on the next do_io.
+  void transmit_probe_reply();
+
+  // Adds a non-telemetry received byte to the receive buffer.
+  void enqueue_receive(uint8_t rx_byte);
+
+#if TELEMETRY_BATCHING
+  // Adds the updated data to the current batch, sending the batch when due.
+  void transmit_data_batched(bool* data_updated_local);
+  // Ends and sends the batch being built in packet, starting a new one.
+  // Returns false (leaving the batch unchanged) if deferred.
+  bool send_batch(BufferedTransmitPacket& packet);
+  // Returns the number of bytes to leave free in a batch for terminators.
+  size_t get_batch_reserve_length() {
+    return batch_cycle_offsets ? 2 : 1;
+  }
+#endif
+
+  // Sends a data packet containing only a payload too large for the transmit
+  // buffer, streamed directly to the HAL. Returns false if deferred.
+  bool transmit_data_unbuffered(size_t data_idx);
+
+#if TELEMETRY_CHUNKING
+  // Packet which sends what's written to it as the chunks of a chunked
+  // packet, sending urgent data between them.
+  class ChunkedTransmitPacket;
+
+  // Sends a header (if header is set) or data packet, with the given opcode,
+  // containing only the definition or payload of a data object, as a chunked
+  // packet. Returns false if deferred. In nonblocking mode, data and header
+  // append packets are sent as far as the HAL's transmit buffer allows, and
+  // the transfer left in progress is resumed (for the same data) by later
+  // calls. A data packet left in progress counts as sent, a definition as
+  // deferred.
+  bool transmit_chunked(uint8_t opcode, size_t data_idx, bool header);
+  // Abandons the chunked transfer in progress, if any, leaving its data
+  // pending.
+  void cancel_chunked();
+  // Returns the length of the packet start and chunk fields of a chunk of a
+  // chunked packet of the given total length.
+  size_t get_chunk_start_length(size_t total_length) {
+    return get_packet_start_length() + 1 + 2 * protocol::varint_length(
+        total_length);
+  }
+  // Sends the urgent data flagged in updated (whose payloads fit in the
+  // transmit buffer) in their own packets, clearing their flags.
+  void transmit_urgent(bool* updated);
+  // Sends pending urgent updates of data announced in the header, other than
+  // exclude_idx, leaving them pending if deferred.
+  void transmit_urgent_pending(size_t exclude_idx);
+  // Returns whether a data object is urgent.
+  bool is_urgent(size_t data_idx) {
+    return (urgent_mask[data_idx / 32] >> (data_idx % 32)) & 1;
+  }
+#endif
+
+  // Transmits the definitions of data from data_idx on, in as many packets
+  // as needed, the first starting a new header if new_header is set and the
+  // rest appending to it. Appends are deferred in nonblocking mode like data.
+  // Returns the index of the first definition not sent.
+  size_t transmit_header_records(size_t data_idx, bool new_header);
+  // Transmits a header packet containing only the definition of a data
+  // object, streamed directly to the HAL, for definitions too large for the
+  // transmit buffer. Returns false if deferred.
+  bool transmit_header_unbuffered(uint8_t opcode, size_t data_idx);
+  // Returns whether an unbuffered header packet of the given opcode and
+  // length, for the definition of a data object, fits in the HAL's transmit
+  // buffer.
+  bool header_fits_tx_space(uint8_t opcode, size_t data_idx,
+      size_t packet_length);
+  // Writes the definition of a data object.
+  void write_header_record(TransmitPacket& packet, size_t data_idx);
+
+  // Writes the opcode, namespace (if not 0) and sequence number of a packet.
+  void write_packet_start(TransmitPacket& packet, uint8_t opcode);
+  // Returns the length of the bytes written by write_packet_start.
+  size_t get_packet_start_length() {
+    return namespace_id != 0 ? 3 : 2;
+  }
+
+  // Sends a finished-for-writing packet from the transmit buffer, or its
+  // compressed version if smaller. Returns false (sending nothing) if
+  // non-blocking and the packet doesn't fit in the HAL's tx_space.
+  bool send_buffered_packet(BufferedTransmitPacket& packet, bool blocking);
+  // Returns whether the packet, ended with reserve_length more terminator
+  // bytes, fits in the HAL's tx_space. Packets are only filled as far as
+  // this in non-blocking mode, so they can always be sent once the HAL's
+  // transmit buffer drains, however small it is.
+  bool fits_tx_space(BufferedTransmitPacket& packet, size_t reserve_length);
+
+  // Handles a data object's payload having been sent.
+  void data_transmitted(size_t data_idx);
+
+  // Updates stats after a packet has been finished.
+  void record_transmitted_packet(bool sent, size_t payload_length,
+      size_t stuff_count);
 
   HalInterface& hal;
 
@@ -149,11 +609,11 @@ protected:
   // DataInterface's data ID field.
   Data* data[MAX_DATA_PER_TELEMETRY];
   // Whether each data has been updated or not.
-  bool data_updated[MAX_DATA_PER_TELEMETRY];
+  internal::UpdateFlags<MAX_DATA_PER_TELEMETRY, PRODUCER_SLOTS> data_updated;
   // Count of associated DataInterface objects.
   size_t data_count;
 
-  // Buffer holding the receive packet being assembled / parsed.
+  // Buffer holding the received payload element being assembled / parsed.
   ReceivePacketBuffer received_packet;
 
   enum DecoderState {
@@ -161,21 +621,132 @@ protected:
     LENGTH, // reading packet length
     DATA,   // reading telemetry packet data
     DATA_DESTUFF,     // reading a stuffed byte
-    DATA_DESTUFF_END  // last stuffed byte in a packet
+    DATA_DESTUFF_END, // last stuffed byte in a packet
+    COBS_DATA         // reading a COBS-encoded length and payload
   } decoder_state;
 
+  // State within a telemetry packet payload, parsed as it arrives.
+  enum ReceiveState {
+    RX_OPCODE,   // reading the opcode
+    RX_NAMESPACE,  // reading the namespace
+    RX_DATA_ID,  // reading a data ID, or the terminator
+    RX_ELEMENT,  // reading an element of a data payload
+    RX_PROBE,    // reading a probe token
+    RX_PROBE_DONE,  // probe token complete, to be answered at the packet end
+    RX_IGNORE    // discarding the remainder of the packet
+  } receive_state;
+
+  // Data being received, in RX_ELEMENT.
+  Data* receive_data;
+  // Index of the payload element being received, in RX_ELEMENT.
+  size_t receive_element;
+  // Data ID being received and the bit position of its next byte, in
+  // RX_DATA_ID.
+  uint32_t receive_data_id;
+  uint8_t receive_data_id_shift;
+  // Opcode (without flags) of the packet being received.
+  uint8_t receive_opcode;
+  // Range of indices of the data with payloads in the frame being received,
+  // empty if begin and end are equal, and whether the frame is intact so far.
+  size_t receive_done_begin, receive_done_end;
+  bool receive_frame_intact;
+  // Token of the probe being received, the count of its bytes received so
+  // far, and the time its opcode was received.
+  uint8_t probe_token[protocol::PROBE_TOKEN_LENGTH];
+  uint8_t probe_token_length;
+  uint32_t probe_receive_time_us;
+  // Whether the received probe has yet to be answered.
+  bool probe_reply_pending;
+
   size_t decoder_pos;
   size_t packet_length;
-  bool decoder_last_received;
+  // Bytes left in the current COBS block, and whether it ends in a zero.
+  uint8_t cobs_remaining;
+  bool cobs_zero_pending;
+  // Time of the last do_io which received data.
   uint32_t decoder_last_receive_ms;
+  // Time after which a partially received packet is discarded.
+  uint32_t decoder_timeout_ms;
 
   Queue<uint8_t, SERIAL_RX_BUFFER_SIZE> rx_buffer;
 
   bool header_transmitted;
+  // Count of data objects announced in transmitted headers.
+  size_t header_data_count;
 
   // Sequence number of the next packet to be transmitted.
   uint8_t packet_tx_sequence;
   uint8_t packet_rx_sequence; // TODO use this somewhere
+
+  // Whether transmit_data may only send packets which fit in tx_space.
+  bool nonblocking;
+  // Framing of transmitted packets.
+  protocol::Framing framing;
+  uint8_t namespace_id;
+  // HAL time at the start of the latest do_io.
+  uint32_t io_time_ms;
+
+#if TELEMETRY_SCHEDULER
+  internal::Scheduler<MAX_DATA_PER_TELEMETRY, SCHEDULER_SLOTS,
+      SCHEDULER_TICK_MS> scheduler;
+#endif
+
+#if TELEMETRY_COMPRESSION
+  // Whether transmitted packets are compressed.
+  bool compression;
+  // Whether the packet being received is compressed.
+  bool receive_compressed;
+  LzEncoder<COMPRESSION_LOOKAHEAD> tx_compressor;
+  LzDecoder rx_decompressor;
+  // Buffer compressed packets are built in.
+  uint8_t tx_compress_buffer[MAX_TRANSMIT_PACKET_LENGTH];
+#endif
+
+#if TELEMETRY_BATCHING
+  uint16_t batch_max_cycles;
+  uint32_t batch_max_latency_ms;
+  size_t batch_max_bytes;
+  bool batch_cycle_offsets;
+  // Length of the batch built so far in tx_batch_buffer, zero before the
+  // first is started.
+  size_t batch_length;
+  // do_io calls since the batch was started, and the time it was started.
+  uint16_t batch_cycle;
+  uint32_t batch_start_ms;
+  // Buffer data packets are batched in, across do_io calls.
+  uint8_t tx_batch_buffer[MAX_TRANSMIT_PACKET_LENGTH];
+#endif
+
+#if TELEMETRY_CHUNKING
+  // Maximum chunk length, zero if chunking is disabled.
+  size_t chunk_length;
+  // Transfer number of the next chunked packet.
+  uint8_t chunk_transfer;
+  // Whether the chunked transfer left in progress in nonblocking mode is a
+  // definition (else a payload), of which data, the bytes of it sent (zero if
+  // none is in progress), and its total length.
+  bool chunk_resume_header;
+  size_t chunk_resume_idx;
+  size_t chunk_resume_offset;
+  size_t chunk_resume_length;
+  // Whether each data is urgent, as 32-bit words, LSB first.
+  uint32_t urgent_mask[(MAX_DATA_PER_TELEMETRY + 31) / 32];
+#endif
+
+  // Buffer transmitted packets are built in.
+  uint8_t tx_packet_buffer[MAX_TRANSMIT_PACKET_LENGTH];
+
+  Stats stats;
+  StatsChannels* stats_channels;
+};
+
+// Change suppression modes for Numeric, comparing an assigned value against
+// the last value which was marked for transmission.
+enum Suppression {
+  SUPPRESS_NONE,       // every assignment is transmitted
+  SUPPRESS_UNCHANGED,  // skip values equal to the last
+  SUPPRESS_ABSOLUTE,   // skip values within a deadband of the last
+  SUPPRESS_RELATIVE    // skip values within a fraction of the last
 };
 
 template <typename T>
@@ -186,12 +757,26 @@ public:
       const char* units, T init_value):
       Data(internal_name, display_name, units),
       telemetry_container(telemetry_container),
-      value(init_value), min_val(init_value), max_val(init_value) {
+      value(init_value), min_val(init_value), max_val(init_value)
+#if TELEMETRY_CHANGE_SUPPRESSION
+      , suppression(SUPPRESS_NONE), deadband(0), refresh_ms(0),
+      reference(init_value), reference_ms(0)
+#endif
+      {
     data_id = telemetry_container.add_data(*this);
   }
 
   T operator = (T b) {
     value = b;
+#if TELEMETRY_CHANGE_SUPPRESSION
+    if (suppression != SUPPRESS_NONE) {
+      if (is_suppressed(b)) {
+        return b;
+      }
+      reference = b;
+      reference_ms = telemetry_container.get_io_time_ms();
+    }
+#endif
     telemetry_container.mark_data_updated(data_id);
     return b;
   }
@@ -206,13 +791,32 @@ public:
     return *this;
   }
 
+#if TELEMETRY_CHANGE_SUPPRESSION
+  // Sets change suppression: assignments which don't differ from the last
+  // transmitted value by more than the deadband (an absolute difference, or
+  // a fraction of that value) aren't marked for transmission, unless
+  // refresh_ms (if nonzero) have passed since it was marked. Refreshes are
+  // only checked on assignment, using the time of the latest do_io. With
+  // concurrent producers, values are compared against whichever was last
+  // marked.
+  Numeric<T>& set_suppression(Suppression mode, float new_deadband=0,
+      uint32_t new_refresh_ms=0) {
+    suppression = mode;
+    deadband = new_deadband;
+    refresh_ms = new_refresh_ms;
+    reference = value;
+    reference_ms = telemetry_container.get_io_time_ms();
+    return *this;
+  }
+#endif
+
   uint8_t get_data_type() { return protocol::DATATYPE_NUMERIC; }
 
   size_t get_header_kvrs_length() {
     return Data::get_header_kvrs_length()
         + 1 + 1   // subtype
         + 1 + 1   // data length
-        + 1 + sizeof(value) + sizeof(value);  // limits
+        + 1 + sizeof(T) + sizeof(T);  // limits
   }
 
   void write_header_kvrs(TransmitPacket& packet) {
@@ -220,16 +824,22 @@ public:
     packet.write_uint8(protocol::RECORDID_NUMERIC_SUBTYPE);
     packet.write_uint8(protocol::numeric_subtype<T>());
     packet.write_uint8(protocol::RECORDID_NUMERIC_LENGTH);
-    packet.write_uint8(sizeof(value));
+    packet.write_uint8(sizeof(T));
     packet.write_uint8(protocol::RECORDID_NUMERIC_LIMITS);
     serialize_data(min_val, packet);
     serialize_data(max_val, packet);
   }
 
-  size_t get_payload_length() { return sizeof(value); }
   void write_payload(TransmitPacket& packet) { serialize_data(value, packet); }
-  void set_from_packet(ReceivePacketBuffer& packet) {
-    value = deserialize_data(packet);
+
+  size_t get_element_length() { return sizeof(T); }
+  void set_element_from_packet(size_t index, ReceivePacketBuffer& packet) {
+    value = deserialize_data(packet); }
+  void set_from_packet_done() {
+#if TELEMETRY_CHANGE_SUPPRESSION
+    reference = value;
+    reference_ms = telemetry_container.get_io_time_ms();
+#endif
     telemetry_container.mark_data_updated(data_id); }
 
   void serialize_data(T value, TransmitPacket& packet) {
@@ -241,9 +851,157 @@ public:
 
 
 protected:
+#if TELEMETRY_CHANGE_SUPPRESSION
+  // Returns whether an assigned value should not be marked for transmission.
+  bool is_suppressed(T b) {
+    if (suppression == SUPPRESS_UNCHANGED) {
+      if (b != reference) {
+        return false;
+      }
+    } else {
+      float difference = (float)b - (float)reference;
+      if (difference < 0) {
+        difference = -difference;
+      }
+      float limit = deadband;
+      if (suppression == SUPPRESS_RELATIVE) {
+        float magnitude = (float)reference;
+        limit *= magnitude < 0 ? -magnitude : magnitude;
+      }
+      if (difference > limit) {
+        return false;
+      }
+    }
+    return refresh_ms == 0
+        || telemetry_container.get_io_time_ms() - reference_ms < refresh_ms;
+  }
+#endif
+
+  Telemetry& telemetry_container;
+  size_t data_id;
+  internal::Value<T> value;
+  T min_val, max_val;
+
+#if TELEMETRY_CHANGE_SUPPRESSION
+  Suppression suppression;
+  float deadband;
+  uint32_t refresh_ms;
+  // Last value marked for transmission, and the do_io time it was marked.
+  T reference;
+  uint32_t reference_ms;
+#endif
+};
+
+/**
+ * Numeric data which aggregates all values assigned between transmits,
+ * sending their count, min, max and mean instead of only the latest value,
+ * so excursions shorter than the transmit period are still visible. Each
+ * assignment is O(1). The window restarts once a payload has been sent.
+ *
+ * Unlike Numeric, the aggregate isn't atomic, so it must only be assigned
+ * from the same thread as do_io. The running sum is a double, which is only
+ * single precision on AVR.
+ */
+template <typename T>
+class Aggregate : public Data {
+public:
+  Aggregate(Telemetry& telemetry_container,
+      const char* internal_name, const char* display_name,
+      const char* units, T init_value):
+      Data(internal_name, display_name, units),
+      telemetry_container(telemetry_container),
+      value(init_value), count(0), window_min(init_value),
+      window_max(init_value), sum(0),
+      min_val(init_value), max_val(init_value) {
+    data_id = telemetry_container.add_data(*this);
+  }
+
+  // Adds a value to the window.
+  T operator = (T b) {
+    add(b);
+    telemetry_container.mark_data_updated(data_id);
+    return b;
+  }
+
+  // Returns the latest value.
+  operator T() {
+    return value;
+  }
+
+  Aggregate<T>& set_limits(T min, T max) {
+    min_val = min;
+    max_val = max;
+    return *this;
+  }
+
+  uint8_t get_data_type() { return protocol::DATATYPE_AGGREGATE; }
+
+  size_t get_header_kvrs_length() {
+    return Data::get_header_kvrs_length()
+        + 1 + 1   // subtype
+        + 1 + 1   // data length
+        + 1 + sizeof(T) + sizeof(T);  // limits
+  }
+
+  void write_header_kvrs(TransmitPacket& packet) {
+    Data::write_header_kvrs(packet);
+    packet.write_uint8(protocol::RECORDID_NUMERIC_SUBTYPE);
+    packet.write_uint8(protocol::numeric_subtype<T>());
+    packet.write_uint8(protocol::RECORDID_NUMERIC_LENGTH);
+    packet.write_uint8(sizeof(T));
+    packet.write_uint8(protocol::RECORDID_NUMERIC_LIMITS);
+    packet.write<T>(min_val);
+    packet.write<T>(max_val);
+  }
+
+  size_t get_payload_length() {
+    return 4 + sizeof(T) + sizeof(T) + 4;
+  }
+
+  void write_payload(TransmitPacket& packet) {
+    packet.write_uint32(count);
+    if (count > 0) {
+      packet.write<T>(window_min);
+      packet.write<T>(window_max);
+      packet.write_float(sum / count);
+    } else {
+      packet.write<T>(value);
+      packet.write<T>(value);
+      packet.write_float(value);
+    }
+  }
+
+  void payload_transmitted() {
+    count = 0;
+    sum = 0;
+  }
+
+  // Received values are added to the window like assignments.
+  size_t get_element_length() { return sizeof(T); }
+  void set_element_from_packet(size_t index, ReceivePacketBuffer& packet) {
+    add(packet.read<T>()); }
+  void set_from_packet_done() {
+    telemetry_container.mark_data_updated(data_id); }
+
+protected:
+  void add(T b) {
+    value = b;
+    if (count == 0 || b < window_min) {
+      window_min = b;
+    }
+    if (count == 0 || b > window_max) {
+      window_max = b;
+    }
+    sum += b;
+    count++;
+  }
+
   Telemetry& telemetry_container;
   size_t data_id;
   T value;
+  uint32_t count;
+  T window_min, window_max;
+  double sum;
   T min_val, max_val;
 };
 
@@ -284,7 +1042,7 @@ public:
         + 1 + 1   // subtype
         + 1 + 1   // data length
         + 1 + 4   // array length
-        + 1 + sizeof(value[0]) + sizeof(value[0]);  // limits
+        + 1 + sizeof(T) + sizeof(T);  // limits
   }
 
   void write_header_kvrs(TransmitPacket& packet) {
@@ -292,7 +1050,7 @@ public:
     packet.write_uint8(protocol::RECORDID_NUMERIC_SUBTYPE);
     packet.write_uint8(protocol::numeric_subtype<T>());
     packet.write_uint8(protocol::RECORDID_NUMERIC_LENGTH);
-    packet.write_uint8(sizeof(value[0]));
+    packet.write_uint8(sizeof(T));
     packet.write_uint8(protocol::RECORDID_ARRAY_COUNT);
     packet.write_uint32(array_count);
     packet.write_uint8(protocol::RECORDID_NUMERIC_LIMITS);
@@ -300,11 +1058,14 @@ public:
     serialize_data(max_val, packet);
   }
 
-  size_t get_payload_length() { return sizeof(value); }
   void write_payload(TransmitPacket& packet) {
     for (size_t i=0; i<array_count; i++) { serialize_data(this->value[i], packet); } }
-  void set_from_packet(ReceivePacketBuffer& packet) {
-    for (size_t i=0; i<array_count; i++) { value[i] = deserialize_data(packet); }
+
+  size_t get_element_length() { return sizeof(T); }
+  size_t get_element_count() { return array_count; }
+  void set_element_from_packet(size_t index, ReceivePacketBuffer& packet) {
+    value[index] = deserialize_data(packet); }
+  void set_from_packet_done() {
     telemetry_container.mark_data_updated(data_id); }
 
   void serialize_data(T data, TransmitPacket& packet) {
@@ -315,7 +1076,7 @@ public:
 protected:
   Telemetry& telemetry_container;
   size_t data_id;
-  T value[array_count];
+  internal::Value<T> value[array_count];
   T min_val, max_val;
 };
 
@@ -340,6 +1101,973 @@ protected:
   size_t index;
 };
 
+/**
+ * Array of array_count elements in caller-owned memory, such as a DMA buffer,
+ * sent the same as a NumericArray. Nothing is copied: publish() marks the
+ * array updated once, and the payload is serialized straight from the buffer
+ * when transmitted, so the buffer must not be overwritten until is_pending()
+ * returns false.
+ *
+ * For ping-pong (double) buffering, two buffers can be given, and each is
+ * published by index as it fills. Publishing replaces any pending buffer,
+ * which is then not sent. Neither buffer may be overwritten while
+ * is_pending() returns true: a do_io may still be serializing the previously
+ * published buffer after the other is published. Values received from the
+ * host are written into the last published buffer.
+ *
+ * publish() may be called from an interrupt or another thread than do_io (in
+ * which case TELEMETRY_THREADSAFE must be set).
+ */
+template <typename T, uint32_t array_count>
+class NumericArrayView : public Data {
+public:
+  NumericArrayView(Telemetry& telemetry_container,
+      const char* internal_name, const char* display_name,
+      const char* units, T* buffer0, T* buffer1=NULL):
+      Data(internal_name, display_name, units),
+      telemetry_container(telemetry_container),
+      published_buffer(0), written_buffer(0), published_count(0),
+      written_count(0), transmitted_count(0), min_val(0), max_val(0) {
+    buffers[0] = buffer0;
+    buffers[1] = buffer1 != NULL ? buffer1 : buffer0;
+    data_id = telemetry_container.add_data(*this);
+  }
+
+  // Publishes a buffer (0 or 1) whose contents are ready to be sent.
+  void publish(uint8_t buffer_index=0) {
+    published_buffer = buffer_index;
+    published_count = published_count + 1;
+    telemetry_container.mark_data_updated(data_id);
+  }
+
+  // Returns whether the last published buffer has yet to be sent, in which
+  // case neither buffer may be modified.
+  bool is_pending() {
+    return transmitted_count != published_count;
+  }
+
+  // Returns a buffer (0 or 1).
+  T* get_buffer(uint8_t buffer_index=0) {
+    return buffers[buffer_index];
+  }
+
+  NumericArrayView<T, array_count>& set_limits(T min, T max) {
+    min_val = min;
+    max_val = max;
+    return *this;
+  }
+
+  uint8_t get_data_type() { return protocol::DATATYPE_NUMERIC_ARRAY; }
+
+  size_t get_header_kvrs_length() {
+    return Data::get_header_kvrs_length()
+        + 1 + 1   // subtype
+        + 1 + 1   // data length
+        + 1 + 4   // array length
+        + 1 + sizeof(T) + sizeof(T);  // limits
+  }
+
+  void write_header_kvrs(TransmitPacket& packet) {
+    Data::write_header_kvrs(packet);
+    packet.write_uint8(protocol::RECORDID_NUMERIC_SUBTYPE);
+    packet.write_uint8(protocol::numeric_subtype<T>());
+    packet.write_uint8(protocol::RECORDID_NUMERIC_LENGTH);
+    packet.write_uint8(sizeof(T));
+    packet.write_uint8(protocol::RECORDID_ARRAY_COUNT);
+    packet.write_uint32(array_count);
+    packet.write_uint8(protocol::RECORDID_NUMERIC_LIMITS);
+    packet.write<T>(min_val);
+    packet.write<T>(max_val);
+  }
+
+  void write_payload(TransmitPacket& packet) {
+    // The published buffer is latched until its payload is transmitted, so a
+    // payload written again (after a deferral, or to resume a chunked
+    // transfer) is the same one. The count is read first, so a buffer
+    // published meanwhile is sent but stays pending.
+    if (written_count == transmitted_count) {
+      written_count = published_count;
+      written_buffer = published_buffer;
+    }
+    const T* buffer = buffers[written_buffer];
+    for (size_t i=0; i<array_count; i++) {
+      packet.write<T>(buffer[i]);
+    }
+  }
+  void payload_transmitted() {
+    transmitted_count = written_count;
+  }
+
+  size_t get_element_length() { return sizeof(T); }
+  size_t get_element_count() { return array_count; }
+  void set_element_from_packet(size_t index, ReceivePacketBuffer& packet) {
+    buffers[published_buffer][index] = packet.read<T>();
+  }
+  void set_from_packet_done() {
+    telemetry_container.mark_data_updated(data_id);
+  }
+
+protected:
+  Telemetry& telemetry_container;
+  size_t data_id;
+  T* buffers[2];
+  internal::Value<uint8_t> published_buffer;
+  // Buffer of the payload being written until transmitted.
+  uint8_t written_buffer;
+  // Count of publish() calls, as of the last written and transmitted
+  // payloads.
+  internal::Value<uint32_t> published_count;
+  uint32_t written_count;
+  internal::Value<uint32_t> transmitted_count;
+  T min_val, max_val;
+};
+
+/**
+ * Downlink sample stream with credit-based flow control: the host sends
+ * samples of type T, which are queued in a FIFO of DEPTH samples and taken by
+ * read() at the consumer's rate (like a playback loop). The payload reports
+ * the stream position of the next expected sample and the free FIFO slots,
+ * and the host sends no samples beyond that position plus the free slots, so
+ * the FIFO never overflows however fast the host sends, and can be kept full
+ * so it doesn't underrun.
+ *
+ * Received records are a uint32 stream position (of the first sample) and a
+ * uint8 sample count, then the samples. Samples before the expected position
+ * (duplicates) or a FIFO depth or more beyond it are ignored, and a gap (from
+ * a lost frame) is skipped and counted as dropped. Samples are only queued
+ * once their record is complete and the frame containing it was received
+ * intact, so a corrupt frame's samples are never played. Each received
+ * frame with records, and each credit interval of reads (a quarter of the
+ * FIFO by default), marks a report for transmission, as does the first
+ * underrun after samples were available.
+ *
+ * read() may be called from an interrupt or another thread than do_io (in
+ * which case TELEMETRY_THREADSAFE must be set). DEPTH must be below 65536.
+ */
+template <typename T, size_t DEPTH>
+class SampleStream : public Data {
+public:
+  SampleStream(Telemetry& telemetry_container,
+      const char* internal_name, const char* display_name,
+      const char* units):
+      Data(internal_name, display_name, units),
+      telemetry_container(telemetry_container),
+      credit_interval(DEPTH / 4 > 0 ? DEPTH / 4 : 1),
+      reads(0), reads_marked(0), starved(false),
+      underruns(0), underruns_reported(0), dropped(0), dropped_reported(0),
+      position(0), rx_index(0), rx_position(0), rx_count(0),
+      staged_position(0), staged_count(0), staged_dropped(0),
+      rx_staged_position(0), rx_staged_count(0), rx_staged_dropped(0),
+      frame_received(false), sent_underruns(0), sent_dropped(0) {
+    data_id = telemetry_container.add_data(*this);
+    // Announces the initial credit.
+    telemetry_container.mark_data_updated(data_id);
+  }
+
+  // Sets the number of reads after which a report (returning credit to the
+  // host) is marked for transmission. Smaller intervals keep the FIFO fuller
+  // at the cost of more uplink traffic.
+  SampleStream<T, DEPTH>& set_credit_interval(uint32_t interval) {
+    credit_interval = interval > 0 ? interval : 1;
+    return *this;
+  }
+
+  // Takes the next sample into out, returning false (and counting an
+  // underrun) if the FIFO is empty.
+  bool read(T* out) {
+    if (!fifo.dequeue(out)) {
+      underruns = underruns + 1;
+      if (!starved) {
+        starved = true;
+        telemetry_container.mark_data_updated(data_id);
+      }
+      return false;
+    }
+    starved = false;
+    uint32_t new_reads = reads + 1;
+    reads = new_reads;
+    if (new_reads - reads_marked >= credit_interval) {
+      reads_marked = new_reads;
+      telemetry_container.mark_data_updated(data_id);
+    }
+    return true;
+  }
+
+  // Returns the number of queued samples.
+  size_t available() { return fifo.size(); }
+
+  // Returns the number of underruns and dropped samples since this object was
+  // created.
+  uint32_t get_underruns() { return underruns; }
+  uint32_t get_dropped() { return dropped; }
+
+  uint8_t get_data_type() { return protocol::DATATYPE_STREAM; }
+
+  size_t get_header_kvrs_length() {
+    return Data::get_header_kvrs_length()
+        + 1 + 1   // subtype
+        + 1 + 1   // data length
+        + 1 + 4;  // depth
+  }
+
+  void write_header_kvrs(TransmitPacket& packet) {
+    Data::write_header_kvrs(packet);
+    packet.write_uint8(protocol::RECORDID_NUMERIC_SUBTYPE);
+    packet.write_uint8(protocol::numeric_subtype<T>());
+    packet.write_uint8(protocol::RECORDID_NUMERIC_LENGTH);
+    packet.write_uint8(sizeof(T));
+    packet.write_uint8(protocol::RECORDID_ARRAY_COUNT);
+    packet.write_uint32(DEPTH);
+  }
+
+  size_t get_payload_length() { return 4 + 2 + 2 + 2; }
+
+  void write_payload(TransmitPacket& packet) {
+    packet.write_uint32(position);
+    packet.write_uint16(DEPTH - fifo.size());
+    uint32_t new_underruns = underruns - underruns_reported;
+    sent_underruns = new_underruns < 0xffff ? new_underruns : 0xffff;
+    packet.write_uint16(sent_underruns);
+    uint32_t new_dropped = dropped - dropped_reported;
+    sent_dropped = new_dropped < 0xffff ? new_dropped : 0xffff;
+    packet.write_uint16(sent_dropped);
+  }
+
+  void payload_transmitted() {
+    underruns_reported += sent_underruns;
+    dropped_reported += sent_dropped;
+    sent_underruns = 0;
+    sent_dropped = 0;
+  }
+
+  size_t get_element_length() {
+    if (rx_index == 0) {
+      return 4;  // position
+    } else if (rx_index == 1) {
+      return 1;  // count
+    } else {
+      return sizeof(T);
+    }
+  }
+  size_t get_element_count() { return rx_index < 2 ? 2 : 2 + rx_count; }
+
+  void set_element_from_packet(size_t index, ReceivePacketBuffer& packet) {
+    rx_index = index + 1;
+    if (index == 0) {
+      rx_position = packet.read_uint32();
+      rx_staged_position = staged_position;
+      rx_staged_count = staged_count;
+      rx_staged_dropped = staged_dropped;
+    } else if (index == 1) {
+      rx_count = packet.read_uint8();
+    } else {
+      T sample = packet.read<T>();
+      int32_t ahead = (int32_t)(rx_position - rx_staged_position);
+      rx_position++;
+      if (ahead < 0 || ahead >= (int32_t)DEPTH) {
+        // Already received, or beyond any credit given (so corrupt, or from
+        // a host out of sync, which resynchronizes from the reports).
+        return;
+      }
+      rx_staged_dropped += ahead;
+      rx_staged_position += ahead + 1;
+      if (fifo.stage(rx_staged_count, sample)) {
+        rx_staged_count++;
+      } else {
+        rx_staged_dropped++;  // host exceeded its credit
+      }
+    }
+  }
+
+  // Keeps the samples of a complete record, until the end of the frame.
+  void set_from_packet_done() {
+    if (rx_index >= 2 && rx_index == 2 + (size_t)rx_count) {
+      staged_position = rx_staged_position;
+      staged_count = rx_staged_count;
+      staged_dropped = rx_staged_dropped;
+    }
+    rx_index = 0;
+    rx_count = 0;
+    frame_received = true;
+  }
+
+  // Queues the kept samples if the frame was intact. A record without
+  // samples requests a report.
+  void set_from_frame_done(bool intact) {
+    if (!frame_received) {
+      return;
+    }
+    if (intact) {
+      fifo.commit(staged_count);
+      position = staged_position;
+      dropped += staged_dropped;
+    }
+    staged_position = position;
+    staged_count = 0;
+    staged_dropped = 0;
+    frame_received = false;
+    telemetry_container.mark_data_updated(data_id);
+  }
+
+protected:
+  Telemetry& telemetry_container;
+  size_t data_id;
+
+  Queue<T, DEPTH> fifo;
+  uint32_t credit_interval;
+
+  // Reads and underruns, counted by the consumer, with the reads as of the
+  // last report marked and whether the last read underran.
+  internal::Value<uint32_t> reads;
+  uint32_t reads_marked;
+  internal::Value<bool> starved;
+  internal::Value<uint32_t> underruns;
+  uint32_t underruns_reported;
+  // Samples dropped, and of those the number reported.
+  uint32_t dropped;
+  uint32_t dropped_reported;
+
+  // Stream position of the next expected sample.
+  uint32_t position;
+  // Next element, position and sample count of the record being received.
+  size_t rx_index;
+  uint32_t rx_position;
+  uint8_t rx_count;
+  // Stream position after, count of, and samples dropped before the samples
+  // staged in the FIFO by complete records of the frame being received, then
+  // the same including the record being received, and whether the frame had
+  // any records.
+  uint32_t staged_position;
+  size_t staged_count;
+  uint32_t staged_dropped;
+  uint32_t rx_staged_position;
+  size_t rx_staged_count;
+  uint32_t rx_staged_dropped;
+  bool frame_received;
+
+  // Counts in the last written payload.
+  uint16_t sent_underruns;
+  uint16_t sent_dropped;
+};
+
+// Trigger conditions for Capture.
+enum TriggerMode {
+  TRIGGER_RISING,   // the channel crosses the level upwards
+  TRIGGER_FALLING,  // the channel crosses the level downwards
+  TRIGGER_ABOVE,    // the channel is above the level
+  TRIGGER_BELOW     // the channel is below the level
+};
+
+/**
+ * Oscilloscope-style capture of CHANNELS channels into a ring of DEPTH
+ * samples, taken at loop rate with sample(). While armed, the ring holds
+ * the most recent samples; once the trigger condition is met, the remaining
+ * post-trigger samples are taken and the ring is frozen and sent as a burst,
+ * a chunk per transmit packet at whatever rate the link allows. Sampling
+ * while a burst is being sent is ignored. Once sent, the capture re-arms
+ * (unless auto re-arm was disabled, in which case arm() must be called).
+ * DEPTH is at most 65535 and CHANNELS at most 255.
+ *
+ * sample() must be called from the same thread as do_io.
+ */
+template <typename T, size_t CHANNELS, size_t DEPTH>
+class Capture : public Data {
+public:
+  Capture(Telemetry& telemetry_container,
+      const char* internal_name, const char* display_name,
+      const char* units, size_t pretrigger):
+      Data(internal_name, display_name, units),
+      telemetry_container(telemetry_container),
+      pretrigger(pretrigger < DEPTH ? pretrigger : DEPTH - 1),
+      trigger_channel(0), trigger_mode(TRIGGER_RISING), trigger_level(0),
+      auto_rearm(true), force_trigger(false), last(0), has_last(false),
+      head(0), filled(0), trigger_index(0), post_remaining(0), total(0),
+      start(0), send_pos(0), capture_number(0),
+      min_val(0), max_val(0) {
+    state = IDLE;
+    arm();
+    data_id = telemetry_container.add_data(*this);
+  }
+
+  // Sets the trigger condition, on the channel with the given index.
+  Capture<T, CHANNELS, DEPTH>& set_trigger(size_t channel, TriggerMode mode,
+      T level) {
+    trigger_channel = channel < CHANNELS ? channel : 0;
+    trigger_mode = mode;
+    trigger_level = level;
+    return *this;
+  }
+
+  Capture<T, CHANNELS, DEPTH>& set_auto_rearm(bool rearm) {
+    auto_rearm = rearm;
+    return *this;
+  }
+
+  Capture<T, CHANNELS, DEPTH>& set_limits(T min, T max) {
+    min_val = min;
+    max_val = max;
+    return *this;
+  }
+
+  // Clears the ring and waits for the trigger. Has no effect while a burst is
+  // being sent.
+  void arm() {
+    if (state == SENDING) {
+      return;
+    }
+    state = ARMED;
+    head = 0;
+    filled = 0;
+    has_last = false;
+    force_trigger = false;
+  }
+
+  // Triggers on the next sample (if armed), for events detected in code.
+  void trigger() {
+    force_trigger = true;
+  }
+
+  bool is_armed() { return state == ARMED; }
+  bool is_sending() { return state == SENDING; }
+
+  // Records a sample of all channels, taking CHANNELS values.
+  void sample(const T* values) {
+    if (state != ARMED && state != TRIGGERED) {
+      return;
+    }
+    for (size_t i=0; i<CHANNELS; i++) {
+      ring[head][i] = values[i];
+    }
+    head = (head + 1) % DEPTH;
+    if (filled < DEPTH) {
+      filled++;
+    }
+
+    if (state == ARMED) {
+      T current = values[trigger_channel];
+      if (force_trigger || is_triggered(current)) {
+        trigger_index = filled - 1 < pretrigger ? filled - 1 : pretrigger;
+        post_remaining = DEPTH - pretrigger - 1;
+        state = TRIGGERED;
+      }
+      last = current;
+      has_last = true;
+    } else {
+      post_remaining--;
+    }
+
+    if (state == TRIGGERED && post_remaining == 0) {
+      total = trigger_index + DEPTH - pretrigger;
+      start = (head + DEPTH - total) % DEPTH;
+      send_pos = 0;
+      state = SENDING;
+      telemetry_container.mark_data_updated(data_id);
+    }
+  }
+
+  uint8_t get_data_type() { return protocol::DATATYPE_CAPTURE; }
+
+  size_t get_header_kvrs_length() {
+    return Data::get_header_kvrs_length()
+        + 1 + 1   // subtype
+        + 1 + 1   // data length
+        + 1 + 4   // depth
+        + 1 + 1   // channels
+        + 1 + 4   // pretrigger
+        + 1 + sizeof(T) + sizeof(T);  // limits
+  }
+
+  void write_header_kvrs(TransmitPacket& packet) {
+    Data::write_header_kvrs(packet);
+    packet.write_uint8(protocol::RECORDID_NUMERIC_SUBTYPE);
+    packet.write_uint8(protocol::numeric_subtype<T>());
+    packet.write_uint8(protocol::RECORDID_NUMERIC_LENGTH);
+    packet.write_uint8(sizeof(T));
+    packet.write_uint8(protocol::RECORDID_ARRAY_COUNT);
+    packet.write_uint32(DEPTH);
+    packet.write_uint8(protocol::RECORDID_CAPTURE_CHANNELS);
+    packet.write_uint8(CHANNELS);
+    packet.write_uint8(protocol::RECORDID_CAPTURE_PRETRIGGER);
+    packet.write_uint32(pretrigger);
+    packet.write_uint8(protocol::RECORDID_NUMERIC_LIMITS);
+    packet.write<T>(min_val);
+    packet.write<T>(max_val);
+  }
+
+  size_t get_payload_length() {
+    return CHUNK_HEADER_LENGTH + chunk_count() * CHANNELS * sizeof(T);
+  }
+
+  void write_payload(TransmitPacket& packet) {
+    size_t count = chunk_count();
+    packet.write_uint8(capture_number);
+    packet.write_uint16(state == SENDING ? total : 0);
+    packet.write_uint16(state == SENDING ? trigger_index : 0);
+    packet.write_uint16(send_pos);
+    packet.write_uint8(count);
+    for (size_t i=0; i<count; i++) {
+      size_t index = (start + send_pos + i) % DEPTH;
+      for (size_t j=0; j<CHANNELS; j++) {
+        packet.write<T>(ring[index][j]);
+      }
+    }
+  }
+
+  void payload_transmitted() {
+    if (state != SENDING) {
+      return;
+    }
+    send_pos += chunk_count();
+    if (send_pos < total) {
+      telemetry_container.mark_data_updated(data_id);
+    } else {
+      capture_number++;
+      state = IDLE;
+      if (auto_rearm) {
+        arm();
+      }
+    }
+  }
+
+  // Captures can't be set from the receiver, received payloads are ignored.
+  size_t get_element_length() { return sizeof(T); }
+  void set_element_from_packet(size_t, ReceivePacketBuffer&) {}
+
+protected:
+  static const size_t CHUNK_HEADER_LENGTH = 1 + 2 + 2 + 2 + 1;
+  // Samples per chunk, sized so a chunk fits in a transmit packet alongside
+  // the packet and record overhead.
+  static const size_t CHUNK_FIT =
+      (MAX_TRANSMIT_PACKET_LENGTH - CHUNK_HEADER_LENGTH - 4)
+      / (CHANNELS * sizeof(T));
+  static const size_t CHUNK_SAMPLES =
+      CHUNK_FIT < 1 ? 1 : CHUNK_FIT > 255 ? 255 : CHUNK_FIT;
+
+  // Sample counts and indices are sent as uint16, and the channel and chunk
+  // sample counts as uint8.
+  static_assert(DEPTH > 0 && DEPTH <= 0xffff,
+      "Capture DEPTH must be between 1 and 65535");
+  static_assert(CHANNELS > 0 && CHANNELS <= 0xff,
+      "Capture CHANNELS must be between 1 and 255");
+  static_assert(CHUNK_SAMPLES <= 0xff,
+      "Capture chunks must have at most 255 samples");
+
+  enum State {
+    ARMED,      // sampling into the ring, waiting for the trigger
+    TRIGGERED,  // sampling the post-trigger samples
+    SENDING,    // ring frozen, burst being sent
+    IDLE        // burst sent, waiting for arm()
+  } state;
+
+  size_t chunk_count() {
+    if (state != SENDING) {
+      return 0;
+    }
+    size_t count = total - send_pos;
+    if (count > CHUNK_SAMPLES) {
+      count = CHUNK_SAMPLES;
+    }
+    return count;
+  }
+
+  bool is_triggered(T current) {
+    switch (trigger_mode) {
+    case TRIGGER_RISING:
+      return has_last && last < trigger_level && current >= trigger_level;
+    case TRIGGER_FALLING:
+      return has_last && last > trigger_level && current <= trigger_level;
+    case TRIGGER_ABOVE:
+      return current > trigger_level;
+    case TRIGGER_BELOW:
+      return current < trigger_level;
+    }
+    return false;
+  }
+
+  Telemetry& telemetry_container;
+  size_t data_id;
+
+  size_t pretrigger;
+  size_t trigger_channel;
+  TriggerMode trigger_mode;
+  T trigger_level;
+  bool auto_rearm;
+  bool force_trigger;
+  T last;
+  bool has_last;
+
+  T ring[DEPTH][CHANNELS];
+  size_t head;      // index of the next sample to write
+  size_t filled;    // number of valid samples in the ring
+
+  size_t trigger_index;   // samples before the trigger in the capture
+  size_t post_remaining;  // post-trigger samples left to take
+  size_t total;           // samples in the capture
+  size_t start;           // ring index of the first sample in the capture
+  size_t send_pos;        // index of the first sample of the next chunk
+  uint8_t capture_number;
+
+  T min_val, max_val;
+};
+
+/**
+ * Log messages with deferred formatting: each message is recorded as the
+ * index of its printf-style format string, from a table sent in the header,
+ * followed by its arguments in binary, and is formatted by the receiver.
+ * Messages are buffered and sent in batches, as many per transmit packet as
+ * fit. Messages logged while the buffer is full are dropped and counted.
+ *
+ * Format strings may use the d, i, u, o, x, X, c, p, s and floating-point
+ * conversions, with flags, width and precision (but not *) and the hh, h, l,
+ * ll, j, z and t length modifiers. Arguments after any other conversion are
+ * not recorded. Messages (including string arguments) longer than
+ * MAX_MESSAGE_LENGTH bytes are dropped.
+ *
+ * log() must be called from the same thread as do_io. Storage is provided by
+ * Log<BUFFER_LENGTH>.
+ */
+class LogBase : public Data {
+public:
+  // Records a message with format string format_index and the arguments of
+  // its conversions. Returns false if it was dropped.
+  bool log(size_t format_index, ...);
+  bool vlog(size_t format_index, va_list args);
+
+  // Returns the number of messages dropped and not yet reported.
+  uint16_t get_dropped() { return dropped; }
+
+  uint8_t get_data_type() { return protocol::DATATYPE_LOG; }
+
+  size_t get_header_kvrs_length();
+  void write_header_kvrs(TransmitPacket& packet);
+
+  size_t get_payload_length();
+  void write_payload(TransmitPacket& packet);
+  void payload_transmitted();
+
+  // Logs can't be set from the receiver, received payloads are ignored.
+  size_t get_element_length() { return 1; }
+  void set_element_from_packet(size_t, ReceivePacketBuffer&) {}
+
+  static const size_t PAYLOAD_HEADER_LENGTH = 2 + 2;
+  // Message bytes per payload, sized so a payload fits in a transmit packet
+  // alongside the packet and record overhead.
+  static const size_t PAYLOAD_FIT =
+      MAX_TRANSMIT_PACKET_LENGTH - PAYLOAD_HEADER_LENGTH - 8;
+  static const size_t MAX_MESSAGE_LENGTH =
+      PAYLOAD_FIT < 255 ? PAYLOAD_FIT : 255;
+
+protected:
+  LogBase(Telemetry& telemetry_container,
+      const char* internal_name, const char* display_name,
+      const char* const* formats, size_t format_count,
+      uint8_t* buffer, size_t buffer_length);
+
+  // Appends a byte to the message being recorded, returning false if it
+  // doesn't fit.
+  bool put(uint8_t data);
+  bool put_uint32(uint32_t data);
+  bool put_uint64(uint64_t data);
+
+  // Finds the buffered messages to send in the next payload, returning the
+  // buffer bytes they take (including length prefixes) and setting
+  // message_bytes to their length on the wire.
+  size_t find_payload(size_t* message_bytes);
+
+  Telemetry& telemetry_container;
+  size_t data_id;
+
+  const char* const* formats;
+  size_t format_count;
+
+  // Ring of messages, each prefixed by its uint8 length. One byte is kept
+  // free to distinguish a full ring from an empty one.
+  uint8_t* buffer;
+  size_t buffer_length;
+  size_t read_pos;
+  size_t write_pos;
+  // Length of the message being recorded.
+  size_t message_length;
+
+  uint16_t dropped;
+  // Buffer bytes and dropped count in the last written payload.
+  size_t sent_length;
+  uint16_t sent_dropped;
+};
+
+template <size_t BUFFER_LENGTH>
+class Log : public LogBase {
+public:
+  // formats is a table of format_count format strings, which (like the
+  // table) must outlive this object.
+  Log(Telemetry& telemetry_container,
+      const char* internal_name, const char* display_name,
+      const char* const* formats, size_t format_count):
+      LogBase(telemetry_container, internal_name, display_name,
+          formats, format_count, storage, BUFFER_LENGTH) {}
+
+protected:
+  uint8_t storage[BUFFER_LENGTH];
+};
+
+/**
+ * Trace events for profiling: the beginnings and ends of scopes, and instant
+ * events, each recorded as an event index (into a table of names sent in the
+ * header) and the HAL time in microseconds. Events are queued in a lock-free
+ * ring of DEPTH events and sent in batches by do_io, as many per transmit
+ * packet as fit, with times as deltas. Events recorded while the ring is full
+ * are dropped and counted.
+ *
+ * Events may be recorded from a single thread or interrupt other than the one
+ * calling do_io (marking updates then needs TELEMETRY_THREADSAFE), or from the
+ * do_io thread. Event indices must be below 16384.
+ */
+template <size_t DEPTH>
+class Trace : public Data {
+public:
+  // names is a table of name_count event names, which (like the table) must
+  // outlive this object.
+  Trace(Telemetry& telemetry_container,
+      const char* internal_name, const char* display_name,
+      const char* const* names, size_t name_count):
+      // No units.
+      Data(internal_name, display_name, TELEMETRY_METADATA("")),
+      telemetry_container(telemetry_container),
+      names(names), name_count(name_count),
+      dropped(0), dropped_reported(0), sent_count(0), sent_dropped(0) {
+    data_id = telemetry_container.add_data(*this);
+  }
+
+  void begin(size_t event) { record(event, protocol::TRACE_KIND_BEGIN); }
+  void end(size_t event) { record(event, protocol::TRACE_KIND_END); }
+  void instant(size_t event) { record(event, protocol::TRACE_KIND_INSTANT); }
+
+  // Returns the number of events dropped since this object was created.
+  uint32_t get_dropped() { return dropped; }
+
+  uint8_t get_data_type() { return protocol::DATATYPE_TRACE; }
+
+  size_t get_header_kvrs_length() {
+    size_t length = Data::get_header_kvrs_length() + 1 + 2;
+    for (size_t i=0; i<name_count; i++) {
+      length += metadata_strlen(names[i]) + 1;
+    }
+    return length;
+  }
+
+  void write_header_kvrs(TransmitPacket& packet) {
+    Data::write_header_kvrs(packet);
+    packet.write_uint8(protocol::RECORDID_TRACE_NAMES);
+    packet.write_uint16(name_count);
+    for (size_t i=0; i<name_count; i++) {
+      packet_write_string(packet, names[i]);
+    }
+  }
+
+  // As events may be added concurrently, this is only exact if the payload
+  // fits in the transmit buffer (which it does unless the data ID takes more
+  // than 3 bytes), so write_payload isn't preceded by this.
+  size_t get_payload_length() {
+    size_t length;
+    find_payload(&length);
+    return length;
+  }
+
+  void write_payload(TransmitPacket& packet) {
+    size_t length;
+    sent_count = find_payload(&length);
+    uint32_t new_dropped = dropped - dropped_reported;
+    sent_dropped = new_dropped < 0xffff ? new_dropped : 0xffff;
+    packet.write_uint16(sent_dropped);
+    packet.write_uint8(sent_count);
+    uint64_t event = 0;
+    uint32_t last_us = 0;
+    for (size_t i=0; i<sent_count; i++) {
+      events.peek(i, &event);
+      uint32_t time_us = event >> 16;
+      if (i == 0) {
+        packet.write_uint32(time_us);
+        last_us = time_us;
+      }
+      packet.write_varint(event & 0xffff);
+      packet.write_varint(time_us - last_us);
+      last_us = time_us;
+    }
+    if (sent_count == 0) {
+      packet.write_uint32(0);
+    }
+  }
+
+  void payload_transmitted() {
+    events.drop(sent_count);
+    dropped_reported += sent_dropped;
+    sent_count = 0;
+    sent_dropped = 0;
+    if (events.size() > 0) {
+      telemetry_container.mark_data_updated(data_id);
+    }
+  }
+
+  // Traces can't be set from the receiver, received payloads are ignored.
+  size_t get_element_length() { return 1; }
+  void set_element_from_packet(size_t, ReceivePacketBuffer&) {}
+
+protected:
+  static const size_t PAYLOAD_HEADER_LENGTH = 2 + 1 + 4;
+  // Event bytes per payload, sized so a payload fits in a transmit packet
+  // alongside the packet and record overhead.
+  static const size_t PAYLOAD_FIT =
+      MAX_TRANSMIT_PACKET_LENGTH - PAYLOAD_HEADER_LENGTH - 8;
+
+  void record(size_t event, uint8_t kind) {
+    if (event >= name_count || event >= 0x4000) {
+      telemetry_container.do_error("Trace event index out of range.");
+      return;
+    }
+    uint64_t packed = ((uint64_t)telemetry_container.get_time_us() << 16)
+        | (event << 2) | kind;
+    if (events.enqueue(packed)) {
+      telemetry_container.mark_data_updated(data_id);
+    } else {
+      dropped++;
+    }
+  }
+
+  // Returns the number of queued events to send in the next payload, setting
+  // length to the payload length.
+  size_t find_payload(size_t* length) {
+    size_t count = 0;
+    size_t event_bytes = 0;
+    uint64_t event = 0;
+    uint32_t last_us = 0;
+    while (count < 255 && events.peek(count, &event)) {
+      uint32_t time_us = event >> 16;
+      if (count == 0) {
+        last_us = time_us;
+      }
+      size_t bytes = protocol::varint_length(event & 0xffff)
+          + protocol::varint_length(time_us - last_us);
+      if (event_bytes + bytes > PAYLOAD_FIT) {
+        break;
+      }
+      event_bytes += bytes;
+      last_us = time_us;
+      count++;
+    }
+    *length = PAYLOAD_HEADER_LENGTH + event_bytes;
+    return count;
+  }
+
+  Telemetry& telemetry_container;
+  size_t data_id;
+
+  const char* const* names;
+  size_t name_count;
+
+  // Events, each the time in microseconds shifted left by 16 ORed with the
+  // varint value of its index and kind.
+  Queue<uint64_t, DEPTH> events;
+  // Events dropped, counted by the producer, and of those the number
+  // reported, counted by the consumer.
+  volatile uint32_t dropped;
+  uint32_t dropped_reported;
+  // Events and dropped count in the last written payload.
+  size_t sent_count;
+  uint16_t sent_dropped;
+};
+
+/**
+ * Records the beginning of a trace event on construction and its end on
+ * destruction, to trace a scope.
+ */
+template <size_t DEPTH>
+class TraceScope {
+public:
+  TraceScope(Trace<DEPTH>& trace, size_t event) : trace(trace), event(event) {
+    trace.begin(event);
+  }
+  ~TraceScope() {
+    trace.end(event);
+  }
+
+protected:
+  Trace<DEPTH>& trace;
+  size_t event;
+};
+
+/**
+ * Statically allocated storage for up to N data objects of type D created at
+ * runtime, such as channels for hot-plugged modules, so they don't need the
+ * heap. Objects are never destroyed, since data can't be removed from a
+ * Telemetry object, and their name and units strings must outlive them.
+ */
+template <typename D, size_t N>
+class DataPool {
+public:
+  DataPool() : used(0) {}
+
+  // Constructs a data object in the next free slot, with the arguments of
+  // D's constructor. Returns NULL if the pool is full.
+  template <typename V>
+  D* create(Telemetry& telemetry_container,
+      const char* internal_name, const char* display_name,
+      const char* units, V init_value) {
+    if (used >= N) {
+      telemetry_container.do_error("DataPool full.");
+      return NULL;
+    }
+    D* created = new (slots[used].storage) D(telemetry_container,
+        internal_name, display_name, units, init_value);
+    used++;
+    return created;
+  }
+
+  // Returns the number of objects which can still be created.
+  size_t get_free() const { return N - used; }
+
+protected:
+  // Storage for one object, aligned for any of its members.
+  union Slot {
+    uint8_t storage[sizeof(D)];
+    double align_double;
+    uint64_t align_uint64;
+    void* align_pointer;
+  } slots[N];
+  size_t used;
+};
+
+// Publishes a Telemetry object's own Stats as telemetry data, refreshed at
+// most once per update period during do_io. The counters are packed into one
+// array, in the order of the Stats fields from tx_frames to rx_overflows, and
+// the histograms are only published with TELEMETRY_STATS_HISTOGRAMS.
+class StatsChannels {
+public:
+  // Number of data objects added to the Telemetry object.
+  static const size_t DATA_COUNT = TELEMETRY_STATS_HISTOGRAMS ? 4 : 1;
+  static_assert(DATA_COUNT < MAX_DATA_PER_TELEMETRY,
+      "StatsChannels leaves no data for the application, raise "
+      "TELEMETRY_DATA_LIMIT");
+
+  StatsChannels(Telemetry& telemetry_container, uint32_t period_ms=1000);
+
+  // Copies the current Stats into the channels, if the update period has
+  // elapsed since the last copy. Called automatically during do_io.
+  void update();
+
+protected:
+  Telemetry& telemetry_container;
+  uint32_t period_ms;
+  uint32_t last_update_ms;
+
+#if TELEMETRY_STATS_HISTOGRAMS
+  NumericArray<uint32_t, HISTOGRAM_BUCKETS> transmit_time_us;
+  NumericArray<uint32_t, HISTOGRAM_BUCKETS> receive_time_us;
+  NumericArray<uint32_t, HISTOGRAM_BUCKETS> tx_frame_size;
+#endif
+  static const size_t COUNTER_COUNT = 12;
+  NumericArray<uint32_t, COUNTER_COUNT> counters;
+};
+
 }
 
 #endif